@@ -36,10 +36,13 @@
  *
  * Reference at: http://code.google.com/p/leveldb/source/browse/db/db_bench.cc
  *
- * TODO: output CSV of results
+ * With -o each result is also appended to a file as a line of JSON, and -x
+ * runs a matrix of modules and benchmarks described in a file, see
+ * bench/matrix.conf, comparing the results against a baseline with -b.
  */
 
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE		/* syscall() */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,6 +55,14 @@
 #include <assert.h>
 #include <err.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#endif
 
 #include "../server/db-zmq.h"
 
@@ -59,6 +70,12 @@
 #define LINE1	"+----------------------+-----------+-------------+--------------------+---------------+--------------------+\n"
 #define LINE	"+--------------------------------------------------------------------------------------------------------------+\n"
 
+#define BATCH_SIZE 50
+
+/* Latency histogram, 16 buckets for each power of two nanoseconds */
+#define LAT_SUB_BITS	4
+#define LAT_BUCKETS		(64 << LAT_SUB_BITS)
+
 #define cycle32(i) (((i) >> 1) ^ (-((i) & 1u) & 0xD0000001u))
 
 struct benchmark {
@@ -69,6 +86,7 @@ struct benchmark {
 	char* val;
 	size_t val_len;
 	size_t read_pct;
+	bool perf;			/* Count with perf_counters */
 
 	uint32_t count;
 	uint32_t ok_count;
@@ -76,12 +94,19 @@ struct benchmark {
 	uint64_t io_bytes;
 
 	struct timeval start;
+	uint64_t latency[LAT_BUCKETS];
+
+	char* pair;			/* Buffer for writes, key_len + val_len */
+	char* records;		/* Buffer for batches of BATCH_SIZE puts */
+	struct dbz_arena* arena;	/* &arena is the token passed to ops */
 
 	dbzop_t put;
 	dbzop_t get;
 	dbzop_t del;
 	dbzop_t walk;
 	dbzop_t flush;
+	dbzop_t stats;
+	dbzop_t batch;
 
 	void (*controller)( struct benchmark* );
 };
@@ -92,6 +117,133 @@ struct benchmark_controller {
 	void (*runner)( struct benchmark* );
 };
 
+/**
+ * Hardware and kernel counters, enabled only while benchmark_op() runs
+ * operations and reported per operation. A counter the CPU or kernel
+ * doesn't offer is left out.
+ */
+struct perf_counter {
+	const char* name;
+	const char* json;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+	double value;
+};
+
+#ifdef __linux__
+#define PERF_CACHE(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static struct perf_counter perf_counters[] = {
+	{"cycles", "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0},
+	{"instructions", "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+	{"LLC misses", "llc_misses", PERF_TYPE_HW_CACHE,
+		PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0},
+	{"dTLB misses", "dtlb_misses", PERF_TYPE_HW_CACHE,
+		PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1, 0},
+	{"branch misses", "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+	{"context switches", "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0},
+	{NULL, NULL, 0, 0, -1, 0}
+};
+#else
+static struct perf_counter perf_counters[] = {
+	{NULL, NULL, 0, 0, -1, 0}
+};
+#endif
+
+static bool perf_enabled = false;
+
+/**
+ * Open every counter for this process, counting kernel time too where
+ * perf_event_paranoid allows.
+ * @return Number of counters opened
+ */
+static int
+perf_open(void)
+{
+	int opened = 0;
+#ifdef __linux__
+	struct perf_counter *c;
+	for( c = &perf_counters[0]; c->name; c++ ) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = c->type;
+		attr.config = c->config;
+		attr.disabled = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if( c->fd < 0 && (errno == EACCES || errno == EPERM) ) {
+			attr.exclude_kernel = 1;
+			c->fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+		if( c->fd < 0 ) {
+			warn("Counter '%s' is unavailable", c->name);
+			continue;
+		}
+		opened++;
+	}
+#else
+	warnx("Performance counters need Linux perf_event_open()");
+#endif
+	perf_enabled = opened > 0;
+	return opened;
+}
+
+static void
+perf_toggle(bool enable)
+{
+#ifdef __linux__
+	struct perf_counter *c;
+	if( ! perf_enabled ) return;
+	for( c = &perf_counters[0]; c->name; c++ ) {
+		if( c->fd >= 0 )
+			ioctl(c->fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+	}
+#else
+	(void)enable;
+#endif
+}
+
+/**
+ * Read the totals, scaled up when the kernel had to multiplex counters.
+ */
+static void
+perf_read(void)
+{
+	struct perf_counter *c;
+	if( ! perf_enabled ) return;
+	for( c = &perf_counters[0]; c->name; c++ ) {
+		uint64_t v[3];
+		c->value = -1;
+		if( c->fd < 0 || read(c->fd, v, sizeof(v)) != sizeof(v) ) continue;
+		c->value = v[2] ? (double)v[0] * ((double)v[1] / v[2]) : 0.0;
+	}
+}
+
+static double
+perf_value(const char *json)
+{
+	struct perf_counter *c;
+	for( c = &perf_counters[0]; c->name; c++ ) {
+		if( ! strcmp(c->json, json) ) return c->value;
+	}
+	return -1;
+}
+
+static void
+perf_close(void)
+{
+	struct perf_counter *c;
+	for( c = &perf_counters[0]; c->name; c++ ) {
+		if( c->fd >= 0 ) close(c->fd);
+		c->fd = -1;
+	}
+	perf_enabled = false;
+}
+
 /**
  * Runs operation `i` for benchmark `b` and returns total bytes of DB I/O
  */
@@ -113,6 +265,44 @@ get_timer(struct timeval *start)
 	return (double)(end.tv_sec - start->tv_sec) + (double)(end.tv_usec - start->tv_usec) / 1000000.0;
 }
 
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static size_t
+latency_bucket(uint64_t ns)
+{
+	int msb;
+	if( ns < (1 << LAT_SUB_BITS) ) return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return ((size_t)(msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+	     + ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/**
+ * Latency below which `pct` percent of operations completed, in microseconds.
+ */
+static double
+latency_percentile(benchmark_t *self, double pct)
+{
+	uint64_t total = 0, seen = 0;
+	size_t i;
+	for( i = 0; i < LAT_BUCKETS; i++ ) total += self->latency[i];
+	if( ! total ) return 0.0;
+	for( i = 0; i < LAT_BUCKETS; i++ ) {
+		seen += self->latency[i];
+		if( seen >= total * (pct / 100.0) ) break;
+	}
+	if( i < (1 << LAT_SUB_BITS) ) return i / 1000.0;
+	/* Top of the bucket */
+	return (double)(((uint64_t)((1 << LAT_SUB_BITS) + (i & ((1 << LAT_SUB_BITS) - 1)) + 1))
+	       << ((i >> LAT_SUB_BITS) - 1)) / 1000.0;
+}
+
 static void
 fill_random( char* x, size_t len ) {
 	size_t i;
@@ -142,6 +332,7 @@ benchmark_reset( benchmark_t *self ) {
 	self->ok_count = 0;
 	self->io_bytes = 0;
 	self->cost = 0.0;
+	memset(self->latency, 0, sizeof(self->latency));
 }
 
 static size_t
@@ -155,6 +346,15 @@ DB_OP(count_value){
 	return in_sz;
 }
 
+/**
+ * Prints the module's own counters, e.g. compression ratio.
+ */
+DB_OP(print_stats){
+	(void)cb;(void)token;
+	printf("  Module stats: %.*s\n", (int)in_sz, in_data);
+	return in_sz;
+}
+
 static void
 benchmark_op(benchmark_t *self, uint32_t count, benchmark_op_t op, const char *progress)
 {
@@ -167,9 +367,13 @@ benchmark_op(benchmark_t *self, uint32_t count, benchmark_op_t op, const char *p
 
 	struct timeval start;
 	start_timer(&start);
+	perf_toggle(true);
 
 	for (i = 0; i < count; i++) {
+		uint64_t op_start = now_ns();
 		size_t io_bytes = op(self);
+		self->latency[latency_bucket(now_ns() - op_start)]++;
+		if( self->arena ) self->arena->used = 0;
 		self->count++;
 		self->ok_count += (io_bytes>0 ? 1 : 0);
 		self->io_bytes += io_bytes;
@@ -178,6 +382,7 @@ benchmark_op(benchmark_t *self, uint32_t count, benchmark_op_t op, const char *p
 		}
 	}
 
+	perf_toggle(false);
 	self->cost += get_timer(&start);	
 }
 
@@ -215,48 +420,63 @@ static size_t
 bop_read_random(benchmark_t* b) {
 	assert(b != NULL);
 	fill_random(b->key, b->key_len);
-	return b->get(b->key, b->key_len, (void*)count_value, NULL);
+	return b->get(b->key, b->key_len, (void*)count_value, &b->arena);
 }
 
 static size_t
 bop_write_random(benchmark_t* b) {
 	assert(b != NULL);
 	size_t pairsz = b->val_len+b->key_len;
-	char* pair = (char*)malloc(pairsz);
-	fill_random(pair, pairsz);
-	size_t ret = b->put(pair, pairsz, NULL, NULL);
-	free(pair);
-	return ret;
+	fill_random(b->pair, pairsz);
+	return b->put(b->pair, pairsz, NULL, &b->arena);
 }
 
 static size_t
 bop_write_pseudorand(benchmark_t* b) {
 	assert(b != NULL);
 	size_t pairsz = b->key_len + b->val_len;
-	char* pair = (char*)malloc(pairsz);
-	fill_pseudorandom(pair, pairsz, b);
-	size_t retsz = b->put(pair, pairsz, NULL, NULL);
-	free(pair);
-	return retsz;
+	fill_pseudorandom(b->pair, pairsz, b);
+	return b->put(b->pair, pairsz, NULL, &b->arena);
 }
 
 static size_t
 bop_read_pseudorand(benchmark_t* b) {
 	assert(b != NULL);
 	fill_pseudorandom(b->key, b->key_len, b);
-	return b->get(b->key, b->key_len, NULL, NULL);
+	return b->get(b->key, b->key_len, NULL, &b->arena);
 }
 
 static size_t
 bop_write_sequence(benchmark_t* b) {
 	assert(b != NULL);
 	size_t pair_sz = b->key_len+b->val_len;
-	char* pair = (char*)malloc(pair_sz);
+	char* pair = b->pair;
 	int i = b->count % (b->entries/100);
 	memset(pair, 'X', pair_sz);
 	snprintf(pair, b->key_len, "%X", i);
 	snprintf(pair+b->key_len, b->val_len, "V%XA%XL%XU%XE%X", i, i, i, i, i);
-	return b->put(pair, pair_sz, NULL, NULL);
+	return b->put(pair, pair_sz, NULL, &b->arena);
+}
+
+/**
+ * BATCH_SIZE sequential puts in one batch op, one commit instead of many.
+ */
+static size_t
+bop_batch_sequence(benchmark_t* b) {
+	assert(b != NULL);
+	size_t pair_sz = b->key_len + b->val_len;
+	size_t out = 0;
+	int n;
+	for( n = 0; n < BATCH_SIZE; n++ ) {
+		char* pair = b->records + out + DBZ_REC_HDR;
+		int i = (b->count * BATCH_SIZE + n) % (b->entries/100);
+		out += dbz_record_header(b->records + out, DBZ_REC_PUT, pair_sz);
+		memset(pair, 'X', pair_sz);
+		snprintf(pair, b->key_len, "%X", i);
+		snprintf(pair+b->key_len, b->val_len, "V%XA%XL%XU%XE%X", i, i, i, i, i);
+		out += pair_sz;
+	}
+	return b->batch(b->records, out, NULL, &b->arena);
 }
 
 static size_t
@@ -266,7 +486,7 @@ bop_read_sequence(benchmark_t* b) {
 	snprintf(b->key, b->key_len, "%X", i);
 	fill_pseudorandom(b->val, b->val_len, b);
 
-	return b->get(b->key, b->key_len, NULL, NULL);
+	return b->get(b->key, b->key_len, NULL, &b->arena);
 }
 
 static size_t
@@ -275,7 +495,41 @@ bop_remove_sequence(benchmark_t* b) {
 	int i = b->count % (b->entries/100);
 	memset(b->key, 'X', b->key_len);
 	snprintf(b->key, b->key_len, "%X", i);
-	return b->del(b->key, b->key_len, NULL, NULL);
+	return b->del(b->key, b->key_len, NULL, &b->arena);
+}
+
+/**
+ * Small documents sharing most of their structure, as real JSON values do.
+ */
+static size_t
+fill_json(char* x, size_t len, int i) {
+	static const char* states[] = {"active", "suspended", "pending", "deleted"};
+	int n = snprintf(x, len,
+		"{\"id\":%d,\"user\":\"user%d@example.com\",\"status\":\"%s\","
+		"\"created\":\"2012-%02d-%02dT%02d:%02d:00Z\",\"tags\":[\"tag%d\",\"tag%d\"],"
+		"\"score\":%d.%d,\"verified\":%s}",
+		i, i * 7, states[i % 4], 1 + i % 12, 1 + i % 28, i % 24, i % 60,
+		i % 13, i % 17, i % 1000, i % 10, (i % 3) ? "true" : "false");
+	if( n < 0 || (size_t)n >= len ) n = len - 1;
+	return n;
+}
+
+static size_t
+bop_write_json(benchmark_t* b) {
+	assert(b != NULL);
+	char* pair = b->pair;
+	int i = b->count % (b->entries/100);
+	memset(pair, 'X', b->key_len);
+	snprintf(pair, b->key_len, "%X", i);
+	return b->put(pair, b->key_len + fill_json(pair + b->key_len, b->val_len, i), NULL, &b->arena);
+}
+
+static size_t
+bop_read_json(benchmark_t* b) {
+	assert(b != NULL);
+	int i = b->count % (b->entries/100);
+	snprintf(b->key, b->key_len, "%X", i);
+	return b->get(b->key, b->key_len, (void*)count_value, &b->arena);
 }
 
 static void
@@ -296,6 +550,8 @@ run_test_rwmix( benchmark_t *b, size_t entries, benchmark_op_t readop_cb, benchm
 	memset(b->key, 'X', b->key_len);
 	b->val = (char*)malloc(b->val_len);
 	memset(b->val, 'X', b->val_len);
+	b->pair = (char*)malloc(b->key_len + b->val_len);
+	b->records = (char*)malloc((DBZ_REC_HDR + b->key_len + b->val_len) * BATCH_SIZE);
 	for( i = 0; i < runs; i++ ) {
 		if( b->read_pct >= (size_t)(rand() % 100) ) {			
 			benchmark_op(b, entries_per_run, readop_cb, NULL);			
@@ -319,8 +575,12 @@ run_test_rwmix( benchmark_t *b, size_t entries, benchmark_op_t readop_cb, benchm
 	}
 	free(b->key);
 	free(b->val);
+	free(b->pair);
+	free(b->records);
 	b->key = NULL;
 	b->val = NULL;
+	b->pair = NULL;
+	b->records = NULL;
 }
 
 static void
@@ -347,6 +607,22 @@ db_test_random( benchmark_t *b ) {
 	run_test_rwmix(b, b->entries, bop_read_random, bop_write_random);
 }
 
+static void
+db_test_batch( benchmark_t *b ) {
+	assert(b != NULL);
+	if( ! b->batch ) {
+		warnx("Module has no batch op");
+		return;
+	}
+	run_test_rwmix(b, b->entries / BATCH_SIZE, bop_read_sequence, bop_batch_sequence);
+}
+
+static void
+db_test_json( benchmark_t *b ) {
+	assert(b != NULL);
+	run_test_rwmix(b, b->entries, bop_read_json, bop_write_json);
+}
+
 static struct benchmark_controller
 available_benchmarks[] = {
 	{"null", db_test_null},
@@ -354,6 +630,8 @@ available_benchmarks[] = {
 	{"removewrite-sequence", db_test_removewrite},
 	{"readwrite-sequence", db_test_sequence},
 	{"readwrite-random", db_test_random},
+	{"readwrite-json", db_test_json},
+	{"readbatch-sequence", db_test_batch},
 	{NULL, NULL}	
 };
 
@@ -394,16 +672,20 @@ benchmark_validate( benchmark_t *b ) {
 		&& (b->val_len > 0);
 }
 
+struct environment {
+	char date[64];
+	int num_cpus;
+	char cpu_type[256];
+	char cache_size[256];
+};
+
 static void
-print_environment(void)
+get_environment(struct environment *env)
 {
 	time_t now = time(NULL);
-	printf("  Compiler:	%s\n", __VERSION__);
-	printf("  Date:		%s", (char*)ctime(&now));
-	
-	int num_cpus = 0;
-	char cpu_type[256] = {0};
-	char cache_size[256] = {0};
+	memset(env, 0, sizeof(*env));
+	strncpy(env->date, ctime(&now), sizeof(env->date) - 1);
+	env->date[strcspn(env->date, "\n")] = 0;
 
 	FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
 	if (cpuinfo) {
@@ -418,30 +700,179 @@ print_environment(void)
 			strncpy(key, line, sep - 1 - line);
 			strncpy(val, sep+1, strlen(sep)-1);
 			if (strcmp("model name", key) == 0) {
-				num_cpus++;
-				strncpy(cpu_type, val, strlen(val) - 1);
+				env->num_cpus++;
+				strncpy(env->cpu_type, val, strlen(val) - 1);
 			}
 			else if(strcmp("cache size", key) == 0)
-				strncpy(cache_size, val + 1, strlen(val) - 2);	
+				strncpy(env->cache_size, val + 1, strlen(val) - 2);	
 		}
 
 		fclose(cpuinfo);
-		printf("  CPU:		%d * %s\n", num_cpus, cpu_type);
-		printf("  CPUCache:	%s\n", cache_size);
 	}
 }
 
+static void
+print_environment(const struct environment *env)
+{
+	printf("  Compiler:	%s\n", __VERSION__);
+	printf("  Date:		%s\n", env->date);
+	if( env->num_cpus ) {
+		printf("  CPU:		%d * %s\n", env->num_cpus, env->cpu_type);
+		printf("  CPUCache:	%s\n", env->cache_size);
+	}
+}
+
+static void
+json_string(FILE *fh, const char *str)
+{
+	fputc('"', fh);
+	for( ; *str; str++ ) {
+		if( *str == '"' || *str == '\\' ) fputc('\\', fh);
+		if( (unsigned char)*str >= ' ' ) fputc(*str, fh);
+	}
+	fputc('"', fh);
+}
+
+static void
+json_environment(FILE *fh, const struct environment *env)
+{
+	fprintf(fh, "{\"environment\":{\"compiler\":");
+	json_string(fh, __VERSION__);
+	fprintf(fh, ",\"date\":");
+	json_string(fh, env->date);
+	fprintf(fh, ",\"cpus\":%d,\"cpu\":", env->num_cpus);
+	json_string(fh, env->cpu_type);
+	fprintf(fh, ",\"cache\":");
+	json_string(fh, env->cache_size);
+	fprintf(fh, "}}\n");
+}
+
+static void
+json_result(FILE *fh, const char *mod_file, benchmark_t *b)
+{
+	fprintf(fh, "{\"module\":");
+	json_string(fh, mod_file);
+	fprintf(fh, ",\"benchmark\":");
+	json_string(fh, b->name);
+	if( perf_enabled ) {
+		struct perf_counter *c;
+		for( c = &perf_counters[0]; c->name; c++ ) {
+			if( c->value >= 0 ) fprintf(fh, ",\"%s_per_op\":%.3f", c->json, c->value / b->count);
+		}
+	}
+	fprintf(fh, ",\"key_len\":%zu,\"val_len\":%zu,\"entries\":%zu,\"read_pct\":%zu"
+		",\"ops\":%u,\"ok_pct\":%.1f,\"ops_per_sec\":%.2f,\"mib_per_sec\":%.2f"
+		",\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"seconds\":%.3f}\n",
+		b->key_len, b->val_len, b->entries, b->read_pct,
+		b->count, b->ok_count / (b->count / 100.0), b->count / b->cost,
+		benchmark_bps(b) / 1024.0 / 1024.0,
+		latency_percentile(b, 50), latency_percentile(b, 99), latency_percentile(b, 99.9),
+		b->cost);
+	fflush(fh);
+}
+
+/**
+ * Value of `"name":` in a line written by json_result(), strings are
+ * copied to `str` which has room for `len` bytes.
+ * @return false if the line has no such field
+ */
+static bool
+json_field(const char *line, const char *name, double *num, char *str, size_t len)
+{
+	char pattern[64];
+	const char *p;
+	snprintf(pattern, sizeof(pattern), "\"%s\":", name);
+	if( (p = strstr(line, pattern)) == NULL ) return false;
+	p += strlen(pattern);
+	if( str ) {
+		size_t n = 0;
+		if( *p++ != '"' ) return false;
+		for( ; *p && *p != '"' && n + 1 < len; p++ ) {
+			if( *p == '\\' && p[1] ) p++;
+			str[n++] = *p;
+		}
+		str[n] = 0;
+	}
+	if( num ) *num = strtod(p, NULL);
+	return true;
+}
+
+static bool
+result_same_run(const char *a, const char *b)
+{
+	static const char* keys[] = {"key_len", "val_len", "entries", "read_pct", NULL};
+	char x[1024], y[1024];
+	double m, n;
+	int i;
+	if( ! json_field(a, "module", NULL, x, sizeof(x)) || ! json_field(b, "module", NULL, y, sizeof(y)) || strcmp(x, y) )
+		return false;
+	if( ! json_field(a, "benchmark", NULL, x, sizeof(x)) || ! json_field(b, "benchmark", NULL, y, sizeof(y)) || strcmp(x, y) )
+		return false;
+	for( i = 0; keys[i]; i++ ) {
+		if( ! json_field(a, keys[i], &m, NULL, 0) || ! json_field(b, keys[i], &n, NULL, 0) || m != n )
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Compare a result with the same run in the baseline file.
+ * @return false if throughput dropped or p99 latency grew by more than `threshold` percent
+ */
+static bool
+result_compare(const char *result, FILE *baseline, double threshold)
+{
+	char line[4096], module[1024], name[64];
+	double ops = 0, p99 = 0, base_ops = 0, base_p99 = 0, k = 0, v = 0, e = 0, r = 0;
+	bool ok = true;
+
+	rewind(baseline);
+	while( fgets(line, sizeof(line), baseline) ) {
+		if( ! result_same_run(result, line) ) continue;
+		json_field(result, "module", NULL, module, sizeof(module));
+		json_field(result, "benchmark", NULL, name, sizeof(name));
+		json_field(result, "key_len", &k, NULL, 0);
+		json_field(result, "val_len", &v, NULL, 0);
+		json_field(result, "entries", &e, NULL, 0);
+		json_field(result, "read_pct", &r, NULL, 0);
+		json_field(result, "ops_per_sec", &ops, NULL, 0);
+		json_field(result, "p99_us", &p99, NULL, 0);
+		json_field(line, "ops_per_sec", &base_ops, NULL, 0);
+		json_field(line, "p99_us", &base_p99, NULL, 0);
+		if( base_ops > 0 && ops < base_ops * (1.0 - threshold / 100.0) ) {
+			printf("  REGRESSION %s %s -k %.0f -v %.0f -e %.0f -r %.0f: %.2f ops/sec, baseline %.2f (%+.1f%%)\n",
+				module, name, k, v, e, r, ops, base_ops, (ops / base_ops - 1.0) * 100.0);
+			ok = false;
+		}
+		/* Sub-microsecond p99s are within timer noise */
+		if( base_p99 > 0 && p99 > base_p99 * (1.0 + threshold / 100.0) && p99 - base_p99 >= 1.0 ) {
+			printf("  REGRESSION %s %s -k %.0f -v %.0f -e %.0f -r %.0f: p99 %.3f us, baseline %.3f us (%+.1f%%)\n",
+				module, name, k, v, e, r, p99, base_p99, (p99 / base_p99 - 1.0) * 100.0);
+			ok = false;
+		}
+		return ok;
+	}
+	return ok;
+}
+
 static void
 print_usage( char *prog ) {
 	fprintf(stderr,
 		"Usage: %s [options] <module.so> <benchmark-name>\n"
+		"       %s [options] -x <matrix-file>\n"
 		"\t-r <pct> Workload read percentage %%\n"
 		"\t-e <num> Number of DB entries (default: 500000)\n"
 		"\t-k <num> Key size in bytes (default: 20)\n"
 		"\t-v <num> Value size in bytes (default: 100)\n"
 		"\t-c <mb>  Cache size in megabytes (default: 4)\n"
+		"\t-m       Modules malloc() their buffers instead of using an arena\n"
+		"\t-p       Count cycles, cache misses etc. per operation with perf_event_open()\n"
+		"\t-o <file> Append results as lines of JSON\n"
+		"\t-x <file> Run every combination in a matrix file, see bench/matrix.conf\n"
+		"\t-b <file> With -x, fail on regressions against results in this file\n"
+		"\t-t <pct> Regression threshold %% (default: 10)\n"
 		"\n"
-		"Benchmarks:\n", prog);
+		"Benchmarks:\n", prog, prog);
 	
 	struct benchmark_controller *b = &available_benchmarks[0];
 	while( b->name ) {
@@ -451,10 +882,319 @@ print_usage( char *prog ) {
 	fprintf(stderr, "\n");
 }
 
+/**
+ * A module's own stats op, named e.g. "zdict-stats" so the server's
+ * stats op isn't hidden.
+ */
+static struct dbz_op*
+module_stats_op(dbz *mod)
+{
+	struct dbz_op *op;
+	size_t len;
+	for( op = mod->ops; op->name; op++ ) {
+		len = strlen(op->name);
+		if( len > 6 && strcmp(op->name + len - 6, "-stats") == 0 ) return op;
+	}
+	return NULL;
+}
+
+/**
+ * Run one benchmark against one module, appending the result to `results`.
+ */
+static int
+benchmark_module(const char *mod_file, benchmark_t *bench, bool use_arena, FILE *results)
+{
+	struct dbz_arena arena;
+	struct environment env;
+	dbz* mod = NULL;
+
+	if( mod_file ) {
+		mod = dbz_open(mod_file);
+		if( ! mod ) {
+			return EXIT_FAILURE;
+		}
+		
+		{struct dbz_op
+			*put_op = dbz_op(mod, "put"),
+			*get_op = dbz_op(mod, "get"),
+			*del_op = dbz_op(mod, "del"),
+			*walk_op = dbz_op(mod, "walk"),
+			*flush_op = dbz_op(mod, "flush"),
+			*stats_op = module_stats_op(mod),
+			*batch_op = dbz_op(mod, "batch");
+
+			if( put_op ) bench->put = put_op->cb;
+			if( get_op ) bench->get = get_op->cb;
+			if( del_op ) bench->del = del_op->cb;
+			if( walk_op ) bench->walk = walk_op->cb;
+			if( flush_op ) bench->flush = flush_op->cb;
+			if( stats_op ) bench->stats = stats_op->cb;
+			if( batch_op ) bench->batch = batch_op->cb;
+		}
+	}
+	
+	if( ! benchmark_validate(bench) ) {
+		dbz_close(mod);
+		return -1;
+	}
+
+	memset(&arena, 0, sizeof(arena));
+	if( use_arena ) {
+		arena.size = 1024 * 1024;
+		arena.base = (char*)malloc(arena.size);
+		bench->arena = &arena;
+	}
+
+	if( bench->perf ) perf_open();
+
+	get_environment(&env);
+	print_environment(&env);
+	printf("\n");
+	printf("  Benchmark:    %s\n", bench->name);
+	printf("  Backend:      %s\n", mod_file);
+	printf("  Keys:         %zu bytes each\n", bench->key_len);
+	printf("  Values:       %zu bytes each\n", bench->val_len);
+	printf("  Entries:      %zu\n", bench->entries);
+	printf("  Buffers:      %s\n", use_arena ? "arena" : "malloc");
+	printf("  Load:         %d%% READS / %d%% WRITES\n", (int)bench->read_pct, (int)(100-bench->read_pct));
+	printf("\n");
+
+	benchmark_run(bench);
+	if( bench->count ) {
+		printf("  Latency:      p50 %.3f us, p99 %.3f us, p99.9 %.3f us\n",
+			latency_percentile(bench, 50), latency_percentile(bench, 99), latency_percentile(bench, 99.9));
+	}
+	if( perf_enabled && bench->count ) {
+		struct perf_counter *c;
+		const char *sep = "";
+		double cycles, instructions;
+		perf_read();
+		printf("  Per op:       ");
+		for( c = &perf_counters[0]; c->name; c++ ) {
+			if( c->value < 0 ) continue;
+			printf("%s%.3f %s", sep, c->value / bench->count, c->name);
+			sep = ", ";
+		}
+		cycles = perf_value("cycles");
+		instructions = perf_value("instructions");
+		if( cycles > 0 && instructions >= 0 )
+			printf("%s%.2f IPC", sep, instructions / cycles);
+		printf("\n");
+	}
+	if( bench->stats ) {
+		bench->stats("", 0, (void*)print_stats, &bench->arena);
+	}
+	if( arena.misses ) {
+		printf("  Arena misses: %zu\n", arena.misses);
+	}
+	if( results && bench->count ) {
+		json_result(results, mod_file, bench);
+	}
+	perf_close();
+	bench->arena = NULL;
+	free(arena.base);
+	dbz_close(mod);
+	mod=NULL;
+	return EXIT_SUCCESS;
+}
+
+#define MATRIX_MAX 32
+
+struct matrix {
+	const char* modules[MATRIX_MAX];
+	const char* benchmarks[MATRIX_MAX];
+	size_t keys[MATRIX_MAX];
+	size_t values[MATRIX_MAX];
+	size_t entries[MATRIX_MAX];
+	size_t reads[MATRIX_MAX];
+	size_t nmodules, nbenchmarks, nkeys, nvalues, nentries, nreads;
+	const char* setup;
+};
+
+static size_t
+matrix_words(char *line, const char **words)
+{
+	size_t n = 0;
+	char *word, *save = NULL;
+	for( word = strtok_r(line, " \t\r\n", &save); word && n < MATRIX_MAX; word = strtok_r(NULL, " \t\r\n", &save) ) {
+		words[n++] = strdup(word);
+	}
+	return n;
+}
+
+static size_t
+matrix_sizes(char *line, size_t *sizes)
+{
+	const char* words[MATRIX_MAX];
+	size_t i, n = matrix_words(line, words);
+	for( i = 0; i < n; i++ ) {
+		sizes[i] = strtoul(words[i], NULL, 10);
+		free((void*)words[i]);
+	}
+	return n;
+}
+
+/**
+ * Read a matrix file, each line is a directive followed by its values:
+ *
+ *   modules, benchmarks, keys, values, entries, reads, env NAME=VALUE
+ *   and setup <shell command run before each benchmark>
+ */
+static bool
+matrix_load(const char *filename, struct matrix *m)
+{
+	char line[4096], *rest;
+	int lineno = 0;
+	FILE *fh = fopen(filename, "r");
+	if( ! fh ) {
+		warn("Cannot open matrix '%s'", filename);
+		return false;
+	}
+	while( fgets(line, sizeof(line), fh) ) {
+		lineno++;
+		rest = line + strspn(line, " \t");
+		if( *rest == '#' || *rest == '\n' || *rest == 0 ) continue;
+		rest[strcspn(rest, "\r\n")] = 0;
+		char *name = rest;
+		rest += strcspn(rest, " \t");
+		if( *rest ) *rest++ = 0;
+		rest += strspn(rest, " \t");
+
+		if( ! strcmp(name, "modules") ) m->nmodules = matrix_words(rest, m->modules);
+		else if( ! strcmp(name, "benchmarks") ) m->nbenchmarks = matrix_words(rest, m->benchmarks);
+		else if( ! strcmp(name, "keys") ) m->nkeys = matrix_sizes(rest, m->keys);
+		else if( ! strcmp(name, "values") ) m->nvalues = matrix_sizes(rest, m->values);
+		else if( ! strcmp(name, "entries") ) m->nentries = matrix_sizes(rest, m->entries);
+		else if( ! strcmp(name, "reads") ) m->nreads = matrix_sizes(rest, m->reads);
+		else if( ! strcmp(name, "setup") ) m->setup = strdup(rest);
+		else if( ! strcmp(name, "env") && strchr(rest, '=') ) {
+			char *value = strchr(rest, '=');
+			*value++ = 0;
+			setenv(rest, value, 1);
+		}
+		else {
+			warnx("%s:%d: unknown directive '%s'", filename, lineno, name);
+			fclose(fh);
+			return false;
+		}
+	}
+	fclose(fh);
+	if( ! m->nmodules || ! m->nbenchmarks ) {
+		warnx("%s: needs modules and benchmarks", filename);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Run one benchmark in a child process, so each starts with a freshly
+ * loaded module, and copy its result line to `results` and `line`.
+ * @return 1 for a result, 0 if the module can't run the benchmark, -1 if it failed
+ */
+static int
+matrix_cell(const char *mod_file, benchmark_t *bench, bool use_arena, FILE *results, char *line, size_t len)
+{
+	int fds[2], status;
+	pid_t pid;
+	FILE *fh;
+	char keysize[16];
+
+	fflush(NULL);
+	if( pipe(fds) != 0 ) err(EXIT_FAILURE, "Cannot pipe()");
+	pid = fork();
+	if( pid < 0 ) err(EXIT_FAILURE, "Cannot fork()");
+	if( pid == 0 ) {
+		close(fds[0]);
+		snprintf(keysize, sizeof(keysize), "%zu", bench->key_len);
+		setenv("DBZMQ_KEYSIZE", keysize, 1);
+		fh = fdopen(fds[1], "w");
+		exit(benchmark_module(mod_file, bench, use_arena, fh));
+	}
+
+	close(fds[1]);
+	fh = fdopen(fds[0], "r");
+	line[0] = 0;
+	if( ! fgets(line, len, fh) ) line[0] = 0;
+	fclose(fh);
+	waitpid(pid, &status, 0);
+	if( ! WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS ) {
+		warnx("Benchmark %s of %s failed", bench->name, mod_file);
+		return -1;
+	}
+	if( line[0] != '{' ) {
+		warnx("Benchmark %s of %s skipped", bench->name, mod_file);
+		return 0;
+	}
+	fputs(line, results);
+	fflush(results);
+	return 1;
+}
+
+static int
+matrix_run(const char *filename, benchmark_t *defaults, bool use_arena, FILE *results, FILE *baseline, double threshold)
+{
+	struct matrix m;
+	struct environment env;
+	size_t a, b, c, d, e, f;
+	int runs = 0, skipped = 0, failed = 0, regressed = 0;
+
+	memset(&m, 0, sizeof(m));
+	if( ! matrix_load(filename, &m) ) return EXIT_FAILURE;
+	if( ! m.nkeys ) m.keys[m.nkeys++] = defaults->key_len;
+	if( ! m.nvalues ) m.values[m.nvalues++] = defaults->val_len;
+	if( ! m.nentries ) m.entries[m.nentries++] = defaults->entries;
+	if( ! m.nreads ) m.reads[m.nreads++] = defaults->read_pct;
+
+	get_environment(&env);
+	json_environment(results, &env);
+
+	for( a = 0; a < m.nmodules; a++ )
+	for( b = 0; b < m.nbenchmarks; b++ )
+	for( c = 0; c < m.nkeys; c++ )
+	for( d = 0; d < m.nvalues; d++ )
+	for( e = 0; e < m.nentries; e++ )
+	for( f = 0; f < m.nreads; f++ ) {
+		benchmark_t bench;
+		char result[4096];
+		memset(&bench, 0, sizeof(bench));
+		bench.name = m.benchmarks[b];
+		bench.key_len = m.keys[c];
+		bench.val_len = m.values[d];
+		bench.entries = m.entries[e];
+		bench.read_pct = m.reads[f];
+		bench.perf = defaults->perf;
+		benchmark_reset(&bench);
+
+		if( m.setup && system(m.setup) != 0 ) {
+			warnx("Setup '%s' failed", m.setup);
+		}
+		runs++;
+		switch( matrix_cell(m.modules[a], &bench, use_arena, results, result, sizeof(result)) ) {
+		case 1:
+			if( baseline && ! result_compare(result, baseline, threshold) ) regressed++;
+			break;
+		case 0:
+			skipped++;
+			break;
+		default:
+			failed++;
+		}
+	}
+
+	printf("\n  Matrix:       %d runs, %d skipped, %d failed", runs, skipped, failed);
+	if( baseline ) printf(", %d regressed by more than %.1f%%", regressed, threshold);
+	printf("\n");
+	return (failed || regressed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int
 main(int argc, char** argv)
 {
-	int c;
+	int c, ret;
+	bool use_arena = true;
+	const char *matrix_file = NULL, *results_file = NULL, *baseline_file = NULL;
+	FILE *results = NULL, *baseline = NULL;
+	double threshold = 10.0;
 	benchmark_t bench;
 	memset(&bench, 0, sizeof(bench));
 	bench.read_pct = 50;
@@ -463,7 +1203,7 @@ main(int argc, char** argv)
 	bench.val_len = 100;
 	benchmark_reset(&bench);
 
-	while( (c = getopt(argc, argv, "d:e:k:v:c:r:")) != -1 ) {
+	while( (c = getopt(argc, argv, "d:e:k:v:c:r:mpo:x:b:t:")) != -1 ) {
 		switch( c ) {
 		case 'r':
 			bench.read_pct = atoi(optarg);
@@ -481,57 +1221,69 @@ main(int argc, char** argv)
 			bench.val_len = atoi(optarg);
 			break;	
 
+		case 'm':
+			use_arena = false;
+			break;
+
+		case 'p':
+			bench.perf = true;
+			break;
+
+		case 'o':
+			results_file = optarg;
+			break;
+
+		case 'x':
+			matrix_file = optarg;
+			break;
+
+		case 'b':
+			baseline_file = optarg;
+			break;
+
+		case 't':
+			threshold = atof(optarg);
+			break;
+
 		default:
 			fprintf(stderr, "Unknown option -%c\n", c);
 			break;
 		}
 	}
 
-	const char *mod_file = NULL;
-	if( optind < (argc-1) ) {
-		bench.name = argv[optind + 1];
-		mod_file = argv[optind];
+	if( results_file ) {
+		/* A matrix run writes a new file, single runs add to it */
+		results = fopen(results_file, matrix_file ? "w" : "a");
+		if( ! results ) err(EXIT_FAILURE, "Cannot open '%s'", results_file);
+	}
+	if( baseline_file ) {
+		baseline = fopen(baseline_file, "r");
+		if( ! baseline ) err(EXIT_FAILURE, "Cannot open '%s'", baseline_file);
 	}
 
-	dbz* mod = NULL;
-	if( mod_file ) {
-		mod = dbz_open(mod_file);
-		if( ! mod ) {
-			return EXIT_FAILURE;
+	if( matrix_file ) {
+		if( ! results ) errx(EXIT_FAILURE, "-x needs a results file, -o");
+		ret = matrix_run(matrix_file, &bench, use_arena, results, baseline, threshold);
+	}
+	else {
+		const char *mod_file = NULL;
+		if( optind < (argc-1) ) {
+			bench.name = argv[optind + 1];
+			mod_file = argv[optind];
 		}
-		
-		{struct dbz_op
-			*put_op = dbz_op(mod, "put"),
-			*get_op = dbz_op(mod, "get"),
-			*del_op = dbz_op(mod, "del"),
-			*walk_op = dbz_op(mod, "walk"),
-			*flush_op = dbz_op(mod, "flush");
-
-			if( put_op ) bench.put = put_op->cb;
-			if( get_op ) bench.get = get_op->cb;
-			if( del_op ) bench.del = del_op->cb;
-			if( walk_op ) bench.walk = walk_op->cb;
-			if( flush_op ) bench.flush = flush_op->cb;
+		if( results && fseek(results, 0, SEEK_END) == 0 && ftell(results) == 0 ) {
+			struct environment env;
+			get_environment(&env);
+			json_environment(results, &env);
+		}
+		ret = benchmark_module(mod_file, &bench, use_arena, results);
+		if( ret < 0 ) {
+			print_usage(argv[0]);
+			ret = EXIT_FAILURE;
 		}
-	}
-	
-	if( ! benchmark_validate(&bench) ) {
-		print_usage(argv[0]);
-		return EXIT_FAILURE;
 	}
 
-	print_environment();
-	printf("\n");
-	printf("  Benchmark:    %s\n", bench.name);
-	printf("  Backend:      %s\n", mod_file);
-	printf("  Keys:         %zu bytes each\n", bench.key_len);
-	printf("  Values:       %zu bytes each\n", bench.val_len);
-	printf("  Entries:      %zu\n", bench.entries);
-	printf("  Load:         %d%% READS / %d%% WRITES\n", (int)bench.read_pct, (int)(100-bench.read_pct));
-	printf("\n");
-
-	benchmark_run(&bench);
-	dbz_close(mod);
-	mod=NULL;
-	return EXIT_SUCCESS;
+	if( results ) fclose(results);
+	if( baseline ) fclose(baseline);
+	return ret;
 }
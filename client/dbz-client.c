@@ -0,0 +1,635 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <assert.h>
+
+#include <zmq.h>
+
+#include "../server/db-zmq.h"
+#include "dbz-client.h"
+
+#if ZMQ_VERSION_MAJOR < 3
+#define POLL_MSEC(ms)	((ms) * 1000L)
+#else
+#define POLL_MSEC(ms)	(ms)
+#endif
+
+#define DBZC_EXPORT	__attribute__((visibility("default")))
+
+#define DBZC_MAX_OPS	16
+#define DBZC_MAX_POOL	16
+
+enum { KIND_GET, KIND_PUT, KIND_DEL, KIND_CALL, KIND_BATCH };
+
+typedef struct {
+	char name[32];
+	void* socks[DBZC_MAX_POOL];	/* DEALER, each connected to every address */
+	int nsocks;
+	unsigned next;		/* Round robin */
+} op_t;
+
+typedef struct {
+	dbzc_cb cb;
+	void* arg;
+} member_t;
+
+/* A request sent, in pending[id & mask] */
+typedef struct {
+	uint64_t id;		/* 0 when free */
+	int kind;
+	op_t* op;
+	dbzc_cb cb;
+	void* arg;
+	uint64_t sent_ms;
+	int tries;
+	char* payload;		/* Kept to send a get again */
+	size_t len, cap;
+	member_t* members;	/* Of a batch */
+	size_t nmembers, members_cap;
+} pending_t;
+
+struct dbzc_s {
+	void* zctx;
+	int own_zctx;
+	size_t key_size;
+	int pool;
+	long timeout_ms;
+	int retries;
+	size_t batch_record;
+	size_t batch_bytes;
+
+	op_t ops[DBZC_MAX_OPS];
+	int nops;
+	zmq_pollitem_t items[DBZC_MAX_OPS * DBZC_MAX_POOL];
+	int nitems;
+
+	pending_t* pending;
+	uint64_t mask;
+	uint64_t next_id;
+	uint64_t oldest;	/* Ids before this are free */
+	size_t npending;
+
+	/* Puts and dels not yet sent, as batch records */
+	char* batch;
+	size_t batch_len, batch_cap;
+	member_t* members;
+	size_t nmembers, members_cap;
+
+	int completed;		/* Callbacks made by this poll */
+};
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static op_t* op_find(dbzc_t* c, const char* name)
+{
+	int i;
+	for( i = 0; i < c->nops; i++ ) {
+		if( strcmp(c->ops[i].name, name) == 0 ) return &c->ops[i];
+	}
+	return NULL;
+}
+
+static void pending_free(dbzc_t* c)
+{
+	size_t i;
+	if( ! c->pending ) return;
+	for( i = 0; i <= c->mask; i++ ) {
+		free(c->pending[i].payload);
+		free(c->pending[i].members);
+	}
+	free(c->pending);
+	c->pending = NULL;
+}
+
+static int pending_alloc(dbzc_t* c, size_t slots)
+{
+	pending_t* p = (pending_t*)calloc(slots, sizeof(pending_t));
+	if( ! p ) return 0;
+	pending_free(c);
+	c->pending = p;
+	c->mask = slots - 1;
+	return 1;
+}
+
+DBZC_EXPORT int dbzc_abi(void)
+{
+	return DBZC_ABI;
+}
+
+DBZC_EXPORT dbzc_t* dbzc_new(void* zctx)
+{
+	dbzc_t* c = (dbzc_t*)calloc(1, sizeof(dbzc_t));
+	if( ! c ) return NULL;
+	c->key_size = 20;
+	c->pool = 2;
+	c->timeout_ms = 1000;
+	c->retries = 2;
+	c->batch_record = 4096;
+	c->batch_bytes = 65536;
+	c->next_id = c->oldest = 1;
+	if( ! pending_alloc(c, 4096) ) {
+		free(c);
+		return NULL;
+	}
+	c->zctx = zctx;
+	if( ! c->zctx ) {
+		c->zctx = zmq_init(1);
+		c->own_zctx = 1;
+		if( ! c->zctx ) {
+			dbzc_free(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+/**
+ * Pending requests are dropped without calling back.
+ */
+DBZC_EXPORT void dbzc_free(dbzc_t* c)
+{
+	int linger = 0, i, j;
+	if( ! c ) return;
+	for( i = 0; i < c->nops; i++ ) {
+		for( j = 0; j < c->ops[i].nsocks; j++ ) {
+			zmq_setsockopt(c->ops[i].socks[j], ZMQ_LINGER, &linger, sizeof(linger));
+			zmq_close(c->ops[i].socks[j]);
+		}
+	}
+	if( c->own_zctx && c->zctx ) zmq_term(c->zctx);
+	pending_free(c);
+	free(c->batch);
+	free(c->members);
+	free(c);
+}
+
+DBZC_EXPORT int dbzc_set(dbzc_t* c, int option, int64_t value)
+{
+	switch( option ) {
+	case DBZC_OPT_KEY_SIZE:
+		if( value < 1 || value > 0x100 || c->nmembers ) return DBZC_INVALID;
+		c->key_size = (size_t)value;
+		break;
+	case DBZC_OPT_POOL:
+		if( value < 1 || value > DBZC_MAX_POOL ) return DBZC_INVALID;
+		c->pool = (int)value;
+		break;
+	case DBZC_OPT_INFLIGHT:
+		if( value < 2 || (value & (value - 1)) || c->npending ) return DBZC_INVALID;
+		if( ! pending_alloc(c, (size_t)value) ) return DBZC_FAILED;
+		break;
+	case DBZC_OPT_TIMEOUT:
+		/* A request never timing out would hold back every later id */
+		if( value < 1 ) return DBZC_INVALID;
+		c->timeout_ms = (long)value;
+		break;
+	case DBZC_OPT_RETRIES:
+		if( value < 0 ) return DBZC_INVALID;
+		c->retries = (int)value;
+		break;
+	case DBZC_OPT_BATCH_RECORD:
+		if( value < 0 ) return DBZC_INVALID;
+		c->batch_record = (size_t)value;
+		break;
+	case DBZC_OPT_BATCH_BYTES:
+		if( value < 1 ) return DBZC_INVALID;
+		c->batch_bytes = (size_t)value;
+		break;
+	default:
+		return DBZC_INVALID;
+	}
+	return DBZC_OK;
+}
+
+DBZC_EXPORT int dbzc_connect(dbzc_t* c, const char* name, const char* addr)
+{
+	op_t* op = op_find(c, name);
+	int i;
+
+	if( ! op ) {
+		if( c->nops == DBZC_MAX_OPS || strlen(name) >= sizeof(op->name) ) return DBZC_INVALID;
+		op = &c->ops[c->nops];
+		memset(op, 0, sizeof(op_t));
+		strcpy(op->name, name);
+		for( i = 0; i < c->pool; i++ ) {
+			if( ! (op->socks[i] = zmq_socket(c->zctx, ZMQ_DEALER)) ) break;
+			op->nsocks++;
+		}
+		if( op->nsocks < c->pool ) {
+			for( i = 0; i < op->nsocks; i++ ) zmq_close(op->socks[i]);
+			return DBZC_FAILED;
+		}
+		for( i = 0; i < op->nsocks; i++ ) {
+			zmq_pollitem_t* item = &c->items[c->nitems++];
+			memset(item, 0, sizeof(zmq_pollitem_t));
+			item->socket = op->socks[i];
+			item->events = ZMQ_POLLIN;
+		}
+		c->nops++;
+	}
+	for( i = 0; i < op->nsocks; i++ ) {
+		if( zmq_connect(op->socks[i], addr) != 0 ) return DBZC_FAILED;
+	}
+	return DBZC_OK;
+}
+
+/**
+ * Send a request on the first socket of the pool which takes it,
+ * id[8] ++ payload as db-zmq reads from router@ binds.
+ * @return 0 if none can take it now
+ */
+static int op_send(op_t* op, uint64_t id, const char* data, size_t len)
+{
+	zmq_msg_t msg;
+	int i;
+
+	for( i = 0; i < op->nsocks; i++ ) {
+		void* sock = op->socks[op->next++ % op->nsocks];
+		zmq_msg_init_size(&msg, 8);
+		dbz_put64((char*)zmq_msg_data(&msg), id);
+		if( zmq_send(sock, &msg, ZMQ_SNDMORE | ZMQ_NOBLOCK) != 0 ) {
+			zmq_msg_close(&msg);
+			continue;
+		}
+		zmq_msg_close(&msg);
+		/* The rest of a message is queued once its first frame is */
+		zmq_msg_init_size(&msg, len);
+		memcpy(zmq_msg_data(&msg), data, len);
+		zmq_send(sock, &msg, 0);
+		zmq_msg_close(&msg);
+		return 1;
+	}
+	return 0;
+}
+
+static void pending_done(dbzc_t* c, pending_t* p)
+{
+	p->id = 0;
+	c->npending--;
+	while( c->oldest < c->next_id && c->pending[c->oldest & c->mask].id != c->oldest ) c->oldest++;
+}
+
+/**
+ * Send a request under the next id.
+ * @return the slot it waits in, NULL if it can't be sent now
+ */
+static pending_t* request_send(dbzc_t* c, op_t* op, int kind, const char* data, size_t len, dbzc_cb cb, void* arg)
+{
+	pending_t* p;
+	uint64_t id = c->next_id;
+
+	if( id - c->oldest > c->mask ) return NULL;
+	p = &c->pending[id & c->mask];
+	assert(p->id == 0);
+	if( kind == KIND_GET ) {
+		if( len > p->cap ) {
+			char* payload = (char*)realloc(p->payload, len);
+			if( ! payload ) return NULL;
+			p->payload = payload;
+			p->cap = len;
+		}
+		memcpy(p->payload, data, len);
+		p->len = len;
+	}
+	if( ! op_send(op, id, data, len) ) return NULL;
+	c->next_id++;
+	c->npending++;
+	p->id = id;
+	p->kind = kind;
+	p->op = op;
+	p->cb = cb;
+	p->arg = arg;
+	p->sent_ms = now_ms();
+	p->tries = 1;
+	p->nmembers = 0;
+	return p;
+}
+
+/**
+ * Send a get again under a new id, so a late reply to the old one is
+ * ignored.
+ * @return 0 if it can't be sent now
+ */
+static int request_retry(dbzc_t* c, pending_t* p)
+{
+	pending_t* q;
+	char* payload;
+	size_t cap;
+	int tries = p->tries;
+
+	if( c->next_id - c->oldest > c->mask ) return 0;
+	q = &c->pending[c->next_id & c->mask];
+	/* Swap buffers, the old slot's is the one with the key */
+	payload = q->payload;
+	cap = q->cap;
+	q->payload = p->payload;
+	q->cap = p->cap;
+	q->len = p->len;
+	p->payload = payload;
+	p->cap = cap;
+	if( ! op_send(p->op, c->next_id, q->payload, q->len) ) return 0;
+	q->id = c->next_id++;
+	q->kind = p->kind;
+	q->op = p->op;
+	q->cb = p->cb;
+	q->arg = p->arg;
+	q->sent_ms = now_ms();
+	q->tries = tries + 1;
+	c->npending++;
+	pending_done(c, p);
+	return 1;
+}
+
+static void member_add(member_t** members, size_t* n, size_t* cap, dbzc_cb cb, void* arg)
+{
+	if( *n == *cap ) {
+		*cap = *cap ? *cap * 2 : 64;
+		*members = (member_t*)realloc(*members, *cap * sizeof(member_t));
+		assert(*members != NULL);
+	}
+	(*members)[*n].cb = cb;
+	(*members)[*n].arg = arg;
+	(*n)++;
+}
+
+/**
+ * Send the puts and dels gathered so far as one batch op.
+ * @return 0 if they can't be sent now, they are tried again next poll
+ */
+static int batch_send(dbzc_t* c)
+{
+	op_t* op = op_find(c, "batch");
+	pending_t* p;
+	member_t* members;
+	size_t cap;
+
+	if( ! c->nmembers ) return 1;
+	assert(op != NULL);
+	if( ! (p = request_send(c, op, KIND_BATCH, c->batch, c->batch_len, NULL, NULL)) ) return 0;
+	/* Swap the member lists, keeping both allocations */
+	members = p->members;
+	cap = p->members_cap;
+	p->members = c->members;
+	p->members_cap = c->members_cap;
+	p->nmembers = c->nmembers;
+	c->members = members;
+	c->members_cap = cap;
+	c->nmembers = 0;
+	c->batch_len = 0;
+	return 1;
+}
+
+static int batch_add(dbzc_t* c, char type, const char* key, const char* value, size_t len, dbzc_cb cb, void* arg)
+{
+	size_t need = c->batch_len + DBZ_REC_HDR + c->key_size + len;
+	if( need > c->batch_cap ) {
+		size_t cap = c->batch_cap ? c->batch_cap : 4096;
+		char* batch;
+		while( cap < need ) cap *= 2;
+		if( ! (batch = (char*)realloc(c->batch, cap)) ) return DBZC_FAILED;
+		c->batch = batch;
+		c->batch_cap = cap;
+	}
+	c->batch_len += dbz_record_header(c->batch + c->batch_len, type, c->key_size + len);
+	memcpy(c->batch + c->batch_len, key, c->key_size);
+	if( len ) memcpy(c->batch + c->batch_len + c->key_size, value, len);
+	c->batch_len += c->key_size + len;
+	member_add(&c->members, &c->nmembers, &c->members_cap, cb, arg);
+	if( c->batch_len >= c->batch_bytes ) batch_send(c);
+	return DBZC_OK;
+}
+
+/**
+ * Send a request other than a batch, after the puts and dels gathered
+ * before it so requests leave in the order they were made.
+ */
+static int submit(dbzc_t* c, const char* name, int kind, const char* data, size_t len, dbzc_cb cb, void* arg)
+{
+	op_t* op = op_find(c, name);
+	if( ! op ) return DBZC_INVALID;
+	if( ! batch_send(c) ) return DBZC_OVERLOAD;
+	return request_send(c, op, kind, data, len, cb, arg) ? DBZC_OK : DBZC_OVERLOAD;
+}
+
+DBZC_EXPORT int dbzc_get(dbzc_t* c, const char* key, dbzc_cb cb, void* arg)
+{
+	return submit(c, "get", KIND_GET, key, c->key_size, cb, arg);
+}
+
+DBZC_EXPORT int dbzc_put(dbzc_t* c, const char* key, const char* value, size_t len, dbzc_cb cb, void* arg)
+{
+	char small[0x400];
+	char* rec;
+	int rc;
+
+	if( ! len ) return DBZC_INVALID;
+	if( c->key_size + len <= c->batch_record && op_find(c, "batch") ) {
+		return batch_add(c, DBZ_REC_PUT, key, value, len, cb, arg);
+	}
+	rec = c->key_size + len <= sizeof(small) ? small : (char*)malloc(c->key_size + len);
+	if( ! rec ) return DBZC_FAILED;
+	memcpy(rec, key, c->key_size);
+	memcpy(rec + c->key_size, value, len);
+	rc = submit(c, "put", KIND_PUT, rec, c->key_size + len, cb, arg);
+	if( rec != small ) free(rec);
+	return rc;
+}
+
+DBZC_EXPORT int dbzc_del(dbzc_t* c, const char* key, dbzc_cb cb, void* arg)
+{
+	if( c->batch_record && op_find(c, "batch") ) {
+		return batch_add(c, DBZ_REC_DEL, key, NULL, 0, cb, arg);
+	}
+	return submit(c, "del", KIND_DEL, key, c->key_size, cb, arg);
+}
+
+DBZC_EXPORT int dbzc_call(dbzc_t* c, const char* name, const char* data, size_t len, dbzc_cb cb, void* arg)
+{
+	return submit(c, name, KIND_CALL, data, len, cb, arg);
+}
+
+static void callback(dbzc_t* c, dbzc_cb cb, void* arg, int status, const char* data, size_t len)
+{
+	c->completed++;
+	if( cb ) cb(arg, status, data, len);
+}
+
+/**
+ * Answer a request and free its slot. `status` is DBZC_OK for a reply,
+ * otherwise why there was none.
+ */
+static void request_done(dbzc_t* c, pending_t* p, int status, const char* data, size_t len)
+{
+	size_t i;
+
+	if( status != DBZC_OK && p->kind == KIND_GET && p->tries <= c->retries && request_retry(c, p) ) {
+		return;
+	}
+	/* Callbacks may send more requests, which can't take this slot while it is in use */
+	switch( p->kind ) {
+	case KIND_GET:
+		if( status != DBZC_OK ) callback(c, p->cb, p->arg, status, NULL, 0);
+		else if( len > c->key_size ) callback(c, p->cb, p->arg, DBZC_OK, data + c->key_size, len - c->key_size);
+		else callback(c, p->cb, p->arg, DBZC_MISSING, NULL, 0);
+		break;
+	case KIND_PUT:
+		if( status == DBZC_OK && len <= c->key_size ) status = DBZC_FAILED;
+		callback(c, p->cb, p->arg, status, NULL, 0);
+		break;
+	case KIND_DEL:
+		callback(c, p->cb, p->arg, status, NULL, 0);
+		break;
+	case KIND_CALL:
+		callback(c, p->cb, p->arg, status, status == DBZC_OK ? data : NULL, status == DBZC_OK ? len : 0);
+		break;
+	case KIND_BATCH:
+		for( i = 0; i < p->nmembers; i++ ) {
+			int rc = status;
+			/* A malformed batch is answered with a single DBZ_REC_FAILED */
+			if( rc == DBZC_OK && (i >= len || data[i] != DBZ_REC_OK) ) rc = DBZC_FAILED;
+			callback(c, p->members[i].cb, p->members[i].arg, rc, NULL, 0);
+		}
+		p->nmembers = 0;
+		break;
+	}
+	pending_done(c, p);
+}
+
+static void drain(void* sock, zmq_msg_t* msg)
+{
+	int64_t more = 1;
+	size_t more_sz;
+	for( ;; ) {
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		if( ! more ) break;
+		zmq_msg_close(msg);
+		zmq_msg_init(msg);
+		if( zmq_recv(sock, msg, 0) != 0 ) break;
+	}
+	zmq_msg_close(msg);
+}
+
+/**
+ * Read the replies waiting on one socket: id[8], then a status frame
+ * starting with '!' when the server didn't run the request, then the
+ * payload.
+ */
+static void sock_recv(dbzc_t* c, void* sock)
+{
+	int64_t more;
+	size_t more_sz;
+	zmq_msg_t msg;
+
+	for( ;; ) {
+		pending_t* p;
+		uint64_t id;
+		int status = DBZC_OK;
+
+		zmq_msg_init(&msg);
+		if( zmq_recv(sock, &msg, ZMQ_NOBLOCK) != 0 ) {
+			zmq_msg_close(&msg);
+			return;
+		}
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		if( zmq_msg_size(&msg) != 8 || ! more ) {
+			drain(sock, &msg);
+			continue;
+		}
+		id = dbz_get64((const char*)zmq_msg_data(&msg));
+		zmq_msg_close(&msg);
+		zmq_msg_init(&msg);
+		if( zmq_recv(sock, &msg, 0) != 0 ) {
+			zmq_msg_close(&msg);
+			continue;
+		}
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		if( more && zmq_msg_size(&msg) > 0 && ((const char*)zmq_msg_data(&msg))[0] == '!' ) {
+			size_t n = strlen(DBZ_STATUS_TIMEOUT);
+			status = zmq_msg_size(&msg) == n && memcmp(zmq_msg_data(&msg), DBZ_STATUS_TIMEOUT, n) == 0
+				? DBZC_TIMEOUT : DBZC_OVERLOAD;
+			zmq_msg_close(&msg);
+			zmq_msg_init(&msg);
+			if( zmq_recv(sock, &msg, 0) != 0 ) {
+				zmq_msg_close(&msg);
+				continue;
+			}
+		}
+
+		p = &c->pending[id & c->mask];
+		if( p->id == id ) {
+			request_done(c, p, status, (const char*)zmq_msg_data(&msg), zmq_msg_size(&msg));
+		}
+		/* Otherwise a reply to a request which timed out */
+		drain(sock, &msg);
+	}
+}
+
+/**
+ * Time out requests sent more than DBZC_OPT_TIMEOUT ago, oldest first.
+ * @return ms until the next one times out, -1 if none will
+ */
+static long requests_expire(dbzc_t* c)
+{
+	uint64_t now = now_ms(), id;
+
+	for( id = c->oldest; id < c->next_id; id++ ) {
+		pending_t* p = &c->pending[id & c->mask];
+		if( p->id != id ) continue;
+		/* Sent in order of id, retries included */
+		if( p->sent_ms + c->timeout_ms > now ) return (long)(p->sent_ms + c->timeout_ms - now);
+		request_done(c, p, DBZC_TIMEOUT, NULL, 0);
+	}
+	return -1;
+}
+
+DBZC_EXPORT int dbzc_poll(dbzc_t* c, long timeout_ms)
+{
+	long next;
+	int i, rc;
+
+	c->completed = 0;
+	batch_send(c);
+	next = requests_expire(c);
+	if( ! c->npending ) return c->completed;
+	if( next >= 0 && (timeout_ms < 0 || next < timeout_ms) ) timeout_ms = next;
+	if( c->completed ) timeout_ms = 0;
+
+	rc = zmq_poll(c->items, c->nitems, timeout_ms < 0 ? -1 : POLL_MSEC(timeout_ms));
+	if( rc < 0 ) return -1;
+	for( i = 0; rc > 0 && i < c->nitems; i++ ) {
+		if( c->items[i].revents & ZMQ_POLLIN ) sock_recv(c, c->items[i].socket);
+	}
+	requests_expire(c);
+	/* Sent now rather than at the next poll, when replies made room */
+	batch_send(c);
+	return c->completed;
+}
+
+DBZC_EXPORT size_t dbzc_wait(dbzc_t* c, long timeout_ms)
+{
+	uint64_t until = now_ms() + (uint64_t)(timeout_ms < 0 ? 0 : timeout_ms);
+	uint64_t now;
+
+	while( dbzc_pending(c) ) {
+		now = now_ms();
+		if( timeout_ms >= 0 && now >= until ) break;
+		if( dbzc_poll(c, timeout_ms < 0 ? -1 : (long)(until - now)) < 0 ) break;
+	}
+	return dbzc_pending(c);
+}
+
+DBZC_EXPORT size_t dbzc_pending(const dbzc_t* c)
+{
+	return c->npending + c->nmembers;
+}
@@ -0,0 +1,96 @@
+#ifndef _DBZ_CLIENT_H
+#define _DBZ_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Client for db-zmq, see server/db-zmq.c.
+ *
+ * Each op is reached over a pool of DEALER sockets connected to the
+ * server's router@ binds, and every request is tagged with its own id,
+ * so many requests are in flight at once and their replies are matched
+ * in whatever order they come. Requests are queued without waiting and
+ * completed from dbzc_poll(), which calls the request's callback.
+ *
+ * Puts and dels no larger than DBZC_OPT_BATCH_RECORD are gathered into
+ * one batch op per poll when batch is connected, and sent one by one
+ * otherwise. Any other request sends the batch first, so requests leave
+ * in the order they are made; the server may still apply those on
+ * different sockets in either order, so a get is only sure to see a
+ * write once it is answered. Gets not answered within DBZC_OPT_TIMEOUT,
+ * or refused as overloaded, are sent again up to DBZC_OPT_RETRIES times;
+ * other requests are not, as they may have been applied.
+ *
+ * Keys are DBZC_OPT_KEY_SIZE bytes. A client is used by one thread at a
+ * time. The structure is private, so programs built against this header
+ * keep working with later builds of libdbz-client.so.1.
+ */
+#define DBZC_ABI	1
+
+/* Status passed to callbacks, also returned when a request isn't queued */
+#define DBZC_OK			0
+#define DBZC_MISSING	1	/* get: no such key */
+#define DBZC_FAILED		2	/* Not applied by the module */
+#define DBZC_OVERLOAD	3	/* Refused by the server, or too many requests in flight */
+#define DBZC_TIMEOUT	4	/* No reply in time */
+#define DBZC_INVALID	5	/* Bad arguments, or the op isn't connected */
+
+/* Options, see dbzc_set() */
+#define DBZC_OPT_KEY_SIZE		1	/* Bytes in a key (default: 20) */
+#define DBZC_OPT_POOL			2	/* Sockets per op, before its first dbzc_connect() (default: 2) */
+#define DBZC_OPT_INFLIGHT		3	/* Requests in flight, a power of two, before any request (default: 4096) */
+#define DBZC_OPT_TIMEOUT		4	/* ms before a request times out (default: 1000) */
+#define DBZC_OPT_RETRIES		5	/* Times a get is sent again (default: 2) */
+#define DBZC_OPT_BATCH_RECORD	6	/* Largest put batched, 0 to never batch (default: 4096) */
+#define DBZC_OPT_BATCH_BYTES	7	/* Batch sent once it is this large (default: 65536) */
+
+typedef struct dbzc_s dbzc_t;
+
+/**
+ * Called once per request. `data` is the value for a get, the whole
+ * reply for dbzc_call(), and NULL otherwise. It is only valid during
+ * the call.
+ */
+typedef void (*dbzc_cb)(void* arg, int status, const char* data, size_t len);
+
+int dbzc_abi(void);
+
+/**
+ * @param zctx ZeroMQ context to share, NULL for one of the client's own
+ */
+dbzc_t* dbzc_new(void* zctx);
+void dbzc_free(dbzc_t* c);
+int dbzc_set(dbzc_t* c, int option, int64_t value);
+
+/**
+ * Connect op `name` to a router@ bind, more than one spreads requests
+ * between them.
+ */
+int dbzc_connect(dbzc_t* c, const char* name, const char* addr);
+
+int dbzc_get(dbzc_t* c, const char* key, dbzc_cb cb, void* arg);
+int dbzc_put(dbzc_t* c, const char* key, const char* value, size_t len, dbzc_cb cb, void* arg);
+int dbzc_del(dbzc_t* c, const char* key, dbzc_cb cb, void* arg);
+
+/**
+ * Any other op taking a reply, e.g. incr or stats, with its payload as is.
+ */
+int dbzc_call(dbzc_t* c, const char* name, const char* data, size_t len, dbzc_cb cb, void* arg);
+
+/**
+ * Send what is waiting, read replies and call back, waiting up to
+ * `timeout_ms` for the first reply (-1 for as long as it takes).
+ * @return Requests completed, -1 on error
+ */
+int dbzc_poll(dbzc_t* c, long timeout_ms);
+
+/**
+ * Poll until every request has completed or `timeout_ms` has passed.
+ * @return Requests still waiting
+ */
+size_t dbzc_wait(dbzc_t* c, long timeout_ms);
+
+size_t dbzc_pending(const dbzc_t* c);
+
+#endif
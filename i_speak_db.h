@@ -6,7 +6,14 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
+/*
+ * An op answers by calling `cb` with the reply. `cb` is NULL when the
+ * host applies a mutation for itself (replication, WAL replay, expiry,
+ * a write-behind flush), so ops must check it before calling back.
+ */
 typedef size_t (*dbzop_t)(
 	const char* in_data,
 	size_t in_sz,
@@ -14,7 +21,11 @@ typedef size_t (*dbzop_t)(
 	void* token
 );
 
-struct dbz_op {	
+/* dbz_op.opts flags */
+#define DBZ_OP_REPLY		1	/* Op answers each request, e.g. get */
+#define DBZ_OP_THREADSAFE	2	/* Op may be called from several threads at once */
+
+struct dbz_op {
 	const char* name;
 	size_t opts;
 	dbzop_t cb;
@@ -23,6 +34,180 @@ struct dbz_op {
 
 typedef struct dbz_op* (*mod_init_fn)();
 
+/**
+ * Per-request scratch memory owned by the host.
+ *
+ * The token handed to an op is NULL or points to a structure whose first
+ * member is a `struct dbz_arena*`, which may itself be NULL. Memory from
+ * dbz_alloc() is valid until the op returns, then the host resets the
+ * arena. dbz_free() does nothing for arena memory, so modules can pair
+ * it with dbz_alloc() as they would malloc() and free(). Allocations
+ * which don't fit in the arena fall back to malloc().
+ */
+struct dbz_arena {
+	char* base;
+	size_t size;
+	size_t used;
+	size_t misses;	/* Allocations which fell back to malloc() */
+};
+
+static inline struct dbz_arena* dbz_arena_of(void* token)
+{
+	return token ? *(struct dbz_arena**)token : NULL;
+}
+
+static inline void* dbz_alloc(void* token, size_t size)
+{
+	struct dbz_arena* a = dbz_arena_of(token);
+	if( a ) {
+		size_t offset = (a->used + 15) & ~(size_t)15;
+		if( offset + size <= a->size ) {
+			a->used = offset + size;
+			return a->base + offset;
+		}
+		a->misses++;
+	}
+	return malloc(size);
+}
+
+static inline void dbz_free(void* token, void* p)
+{
+	struct dbz_arena* a = dbz_arena_of(token);
+	if( a && (char*)p >= a->base && (char*)p < a->base + a->size )
+		return;
+	free(p);
+}
+
+/*
+ * Records, as carried by the batch op:
+ *
+ *   type[1] ++ len[4] ++ data[len]
+ *
+ * `len` is big-endian, `type` is DBZ_REC_PUT (data is k ++ v) or
+ * DBZ_REC_DEL (data is k). The batch op applies every record or none and
+ * replies with one status byte per record, or a single DBZ_REC_FAILED
+ * when the batch is empty or malformed.
+ */
+#define DBZ_REC_PUT		'P'
+#define DBZ_REC_DEL		'D'
+#define DBZ_REC_HDR		5
+
+#define DBZ_REC_OK		'O'	/* Applied */
+#define DBZ_REC_FAILED	'F'	/* Failed, nothing in the batch was applied */
+#define DBZ_REC_ABORTED	'A'	/* Not applied because another record failed */
+
+/**
+ * Read the record at `*offset` and move past it.
+ * @return 1 for a record, 0 at the end, -1 if the rest is malformed
+ */
+static inline int dbz_record_next(const char* buf, size_t size, size_t* offset, char* type, const char** data, size_t* len)
+{
+	const unsigned char* p = (const unsigned char*)buf + *offset;
+	size_t n;
+	if( *offset == size ) return 0;
+	if( size - *offset < DBZ_REC_HDR ) return -1;
+	n = ((size_t)p[1] << 24) | ((size_t)p[2] << 16) | ((size_t)p[3] << 8) | p[4];
+	if( n > size - *offset - DBZ_REC_HDR ) return -1;
+	*type = (char)p[0];
+	*data = buf + *offset + DBZ_REC_HDR;
+	*len = n;
+	*offset += DBZ_REC_HDR + n;
+	return 1;
+}
+
+/**
+ * Write a record header to `out`, the caller copies `len` bytes of data after it.
+ * @return DBZ_REC_HDR
+ */
+static inline size_t dbz_record_header(char* out, char type, size_t len)
+{
+	out[0] = type;
+	out[1] = (char)((len >> 24) & 0xFF);
+	out[2] = (char)((len >> 16) & 0xFF);
+	out[3] = (char)((len >> 8) & 0xFF);
+	out[4] = (char)(len & 0xFF);
+	return DBZ_REC_HDR;
+}
+
+/**
+ * Check every record of a batch before applying any of them.
+ * @return Number of records, -1 if malformed
+ */
+static inline long dbz_batch_count(const char* buf, size_t size, size_t key_size)
+{
+	size_t offset = 0, len;
+	const char* data;
+	long n = 0;
+	char type;
+	int rc;
+	while( (rc = dbz_record_next(buf, size, &offset, &type, &data, &len)) == 1 ) {
+		if( type == DBZ_REC_PUT && len <= key_size ) return -1;
+		if( type == DBZ_REC_DEL && len != key_size ) return -1;
+		if( type != DBZ_REC_PUT && type != DBZ_REC_DEL ) return -1;
+		n++;
+	}
+	return rc == 0 ? n : -1;
+}
+
+/*
+ * The snapshot op takes limit[4] ++ after, `after` being empty to pin a
+ * new consistent view of the database or the last key of the previous
+ * chunk to carry on from it. It calls back once with DBZ_REC_PUT records
+ * for about `limit` bytes of the view, at least one record unless the
+ * view is exhausted, and returns the number of records. A view is
+ * released once a call returns 0. The op doesn't call back at all when
+ * it cannot take or read the snapshot. Each call runs on the server's
+ * thread, so it should be short; the call pinning a view may have to
+ * copy the database (tcbdb does) and blocks requests while it does.
+ */
+
+/**
+ * Limit in bytes from the start of a snapshot request.
+ */
+static inline size_t dbz_snapshot_limit(const char* in_data)
+{
+	const unsigned char* p = (const unsigned char*)in_data;
+	return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Append a DBZ_REC_PUT record of k ++ v to a growable buffer.
+ * @return 0 when out of memory
+ */
+static inline int dbz_record_append(char** buf, size_t* cap, size_t* used, const char* k, size_t k_sz, const char* v, size_t v_sz)
+{
+	size_t need = *used + DBZ_REC_HDR + k_sz + v_sz;
+	if( need > *cap ) {
+		size_t n = *cap ? *cap : 4096;
+		char* p;
+		while( n < need ) n *= 2;
+		p = (char*)realloc(*buf, n);
+		if( ! p ) return 0;
+		*buf = p;
+		*cap = n;
+	}
+	*used += dbz_record_header(*buf + *used, DBZ_REC_PUT, k_sz + v_sz);
+	memcpy(*buf + *used, k, k_sz);
+	memcpy(*buf + *used + k_sz, v, v_sz);
+	*used += k_sz + v_sz;
+	return 1;
+}
+
+/*
+ * The sync op takes no input and returns 1 once everything the module
+ * applied before the call is on disk, 0 if it cannot tell. Modules with
+ * fast unsynced writes provide it so the host can keep its own log of
+ * recent mutations short, see the WAL in server/wal.h.
+ */
+
+/*
+ * The memory op returns the bytes the module holds in memory, e.g. in
+ * caches and write buffers, 0 if it cannot tell. Given "trim" it first
+ * releases what it can, by dropping caches or writing out buffers. The
+ * host calls it outside requests to account for its memory and to stay
+ * under a limit, see server/memory.h.
+ */
+
 #define DB_OP(name) size_t name ( char* in_data, size_t in_sz, dbzop_t cb, void* token )
 
 #ifdef __cplusplus
@@ -14,9 +14,28 @@ static leveldb_readoptions_t* db_roptions = NULL;
 static leveldb_writeoptions_t* db_woptions = NULL;
 static size_t key_size = -1;
 
+static const leveldb_snapshot_t* snap = NULL;
+static leveldb_readoptions_t* snap_roptions = NULL;
+static leveldb_iterator_t* snap_iter = NULL;
+static char* snap_buf = NULL;
+static size_t snap_cap = 0;
+
+static void
+snapshot_release(){
+	if(snap){
+		leveldb_iter_destroy(snap_iter);
+		leveldb_readoptions_destroy(snap_roptions);
+		leveldb_release_snapshot(db, snap);
+		snap_iter = NULL;
+		snap_roptions = NULL;
+		snap = NULL;
+	}
+}
+
 static void
 close_db(){
 	if(db){
+		snapshot_release();
 		leveldb_close(db);
 		leveldb_options_destroy(db_options);
 		leveldb_readoptions_destroy(db_roptions);
@@ -109,11 +128,11 @@ DB_OP(do_get){
 
 	out_sz = in_sz + data_sz;
 	if(cb){
-		out_data = (char*)malloc(out_sz);
+		out_data = (char*)dbz_alloc(token, out_sz);
 		memcpy(out_data, in_data, in_sz);
 		memcpy(out_data+in_sz, data, data_sz);
 		cb(out_data, out_sz, NULL, token);
-		free(out_data);
+		dbz_free(token, out_data);
 	}
 	free(data);
 	return out_sz;
@@ -133,6 +152,154 @@ DB_OP(do_del){
 	return in_sz;
 }
 
+/**
+ * Apply every record in one leveldb_write().
+ */
+static
+DB_OP(do_batch){
+	size_t offset = 0, len;
+	const char* data;
+	char type, *status;
+	char *dberr = NULL;
+	leveldb_writebatch_t* batch;
+	long n;
+	int failed;
+
+	open_db();
+	n = dbz_batch_count(in_data, in_sz, key_size);
+	if( n <= 0 ) {
+		if( cb ) cb("F", 1, NULL, token);
+		return 0;
+	}
+
+	batch = leveldb_writebatch_create();
+	while( dbz_record_next(in_data, in_sz, &offset, &type, &data, &len) == 1 ) {
+		if( type == DBZ_REC_PUT )
+			leveldb_writebatch_put(batch, data, key_size, data+key_size, len-key_size);
+		else
+			leveldb_writebatch_delete(batch, data, len);
+	}
+	leveldb_write(db, db_woptions, batch, &dberr);
+	leveldb_writebatch_destroy(batch);
+	failed = dberr != NULL;
+	if( failed ) {
+		warnx("Cannot write batch: %s", dberr);
+		free(dberr);
+	}
+
+	status = (char*)dbz_alloc(token, n);
+	memset(status, failed ? DBZ_REC_FAILED : DBZ_REC_OK, n);
+	if( cb )
+		cb(status, n, NULL, token);
+	dbz_free(token, status);
+	return failed ? 0 : in_sz;
+}
+
+/**
+ * Walk a leveldb snapshot, the iterator doesn't fill the block cache so a
+ * backup doesn't push out the working set.
+ */
+static
+DB_OP(do_snapshot){
+	size_t limit, used = 0, n = 0;
+	const char *k, *v;
+	size_t k_sz, v_sz;
+	char *dberr = NULL;
+
+	if( in_sz < 4 ) return 0;
+	open_db();
+	limit = dbz_snapshot_limit(in_data);
+	if( in_sz == 4 ) {
+		snapshot_release();
+		snap = leveldb_create_snapshot(db);
+		snap_roptions = leveldb_readoptions_create();
+		leveldb_readoptions_set_snapshot(snap_roptions, snap);
+		leveldb_readoptions_set_fill_cache(snap_roptions, 0);
+		snap_iter = leveldb_create_iterator(db, snap_roptions);
+		leveldb_iter_seek_to_first(snap_iter);
+	}
+	else if( ! snap_iter ) {
+		warnx("No snapshot to continue");
+		return 0;
+	}
+	else {
+		leveldb_iter_seek(snap_iter, in_data + 4, in_sz - 4);
+		if( leveldb_iter_valid(snap_iter) ) {
+			k = leveldb_iter_key(snap_iter, &k_sz);
+			if( k_sz == in_sz - 4 && memcmp(k, in_data + 4, k_sz) == 0 )
+				leveldb_iter_next(snap_iter);
+		}
+	}
+
+	while( leveldb_iter_valid(snap_iter) && (n == 0 || used < limit) ) {
+		k = leveldb_iter_key(snap_iter, &k_sz);
+		v = leveldb_iter_value(snap_iter, &v_sz);
+		if( ! dbz_record_append(&snap_buf, &snap_cap, &used, k, k_sz, v, v_sz) ) {
+			warnx("Cannot grow snapshot buffer");
+			snapshot_release();
+			return 0;
+		}
+		n++;
+		leveldb_iter_next(snap_iter);
+	}
+	leveldb_iter_get_error(snap_iter, &dberr);
+	if( dberr ) {
+		warnx("Cannot read snapshot: %s", dberr);
+		free(dberr);
+		snapshot_release();
+		return 0;
+	}
+
+	if( cb )
+		cb(snap_buf, used, NULL, token);
+	if( ! n )
+		snapshot_release();
+	return n;
+}
+
+/**
+ * An empty synced write, leveldb syncs its log up to and including it.
+ */
+static
+DB_OP(do_sync){
+	leveldb_writeoptions_t* woptions;
+	leveldb_writebatch_t* wb;
+	char *dberr = NULL;
+	(void)in_data; (void)in_sz; (void)cb; (void)token;
+
+	open_db();
+	woptions = leveldb_writeoptions_create();
+	leveldb_writeoptions_set_sync(woptions, 1);
+	wb = leveldb_writebatch_create();
+	leveldb_write(db, woptions, wb, &dberr);
+	leveldb_writebatch_destroy(wb);
+	leveldb_writeoptions_destroy(woptions);
+	if( dberr ) {
+		warnx("Cannot sync: %s", dberr);
+		free(dberr);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * leveldb's estimate of its memtables and block cache. It has nothing
+ * to trim short of compacting.
+ */
+static
+DB_OP(do_memory){
+	char* usage;
+	size_t bytes = 0;
+	(void)in_data; (void)in_sz; (void)cb; (void)token;
+	open_db();
+	usage = leveldb_property_value(db, "leveldb.approximate-memory-usage");
+	if( usage ) {
+		bytes = (size_t)strtoull(usage, NULL, 10);
+		free(usage);
+	}
+	return bytes;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -140,8 +307,12 @@ extern "C" {
 	i_speak_db(void){
 		static struct dbz_op ops[] = {
 			{"put", 0, (dbzop_t)do_put, NULL},
-			{"get", 1, (dbzop_t)do_get, NULL},
+			{"get", DBZ_OP_REPLY|DBZ_OP_THREADSAFE, (dbzop_t)do_get, NULL},
 			{"del", 0, (dbzop_t)do_del, NULL},
+			{"batch", DBZ_OP_REPLY, (dbzop_t)do_batch, NULL},
+			{"snapshot", DBZ_OP_REPLY, (dbzop_t)do_snapshot, NULL},
+			{"sync", 0, (dbzop_t)do_sync, NULL},
+			{"memory", 0, (dbzop_t)do_memory, NULL},
 			{NULL, 0, 0, 0}
 		};
 		return &ops;
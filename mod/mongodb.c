@@ -109,12 +109,12 @@ DB_OP(do_get){
 				const char* data = bson_iterator_bin_data(&it);
 				size_t data_sz = bson_iterator_bin_len(&it);
 				size_t out_sz = data_sz + in_sz;
-				char *out_data = (char*)malloc(out_sz);
+				char *out_data = (char*)dbz_alloc(token, out_sz);
 				memcpy(out_data, in_data, in_sz);
 				memcpy(out_data+in_sz, data, data_sz);
 				cb(out_data, out_sz, NULL, token);
 				ret = out_sz;
-				free(out_data);
+				dbz_free(token, out_data);
 			}
 		}
 		bson_destroy(bout);
@@ -147,7 +147,8 @@ DB_OP(do_del){
 	}
 	bson_destroy(b);
 
-	cb(in_data, in_sz, NULL, token);
+	if(cb)
+		cb(in_data, in_sz, NULL, token);
 
 	return ret;
 }
@@ -65,14 +65,14 @@ DB_OP(nessdb_get){
 	size_t ret = in_sz;
 	if( db_get(db, &sk, &sv) && sv.len && sv.data ) {
 		if(cb) {
-			struct slice out = {malloc(sk.len+sv.len), sk.len+sv.len};
+			struct slice out = {dbz_alloc(token, sk.len+sv.len), sk.len+sv.len};
 			memcpy(out.data, in_data, in_sz);
-			memcpy(out.data, sv.data, sv.len);
+			memcpy(out.data+in_sz, sv.data, sv.len);
 			cb(out.data, out.len, NULL, token);
-			free(out.data);
-			free(sv.data);
+			dbz_free(token, out.data);
 		}
 		ret += sv.len;
+		free(sv.data);
 	}
 	else {
 		if(cb)
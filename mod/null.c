@@ -5,12 +5,18 @@ DB_OP(nullop_null){
 	return in_sz;
 }
 
+DB_OP(nullop_sync){
+	(void)in_data; (void)in_sz; (void)cb; (void)token;
+	return 1;
+}
+
 void*
 i_speak_db(void){
 	static struct dbz_op ops[] = {
 		{"put", 0, (dbzop_t)nullop_null, NULL},
-		{"get", 1, (dbzop_t)nullop_null, NULL},
+		{"get", DBZ_OP_REPLY|DBZ_OP_THREADSAFE, (dbzop_t)nullop_null, NULL},
 		{"del", 0, (dbzop_t)nullop_null, NULL},
+		{"sync", 0, (dbzop_t)nullop_sync, NULL},
 		{NULL, 0, 0, 0}
 	};
 	return &ops;
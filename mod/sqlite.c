@@ -14,15 +14,35 @@ static sqlite3_stmt* db_get_stmt = NULL;
 static sqlite3_stmt* db_del_stmt = NULL;
 
 static size_t key_size = -1;
+static const char* db_filename = NULL;
+static int db_wal = 0;
+
+static sqlite3* snap = NULL;
+static sqlite3_stmt* snap_stmt = NULL;
+static char* snap_buf = NULL;
+static size_t snap_cap = 0;
 
 static const char init_sql[] = "CREATE TABLE kv(k BLOB PRIMARY KEY, v BLOB)";
 static const char get_sql[]  = "SELECT v FROM kv WHERE k = ? LIMIT 1";
-static const char put_sql[]  = "INSERT INTO kv VALUES (?,?)";
+static const char put_sql[]  = "INSERT OR REPLACE INTO kv VALUES (?,?)";
 static const char del_sql[]  = "DELETE FROM kv WHERE k = ? LIMIT 1";
+static const char snap_sql[] = "SELECT k, v FROM kv WHERE k > ? ORDER BY k";
+
+static void
+snapshot_release(){
+	if(snap){
+		sqlite3_finalize(snap_stmt);
+		sqlite3_exec(snap, "COMMIT", NULL, NULL, NULL);
+		sqlite3_close(snap);
+		snap_stmt = NULL;
+		snap = NULL;
+	}
+}
 
 static void
 close_db(){
 	if(db){
+		snapshot_release();
 		/* TODO: validate return codes. */
 		sqlite3_finalize(db_put_stmt);
 		sqlite3_finalize(db_get_stmt);
@@ -39,6 +59,8 @@ open_db() {
 	if(!db){
 		const char* filename = getenv("SQLITE3_FILE");
 		if(!filename) filename = "sqlite3.dat";
+		db_filename = filename;
+		db_wal = getenv("SQLITE3_WAL") && atoi(getenv("SQLITE3_WAL"));
 
 		const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
 		if(!prot_keysize) prot_keysize = "20";
@@ -53,12 +75,23 @@ open_db() {
 		}
 		else {			
 			sqlite3_exec(db, init_sql, NULL, NULL, NULL);
-			sqlite3_exec(db, 
-			    "PRAGMA synchronous = off;"
-			    "PRAGMA journal_mode = off;"
-			    "PRAGMA locking_mode = exclusive;"
-			, 0, 0, 0
-			  );
+			if( db_wal ) {
+				/* Readers on other connections see the last commit, for snapshots */
+				sqlite3_exec(db,
+				    "PRAGMA synchronous = off;"
+				    "PRAGMA journal_mode = wal;"
+				, 0, 0, 0
+				  );
+			}
+			else {
+				/* Without a journal a batch spilled to the file can't be rolled back */
+				sqlite3_exec(db, 
+				    "PRAGMA synchronous = off;"
+				    "PRAGMA journal_mode = memory;"
+				    "PRAGMA locking_mode = exclusive;"
+				, 0, 0, 0
+				  );
+			}
 			sqlite3_prepare_v2(db, get_sql, -1, &db_get_stmt, 0);
 			sqlite3_prepare_v2(db, put_sql, -1, &db_put_stmt, 0);
 			sqlite3_prepare_v2(db, del_sql, -1, &db_del_stmt, 0);
@@ -69,9 +102,9 @@ open_db() {
 
 static
 DB_OP(do_put){
+	open_db();
 	if(in_sz<=key_size)
 		return 0;
-	open_db();
 	size_t ret_sz;
 
 	sqlite3_bind_blob(db_put_stmt, 1, in_data, key_size, SQLITE_STATIC);
@@ -102,11 +135,11 @@ DB_OP(do_get){
 	if( sqlite3_step(db_get_stmt) == SQLITE_ROW ) {
 		if(cb){
 			out_sz += sqlite3_column_bytes(db_get_stmt, 0);
-			out_data = (char*)malloc(out_sz);
+			out_data = (char*)dbz_alloc(token, out_sz);
 			memcpy(out_data, in_data, in_sz);
 			memcpy(out_data+in_sz, sqlite3_column_blob(db_get_stmt, 0), out_sz - in_sz);
 			cb(out_data, out_sz, NULL, token);
-			free(out_data);			
+			dbz_free(token, out_data);
 		}
 	}
 	else {
@@ -129,12 +162,158 @@ DB_OP(do_del){
 	return in_sz;
 }
 
+/**
+ * Apply every record in one transaction.
+ */
+static
+DB_OP(do_batch){
+	size_t offset = 0, len;
+	const char* data;
+	char type, *status;
+	long i = 0, failed = -1, n;
+
+	open_db();
+	n = dbz_batch_count(in_data, in_sz, key_size);
+	if( n <= 0 || sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK ) {
+		if( n > 0 ) warnx("Cannot begin batch: %s", sqlite3_errmsg(db));
+		if( cb ) cb("F", 1, NULL, token);
+		return 0;
+	}
+
+	while( failed < 0 && dbz_record_next(in_data, in_sz, &offset, &type, &data, &len) == 1 ) {
+		sqlite3_stmt* stmt = (type == DBZ_REC_PUT) ? db_put_stmt : db_del_stmt;
+		sqlite3_bind_blob(stmt, 1, data, key_size, SQLITE_STATIC);
+		if( type == DBZ_REC_PUT )
+			sqlite3_bind_blob(stmt, 2, data+key_size, len-key_size, SQLITE_STATIC);
+		if( sqlite3_step(stmt) != SQLITE_DONE )
+			failed = i;
+		sqlite3_reset(stmt);
+		i++;
+	}
+
+	status = (char*)dbz_alloc(token, n);
+	if( failed < 0 && sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK ) {
+		memset(status, DBZ_REC_OK, n);
+	}
+	else {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		memset(status, failed < 0 ? DBZ_REC_FAILED : DBZ_REC_ABORTED, n);
+		if( failed >= 0 ) status[failed] = DBZ_REC_FAILED;
+	}
+	if( cb )
+		cb(status, n, NULL, token);
+	i = status[0] == DBZ_REC_OK;
+	dbz_free(token, status);
+	return i ? in_sz : 0;
+}
+
+/**
+ * Hold a read transaction open on a second connection, in WAL mode it
+ * keeps seeing the database as it was when the snapshot started while
+ * writes carry on. Needs SQLITE3_WAL=1.
+ */
+static
+DB_OP(do_snapshot){
+	size_t limit, used = 0, n = 0;
+	int rc = SQLITE_DONE;
+
+	if( in_sz < 4 ) return 0;
+	open_db();
+	limit = dbz_snapshot_limit(in_data);
+	if( in_sz == 4 ) {
+		snapshot_release();
+		if( ! db_wal ) {
+			warnx("Snapshots need SQLITE3_WAL=1");
+			return 0;
+		}
+		if( sqlite3_open_v2(db_filename, &snap, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK
+		 || sqlite3_exec(snap, "BEGIN", NULL, NULL, NULL) != SQLITE_OK
+		 || sqlite3_prepare_v2(snap, snap_sql, -1, &snap_stmt, 0) != SQLITE_OK ) {
+			warnx("Cannot start snapshot: %s", sqlite3_errmsg(snap));
+			snapshot_release();
+			return 0;
+		}
+		sqlite3_bind_zeroblob(snap_stmt, 1, 0);
+	}
+	else if( ! snap ) {
+		warnx("No snapshot to continue");
+		return 0;
+	}
+	else {
+		sqlite3_bind_blob(snap_stmt, 1, in_data + 4, in_sz - 4, SQLITE_TRANSIENT);
+	}
+
+	while( (n == 0 || used < limit) && (rc = sqlite3_step(snap_stmt)) == SQLITE_ROW ) {
+		if( ! dbz_record_append(&snap_buf, &snap_cap, &used,
+		        (const char*)sqlite3_column_blob(snap_stmt, 0), sqlite3_column_bytes(snap_stmt, 0),
+		        (const char*)sqlite3_column_blob(snap_stmt, 1), sqlite3_column_bytes(snap_stmt, 1)) ) {
+			rc = SQLITE_NOMEM;
+			break;
+		}
+		n++;
+	}
+	sqlite3_reset(snap_stmt);
+	if( rc != SQLITE_ROW && rc != SQLITE_DONE ) {
+		warnx("Cannot read snapshot: %s", sqlite3_errstr(rc));
+		snapshot_release();
+		return 0;
+	}
+
+	if( cb )
+		cb(snap_buf, used, NULL, token);
+	if( ! n )
+		snapshot_release();
+	return n;
+}
+
+static int
+sync_file(int op){
+	sqlite3_file* f = NULL;
+	if( sqlite3_file_control(db, "main", op, &f) != SQLITE_OK || ! f || ! f->pMethods )
+		return 0;
+	return f->pMethods->xSync(f, SQLITE_SYNC_NORMAL) == SQLITE_OK;
+}
+
+/**
+ * Writes run with synchronous off, sync the database file and the WAL
+ * directly.
+ */
+static
+DB_OP(do_sync){
+	int ok;
+	(void)in_data; (void)in_sz; (void)cb; (void)token;
+	open_db();
+	ok = sync_file(SQLITE_FCNTL_FILE_POINTER);
+	if( db_wal ) ok = sync_file(SQLITE_FCNTL_JOURNAL_POINTER) && ok;
+	if( ! ok ) warnx("Cannot sync '%s'", db_filename);
+	return ok;
+}
+
+/**
+ * Everything sqlite has allocated, mostly page cache. Trimming drops
+ * the unused pages of both connections.
+ */
+static
+DB_OP(do_memory){
+	(void)cb; (void)token;
+	open_db();
+	if( in_sz == 4 && memcmp(in_data, "trim", 4) == 0 ) {
+		sqlite3_db_release_memory(db);
+		if( snap ) sqlite3_db_release_memory(snap);
+	}
+	return (size_t)sqlite3_memory_used();
+}
+
 void*
 i_speak_db(void){
 	static struct dbz_op ops[] = {
 		{"put", 0, (dbzop_t)do_put, NULL},
 		{"get", 1, (dbzop_t)do_get, NULL},
 		{"del", 0, (dbzop_t)do_del, NULL},
+		{"batch", DBZ_OP_REPLY, (dbzop_t)do_batch, NULL},
+		{"snapshot", DBZ_OP_REPLY, (dbzop_t)do_snapshot, NULL},
+		{"sync", 0, (dbzop_t)do_sync, NULL},
+		{"memory", 0, (dbzop_t)do_memory, NULL},
 		{NULL, 0, 0, 0}
 	};
 	return &ops;
@@ -0,0 +1,305 @@
+/*
+ * Read-only sorted table, for datasets which are rebuilt offline and then
+ * only read. The table is built with db-sstable (tools/db-sstable.c) and
+ * mmap()ed, so opening it reads only the header and the index, and gets
+ * are served from the page cache without copying the file.
+ *
+ * A get searches the index for the block which may hold the key, then
+ * the block's entries, both by interpolation on the first 8 bytes of the
+ * key: hashed keys (e.g. SHA1) are uniform, so a probe usually lands
+ * next to the key and a lookup touches one or two pages of entries.
+ * After SEARCH_GUESSES steps a search falls back to bisection, so skewed
+ * keys still take O(log n) probes.
+ *
+ * There is no put or del. Replace the file and restart the server to
+ * load a new version.
+ *
+ * Environment:
+ *   SSTABLE_FILE   Table to serve (default: database.sst)
+ *   DBZMQ_KEYSIZE  Must match the table's key size (default: 20)
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE		/* madvise() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../i_speak_db.h"
+#include "sstable.h"
+
+/* Interpolation steps before a search falls back to bisection */
+#define SEARCH_GUESSES	8
+
+static pthread_once_t opened = PTHREAD_ONCE_INIT;
+static const char *filename = NULL;
+static char *map = NULL;
+static uint64_t map_size = 0;
+static struct sst_header table;
+static size_t key_size = -1;
+static size_t entry_size;
+static uint64_t blocks;
+static const char *entries;
+static const char *index_keys;
+
+static char *snap_buf = NULL;
+static size_t snap_cap = 0;
+
+static struct {
+	uint64_t gets;
+	uint64_t hits;
+	uint64_t probes;
+	uint64_t corrupt;
+} stats;
+
+static void
+close_db(){
+	if( map ) {
+		munmap(map, map_size);
+		map = NULL;
+	}
+	free(snap_buf);
+	snap_buf = NULL;
+}
+
+static void
+open_table(){
+	struct stat st;
+	int fd;
+
+	filename = getenv("SSTABLE_FILE");
+	if( ! filename ) filename = "database.sst";
+
+	const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
+	if( ! prot_keysize ) prot_keysize = "20";
+	key_size = atoi(prot_keysize);
+	if( key_size < 1 || key_size > 0xFF ) {
+		errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+	}
+
+	fd = open(filename, O_RDONLY);
+	if( fd < 0 || fstat(fd, &st) != 0 ) {
+		err(EXIT_FAILURE, "Cannot open table '%s'", filename);
+	}
+	map_size = st.st_size;
+	map = (char*)mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if( map == MAP_FAILED ) {
+		err(EXIT_FAILURE, "Cannot mmap('%s')", filename);
+	}
+	if( ! sst_header_read(map, map_size, &table) ) {
+		errx(EXIT_FAILURE, "'%s' is not a table, or is truncated", filename);
+	}
+	if( table.key_size != key_size ) {
+		errx(EXIT_FAILURE, "'%s' has %zu byte keys, not %zu", filename, table.key_size, key_size);
+	}
+
+	entry_size = sst_entry_size(key_size);
+	blocks = sst_blocks(table.count, table.block);
+	entries = map + table.entries;
+	index_keys = map + table.index;
+
+	/* Gets jump around the file, but every one of them reads the index */
+	madvise(map, map_size, MADV_RANDOM);
+	if( blocks ) {
+		long page = sysconf(_SC_PAGESIZE);
+		uint64_t start = table.index & ~(uint64_t)(page - 1);
+		madvise(map + start, map_size - start, MADV_WILLNEED);
+	}
+	atexit(close_db);
+}
+
+static void
+open_db(){
+	pthread_once(&opened, open_table);
+}
+
+/**
+ * First 8 bytes of a key as a number, for interpolation.
+ */
+static uint64_t
+key_prefix(const char* key){
+	const unsigned char* u = (const unsigned char*)key;
+	uint64_t v = 0;
+	size_t i;
+	for( i = 0; i < 8; i++ ) v = (v << 8) | (i < key_size ? u[i] : 0);
+	return v;
+}
+
+/**
+ * Find the last of `n` sorted keys, `stride` bytes apart, which is at
+ * most `key`.
+ * @return Its position, -1 if every key is greater
+ */
+static int64_t
+search(const char* base, size_t stride, int64_t n, const char* key, uint64_t* probes){
+	int64_t lo = 0, hi = n - 1, pos, width;
+	uint64_t k = key_prefix(key), klo, khi;
+	int guesses = SEARCH_GUESSES;
+
+	if( n <= 0 || memcmp(base, key, key_size) > 0 ) return -1;
+	if( memcmp(base + hi * stride, key, key_size) <= 0 ) return hi;
+
+	/* base[lo] <= key < base[hi] */
+	while( (width = hi - lo) > 1 ) {
+		klo = key_prefix(base + lo * stride);
+		khi = key_prefix(base + hi * stride);
+		if( guesses-- <= 0 || khi == klo ) {
+			pos = lo + width / 2;
+		}
+		else {
+			pos = lo + (int64_t)((double)(k - klo) / (double)(khi - klo) * width);
+			if( pos <= lo ) pos = lo + 1;
+			if( pos >= hi ) pos = hi - 1;
+		}
+		(*probes)++;
+		if( memcmp(base + pos * stride, key, key_size) <= 0 ) lo = pos;
+		else hi = pos;
+	}
+	return lo;
+}
+
+/**
+ * Find the last entry which is at most `key`.
+ * @return Its position, -1 if every entry is greater
+ */
+static int64_t
+lookup_floor(const char* key, uint64_t* probes){
+	int64_t b, i, first, n;
+
+	b = search(index_keys, key_size, blocks, key, probes);
+	if( b < 0 ) return -1;
+	first = b * table.block;
+	n = table.count - first < table.block ? (int64_t)(table.count - first) : (int64_t)table.block;
+	i = search(entries + first * entry_size, entry_size, n, key, probes);
+	return i < 0 ? -1 : first + i;
+}
+
+/**
+ * Find `key`'s entry.
+ * @return Its position, -1 if the table doesn't have it
+ */
+static int64_t
+lookup(const char* key, uint64_t* probes){
+	int64_t i = lookup_floor(key, probes);
+	if( i < 0 || memcmp(entries + i * entry_size, key, key_size) != 0 ) return -1;
+	return i;
+}
+
+/**
+ * Locate the value of entry `i`.
+ * @return 0 if its offsets are outside the values
+ */
+static int
+entry_value(uint64_t i, const char** v, size_t* v_sz){
+	uint64_t start = dbz_get64(entries + i * entry_size + key_size);
+	uint64_t end = i + 1 < table.count
+		? dbz_get64(entries + (i + 1) * entry_size + key_size)
+		: table.entries - table.values;
+	if( start > end || end > table.entries - table.values ) {
+		__atomic_fetch_add(&stats.corrupt, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*v = map + table.values + start;
+	*v_sz = end - start;
+	return 1;
+}
+
+static
+DB_OP(do_get){
+	uint64_t probes = 0;
+	const char* v;
+	size_t v_sz;
+	char* out_data;
+	int64_t i;
+
+	open_db();
+	__atomic_fetch_add(&stats.gets, 1, __ATOMIC_RELAXED);
+	i = in_sz == key_size ? lookup(in_data, &probes) : -1;
+	__atomic_fetch_add(&stats.probes, probes, __ATOMIC_RELAXED);
+	if( i < 0 || ! entry_value(i, &v, &v_sz) ) {
+		if( cb ) cb(in_data, in_sz, NULL, token);
+		return key_size;
+	}
+	__atomic_fetch_add(&stats.hits, 1, __ATOMIC_RELAXED);
+
+	if( cb ) {
+		out_data = (char*)dbz_alloc(token, key_size + v_sz);
+		memcpy(out_data, in_data, key_size);
+		memcpy(out_data + key_size, v, v_sz);
+		cb(out_data, key_size + v_sz, NULL, token);
+		dbz_free(token, out_data);
+	}
+	return key_size + v_sz;
+}
+
+/**
+ * The table never changes, so every view of it is consistent and there
+ * is nothing to pin or release: a chunk carries on after the given key.
+ */
+static
+DB_OP(do_snapshot){
+	size_t limit, used = 0, n = 0, v_sz;
+	uint64_t probes = 0;
+	const char* v;
+	int64_t i = 0;
+
+	if( in_sz < 4 ) return 0;
+	open_db();
+	limit = dbz_snapshot_limit(in_data);
+	if( in_sz > 4 ) {
+		if( in_sz - 4 != key_size ) return 0;
+		i = lookup_floor(in_data + 4, &probes) + 1;
+	}
+	for( ; (uint64_t)i < table.count && (n == 0 || used < limit); i++ ) {
+		if( ! entry_value(i, &v, &v_sz)
+		 || ! dbz_record_append(&snap_buf, &snap_cap, &used, entries + i * entry_size, key_size, v, v_sz) ) {
+			warnx("Cannot read '%s' at entry %lld", filename, (long long)i);
+			return 0;
+		}
+		n++;
+	}
+	if( cb )
+		cb(snap_buf, used, NULL, token);
+	return n;
+}
+
+static
+DB_OP(do_stats){
+	char buf[256];
+	int len;
+	uint64_t gets = __atomic_load_n(&stats.gets, __ATOMIC_RELAXED);
+	(void)in_data; (void)in_sz;
+	open_db();
+	len = snprintf(buf, sizeof(buf),
+		"count=%llu blocks=%llu block=%zu bytes=%llu gets=%llu hits=%llu probes_per_get=%.2f corrupt=%llu",
+		(unsigned long long)table.count,
+		(unsigned long long)blocks,
+		table.block,
+		(unsigned long long)map_size,
+		(unsigned long long)gets,
+		(unsigned long long)__atomic_load_n(&stats.hits, __ATOMIC_RELAXED),
+		gets ? (double)__atomic_load_n(&stats.probes, __ATOMIC_RELAXED) / gets : 0.0,
+		(unsigned long long)__atomic_load_n(&stats.corrupt, __ATOMIC_RELAXED));
+	if( cb ) cb(buf, len, NULL, token);
+	return len;
+}
+
+void*
+i_speak_db(void){
+	static struct dbz_op ops[] = {
+		{"get", DBZ_OP_REPLY|DBZ_OP_THREADSAFE, (dbzop_t)do_get, NULL},
+		{"snapshot", DBZ_OP_REPLY, (dbzop_t)do_snapshot, NULL},
+		{"sstable-stats", DBZ_OP_REPLY, (dbzop_t)do_stats, NULL},
+		{NULL, 0, 0, 0}
+	};
+	return &ops;
+}
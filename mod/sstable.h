@@ -0,0 +1,88 @@
+#ifndef _DBZ_SSTABLE_H
+#define _DBZ_SSTABLE_H
+
+/*
+ * Immutable sorted table of fixed size keys, written once by
+ * tools/db-sstable.c and served read-only by mod/sstable.c.
+ *
+ *   header[64] ++ values ++ entries ++ index
+ *
+ *   header   magic[8] ++ key_size[4] ++ block[4] ++ count[8]
+ *            ++ values[8] ++ entries[8] ++ index[8] ++ zero padding
+ *   entries  `count` of key[key_size] ++ offset[8], sorted by key
+ *   index    key of every `block`th entry
+ *
+ * `values`, `entries` and `index` are the file offsets of each part. An
+ * entry's value runs from its offset, relative to `values`, up to the
+ * next entry's offset or the start of `entries` for the last one.
+ * Entries have a fixed size so a block of them can be searched in
+ * place, and the index is small enough to stay in memory. All numbers
+ * are big-endian.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../server/db-zmq.h"
+
+#define SST_MAGIC		"DBZSST1\n"
+#define SST_HEADER		64
+#define SST_BLOCK		128		/* Default entries per index key */
+
+struct sst_header {
+	size_t key_size;
+	size_t block;
+	uint64_t count;
+	uint64_t values;
+	uint64_t entries;
+	uint64_t index;
+};
+
+static inline size_t sst_entry_size(size_t key_size)
+{
+	return key_size + 8;
+}
+
+/**
+ * Number of index keys for `count` entries.
+ */
+static inline uint64_t sst_blocks(uint64_t count, size_t block)
+{
+	return (count + block - 1) / block;
+}
+
+static inline void sst_header_write(char* out, const struct sst_header* h)
+{
+	memset(out, 0, SST_HEADER);
+	memcpy(out, SST_MAGIC, 8);
+	dbz_put32(out + 8, (uint32_t)h->key_size);
+	dbz_put32(out + 12, (uint32_t)h->block);
+	dbz_put64(out + 16, h->count);
+	dbz_put64(out + 24, h->values);
+	dbz_put64(out + 32, h->entries);
+	dbz_put64(out + 40, h->index);
+}
+
+/**
+ * Read and check the header of a file of `size` bytes.
+ * @return 0 if it isn't a table or its parts don't fit in the file
+ */
+static inline int sst_header_read(const char* in, uint64_t size, struct sst_header* h)
+{
+	if( size < SST_HEADER || memcmp(in, SST_MAGIC, 8) != 0 ) return 0;
+	h->key_size = dbz_get32(in + 8);
+	h->block = dbz_get32(in + 12);
+	h->count = dbz_get64(in + 16);
+	h->values = dbz_get64(in + 24);
+	h->entries = dbz_get64(in + 32);
+	h->index = dbz_get64(in + 40);
+	if( h->key_size < 1 || h->key_size > 0xFF || h->block < 1 ) return 0;
+	if( h->values != SST_HEADER || h->entries < h->values || h->entries > size ) return 0;
+	if( h->count > (size - h->entries) / sst_entry_size(h->key_size) ) return 0;
+	if( h->index != h->entries + h->count * sst_entry_size(h->key_size) ) return 0;
+	if( size - h->index != sst_blocks(h->count, h->block) * h->key_size ) return 0;
+	return 1;
+}
+
+#endif
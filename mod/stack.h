@@ -0,0 +1,58 @@
+#ifndef _DBZ_STACK_H
+#define _DBZ_STACK_H
+
+/*
+ * Helpers for modules which wrap another module, e.g.
+ *
+ *   ZDICT_MODULE=build/mod-leveldb.so db-zmq build/mod-zdict.so ...
+ *
+ * The wrapped module is loaded from the path in an environment variable
+ * and its ops are called directly, with the wrapper's own callbacks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <dlfcn.h>
+
+#include "../i_speak_db.h"
+
+/**
+ * Load the module named by environment variable `env`, exits on failure.
+ */
+static struct dbz_op*
+stack_open(const char* env)
+{
+	static void* handle;
+	mod_init_fn f;
+	const char* filename = getenv(env);
+	if( ! filename ) {
+		errx(EXIT_FAILURE, "%s must name the module to wrap", env);
+	}
+	handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+	if( ! handle ) {
+		errx(EXIT_FAILURE, "Cannot dlopen('%s') = %s", filename, dlerror());
+	}
+	f = (mod_init_fn)dlsym(handle, "i_speak_db");
+	if( ! f ) {
+		errx(EXIT_FAILURE, "Cannot dlsym('%s', 'i_speak_db') = %s", filename, dlerror());
+	}
+	return (struct dbz_op*)f();
+}
+
+/**
+ * Find an op of the wrapped module by name, as dbz_op() does.
+ */
+static struct dbz_op*
+stack_op(struct dbz_op* ops, const char* name)
+{
+	size_t len = strlen(name);
+	for( ; ops->name; ops++ ) {
+		if( strncmp(ops->name, name, len) == 0
+		 && (ops->name[len] == 0 || ops->name[len] == ' ') )
+			return ops;
+	}
+	return NULL;
+}
+
+#endif
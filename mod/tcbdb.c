@@ -5,14 +5,35 @@
 #include <stdint.h>
 #include <string.h>
 #include <err.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "../i_speak_db.h"
 
 static TCBDB *db = NULL;
 static size_t key_size = -1;
+static char snap_path[1024];
+
+static TCBDB *snap = NULL;
+static BDBCUR *snap_cur = NULL;
+static char* snap_buf = NULL;
+static size_t snap_cap = 0;
+
+static void
+snapshot_release(){
+	if(snap){
+		tcbdbcurdel(snap_cur);
+		tcbdbclose(snap);
+		tcbdbdel(snap);
+		unlink(snap_path);
+		snap_cur = NULL;
+		snap = NULL;
+	}
+}
 
 static void
 close_db(){
 	if(db){
+		snapshot_release();
 		tcbdbclose(db);
 		db = NULL;
 	}
@@ -24,6 +45,7 @@ open_db() {
 		db = tcbdbnew();
 		const char* filename = getenv("TCBDB_FILE");
 		if(!filename) filename = "database.tcbdb.dat";
+		snprintf(snap_path, sizeof(snap_path), "%s.snapshot", filename);
 
 		const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
 		if(!prot_keysize) prot_keysize = "20";
@@ -43,9 +65,9 @@ open_db() {
 
 static
 DB_OP(do_put){
+	open_db();
 	if(in_sz<=key_size)
 		return 0;
-	open_db();
 	if( tcbdbput(db, in_data, key_size, in_data+key_size, in_sz-key_size) ) {
 		if(cb) {
 			cb(in_data, in_sz, NULL, token);
@@ -64,10 +86,11 @@ DB_OP(do_get){
 	size_t out_sz = in_sz;
 	char *out_data = NULL;
 	int data_sz = 0;
-	char* data;
+	const char* data;
 	
 	open_db();
-	data = (char*)tcbdbget(db, in_data, in_sz, &data_sz);
+	/* Points into the B+tree cache, valid until the next call */
+	data = (const char*)tcbdbget3(db, in_data, in_sz, &data_sz);
 	if(!data){
 		if(cb) cb(in_data, in_sz, NULL, token);
 		return key_size;
@@ -80,13 +103,12 @@ DB_OP(do_get){
 	 */
 	out_sz += data_sz;
 	if(cb){
-		out_data = (char*)malloc(out_sz);
+		out_data = (char*)dbz_alloc(token, out_sz);
 		memcpy(out_data, in_data, in_sz);
 		memcpy(out_data+in_sz, data, data_sz);
 		cb(out_data, out_sz, NULL, token);
-		free(out_data);
+		dbz_free(token, out_data);
 	}
-	free(data);
 
 	return out_sz;
 }
@@ -95,16 +117,136 @@ static
 DB_OP(do_del){
 	open_db();
 	tcbdbout(db, in_data, in_sz);
-	cb(in_data, in_sz, NULL, token);
+	if(cb)
+		cb(in_data, in_sz, NULL, token);
 	return in_sz;
 }
 
+/**
+ * Apply every record in one transaction.
+ */
+static
+DB_OP(do_batch){
+	size_t offset = 0, len;
+	const char* data;
+	char type, *status;
+	long i = 0, failed = -1, n;
+
+	open_db();
+	n = dbz_batch_count(in_data, in_sz, key_size);
+	if( n <= 0 || ! tcbdbtranbegin(db) ) {
+		if( cb ) cb("F", 1, NULL, token);
+		return 0;
+	}
+
+	while( failed < 0 && dbz_record_next(in_data, in_sz, &offset, &type, &data, &len) == 1 ) {
+		if( type == DBZ_REC_PUT ) {
+			if( ! tcbdbput(db, data, key_size, data+key_size, len-key_size) )
+				failed = i;
+		}
+		else if( ! tcbdbout(db, data, len) && tcbdbecode(db) != TCENOREC ) {
+			failed = i;
+		}
+		i++;
+	}
+
+	status = (char*)dbz_alloc(token, n);
+	if( failed < 0 && tcbdbtrancommit(db) ) {
+		memset(status, DBZ_REC_OK, n);
+	}
+	else {
+		warnx("Cannot write batch: %s", tcbdberrmsg(tcbdbecode(db)));
+		tcbdbtranabort(db);
+		memset(status, failed < 0 ? DBZ_REC_FAILED : DBZ_REC_ABORTED, n);
+		if( failed >= 0 ) status[failed] = DBZ_REC_FAILED;
+	}
+	if( cb )
+		cb(status, n, NULL, token);
+	i = status[0] == DBZ_REC_OK;
+	dbz_free(token, status);
+	return i ? in_sz : 0;
+}
+
+/**
+ * Copy the database with tcbdbcopy(), then walk the copy with a cursor.
+ * The copy runs inside the first call, so the server answers nothing
+ * else for as long as copying the whole file takes.
+ */
+static
+DB_OP(do_snapshot){
+	size_t limit, used = 0, n = 0;
+	const char *k, *v;
+	int k_sz, v_sz;
+
+	if( in_sz < 4 ) return 0;
+	open_db();
+	limit = dbz_snapshot_limit(in_data);
+	if( in_sz == 4 ) {
+		snapshot_release();
+		if( ! tcbdbcopy(db, snap_path) ) {
+			warnx("Cannot tcbdbcopy('%s'): %s", snap_path, tcbdberrmsg(tcbdbecode(db)));
+			return 0;
+		}
+		snap = tcbdbnew();
+		if( ! tcbdbopen(snap, snap_path, BDBOREADER|BDBONOLCK) ) {
+			warnx("Cannot tcbdbopen('%s'): %s", snap_path, tcbdberrmsg(tcbdbecode(snap)));
+			tcbdbdel(snap);
+			snap = NULL;
+			unlink(snap_path);
+			return 0;
+		}
+		snap_cur = tcbdbcurnew(snap);
+		tcbdbcurfirst(snap_cur);
+	}
+	else if( ! snap ) {
+		warnx("No snapshot to continue");
+		return 0;
+	}
+	else if( tcbdbcurjump(snap_cur, in_data + 4, in_sz - 4) ) {
+		k = (const char*)tcbdbcurkey3(snap_cur, &k_sz);
+		if( k && (size_t)k_sz == in_sz - 4 && memcmp(k, in_data + 4, k_sz) == 0 )
+			tcbdbcurnext(snap_cur);
+	}
+
+	while( (n == 0 || used < limit)
+	    && (k = (const char*)tcbdbcurkey3(snap_cur, &k_sz)) != NULL ) {
+		v = (const char*)tcbdbcurval3(snap_cur, &v_sz);
+		if( ! v || ! dbz_record_append(&snap_buf, &snap_cap, &used, k, k_sz, v, v_sz) ) {
+			warnx("Cannot read snapshot");
+			snapshot_release();
+			return 0;
+		}
+		n++;
+		tcbdbcurnext(snap_cur);
+	}
+
+	if( cb )
+		cb(snap_buf, used, NULL, token);
+	if( ! n )
+		snapshot_release();
+	return n;
+}
+
+static
+DB_OP(do_sync){
+	(void)in_data; (void)in_sz; (void)cb; (void)token;
+	open_db();
+	if( ! tcbdbsync(db) ) {
+		warnx("Cannot tcbdbsync(): %s", tcbdberrmsg(tcbdbecode(db)));
+		return 0;
+	}
+	return 1;
+}
+
 void* i_speak_db(void)
 {
 	static struct dbz_op ops[] = {
 		{"put", 0, (dbzop_t)do_put, NULL},
 		{"get", 1, (dbzop_t)do_get, NULL},
 		{"del", 0, (dbzop_t)do_del, NULL},
+		{"batch", DBZ_OP_REPLY, (dbzop_t)do_batch, NULL},
+		{"snapshot", DBZ_OP_REPLY, (dbzop_t)do_snapshot, NULL},
+		{"sync", 0, (dbzop_t)do_sync, NULL},
 		{NULL, 0, 0, 0}
 	};
 	return &ops;
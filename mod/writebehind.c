@@ -0,0 +1,612 @@
+/*
+ * Write-behind buffer in front of another module.
+ *
+ * Puts and dels are kept in memory, one entry per key so rewrites of a
+ * key coalesce, and acknowledged at once. Gets of a buffered key are
+ * answered from the buffer. A background thread writes the buffer to the
+ * wrapped module in key order, with its batch op when it has one, once
+ * the oldest entry is WRITEBEHIND_AGE ms old or half of WRITEBEHIND_SIZE
+ * is used. Writes stall while the buffer is full and the previous flush
+ * has not finished, which bounds memory to about WRITEBEHIND_SIZE. A
+ * write the wrapped module fails stays buffered for the next flush.
+ *
+ * There are two tables: writes go to the current one, which the thread
+ * swaps with the empty flushing one before writing it out, and gets look
+ * in both. The wrapped module is only called with `inner_lock` held, so
+ * it needn't be thread-safe. snapshot and sync flush the buffer first.
+ *
+ * Environment:
+ *   WRITEBEHIND_MODULE  Module to wrap (required)
+ *   WRITEBEHIND_SIZE    Bytes of keys and values buffered (default: 67108864)
+ *   WRITEBEHIND_AGE     ms a write may wait to be flushed (default: 1000)
+ *   WRITEBEHIND_BATCH   Records per batch written (default: 1024)
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../i_speak_db.h"
+#include "stack.h"
+
+struct wb_entry {
+	struct wb_entry *next;	/* Hash chain */
+	uint64_t hash;
+	size_t len;		/* k ++ v, or k for a delete */
+	char type;		/* DBZ_REC_PUT or DBZ_REC_DEL */
+	char data[];
+};
+
+struct wb_table {
+	struct wb_entry **buckets;
+	size_t nbuckets;
+	size_t count;
+	size_t bytes;
+	uint64_t oldest;	/* ms, first write since the table was emptied */
+};
+
+static struct dbz_op *inner_put = NULL;
+static struct dbz_op *inner_get = NULL;
+static struct dbz_op *inner_del = NULL;
+static struct dbz_op *inner_batch = NULL;
+static struct dbz_op *inner_snapshot = NULL;
+static struct dbz_op *inner_sync = NULL;
+static struct dbz_op *inner_memory = NULL;
+static size_t key_size = -1;
+static size_t max_bytes = 64 * 1024 * 1024;
+static uint64_t max_age = 1000;
+static size_t batch_records = 1024;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;	/* Flusher waits */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;	/* Writers wait */
+static pthread_t flusher;
+static int running = 0;
+static int stopping = 0;
+static int busy = 0;		/* `flushing` is being written */
+
+static struct wb_table current, flushing;
+static char *batch_buf = NULL;
+static size_t batch_cap = 0;
+
+static struct {
+	uint64_t puts;
+	uint64_t dels;
+	uint64_t gets;
+	uint64_t hits;
+	uint64_t coalesced;
+	uint64_t flushes;
+	uint64_t flushed;
+	uint64_t failed;
+	uint64_t stalls;
+	uint64_t flush_ms_max;
+	uint64_t age_ms_max;
+} stats;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static uint64_t
+key_hash(const char* key)
+{
+	uint64_t h = 14695981039346656037ULL;
+	size_t i;
+	for( i = 0; i < key_size; i++ ) {
+		h ^= (uint8_t)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static struct wb_entry**
+table_find(struct wb_table* t, const char* key, uint64_t h)
+{
+	struct wb_entry** e;
+	if( ! t->nbuckets ) return NULL;
+	for( e = &t->buckets[h & (t->nbuckets - 1)]; *e; e = &(*e)->next ) {
+		if( (*e)->hash == h && memcmp((*e)->data, key, key_size) == 0 ) return e;
+	}
+	return NULL;
+}
+
+static void
+table_grow(struct wb_table* t)
+{
+	size_t n = t->nbuckets ? t->nbuckets * 2 : 1024, i;
+	struct wb_entry** b = (struct wb_entry**)calloc(n, sizeof(struct wb_entry*));
+	if( ! b ) errx(EXIT_FAILURE, "Cannot grow write-behind table to %zu buckets", n);
+	for( i = 0; i < t->nbuckets; i++ ) {
+		struct wb_entry* e = t->buckets[i];
+		while( e ) {
+			struct wb_entry* next = e->next;
+			e->next = b[e->hash & (n - 1)];
+			b[e->hash & (n - 1)] = e;
+			e = next;
+		}
+	}
+	free(t->buckets);
+	t->buckets = b;
+	t->nbuckets = n;
+}
+
+/**
+ * Add or replace the entry for k, `data` being k ++ v or k.
+ * @return 1 if the key was already buffered
+ */
+static int
+table_set(struct wb_table* t, char type, const char* data, size_t len)
+{
+	uint64_t h = key_hash(data);
+	struct wb_entry** slot = table_find(t, data, h);
+	struct wb_entry* e = (struct wb_entry*)malloc(sizeof(struct wb_entry) + len);
+	int replaced = slot != NULL;
+
+	if( ! e ) errx(EXIT_FAILURE, "Cannot buffer %zu bytes", len);
+	e->hash = h;
+	e->len = len;
+	e->type = type;
+	memcpy(e->data, data, len);
+	if( slot ) {
+		e->next = (*slot)->next;
+		t->bytes -= (*slot)->len;
+		free(*slot);
+		*slot = e;
+	}
+	else {
+		if( t->count >= t->nbuckets ) table_grow(t);
+		e->next = t->buckets[h & (t->nbuckets - 1)];
+		t->buckets[h & (t->nbuckets - 1)] = e;
+		if( ! t->count ) t->oldest = now_ms();
+		t->count++;
+	}
+	t->bytes += len;
+	return replaced;
+}
+
+static void
+table_clear(struct wb_table* t)
+{
+	size_t i;
+	for( i = 0; i < t->nbuckets; i++ ) {
+		struct wb_entry* e = t->buckets[i];
+		while( e ) {
+			struct wb_entry* next = e->next;
+			free(e);
+			e = next;
+		}
+		t->buckets[i] = NULL;
+	}
+	t->count = 0;
+	t->bytes = 0;
+}
+
+static int
+entry_cmp(const void* a, const void* b)
+{
+	return memcmp((*(struct wb_entry* const*)a)->data, (*(struct wb_entry* const*)b)->data, key_size);
+}
+
+/**
+ * Write entries one by one, when there is no batch op or a batch failed.
+ * @return Entries not written, moved to the front of `e`
+ */
+static size_t
+write_each(struct wb_entry** e, size_t n)
+{
+	size_t i, ret, failed = 0;
+	for( i = 0; i < n; i++ ) {
+		if( e[i]->type == DBZ_REC_PUT ) {
+			ret = inner_put->cb(e[i]->data, e[i]->len, NULL, NULL);
+			if( ret == e[i]->len ) continue;
+		}
+		else if( inner_del->cb(e[i]->data, key_size, NULL, NULL) > 0 ) {
+			continue;
+		}
+		e[failed++] = e[i];
+	}
+	return failed;
+}
+
+/**
+ * Runs without `lock`, so failures are counted by the caller.
+ * @return Entries not written, moved to the front of `e`
+ */
+static size_t
+write_batch(struct wb_entry** e, size_t n)
+{
+	size_t i, used = 0;
+
+	if( ! inner_batch ) {
+		return write_each(e, n);
+	}
+	for( i = 0; i < n; i++ ) {
+		size_t need = used + DBZ_REC_HDR + e[i]->len;
+		if( need > batch_cap ) {
+			batch_cap = need * 2;
+			batch_buf = (char*)realloc(batch_buf, batch_cap);
+			if( ! batch_buf ) errx(EXIT_FAILURE, "Cannot allocate %zu bytes", batch_cap);
+		}
+		used += dbz_record_header(batch_buf + used, e[i]->type, e[i]->len);
+		memcpy(batch_buf + used, e[i]->data, e[i]->len);
+		used += e[i]->len;
+	}
+	if( ! inner_batch->cb(batch_buf, used, NULL, NULL) ) {
+		/* Nothing was applied, find the records which fail */
+		return write_each(e, n);
+	}
+	return 0;
+}
+
+/**
+ * Swap the tables and write out what was current, in key order. Writes
+ * the wrapped module failed go back in the current table for the next
+ * flush, unless the key has been written again since.
+ * Called with `lock` held and not busy, returns with it held.
+ */
+static void
+flush_locked(void)
+{
+	struct wb_table t = flushing;
+	struct wb_entry** sorted;
+	uint64_t started = now_ms();
+	size_t i, f, n = 0, failed = 0;
+
+	assert(! busy);
+	if( ! current.count ) return;
+	if( started - current.oldest > stats.age_ms_max ) stats.age_ms_max = started - current.oldest;
+	flushing = current;
+	current = t;
+	busy = 1;
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&lock);
+
+	sorted = (struct wb_entry**)malloc(flushing.count * sizeof(struct wb_entry*));
+	if( ! sorted ) errx(EXIT_FAILURE, "Cannot sort %zu writes", flushing.count);
+	for( i = 0; i < flushing.nbuckets; i++ ) {
+		struct wb_entry* e;
+		for( e = flushing.buckets[i]; e; e = e->next ) sorted[n++] = e;
+	}
+	qsort(sorted, n, sizeof(struct wb_entry*), entry_cmp);
+	for( i = 0; i < n; i += batch_records ) {
+		/* Let gets of unbuffered keys in between batches */
+		pthread_mutex_lock(&inner_lock);
+		f = write_batch(sorted + i, n - i < batch_records ? n - i : batch_records);
+		pthread_mutex_unlock(&inner_lock);
+		memmove(sorted + failed, sorted + i, f * sizeof(struct wb_entry*));
+		failed += f;
+	}
+
+	pthread_mutex_lock(&lock);
+	for( i = 0; i < failed; i++ ) {
+		struct wb_entry* e = sorted[i];
+		if( ! table_find(&current, e->data, e->hash) ) table_set(&current, e->type, e->data, e->len);
+	}
+	if( failed ) warnx("Cannot write %zu of %zu buffered writes, will try again", failed, n);
+	free(sorted);
+	table_clear(&flushing);
+	busy = 0;
+	stats.flushes++;
+	stats.flushed += n - failed;
+	stats.failed += failed;
+	if( now_ms() - started > stats.flush_ms_max ) stats.flush_ms_max = now_ms() - started;
+	pthread_cond_broadcast(&done);
+}
+
+static int
+flush_due(void)
+{
+	return current.count && (current.bytes >= max_bytes / 2 || now_ms() - current.oldest >= max_age);
+}
+
+static void*
+flush_thread(void* unused)
+{
+	struct timespec until;
+	(void)unused;
+	pthread_mutex_lock(&lock);
+	while( ! stopping ) {
+		if( ! busy && flush_due() ) {
+			flush_locked();
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += (long)(max_age < 40 ? max_age : 40) * 250000 + 1000000;
+		if( until.tv_nsec >= 1000000000 ) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wake, &lock, &until);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/**
+ * Write out everything buffered so far before returning.
+ */
+static void
+flush_all(void)
+{
+	pthread_mutex_lock(&lock);
+	while( busy ) pthread_cond_wait(&done, &lock);
+	flush_locked();
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+close_writebehind(){
+	if( running ) {
+		pthread_mutex_lock(&lock);
+		stopping = 1;
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+		pthread_join(flusher, NULL);
+		running = 0;
+		flush_all();
+		if( current.count ) warnx("Lost %zu buffered writes the wrapped module failed", current.count);
+		free(current.buckets);
+		free(flushing.buckets);
+		free(batch_buf);
+	}
+}
+
+static void
+open_writebehind() {
+	if( ! inner_put ) {
+		struct dbz_op* ops = stack_open("WRITEBEHIND_MODULE");
+		const char* env;
+
+		const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
+		if(!prot_keysize) prot_keysize = "20";
+		key_size = atoi(prot_keysize);
+		if(key_size < 1 || key_size > 0xFF) {
+			errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+		}
+
+		if( (env = getenv("WRITEBEHIND_SIZE")) ) max_bytes = strtoull(env, NULL, 10);
+		if( (env = getenv("WRITEBEHIND_AGE")) ) max_age = strtoull(env, NULL, 10);
+		if( (env = getenv("WRITEBEHIND_BATCH")) ) batch_records = strtoul(env, NULL, 10);
+		if( max_bytes < 2 || batch_records < 1 ) {
+			errx(EXIT_FAILURE, "Invalid WRITEBEHIND_SIZE or WRITEBEHIND_BATCH");
+		}
+
+		inner_put = stack_op(ops, "put");
+		inner_get = stack_op(ops, "get");
+		inner_del = stack_op(ops, "del");
+		inner_batch = stack_op(ops, "batch");
+		inner_snapshot = stack_op(ops, "snapshot");
+		inner_sync = stack_op(ops, "sync");
+		inner_memory = stack_op(ops, "memory");
+		if( ! inner_put || ! inner_get || ! inner_del ) {
+			errx(EXIT_FAILURE, "Wrapped module needs put, get and del");
+		}
+
+		/* Open the wrapped module now, so its atexit handler runs after ours */
+		{
+			char key[0x100];
+			memset(key, 0, key_size);
+			inner_get->cb(key, key_size, NULL, NULL);
+		}
+
+		if( pthread_create(&flusher, NULL, flush_thread, NULL) != 0 ) {
+			errx(EXIT_FAILURE, "Cannot start write-behind thread");
+		}
+		running = 1;
+		atexit(close_writebehind);
+	}
+}
+
+/**
+ * Buffer one write, waiting while the buffer is full.
+ */
+static void
+buffer_write(char type, const char* data, size_t len)
+{
+	pthread_mutex_lock(&lock);
+	while( current.bytes && current.bytes + len > max_bytes ) {
+		stats.stalls++;
+		pthread_cond_signal(&wake);
+		pthread_cond_wait(&done, &lock);
+	}
+	if( table_set(&current, type, data, len) ) stats.coalesced++;
+	if( type == DBZ_REC_PUT ) stats.puts++;
+	else stats.dels++;
+	if( current.bytes >= max_bytes / 2 ) pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+}
+
+static
+DB_OP(wb_put){
+	open_writebehind();
+	if( in_sz <= key_size ) {
+		if( cb ) cb(in_data, in_sz, NULL, token);
+		return 0;
+	}
+	buffer_write(DBZ_REC_PUT, in_data, in_sz);
+	if( cb ) cb(in_data, in_sz, NULL, token);
+	return in_sz;
+}
+
+static
+DB_OP(wb_del){
+	open_writebehind();
+	if( in_sz != key_size ) {
+		if( cb ) cb(in_data, in_sz, NULL, token);
+		return 0;
+	}
+	buffer_write(DBZ_REC_DEL, in_data, in_sz);
+	if( cb ) cb(in_data, in_sz, NULL, token);
+	return in_sz;
+}
+
+static
+DB_OP(wb_get){
+	struct wb_entry** e = NULL;
+	uint64_t h;
+	char* out = NULL;
+	size_t out_sz = 0, ret;
+
+	open_writebehind();
+	if( in_sz != key_size ) {
+		if( cb ) cb(in_data, in_sz, NULL, token);
+		return in_sz;
+	}
+	h = key_hash(in_data);
+	pthread_mutex_lock(&lock);
+	stats.gets++;
+	e = table_find(&current, in_data, h);
+	if( ! e && busy ) e = table_find(&flushing, in_data, h);
+	if( e ) {
+		stats.hits++;
+		out_sz = (*e)->type == DBZ_REC_PUT ? (*e)->len : key_size;
+		out = (char*)dbz_alloc(token, out_sz);
+		memcpy(out, (*e)->data, out_sz);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if( out ) {
+		if( cb ) cb(out, out_sz, NULL, token);
+		dbz_free(token, out);
+		return out_sz;
+	}
+	pthread_mutex_lock(&inner_lock);
+	ret = inner_get->cb(in_data, in_sz, cb, token);
+	pthread_mutex_unlock(&inner_lock);
+	return ret;
+}
+
+/**
+ * Buffer every record, all of them fit once the buffer has room.
+ */
+static
+DB_OP(wb_batch){
+	size_t offset = 0, len;
+	const char* data;
+	char type, *status;
+	long n;
+
+	open_writebehind();
+	n = dbz_batch_count(in_data, in_sz, key_size);
+	if( n <= 0 ) {
+		if( cb ) cb("F", 1, NULL, token);
+		return 0;
+	}
+	while( dbz_record_next(in_data, in_sz, &offset, &type, &data, &len) == 1 ) {
+		buffer_write(type, data, len);
+	}
+	if( cb ) {
+		status = (char*)dbz_alloc(token, n);
+		memset(status, DBZ_REC_OK, n);
+		cb(status, n, NULL, token);
+		dbz_free(token, status);
+	}
+	return in_sz;
+}
+
+/**
+ * Pinning a view flushes first, so the snapshot holds every write
+ * acknowledged before it.
+ */
+static
+DB_OP(wb_snapshot){
+	size_t ret;
+	open_writebehind();
+	if( ! inner_snapshot ) return 0;
+	if( in_sz == 4 ) flush_all();
+	pthread_mutex_lock(&inner_lock);
+	ret = inner_snapshot->cb(in_data, in_sz, cb, token);
+	pthread_mutex_unlock(&inner_lock);
+	return ret;
+}
+
+static
+DB_OP(wb_sync){
+	size_t ret;
+	open_writebehind();
+	if( ! inner_sync ) return 0;
+	flush_all();
+	pthread_mutex_lock(&inner_lock);
+	ret = inner_sync->cb(in_data, in_sz, cb, token);
+	pthread_mutex_unlock(&inner_lock);
+	return ret;
+}
+
+/**
+ * Buffered writes and tables, plus the wrapped module's memory.
+ * Trimming writes out the buffer first.
+ */
+static
+DB_OP(wb_memory){
+	size_t bytes;
+	open_writebehind();
+	if( in_sz == 4 && memcmp(in_data, "trim", 4) == 0 ) flush_all();
+	pthread_mutex_lock(&lock);
+	bytes = current.bytes + flushing.bytes
+		+ (current.count + flushing.count) * sizeof(struct wb_entry)
+		+ (current.nbuckets + flushing.nbuckets) * sizeof(struct wb_entry*)
+		+ batch_cap;
+	pthread_mutex_unlock(&lock);
+	if( inner_memory ) {
+		pthread_mutex_lock(&inner_lock);
+		bytes += inner_memory->cb(in_data, in_sz, cb, token);
+		pthread_mutex_unlock(&inner_lock);
+	}
+	return bytes;
+}
+
+static
+DB_OP(wb_stats){
+	char buf[512];
+	int len;
+	(void)in_data; (void)in_sz;
+	open_writebehind();
+	pthread_mutex_lock(&lock);
+	len = snprintf(buf, sizeof(buf),
+		"buffered=%zu bytes=%zu max_bytes=%zu puts=%llu dels=%llu coalesced=%llu gets=%llu hits=%llu"
+		" flushes=%llu flushed=%llu failed=%llu stalls=%llu flush_ms_max=%llu age_ms_max=%llu",
+		current.count + (busy ? flushing.count : 0),
+		current.bytes + (busy ? flushing.bytes : 0),
+		max_bytes,
+		(unsigned long long)stats.puts,
+		(unsigned long long)stats.dels,
+		(unsigned long long)stats.coalesced,
+		(unsigned long long)stats.gets,
+		(unsigned long long)stats.hits,
+		(unsigned long long)stats.flushes,
+		(unsigned long long)stats.flushed,
+		(unsigned long long)stats.failed,
+		(unsigned long long)stats.stalls,
+		(unsigned long long)stats.flush_ms_max,
+		(unsigned long long)stats.age_ms_max);
+	pthread_mutex_unlock(&lock);
+	if( cb ) cb(buf, len, NULL, token);
+	return len;
+}
+
+void*
+i_speak_db(void){
+	static struct dbz_op ops[] = {
+		{"put", 0, (dbzop_t)wb_put, NULL},
+		{"get", DBZ_OP_REPLY|DBZ_OP_THREADSAFE, (dbzop_t)wb_get, NULL},
+		{"del", 0, (dbzop_t)wb_del, NULL},
+		{"batch", DBZ_OP_REPLY, (dbzop_t)wb_batch, NULL},
+		{"snapshot", DBZ_OP_REPLY, (dbzop_t)wb_snapshot, NULL},
+		{"sync", 0, (dbzop_t)wb_sync, NULL},
+		{"memory", 0, (dbzop_t)wb_memory, NULL},
+		{"writebehind-stats", DBZ_OP_REPLY, (dbzop_t)wb_stats, NULL},
+		{NULL, 0, 0, 0}
+	};
+	return &ops;
+}
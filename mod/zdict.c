@@ -0,0 +1,833 @@
+/*
+ * Transparent value compression in front of another module.
+ *
+ * Values are compressed with raw deflate primed with a dictionary trained
+ * from the first ZDICT_SAMPLES values written. Small, repetitive values
+ * (e.g. 100 byte JSON documents) have too little history of their own to
+ * compress, but most of their bytes are found in the dictionary.
+ *
+ * Stored values:
+ *
+ *   0xD0 ++ v                                      Stored as-is
+ *   0xD1 ++ version[2] ++ varint(len) ++ deflate   Compressed with dictionary
+ *                                                  `version`, 0 for none
+ *
+ * Every value is tagged, so the first open tags the values written before
+ * the module was stacked as stored as-is, walking a snapshot of the wrapped
+ * module, and then creates ZDICT_DIR/tagged. The chunk being tagged is
+ * kept in ZDICT_DIR/tagging, so a crash partway doesn't tag a value twice.
+ * A wrapped module without snapshots can only be stacked when it holds no
+ * values yet.
+ * Dictionaries are kept in ZDICT_DIR/dict.<version>; old versions stay
+ * readable after retraining.
+ *
+ * Environment:
+ *   ZDICT_MODULE   Module to wrap (required)
+ *   ZDICT_DIR      Dictionary directory (default: zdict)
+ *   ZDICT_SAMPLES  Values sampled before training (default: 4096)
+ *   ZDICT_SIZE     Dictionary size in bytes, at most 32768 (default: 8192)
+ *   ZDICT_LEVEL    Deflate level (default: 6)
+ *   ZDICT_EMPTY    1 when the wrapped module holds no values yet
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "../i_speak_db.h"
+#include "../server/db-zmq.h"
+#include "stack.h"
+
+#define ZDICT_RAW		0xD0
+#define ZDICT_DEFLATE	0xD1
+#define ZDICT_HDR_MAX	8	/* tag ++ version[2] ++ varint(len) */
+#define ZDICT_WINDOW	32768
+#define ZDICT_VERSIONS	0x10000
+#define ZDICT_SNAP_LIMIT	(1 << 20)
+
+#define GRAM_SZ		8	/* Trainer counts 8 byte substrings */
+#define SEGMENT_SZ	32	/* and picks 32 byte segments */
+#define COUNT_BITS	20
+
+struct zdict {
+	char *data;
+	size_t len;
+};
+
+static struct dbz_op *inner_put = NULL;
+static struct dbz_op *inner_get = NULL;
+static struct dbz_op *inner_del = NULL;
+static struct dbz_op *inner_batch = NULL;
+static struct dbz_op *inner_snapshot = NULL;
+static struct dbz_op *inner_sync = NULL;
+static struct dbz_op *inner_memory = NULL;
+static size_t key_size = -1;
+static int level = 6;
+static const char *dict_dir = NULL;
+static size_t dict_target = 8192;
+static size_t samples_wanted = 4096;
+
+static struct zdict dicts[ZDICT_VERSIONS];
+static unsigned current = 0;
+static unsigned newest = 0;
+
+static z_stream zdef, zinf;
+static char *put_buf = NULL;
+static size_t put_buf_sz = 0;
+static char *get_buf = NULL;
+static size_t get_buf_sz = 0;
+static char *batch_buf = NULL;
+static size_t batch_buf_sz = 0;
+static char *snap_buf = NULL;
+static size_t snap_buf_sz = 0;
+
+/* Values kept for training, stored end to end */
+static char *samples = NULL;
+static size_t samples_len = 0;
+static size_t *sample_ends = NULL;
+static size_t nsamples = 0;
+static int collecting = 0;
+
+static struct {
+	uint64_t encodes;
+	uint64_t puts;
+	uint64_t gets;
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+	uint64_t compress_ns;
+	uint64_t decompress_ns;
+	uint64_t errors;
+} stats;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void
+grow(char** buf, size_t* buf_sz, size_t need)
+{
+	if( *buf_sz >= need ) return;
+	*buf = (char*)realloc(*buf, need);
+	if( ! *buf ) {
+		errx(EXIT_FAILURE, "Cannot allocate %zu bytes", need);
+	}
+	*buf_sz = need;
+}
+
+static int
+dict_load(unsigned version)
+{
+	char filename[4096];
+	struct stat st;
+	FILE* fh;
+	char* data;
+
+	snprintf(filename, sizeof(filename), "%s/dict.%u", dict_dir, version);
+	if( stat(filename, &st) != 0 || st.st_size <= 0 || st.st_size > ZDICT_WINDOW ) return 0;
+	if( ! (fh = fopen(filename, "rb")) ) return 0;
+	data = (char*)malloc(st.st_size);
+	if( ! data || fread(data, st.st_size, 1, fh) != 1 ) {
+		warnx("Cannot read dictionary '%s'", filename);
+		free(data);
+		fclose(fh);
+		return 0;
+	}
+	fclose(fh);
+	dicts[version].data = data;
+	dicts[version].len = st.st_size;
+	return 1;
+}
+
+static void
+dict_save(unsigned version)
+{
+	char filename[4096];
+	FILE* fh;
+	snprintf(filename, sizeof(filename), "%s/dict.%u", dict_dir, version);
+	if( ! (fh = fopen(filename, "wb"))
+	 || fwrite(dicts[version].data, dicts[version].len, 1, fh) != 1
+	 || fclose(fh) != 0 ) {
+		err(EXIT_FAILURE, "Cannot write dictionary '%s'", filename);
+	}
+}
+
+struct zdict_tag_s {
+	struct dbz_arena* arena;	/* Always NULL, see i_speak_db.h */
+	char last[0xFF];
+	int have_last;
+	size_t records;
+	int called;
+	char* chunk;		/* Records still to tag */
+	size_t chunk_cap;
+};
+
+/**
+ * Tag `len` bytes of snapshot records and wait for the wrapped module to
+ * keep them. Tagging the same records again leaves the same values.
+ */
+static void
+zdict_tag_records(struct zdict_tag_s* t, const char* data, size_t len)
+{
+	size_t offset = 0, rlen;
+	const char* rdata;
+	char type;
+
+	while( dbz_record_next(data, len, &offset, &type, &rdata, &rlen) == 1 ) {
+		if( rlen < key_size ) continue;
+		grow(&put_buf, &put_buf_sz, rlen + 1);
+		memcpy(put_buf, rdata, key_size);
+		put_buf[key_size] = (char)ZDICT_RAW;
+		memcpy(put_buf + key_size + 1, rdata + key_size, rlen - key_size);
+		if( inner_put->cb(put_buf, rlen + 1, NULL, NULL) != rlen + 1 ) {
+			errx(EXIT_FAILURE, "Cannot tag stored value");
+		}
+		memcpy(t->last, rdata, key_size);
+		t->have_last = 1;
+		t->records++;
+	}
+	if( inner_sync ) inner_sync->cb(NULL, 0, NULL, NULL);
+}
+
+/**
+ * Tag one chunk of the snapshot. Its untagged records are written to
+ * ZDICT_DIR/tagging first, and tagged again from there after a crash,
+ * as the snapshot taken then would hand them back with a tag already.
+ */
+static size_t
+zdict_tag_chunk(const char* data, size_t len, dbzop_t unused, void* token)
+{
+	struct zdict_tag_s* t = (struct zdict_tag_s*)token;
+	char filename[4096], tmp_filename[4096];
+	size_t offset = 0, rlen, used = 0;
+	const char* rdata;
+	char type;
+	FILE* fh;
+	(void)unused;
+
+	t->called = 1;
+	while( dbz_record_next(data, len, &offset, &type, &rdata, &rlen) == 1 ) {
+		/* Tagged before the crash being resumed from */
+		if( rlen < key_size || (t->have_last && memcmp(rdata, t->last, key_size) <= 0) ) continue;
+		if( ! dbz_record_append(&t->chunk, &t->chunk_cap, &used, rdata, key_size, rdata + key_size, rlen - key_size) ) {
+			errx(EXIT_FAILURE, "Cannot allocate %zu bytes", used + rlen);
+		}
+	}
+	if( ! used ) return len;
+
+	snprintf(filename, sizeof(filename), "%s/tagging", dict_dir);
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s/tagging.tmp", dict_dir);
+	if( ! (fh = fopen(tmp_filename, "wb"))
+	 || fwrite(t->chunk, used, 1, fh) != 1
+	 || fclose(fh) != 0
+	 || rename(tmp_filename, filename) != 0 ) {
+		err(EXIT_FAILURE, "Cannot write '%s'", filename);
+	}
+	zdict_tag_records(t, t->chunk, used);
+	return len;
+}
+
+/**
+ * Tag the values already in the wrapped module as stored as-is, once,
+ * so no value is ever decoded that wasn't written by this module. A run
+ * interrupted partway resumes after the last key it tagged.
+ */
+static void
+zdict_tag_existing(void)
+{
+	char filename[4096], tagging[4096], req[4 + 0xFF];
+	struct zdict_tag_s t;
+	const char* env;
+	struct stat st;
+	FILE* fh;
+
+	snprintf(filename, sizeof(filename), "%s/tagged", dict_dir);
+	snprintf(tagging, sizeof(tagging), "%s/tagging", dict_dir);
+	if( stat(filename, &st) == 0 ) return;
+
+	memset(&t, 0, sizeof(t));
+	if( stat(tagging, &st) == 0 ) {
+		/* Tag the chunk which was being tagged again, then carry on after it */
+		if( ! (fh = fopen(tagging, "rb")) ) err(EXIT_FAILURE, "Cannot open '%s'", tagging);
+		grow(&t.chunk, &t.chunk_cap, (size_t)st.st_size);
+		if( st.st_size && fread(t.chunk, (size_t)st.st_size, 1, fh) != 1 ) {
+			err(EXIT_FAILURE, "Cannot read '%s'", tagging);
+		}
+		fclose(fh);
+		zdict_tag_records(&t, t.chunk, (size_t)st.st_size);
+		warnx("Resuming an interrupted tagging of stored values");
+	}
+	else if( (env = getenv("ZDICT_EMPTY")) && atoi(env) == 1 ) {
+		t.called = 1;
+	}
+
+	if( ! t.called ) {
+		if( ! inner_snapshot ) {
+			errx(EXIT_FAILURE, "Cannot tag stored values without a snapshot op, set ZDICT_EMPTY=1 if there are none");
+		}
+		dbz_put32(req, ZDICT_SNAP_LIMIT);
+		if( inner_snapshot->cb(req, 4, (dbzop_t)zdict_tag_chunk, &t) > 0 ) {
+			do {
+				memcpy(req + 4, t.last, key_size);
+			} while( inner_snapshot->cb(req, 4 + key_size, (dbzop_t)zdict_tag_chunk, &t) > 0 );
+		}
+		if( ! t.called ) {
+			errx(EXIT_FAILURE, "Cannot take a snapshot to tag stored values, set ZDICT_EMPTY=1 if there are none");
+		}
+		if( t.records ) warnx("Tagged %zu stored values", t.records);
+	}
+	free(t.chunk);
+
+	if( ! (fh = fopen(filename, "wb")) || fclose(fh) != 0 ) {
+		err(EXIT_FAILURE, "Cannot create '%s'", filename);
+	}
+	unlink(tagging);
+}
+
+static void
+close_zdict(){
+	unsigned i;
+	if( inner_put ) {
+		deflateEnd(&zdef);
+		inflateEnd(&zinf);
+		for( i = 1; i <= newest; i++ ) {
+			free(dicts[i].data);
+		}
+		free(put_buf);
+		free(get_buf);
+		free(batch_buf);
+		free(snap_buf);
+		free(samples);
+		free(sample_ends);
+		inner_put = NULL;
+	}
+}
+
+static void
+open_zdict() {
+	if( ! inner_put ) {
+		struct dbz_op* ops = stack_open("ZDICT_MODULE");
+		const char* env;
+
+		const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
+		if(!prot_keysize) prot_keysize = "20";
+		key_size = atoi(prot_keysize);
+		if(key_size < 1 || key_size > 0xFF) {
+			errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+		}
+
+		dict_dir = getenv("ZDICT_DIR");
+		if( ! dict_dir ) dict_dir = "zdict";
+		if( (env = getenv("ZDICT_SAMPLES")) ) samples_wanted = atoi(env);
+		if( (env = getenv("ZDICT_SIZE")) ) dict_target = atoi(env);
+		if( (env = getenv("ZDICT_LEVEL")) ) level = atoi(env);
+		if( dict_target < SEGMENT_SZ || dict_target > ZDICT_WINDOW ) {
+			errx(EXIT_FAILURE, "Invalid ZDICT_SIZE %zu", dict_target);
+		}
+		if( mkdir(dict_dir, 0755) != 0 && errno != EEXIST ) {
+			err(EXIT_FAILURE, "Cannot mkdir('%s')", dict_dir);
+		}
+
+		inner_put = stack_op(ops, "put");
+		inner_get = stack_op(ops, "get");
+		inner_del = stack_op(ops, "del");
+		inner_batch = stack_op(ops, "batch");
+		inner_snapshot = stack_op(ops, "snapshot");
+		inner_sync = stack_op(ops, "sync");
+		inner_memory = stack_op(ops, "memory");
+		if( ! inner_put || ! inner_get || ! inner_del ) {
+			errx(EXIT_FAILURE, "Wrapped module needs put, get and del");
+		}
+
+		while( newest + 1 < ZDICT_VERSIONS && dict_load(newest + 1) ) {
+			newest++;
+		}
+		current = newest;
+		collecting = (current == 0) && samples_wanted > 0;
+		zdict_tag_existing();
+
+		if( deflateInit2(&zdef, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK
+		 || inflateInit2(&zinf, -15) != Z_OK ) {
+			errx(EXIT_FAILURE, "Cannot initialise zlib");
+		}
+		atexit(close_zdict);
+	}
+}
+
+static uint32_t
+gram_hash(const char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - COUNT_BITS));
+}
+
+struct segment {
+	const char *p;
+	size_t len;
+	uint32_t score;
+};
+
+static int
+segment_cmp(const void* a, const void* b)
+{
+	uint32_t x = ((const struct segment*)a)->score;
+	uint32_t y = ((const struct segment*)b)->score;
+	return (x < y) - (x > y);
+}
+
+static uint32_t
+segment_score(const char* p, size_t len, const uint16_t* counts, const uint8_t* taken)
+{
+	uint32_t score = 0;
+	size_t i;
+	for( i = 0; i + GRAM_SZ <= len; i++ ) {
+		uint32_t h = gram_hash(p + i);
+		if( ! taken || ! taken[h] ) score += counts[h] - 1;
+	}
+	return score;
+}
+
+/**
+ * Build a dictionary out of the segments whose substrings recur most
+ * across the samples. zlib finds the end of the dictionary cheapest to
+ * reference, so the best segments go last.
+ */
+static void
+zdict_train(void)
+{
+	uint16_t* counts = (uint16_t*)calloc(1 << COUNT_BITS, sizeof(uint16_t));
+	uint8_t* taken = (uint8_t*)calloc(1 << COUNT_BITS, 1);
+	struct segment* segs = (struct segment*)malloc(((samples_len / (SEGMENT_SZ / 2)) + nsamples + 1) * sizeof(struct segment));
+	size_t nsegs = 0, total = 0, i, j, start;
+	char* dict;
+
+	if( ! counts || ! taken || ! segs ) {
+		errx(EXIT_FAILURE, "Cannot allocate dictionary trainer");
+	}
+
+	for( i = 0, start = 0; i < nsamples; start = sample_ends[i++] ) {
+		for( j = start; j + GRAM_SZ <= sample_ends[i]; j++ ) {
+			uint32_t h = gram_hash(samples + j);
+			if( counts[h] < 0xFFFF ) counts[h]++;
+		}
+	}
+
+	for( i = 0, start = 0; i < nsamples; start = sample_ends[i++] ) {
+		size_t len = sample_ends[i] - start;
+		for( j = 0; j < len; j += SEGMENT_SZ / 2 ) {
+			struct segment* s = &segs[nsegs];
+			s->p = samples + start + j;
+			s->len = (len - j) < SEGMENT_SZ ? (len - j) : SEGMENT_SZ;
+			if( s->len < GRAM_SZ ) break;
+			s->score = segment_score(s->p, s->len, counts, NULL);
+			if( s->score ) nsegs++;
+			if( j + SEGMENT_SZ >= len ) break;
+		}
+	}
+	qsort(segs, nsegs, sizeof(struct segment), segment_cmp);
+
+	/* Greedy pick, skipping segments mostly covered by earlier picks */
+	dict = (char*)malloc(dict_target);
+	for( i = 0; i < nsegs && total < dict_target; i++ ) {
+		struct segment* s = &segs[i];
+		size_t len = s->len;
+		if( segment_score(s->p, s->len, counts, taken) * 4 < s->score ) continue;
+		if( len > dict_target - total ) len = dict_target - total;
+		memcpy(dict + dict_target - total - len, s->p, len);
+		total += len;
+		for( j = 0; j + GRAM_SZ <= s->len; j++ ) {
+			taken[gram_hash(s->p + j)] = 1;
+		}
+	}
+
+	if( total >= SEGMENT_SZ && newest + 1 < ZDICT_VERSIONS ) {
+		newest++;
+		dicts[newest].len = total;
+		dicts[newest].data = (char*)malloc(total);
+		memcpy(dicts[newest].data, dict + dict_target - total, total);
+		dict_save(newest);
+		current = newest;
+		warnx("Trained dictionary %u, %zu bytes from %zu values", current, total, nsamples);
+	}
+	else {
+		warnx("Not enough repetition in %zu values to train a dictionary", nsamples);
+	}
+
+	free(dict);
+	free(segs);
+	free(taken);
+	free(counts);
+	free(samples);
+	free(sample_ends);
+	samples = NULL;
+	sample_ends = NULL;
+	samples_len = nsamples = 0;
+	collecting = 0;
+}
+
+static void
+zdict_sample(const char* value, size_t len)
+{
+	if( ! sample_ends ) {
+		sample_ends = (size_t*)malloc(samples_wanted * sizeof(size_t));
+	}
+	samples = (char*)realloc(samples, samples_len + len);
+	if( ! samples || ! sample_ends ) {
+		errx(EXIT_FAILURE, "Cannot allocate dictionary samples");
+	}
+	memcpy(samples + samples_len, value, len);
+	samples_len += len;
+	sample_ends[nsamples++] = samples_len;
+	if( nsamples == samples_wanted ) {
+		zdict_train();
+	}
+}
+
+/**
+ * Encode k ++ v as k ++ stored value into put_buf.
+ * @return Encoded size
+ */
+static size_t
+zdict_encode(const char* in_data, size_t in_sz)
+{
+	const char* value = in_data + key_size;
+	size_t vlen = in_sz - key_size;
+	size_t bound = deflateBound(&zdef, vlen);
+	size_t hdr = 3, x;
+	char* out;
+
+	grow(&put_buf, &put_buf_sz, key_size + ZDICT_HDR_MAX + (bound > vlen ? bound : vlen));
+	memcpy(put_buf, in_data, key_size);
+	out = put_buf + key_size;
+
+	out[0] = (char)ZDICT_DEFLATE;
+	out[1] = (char)(current >> 8);
+	out[2] = (char)(current & 0xFF);
+	for( x = vlen; x >= 0x80; x >>= 7 ) {
+		out[hdr++] = (char)(0x80 | (x & 0x7F));
+	}
+	out[hdr++] = (char)x;
+
+	deflateReset(&zdef);
+	if( current ) {
+		deflateSetDictionary(&zdef, (const Bytef*)dicts[current].data, dicts[current].len);
+	}
+	zdef.next_in = (Bytef*)value;
+	zdef.avail_in = vlen;
+	zdef.next_out = (Bytef*)(out + hdr);
+	zdef.avail_out = bound;
+	if( deflate(&zdef, Z_FINISH) == Z_STREAM_END && hdr + zdef.total_out < vlen + 1 ) {
+		return key_size + hdr + zdef.total_out;
+	}
+
+	out[0] = (char)ZDICT_RAW;
+	memcpy(out + 1, value, vlen);
+	return key_size + 1 + vlen;
+}
+
+/**
+ * Decode k ++ stored value into k ++ v in get_buf.
+ * @return Decoded size, 0 on error
+ */
+static size_t
+zdict_decode(const char* data, size_t len)
+{
+	const unsigned char* in = (const unsigned char*)data + key_size;
+	size_t in_len = len - key_size;
+	size_t vlen = 0, hdr = 3;
+	unsigned version, shift = 0;
+
+	if( in[0] == ZDICT_RAW ) {
+		grow(&get_buf, &get_buf_sz, len - 1);
+		memcpy(get_buf, data, key_size);
+		memcpy(get_buf + key_size, in + 1, in_len - 1);
+		return len - 1;
+	}
+	if( in[0] != ZDICT_DEFLATE ) return 0;
+
+	if( in_len < 4 ) return 0;
+	version = ((unsigned)in[1] << 8) | in[2];
+	do {
+		if( hdr >= in_len || shift > 28 ) return 0;
+		vlen |= (size_t)(in[hdr] & 0x7F) << shift;
+		shift += 7;
+	} while( in[hdr++] & 0x80 );
+	if( version && ! dicts[version].data ) {
+		warnx("Value needs missing dictionary %u", version);
+		return 0;
+	}
+
+	grow(&get_buf, &get_buf_sz, key_size + vlen + 1);
+	memcpy(get_buf, data, key_size);
+	inflateReset(&zinf);
+	if( version ) {
+		inflateSetDictionary(&zinf, (const Bytef*)dicts[version].data, dicts[version].len);
+	}
+	zinf.next_in = (Bytef*)(in + hdr);
+	zinf.avail_in = in_len - hdr;
+	zinf.next_out = (Bytef*)(get_buf + key_size);
+	zinf.avail_out = vlen;
+	if( inflate(&zinf, Z_FINISH) != Z_STREAM_END || zinf.total_out != vlen ) {
+		return 0;
+	}
+	return key_size + vlen;
+}
+
+static
+DB_OP(zdict_put){
+	size_t enc_sz, ret_sz;
+	uint64_t start;
+
+	open_zdict();
+	if( in_sz <= key_size ) {
+		if( cb ) cb(in_data, in_sz, NULL, token);
+		return 0;
+	}
+
+	if( collecting ) {
+		zdict_sample(in_data + key_size, in_sz - key_size);
+	}
+
+	start = now_ns();
+	enc_sz = zdict_encode(in_data, in_sz);
+	stats.compress_ns += now_ns() - start;
+	stats.encodes++;
+
+	ret_sz = key_size;
+	if( inner_put->cb(put_buf, enc_sz, NULL, NULL) == enc_sz ) {
+		ret_sz = in_sz;
+		stats.puts++;
+		stats.raw_bytes += in_sz - key_size;
+		stats.stored_bytes += enc_sz - key_size;
+	}
+
+	if( cb ) cb(in_data, ret_sz, NULL, token);
+	return ret_sz;
+}
+
+struct zdict_get_s {
+	struct dbz_arena* arena;	/* Forwarded, see i_speak_db.h */
+	dbzop_t cb;
+	void* token;
+	size_t ret_sz;
+};
+
+static size_t
+zdict_got(const char* data, size_t len, dbzop_t unused, void* token)
+{
+	struct zdict_get_s* g = (struct zdict_get_s*)token;
+	size_t out_sz;
+	uint64_t start;
+	(void)unused;
+
+	if( len <= key_size ) {
+		g->ret_sz = len;
+		if( g->cb ) g->cb(data, len, NULL, g->token);
+		return len;
+	}
+
+	start = now_ns();
+	out_sz = zdict_decode(data, len);
+	stats.decompress_ns += now_ns() - start;
+	stats.gets++;
+	if( ! out_sz ) {
+		warnx("Cannot decode stored value of %zu bytes", len - key_size);
+		stats.errors++;
+		g->ret_sz = key_size;
+		if( g->cb ) g->cb(data, key_size, NULL, g->token);
+		return key_size;
+	}
+
+	g->ret_sz = out_sz;
+	if( g->cb ) g->cb(get_buf, out_sz, NULL, g->token);
+	return out_sz;
+}
+
+static
+DB_OP(zdict_get){
+	struct zdict_get_s g;
+	open_zdict();
+	g.arena = dbz_arena_of(token);
+	g.cb = cb;
+	g.token = token;
+	g.ret_sz = in_sz;
+	inner_get->cb(in_data, in_sz, (dbzop_t)zdict_got, &g);
+	return g.ret_sz;
+}
+
+static
+DB_OP(zdict_del){
+	open_zdict();
+	return inner_del->cb(in_data, in_sz, cb, token);
+}
+
+/**
+ * Compress the values of put records, then pass the batch on.
+ */
+static
+DB_OP(zdict_batch){
+	size_t offset = 0, out = 0, len, enc_sz;
+	const char* data;
+	char type;
+
+	open_zdict();
+	if( ! inner_batch || dbz_batch_count(in_data, in_sz, key_size) <= 0 ) {
+		if( cb ) cb("F", 1, NULL, token);
+		return 0;
+	}
+
+	while( dbz_record_next(in_data, in_sz, &offset, &type, &data, &len) == 1 ) {
+		if( type == DBZ_REC_PUT ) {
+			if( collecting ) zdict_sample(data + key_size, len - key_size);
+			enc_sz = zdict_encode(data, len);
+			grow(&batch_buf, &batch_buf_sz, out + DBZ_REC_HDR + enc_sz);
+			out += dbz_record_header(batch_buf + out, type, enc_sz);
+			memcpy(batch_buf + out, put_buf, enc_sz);
+			out += enc_sz;
+		}
+		else {
+			grow(&batch_buf, &batch_buf_sz, out + DBZ_REC_HDR + len);
+			out += dbz_record_header(batch_buf + out, type, len);
+			memcpy(batch_buf + out, data, len);
+			out += len;
+		}
+	}
+	return inner_batch->cb(batch_buf, out, cb, token) ? in_sz : 0;
+}
+
+/**
+ * Decode the values of a chunk of snapshot records, a value which cannot
+ * be decoded is passed on as stored rather than dropped from the backup.
+ */
+static size_t
+zdict_snapshot_chunk(const char* data, size_t len, dbzop_t unused, void* token)
+{
+	struct zdict_get_s* g = (struct zdict_get_s*)token;
+	size_t offset = 0, used = 0, rlen, out_sz;
+	const char* rdata;
+	char type;
+	(void)unused;
+
+	while( dbz_record_next(data, len, &offset, &type, &rdata, &rlen) == 1 ) {
+		out_sz = rlen > key_size ? zdict_decode(rdata, rlen) : 0;
+		if( ! out_sz ) {
+			if( rlen > key_size ) stats.errors++;
+			grow(&get_buf, &get_buf_sz, rlen);
+			memcpy(get_buf, rdata, rlen);
+			out_sz = rlen;
+		}
+		if( ! dbz_record_append(&snap_buf, &snap_buf_sz, &used, get_buf, key_size, get_buf + key_size, out_sz - key_size) ) {
+			errx(EXIT_FAILURE, "Cannot grow snapshot buffer");
+		}
+	}
+	if( g->cb ) g->cb(snap_buf, used, NULL, g->token);
+	return used;
+}
+
+static
+DB_OP(zdict_snapshot){
+	struct zdict_get_s g;
+	open_zdict();
+	if( ! inner_snapshot ) return 0;
+	g.arena = dbz_arena_of(token);
+	g.cb = cb;
+	g.token = token;
+	return inner_snapshot->cb(in_data, in_sz, (dbzop_t)zdict_snapshot_chunk, &g);
+}
+
+static
+DB_OP(zdict_sync){
+	open_zdict();
+	if( ! inner_sync ) return 0;
+	return inner_sync->cb(in_data, in_sz, cb, token);
+}
+
+/**
+ * Dictionaries, samples and scratch buffers, plus the wrapped module's
+ * memory. Trimming frees the scratch buffers, they grow back on use.
+ */
+static
+DB_OP(zdict_memory){
+	size_t bytes, i;
+	open_zdict();
+	if( in_sz == 4 && memcmp(in_data, "trim", 4) == 0 ) {
+		free(put_buf);
+		free(get_buf);
+		free(batch_buf);
+		free(snap_buf);
+		put_buf = get_buf = batch_buf = snap_buf = NULL;
+		put_buf_sz = get_buf_sz = batch_buf_sz = snap_buf_sz = 0;
+	}
+	bytes = put_buf_sz + get_buf_sz + batch_buf_sz + snap_buf_sz + samples_len + nsamples * sizeof(size_t);
+	for( i = 0; i <= newest; i++ ) bytes += dicts[i].len;
+	if( inner_memory ) bytes += inner_memory->cb(in_data, in_sz, cb, token);
+	return bytes;
+}
+
+/**
+ * Sample the next ZDICT_SAMPLES values and train a new dictionary version.
+ */
+static
+DB_OP(zdict_retrain){
+	open_zdict();
+	if( ! collecting && samples_wanted > 0 ) {
+		collecting = 1;
+		warnx("Sampling %zu values for a new dictionary", samples_wanted);
+	}
+	if( cb ) cb(in_data, in_sz, NULL, token);
+	return in_sz;
+}
+
+static
+DB_OP(zdict_stats){
+	char buf[512];
+	int len;
+	(void)in_data; (void)in_sz;
+	open_zdict();
+	len = snprintf(buf, sizeof(buf),
+		"dictionary=%u puts=%llu gets=%llu raw_bytes=%llu stored_bytes=%llu ratio=%.3f"
+		" compress_ns_per_put=%.0f decompress_ns_per_get=%.0f errors=%llu",
+		current,
+		(unsigned long long)stats.puts,
+		(unsigned long long)stats.gets,
+		(unsigned long long)stats.raw_bytes,
+		(unsigned long long)stats.stored_bytes,
+		stats.raw_bytes ? (double)stats.stored_bytes / stats.raw_bytes : 1.0,
+		stats.encodes ? (double)stats.compress_ns / stats.encodes : 0.0,
+		stats.gets ? (double)stats.decompress_ns / stats.gets : 0.0,
+		(unsigned long long)stats.errors);
+	if( cb ) cb(buf, len, NULL, token);
+	return len;
+}
+
+void*
+i_speak_db(void){
+	static struct dbz_op ops[] = {
+		{"put", 0, (dbzop_t)zdict_put, NULL},
+		{"get", DBZ_OP_REPLY, (dbzop_t)zdict_get, NULL},
+		{"del", 0, (dbzop_t)zdict_del, NULL},
+		{"batch", DBZ_OP_REPLY, (dbzop_t)zdict_batch, NULL},
+		{"snapshot", DBZ_OP_REPLY, (dbzop_t)zdict_snapshot, NULL},
+		{"sync", 0, (dbzop_t)zdict_sync, NULL},
+		{"memory", 0, (dbzop_t)zdict_memory, NULL},
+		{"retrain", DBZ_OP_REPLY, (dbzop_t)zdict_retrain, NULL},
+		{"zdict-stats", DBZ_OP_REPLY, (dbzop_t)zdict_stats, NULL},
+		{NULL, 0, 0, 0}
+	};
+	return &ops;
+}
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include "affinity.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+static int have_worker, have_io, have_backend;
+static cpu_set_t worker_cpus, io_cpus, backend_cpus, initial_cpus;
+
+/* Thread ids which are not backend threads */
+#define MAX_KNOWN_TIDS 64
+static pid_t known_tids[MAX_KNOWN_TIDS];
+static int nknown = 0;
+
+/**
+ * Parse a CPU list such as "0-3,8,10-11".
+ * @return 1 on success
+ */
+static int
+parse_cpus(const char* list, cpu_set_t* set)
+{
+	const char* p = list;
+	CPU_ZERO(set);
+	while( *p ) {
+		char* end;
+		long lo = strtol(p, &end, 10), hi;
+		if( end == p || lo < 0 ) return 0;
+		hi = lo;
+		p = end;
+		if( *p == '-' ) {
+			hi = strtol(++p, &end, 10);
+			if( end == p || hi < lo ) return 0;
+			p = end;
+		}
+		for( ; lo <= hi && lo < CPU_SETSIZE; lo++ ) {
+			CPU_SET(lo, set);
+		}
+		if( *p == ',' ) p++;
+		else if( *p && *p != '\n' ) return 0;
+		else break;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+static void
+env_cpus(const char* name, cpu_set_t* set, int* have)
+{
+	const char* env = getenv(name);
+	if( ! env ) return;
+	if( ! parse_cpus(env, set) ) {
+		errx(EXIT_FAILURE, "Invalid CPU list %s='%s'", name, env);
+	}
+	*have = 1;
+}
+
+static void
+node_cpus(int node, cpu_set_t* set)
+{
+	char path[128];
+	char list[4096];
+	FILE* fh;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if( ! (fh = fopen(path, "r")) ) {
+		err(EXIT_FAILURE, "Cannot read CPUs of NUMA node %d", node);
+	}
+	if( ! fgets(list, sizeof(list), fh) || ! parse_cpus(list, set) ) {
+		errx(EXIT_FAILURE, "Cannot parse '%s'", path);
+	}
+	fclose(fh);
+}
+
+static void
+pin(pid_t tid, const cpu_set_t* set, const char* what)
+{
+	if( sched_setaffinity(tid, sizeof(cpu_set_t), set) != 0 ) {
+		warn("Cannot pin %s thread %d", what, (int)tid);
+	}
+}
+
+static void
+remember_tid(pid_t tid)
+{
+	int i;
+	for( i = 0; i < nknown; i++ ) {
+		if( known_tids[i] == tid ) return;
+	}
+	if( nknown < MAX_KNOWN_TIDS ) known_tids[nknown++] = tid;
+}
+
+/**
+ * Calls `fn` with every thread id in this process.
+ */
+static void
+each_tid(void (*fn)(pid_t))
+{
+	struct dirent* de;
+	DIR* dir = opendir("/proc/self/task");
+	if( ! dir ) return;
+	while( (de = readdir(dir)) != NULL ) {
+		if( de->d_name[0] == '.' ) continue;
+		fn((pid_t)atoi(de->d_name));
+	}
+	closedir(dir);
+}
+
+static void
+pin_io(pid_t tid)
+{
+	int i;
+	for( i = 0; i < nknown; i++ ) {
+		if( known_tids[i] == tid ) return;
+	}
+	remember_tid(tid);
+	if( have_io ) pin(tid, &io_cpus, "I/O");
+}
+
+static void
+pin_backend(pid_t tid)
+{
+	int i;
+	for( i = 0; i < nknown; i++ ) {
+		if( known_tids[i] == tid ) return;
+	}
+	remember_tid(tid);
+	pin(tid, &backend_cpus, "backend");
+}
+
+/**
+ * Read placement settings and apply the NUMA memory policy.
+ * @return Number of ZeroMQ I/O threads to start
+ */
+int affinity_setup(void)
+{
+	const char* env;
+	int io_threads = 1;
+
+	if( (env = getenv("DBZMQ_IO_THREADS")) ) {
+		io_threads = atoi(env);
+		if( io_threads < 1 ) {
+			errx(EXIT_FAILURE, "Invalid DBZMQ_IO_THREADS='%s'", env);
+		}
+	}
+
+	sched_getaffinity(0, sizeof(cpu_set_t), &initial_cpus);
+	remember_tid((pid_t)syscall(SYS_gettid));
+
+	if( (env = getenv("DBZMQ_NUMA_NODE")) ) {
+		int node = atoi(env);
+		unsigned long nodemask[16];
+		if( node < 0 || node >= (int)(sizeof(nodemask) * 8) ) {
+			errx(EXIT_FAILURE, "Invalid DBZMQ_NUMA_NODE='%s'", env);
+		}
+		memset(nodemask, 0, sizeof(nodemask));
+		nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		if( syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8) != 0 ) {
+			warn("Cannot prefer memory from NUMA node %d", node);
+		}
+		/* Node CPUs are the default for every thread */
+		node_cpus(node, &worker_cpus);
+		io_cpus = backend_cpus = worker_cpus;
+		have_worker = have_io = have_backend = 1;
+	}
+
+	env_cpus("DBZMQ_CPUS_WORKER", &worker_cpus, &have_worker);
+	env_cpus("DBZMQ_CPUS_IO", &io_cpus, &have_io);
+	env_cpus("DBZMQ_CPUS_BACKEND", &backend_cpus, &have_backend);
+	return io_threads;
+}
+
+void affinity_enter_io(void)
+{
+	if( have_io ) pin(0, &io_cpus, "I/O");
+}
+
+/**
+ * Threads which appeared since affinity_setup() belong to ZeroMQ.
+ */
+void affinity_enter_worker(void)
+{
+	each_tid(pin_io);
+	pin(0, have_worker ? &worker_cpus : &initial_cpus, "worker");
+}
+
+void affinity_scan(void)
+{
+	if( have_backend ) each_tid(pin_backend);
+}
+
+#else
+
+int affinity_setup(void)
+{
+	const char* env = getenv("DBZMQ_IO_THREADS");
+	if( getenv("DBZMQ_NUMA_NODE") || getenv("DBZMQ_CPUS_WORKER")
+	 || getenv("DBZMQ_CPUS_IO") || getenv("DBZMQ_CPUS_BACKEND") ) {
+		warnx("CPU and NUMA placement is only supported on Linux");
+	}
+	return env && atoi(env) > 0 ? atoi(env) : 1;
+}
+
+void affinity_enter_io(void) {}
+void affinity_enter_worker(void) {}
+void affinity_scan(void) {}
+
+#endif
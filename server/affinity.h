@@ -0,0 +1,23 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+
+/**
+ * Thread placement for the server.
+ *
+ *   DBZMQ_IO_THREADS     ZeroMQ I/O threads (default: 1)
+ *   DBZMQ_NUMA_NODE      Prefer memory from, and run on, this node
+ *   DBZMQ_CPUS_WORKER    CPUs for the thread calling the module, e.g. "2"
+ *   DBZMQ_CPUS_IO        CPUs for ZeroMQ I/O threads, e.g. "0-1"
+ *   DBZMQ_CPUS_BACKEND   CPUs for threads the module starts, e.g. "3,5-7"
+ *
+ * ZeroMQ I/O threads inherit the CPU set of the thread calling zmq_init(),
+ * so the server calls affinity_enter_io() before and affinity_enter_worker()
+ * after. Threads started later by the module (e.g. leveldb compaction) are
+ * found by affinity_scan() and moved onto the backend CPUs.
+ */
+int affinity_setup(void);
+void affinity_enter_io(void);
+void affinity_enter_worker(void);
+void affinity_scan(void);
+
+#endif
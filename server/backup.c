@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include <zmq.h>
+
+#include "db-zmq.h"
+#include "backup.h"
+
+/* Chunks queued for the receiver before reading more waits */
+#define BACKUP_HWM	16
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Read chunks of up to `chunk` bytes with the `snapshot` op, sending at
+ * most `rate` bytes per second (0 for no limit).
+ */
+backup_t* backup_new(void* zctx, dbzop_t snapshot, size_t key_size, size_t chunk, uint64_t rate)
+{
+	backup_t* b;
+	assert(zctx != NULL);
+	assert(snapshot != NULL);
+	assert(chunk > 0 && chunk <= 0xFFFFFFFF);
+	b = (backup_t*)calloc(1, sizeof(backup_t));
+	if( ! b ) return NULL;
+	b->cursor = (char*)malloc(4 + key_size);
+	if( ! b->cursor ) {
+		free(b);
+		return NULL;
+	}
+	b->zctx = zctx;
+	b->snapshot = snapshot;
+	b->key_size = key_size;
+	b->chunk = chunk;
+	b->rate = rate;
+	b->cursor[0] = (char)((chunk >> 24) & 0xFF);
+	b->cursor[1] = (char)((chunk >> 16) & 0xFF);
+	b->cursor[2] = (char)((chunk >> 8) & 0xFF);
+	b->cursor[3] = (char)(chunk & 0xFF);
+	return b;
+}
+
+static void
+backup_close(backup_t* b)
+{
+	if( b->push ) {
+		zmq_close(b->push);
+		b->push = NULL;
+	}
+}
+
+void backup_free(backup_t* b)
+{
+	if( ! b ) return;
+	backup_close(b);
+	free(b->cursor);
+	free(b);
+}
+
+static void
+backup_send(backup_t* b, char type, const char* data, size_t len)
+{
+	char hdr[9];
+	zmq_msg_t msg;
+
+	dbz_put64(hdr, b->seq++);
+	hdr[8] = type;
+	zmq_msg_init_size(&msg, sizeof(hdr));
+	memcpy(zmq_msg_data(&msg), hdr, sizeof(hdr));
+	zmq_send(b->push, &msg, ZMQ_SNDMORE);
+	zmq_msg_close(&msg);
+
+	zmq_msg_init_size(&msg, len);
+	if( len ) memcpy(zmq_msg_data(&msg), data, len);
+	zmq_send(b->push, &msg, 0);
+	zmq_msg_close(&msg);
+}
+
+/**
+ * Start streaming a new snapshot to the receiver at `addr`.
+ * @return 1 if started, 0 if a backup is already running or on error
+ */
+int backup_start(backup_t* b, const char* addr)
+{
+	if( b->push ) return 0;
+
+	b->push = zmq_socket(b->zctx, ZMQ_PUSH);
+	if( ! b->push ) {
+		warnx("Cannot create backup socket: %s", zmq_strerror(zmq_errno()));
+		return 0;
+	}
+	{
+#ifdef ZMQ_SNDHWM
+		int hwm = BACKUP_HWM;
+		zmq_setsockopt(b->push, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+#else
+		uint64_t hwm = BACKUP_HWM;
+		zmq_setsockopt(b->push, ZMQ_HWM, &hwm, sizeof(hwm));
+#endif
+	}
+	if( zmq_connect(b->push, addr) != 0 ) {
+		warnx("Cannot connect backup to '%s': %s", addr, zmq_strerror(zmq_errno()));
+		backup_close(b);
+		return 0;
+	}
+
+	b->cursor_len = 4;
+	b->budget = b->chunk;
+	b->refilled = now_us();
+	b->started = time(NULL);
+	b->seq = 0;
+	b->records = 0;
+	b->bytes = 0;
+	b->chunk_us = 0;
+	b->max_chunk_us = 0;
+	b->backups++;
+	return 1;
+}
+
+static size_t
+backup_chunk(const char* data, size_t len, dbzop_t unused, void* token)
+{
+	backup_t* b = (backup_t*)token;
+	size_t offset = 0, rec_len;
+	const char* rec = NULL;
+	const char* last = NULL;
+	char type;
+	(void)unused;
+
+	b->called = 1;
+	if( ! len ) return 0;
+	while( dbz_record_next(data, len, &offset, &type, &rec, &rec_len) == 1 ) {
+		if( rec_len >= b->key_size ) last = rec;
+		b->records++;
+	}
+	backup_send(b, BACKUP_CHUNK, data, len);
+	b->bytes += len;
+	b->budget -= len;
+	if( last ) {
+		memcpy(b->cursor + 4, last, b->key_size);
+		b->cursor_len = 4 + b->key_size;
+	}
+	return len;
+}
+
+/**
+ * Send the next chunk if the rate and the receiver allow it, call between polls.
+ * @return 1 while the backup is running
+ */
+int backup_step(backup_t* b)
+{
+	zmq_pollitem_t item;
+	uint64_t now, elapsed;
+	size_t n;
+
+	if( ! b->push ) return 0;
+
+	now = now_us();
+	if( b->rate ) {
+		/* Save up for at most one chunk, so it never bursts */
+		b->budget += (double)(now - b->refilled) * b->rate / 1000000.0;
+		if( b->budget > b->chunk ) b->budget = b->chunk;
+		b->refilled = now;
+		if( b->budget <= 0 ) return 1;
+	}
+
+	memset(&item, 0, sizeof(item));
+	item.socket = b->push;
+	item.events = ZMQ_POLLOUT;
+	if( zmq_poll(&item, 1, 0) <= 0 || ! (item.revents & ZMQ_POLLOUT) )
+		return 1;
+
+	b->called = 0;
+	n = b->snapshot(b->cursor, b->cursor_len, (dbzop_t)backup_chunk, b);
+	elapsed = now_us() - now;
+	b->chunk_us += elapsed;
+	if( elapsed > b->max_chunk_us ) b->max_chunk_us = elapsed;
+
+	if( ! b->called ) {
+		warnx("Backup failed after %llu records", (unsigned long long)b->records);
+		backup_send(b, BACKUP_FAILED, NULL, 0);
+		backup_close(b);
+		return 0;
+	}
+	if( ! n ) {
+		warnx("Backup of %llu records done in %lds", (unsigned long long)b->records, (long)(time(NULL) - b->started));
+		backup_send(b, BACKUP_END, NULL, 0);
+		backup_close(b);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,59 @@
+#ifndef _BACKUP_H
+#define _BACKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../i_speak_db.h"
+
+/**
+ * Streams a consistent snapshot of the module to a backup receiver while
+ * requests are being served.
+ *
+ * The server connects a PUSH socket to the receiver and sends one
+ * message per chunk of the module's snapshot op:
+ *
+ *   seq[8] ++ type[1], records
+ *
+ * `seq` counts from 0, `type` is BACKUP_CHUNK with DBZ_REC_PUT records
+ * (see i_speak_db.h) or, last, BACKUP_END or BACKUP_FAILED with no
+ * records. Chunks are read between polls at most one at a time and no
+ * faster than the configured rate, which bounds the time a request waits
+ * behind the backup to the time taken to read one chunk. Taking the
+ * snapshot is the exception: tcbdb copies its whole file in the first
+ * call and requests wait for the copy.
+ */
+#define BACKUP_CHUNK	'C'
+#define BACKUP_END		'E'
+#define BACKUP_FAILED	'F'
+
+typedef struct backup_s {
+	struct dbz_arena *arena;	/* Token for the snapshot op, see i_speak_db.h */
+	void *zctx;
+	void *push;
+	dbzop_t snapshot;
+	size_t key_size;
+	size_t chunk;
+	uint64_t rate;
+	double budget;
+	uint64_t refilled;
+	char *cursor;
+	size_t cursor_len;
+	int called;
+	/* Progress of the current or last backup */
+	time_t started;
+	uint64_t seq;
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t chunk_us;
+	uint64_t max_chunk_us;
+	uint64_t backups;
+} backup_t;
+
+backup_t* backup_new(void* zctx, dbzop_t snapshot, size_t key_size, size_t chunk, uint64_t rate);
+void backup_free(backup_t* b);
+int backup_start(backup_t* b, const char* addr);
+int backup_step(backup_t* b);
+
+#endif
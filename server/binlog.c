@@ -0,0 +1,452 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include <zmq.h>
+
+#include "db-zmq.h"
+#include "binlog.h"
+
+/* Mutations returned for each sync request */
+#define BINLOG_SYNC_MAX		1024
+
+#if ZMQ_VERSION_MAJOR < 3
+#define POLL_MSEC(ms)	((ms) * 1000L)
+#else
+#define POLL_MSEC(ms)	(ms)
+#endif
+
+/**
+ * Keep the last `backlog` mutations for replicas catching up.
+ */
+binlog_t* binlog_new(uint64_t epoch, size_t backlog)
+{
+	binlog_t* bl = (binlog_t*)malloc(sizeof(binlog_t));
+	assert(backlog > 0);
+	if( ! bl ) return NULL;
+	memset(bl, 0, sizeof(binlog_t));
+	bl->epoch = epoch;
+	bl->capacity = backlog;
+	bl->ring = (binlog_entry_t*)calloc(backlog, sizeof(binlog_entry_t));
+	if( ! bl->ring ) {
+		free(bl);
+		return NULL;
+	}
+	return bl;
+}
+
+void binlog_free(binlog_t* bl)
+{
+	size_t i;
+	if( ! bl ) return;
+	for( i = 0; i < bl->capacity; i++ ) {
+		free(bl->ring[i].msg);
+	}
+	free(bl->ring);
+	free(bl);
+}
+
+static void
+send_frame(void* socket, const char* data, size_t len, int flags)
+{
+	zmq_msg_t msg;
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	zmq_send(socket, &msg, flags);
+	zmq_msg_close(&msg);
+}
+
+/**
+ * Record an applied mutation and send it to subscribed replicas, unless
+ * held until binlog_release. Sequence numbers must be consecutive.
+ */
+void binlog_publish(binlog_t* bl, uint64_t seq, char type, const char* data, size_t len)
+{
+	binlog_entry_t* e;
+	char* msg;
+
+	assert(bl != NULL);
+	assert(bl->count == 0 || seq == bl->last_seq + 1);
+
+	msg = (char*)malloc(BINLOG_HDR_SZ + len);
+	if( ! msg ) {
+		warnx("Cannot allocate binlog entry for seq %llu", (unsigned long long)seq);
+		return;
+	}
+	dbz_put64(msg, bl->epoch);
+	dbz_put64(msg + 8, seq);
+	msg[16] = type;
+	memcpy(msg + BINLOG_HDR_SZ, data, len);
+
+	if( bl->pub && ! bl->hold ) {
+		send_frame(bl->pub, msg, BINLOG_HDR_SZ + len, ZMQ_NOBLOCK);
+	}
+
+	if( bl->count < bl->capacity ) {
+		e = &bl->ring[(bl->head + bl->count) % bl->capacity];
+		bl->count++;
+	}
+	else {
+		e = &bl->ring[bl->head];
+		free(e->msg);
+		bl->bytes -= e->len;
+		bl->head = (bl->head + 1) % bl->capacity;
+	}
+	e->seq = seq;
+	e->msg = msg;
+	e->len = BINLOG_HDR_SZ + len;
+	bl->bytes += e->len;
+	bl->last_seq = seq;
+	if( ! bl->hold ) bl->released = seq;
+}
+
+/**
+ * Send the mutations held back since the last release. Those trimmed
+ * meanwhile are gone, replicas find out when they ask for them.
+ */
+void binlog_release(binlog_t* bl)
+{
+	size_t i;
+
+	assert(bl != NULL);
+	for( i = 0; i < bl->count; i++ ) {
+		binlog_entry_t* e = &bl->ring[(bl->head + i) % bl->capacity];
+		if( e->seq > bl->released && bl->pub ) {
+			send_frame(bl->pub, e->msg, e->len, ZMQ_NOBLOCK);
+		}
+	}
+	bl->released = bl->last_seq;
+}
+
+/**
+ * Forget all but the `keep` most recent mutations, to free memory.
+ * Replicas further behind have to start over.
+ */
+void binlog_trim(binlog_t* bl, size_t keep)
+{
+	assert(bl != NULL);
+	while( bl->count > keep ) {
+		binlog_entry_t* e = &bl->ring[bl->head];
+		bl->bytes -= e->len;
+		free(e->msg);
+		e->msg = NULL;
+		e->len = 0;
+		bl->head = (bl->head + 1) % bl->capacity;
+		bl->count--;
+	}
+}
+
+/**
+ * Answer a replica's request for the mutations from epoch[8] ++ from[8],
+ * up to the last one released.
+ */
+void binlog_serve(binlog_t* bl, const char* req, size_t len, binlog_send_fn send, void* ctx)
+{
+	char status[BINLOG_HDR_SZ];
+	uint64_t from, oldest;
+	size_t i, n = 0, start = 0;
+
+	assert(bl != NULL);
+	status[0] = BINLOG_OK;
+	dbz_put64(status + 1, bl->epoch);
+	dbz_put64(status + 9, bl->released);
+
+	if( len != 16 || dbz_get64(req) != bl->epoch ) {
+		status[0] = BINLOG_EPOCH;
+		send(ctx, status, sizeof(status), 0);
+		return;
+	}
+
+	from = dbz_get64(req + 8);
+	oldest = bl->count ? bl->ring[bl->head].seq : bl->last_seq + 1;
+	if( from < oldest ) {
+		if( from <= bl->released ) status[0] = BINLOG_GONE;
+		from = oldest;
+	}
+	if( from <= bl->released ) {
+		start = (size_t)(from - oldest);
+		n = (size_t)(bl->released - from) + 1;
+		if( n > BINLOG_SYNC_MAX ) n = BINLOG_SYNC_MAX;
+	}
+
+	send(ctx, status, sizeof(status), n > 0);
+	for( i = 0; i < n; i++ ) {
+		binlog_entry_t* e = &bl->ring[(bl->head + start + i) % bl->capacity];
+		send(ctx, e->msg, e->len, i + 1 < n);
+	}
+}
+
+static void
+replica_load(replica_t* r)
+{
+	char buf[16];
+	FILE* fh;
+	if( ! r->state_file || ! (fh = fopen(r->state_file, "rb")) ) return;
+	if( fread(buf, sizeof(buf), 1, fh) == 1 ) {
+		r->epoch = dbz_get64(buf);
+		r->seq = dbz_get64(buf + 8);
+	}
+	fclose(fh);
+}
+
+/**
+ * Remember how far the replica got, so a restart resumes from there.
+ */
+void replica_save(replica_t* r)
+{
+	char tmp_filename[4096];
+	char buf[16];
+	FILE* fh;
+
+	assert(r != NULL);
+	if( ! r->state_file || ! r->dirty ) return;
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", r->state_file);
+	if( ! (fh = fopen(tmp_filename, "wb")) ) {
+		warn("Cannot open replica state '%s'", tmp_filename);
+		return;
+	}
+	dbz_put64(buf, r->epoch);
+	dbz_put64(buf + 8, r->seq);
+	if( fwrite(buf, sizeof(buf), 1, fh) != 1 || fclose(fh) != 0
+	 || rename(tmp_filename, r->state_file) != 0 ) {
+		warn("Cannot write replica state '%s'", r->state_file);
+		return;
+	}
+	r->dirty = 0;
+}
+
+/**
+ * A mutation the module fails is not counted as applied, so it is asked
+ * for again rather than skipped.
+ * @return 0 if applied or already seen, -1 if it or mutations before it are missing
+ */
+static int
+replica_apply(replica_t* r, const char* msg, size_t len)
+{
+	uint64_t epoch, seq;
+	int applied = 0;
+
+	if( len < BINLOG_HDR_SZ ) {
+		warnx("Ignoring short binlog message (%zu bytes)", len);
+		return 0;
+	}
+	epoch = dbz_get64(msg);
+	seq = dbz_get64(msg + 8);
+	if( epoch != r->epoch ) return -1;
+	if( seq <= r->seq ) return 0;
+	if( seq != r->seq + 1 ) return -1;
+
+	switch( msg[16] ) {
+	case 'P':
+		applied = r->put(msg + BINLOG_HDR_SZ, len - BINLOG_HDR_SZ, NULL, NULL) == len - BINLOG_HDR_SZ;
+		break;
+	case 'D':
+		applied = r->del(msg + BINLOG_HDR_SZ, len - BINLOG_HDR_SZ, NULL, NULL) > 0;
+		break;
+	default:
+		warnx("Ignoring unknown binlog mutation '%c'", msg[16]);
+		applied = 1;
+		break;
+	}
+	if( ! applied ) {
+		warnx("Cannot apply binlog mutation %llu, will ask for it again", (unsigned long long)seq);
+		return -1;
+	}
+	if( r->on_apply && (msg[16] == 'P' || msg[16] == 'D') ) {
+		r->on_apply(r->on_apply_ctx, epoch, seq, msg[16], msg + BINLOG_HDR_SZ, len - BINLOG_HDR_SZ);
+	}
+	r->seq = seq;
+	r->applied++;
+	r->dirty = 1;
+	return 0;
+}
+
+static void
+replica_drop_req(replica_t* r)
+{
+	int linger = 0;
+	if( ! r->req ) return;
+	zmq_setsockopt(r->req, ZMQ_LINGER, &linger, sizeof(linger));
+	zmq_close(r->req);
+	r->req = NULL;
+}
+
+/**
+ * Fetch missed mutations from the primary's sync socket. The replica
+ * can't follow a primary which has restarted, or no longer keeps the
+ * mutations it needs, as what it missed can't be fetched any more.
+ * @return 1 when caught up, 0 to try again later, -1 if it can't follow
+ */
+static int
+replica_catchup(replica_t* r)
+{
+	char req[16];
+	uint64_t last, before;
+
+	do {
+		zmq_pollitem_t item;
+		zmq_msg_t msg;
+		int64_t more = 0;
+		size_t more_sz = sizeof(more);
+		char status;
+		int lost;
+
+		if( ! r->req ) {
+			if( ! (r->req = zmq_socket(r->zctx, ZMQ_REQ))
+			 || zmq_connect(r->req, r->sync_addr) != 0 ) {
+				warnx("Cannot connect to '%s': %s", r->sync_addr, zmq_strerror(zmq_errno()));
+				replica_drop_req(r);
+				return 0;
+			}
+		}
+
+		before = r->seq;
+		dbz_put64(req, r->epoch);
+		dbz_put64(req + 8, r->seq + 1);
+		send_frame(r->req, req, sizeof(req), 0);
+
+		memset(&item, 0, sizeof(item));
+		item.socket = r->req;
+		item.events = ZMQ_POLLIN;
+		if( zmq_poll(&item, 1, POLL_MSEC(1000)) <= 0 ) {
+			warnx("No answer from '%s', will retry", r->sync_addr);
+			replica_drop_req(r);
+			return 0;
+		}
+
+		zmq_msg_init(&msg);
+		if( zmq_recv(r->req, &msg, 0) != 0 || zmq_msg_size(&msg) != BINLOG_HDR_SZ ) {
+			warnx("Bad sync reply from '%s'", r->sync_addr);
+			zmq_msg_close(&msg);
+			replica_drop_req(r);
+			return 0;
+		}
+		status = ((const char*)zmq_msg_data(&msg))[0];
+		last = dbz_get64((const char*)zmq_msg_data(&msg) + 9);
+		lost = status != BINLOG_OK;
+		if( status == BINLOG_GONE ) {
+			warnx("Primary no longer has mutations after seq %llu",
+				  (unsigned long long)r->seq);
+		}
+		else if( status == BINLOG_EPOCH && r->epoch ) {
+			warnx("Primary restarted, mutations after seq %llu may be missing",
+				  (unsigned long long)r->seq);
+		}
+		else if( status == BINLOG_EPOCH && ! r->empty ) {
+			warnx("Replica has no state, the primary's data from before it joined can't be fetched");
+		}
+		else if( status == BINLOG_EPOCH ) {
+			/* Both started empty, follow from the primary's first mutation */
+			r->epoch = dbz_get64((const char*)zmq_msg_data(&msg) + 1);
+			r->seq = 0;
+			r->dirty = 1;
+			lost = 0;
+		}
+		zmq_msg_close(&msg);
+		if( lost ) {
+			replica_drop_req(r);
+			return -1;
+		}
+
+		zmq_getsockopt(r->req, ZMQ_RCVMORE, &more, &more_sz);
+		while( more ) {
+			zmq_msg_init(&msg);
+			if( zmq_recv(r->req, &msg, 0) != 0 ) {
+				zmq_msg_close(&msg);
+				break;
+			}
+			replica_apply(r, (const char*)zmq_msg_data(&msg), zmq_msg_size(&msg));
+			zmq_msg_close(&msg);
+			more_sz = sizeof(more);
+			zmq_getsockopt(r->req, ZMQ_RCVMORE, &more, &more_sz);
+		}
+		if( status != BINLOG_EPOCH && r->seq == before ) break;
+	} while( r->seq < last );
+
+	return 1;
+}
+
+/**
+ * Subscribe to a primary's binlog and apply its mutations through put/del.
+ * Mutations already applied in a previous run (see `state_file`) are skipped.
+ * Without a state file the replica only follows a primary when `empty`
+ * says both started with no data.
+ * @return NULL on error or if it can't follow the primary
+ */
+replica_t* replica_new(void* zctx, const char* pub_addr, const char* sync_addr, const char* state_file, int empty, dbzop_t put, dbzop_t del)
+{
+	replica_t* r;
+
+	assert(zctx && pub_addr && sync_addr && put && del);
+	r = (replica_t*)malloc(sizeof(replica_t));
+	if( ! r ) return NULL;
+	memset(r, 0, sizeof(replica_t));
+	r->zctx = zctx;
+	r->sync_addr = sync_addr;
+	r->state_file = state_file;
+	r->empty = empty;
+	r->batch = 256;
+	r->put = put;
+	r->del = del;
+	replica_load(r);
+
+	if( ! (r->sub = zmq_socket(zctx, ZMQ_SUB))
+	 || zmq_setsockopt(r->sub, ZMQ_SUBSCRIBE, "", 0) != 0
+	 || zmq_connect(r->sub, pub_addr) != 0 ) {
+		warnx("Cannot subscribe to '%s': %s", pub_addr, zmq_strerror(zmq_errno()));
+		replica_free(r);
+		return NULL;
+	}
+
+	switch( replica_catchup(r) ) {
+	case 1:
+		warnx("Replica at seq %llu", (unsigned long long)r->seq);
+		break;
+	case -1:
+		replica_free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/**
+ * Apply up to one batch of published mutations, catching up on any gap.
+ * @return -1 if the replica can't follow the primary any more
+ */
+int replica_pull(replica_t* r)
+{
+	size_t i;
+	assert(r != NULL);
+	for( i = 0; i < r->batch; i++ ) {
+		zmq_msg_t msg;
+		zmq_msg_init(&msg);
+		if( zmq_recv(r->sub, &msg, ZMQ_NOBLOCK) != 0 ) {
+			zmq_msg_close(&msg);
+			break;
+		}
+		if( replica_apply(r, (const char*)zmq_msg_data(&msg), zmq_msg_size(&msg)) < 0 ) {
+			if( replica_catchup(r) < 0 ) {
+				zmq_msg_close(&msg);
+				return -1;
+			}
+			replica_apply(r, (const char*)zmq_msg_data(&msg), zmq_msg_size(&msg));
+		}
+		zmq_msg_close(&msg);
+	}
+	return 0;
+}
+
+void replica_free(replica_t* r)
+{
+	if( ! r ) return;
+	replica_save(r);
+	replica_drop_req(r);
+	if( r->sub ) zmq_close(r->sub);
+	free(r);
+}
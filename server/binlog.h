@@ -0,0 +1,93 @@
+#ifndef _BINLOG_H
+#define _BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../i_speak_db.h"
+
+/**
+ * Mutation stream between a primary and its read replicas.
+ *
+ * Every successful put/del on the primary is published as one message:
+ *
+ *   epoch[8] ++ seq[8] ++ type[1] ++ payload
+ *
+ * `type` is 'P' (payload is k ++ v) or 'D' (payload is k), `epoch`
+ * identifies the primary process and `seq` increases by one for each
+ * mutation. The most recent mutations are kept so a replica which missed
+ * some can ask for them again on the sync socket with epoch[8] ++ from[8];
+ * the reply is a status frame, status[1] ++ epoch[8] ++ last[8], followed
+ * by one frame per mutation.
+ *
+ * With `hold` set, as on a primary keeping a WAL, mutations are kept back
+ * from replicas until binlog_release, once the WAL has committed them, so
+ * a replica never applies one the primary could lose in a crash.
+ *
+ * A replica only follows one epoch of its primary, from the point its
+ * state file records or, with nothing recorded, from the first mutation
+ * when both started empty. If the primary restarts, or no longer keeps
+ * mutations the replica missed, the replica stops rather than carry on
+ * with data the primary no longer matches, and has to be started again
+ * from a copy of the primary's data.
+ */
+#define BINLOG_HDR_SZ	17
+
+#define BINLOG_OK		'O'	/* Mutations follow, ask again until `last` */
+#define BINLOG_EPOCH	'E'	/* Primary restarted, epoch in status frame */
+#define BINLOG_GONE		'G'	/* Asked for mutations no longer kept */
+
+typedef struct {
+	uint64_t seq;
+	char *msg;
+	size_t len;
+} binlog_entry_t;
+
+typedef struct binlog_s {
+	void *pub;
+	uint64_t epoch;
+	uint64_t last_seq;
+	uint64_t released;	/* Last seq sent to replicas */
+	int hold;		/* Send only on binlog_release */
+	size_t capacity;
+	size_t head;
+	size_t count;
+	size_t bytes;		/* Of the messages kept */
+	binlog_entry_t *ring;
+} binlog_t;
+
+binlog_t* binlog_new(uint64_t epoch, size_t backlog);
+void binlog_free(binlog_t* bl);
+void binlog_publish(binlog_t* bl, uint64_t seq, char type, const char* data, size_t len);
+void binlog_release(binlog_t* bl);
+void binlog_trim(binlog_t* bl, size_t keep);
+typedef void (*binlog_send_fn)(void* ctx, const char* data, size_t len, int more);
+void binlog_serve(binlog_t* bl, const char* req, size_t len, binlog_send_fn send, void* ctx);
+
+/* Told of each mutation once the replica has applied it */
+typedef void (*replica_applied_fn)(void* ctx, uint64_t epoch, uint64_t seq, char type, const char* data, size_t len);
+
+typedef struct replica_s {
+	void *zctx;
+	void *sub;
+	void *req;
+	const char *sync_addr;
+	const char *state_file;
+	uint64_t epoch;
+	uint64_t seq;
+	uint64_t applied;
+	size_t batch;
+	int dirty;
+	int empty;		/* Follow from the first mutation without a state file */
+	dbzop_t put;
+	dbzop_t del;
+	replica_applied_fn on_apply;	/* May be NULL */
+	void *on_apply_ctx;
+} replica_t;
+
+replica_t* replica_new(void* zctx, const char* pub_addr, const char* sync_addr, const char* state_file, int empty, dbzop_t put, dbzop_t del);
+int replica_pull(replica_t* r);
+void replica_save(replica_t* r);
+void replica_free(replica_t* r);
+
+#endif
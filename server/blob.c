@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "db-zmq.h"
+#include "sha1.h"
+#include "blob.h"
+
+void blob_chunk_key(char* out, size_t key_size, const char* key, uint64_t gen, uint32_t seq)
+{
+	sha1nfo s;
+	char tail[12];
+	dbz_put64(tail, gen);
+	dbz_put32(tail + 8, seq);
+	sha1_init(&s);
+	sha1_write(&s, key, key_size);
+	sha1_write(&s, tail, sizeof(tail));
+	if( key_size <= HASH_LENGTH ) {
+		memcpy(out, sha1_result(&s), key_size);
+	}
+	else {
+		memcpy(out, sha1_result(&s), HASH_LENGTH);
+		memset(out + HASH_LENGTH, 0, key_size - HASH_LENGTH);
+	}
+}
+
+size_t blob_manifest_encode(char* out, const blob_manifest_t* m)
+{
+	memcpy(out, BLOB_MAGIC, 4);
+	dbz_put64(out + 4, m->gen);
+	dbz_put32(out + 12, m->chunks);
+	dbz_put64(out + 16, m->size);
+	return BLOB_MANIFEST_SZ;
+}
+
+/**
+ * @return 1 if `data` is a manifest
+ */
+int blob_manifest_decode(const char* data, size_t len, blob_manifest_t* m)
+{
+	if( len != BLOB_MANIFEST_SZ || memcmp(data, BLOB_MAGIC, 4) != 0 )
+		return 0;
+	m->gen = dbz_get64(data + 4);
+	m->chunks = dbz_get32(data + 12);
+	m->size = dbz_get64(data + 16);
+	return 1;
+}
+
+blob_uploads_t* blob_uploads_new(size_t key_size, size_t capacity, time_t timeout)
+{
+	blob_uploads_t* u;
+	size_t i;
+	assert(key_size > 0);
+	assert(capacity > 0);
+	u = (blob_uploads_t*)calloc(1, sizeof(blob_uploads_t));
+	if( ! u ) return NULL;
+	u->key_size = key_size;
+	u->capacity = capacity;
+	u->timeout = timeout;
+	u->uploads = (blob_upload_t*)calloc(capacity, sizeof(blob_upload_t));
+	if( ! u->uploads ) {
+		free(u);
+		return NULL;
+	}
+	for( i = 0; i < capacity; i++ ) {
+		u->uploads[i].key = (char*)malloc(key_size);
+		if( ! u->uploads[i].key ) {
+			blob_uploads_free(u);
+			return NULL;
+		}
+	}
+	return u;
+}
+
+void blob_uploads_free(blob_uploads_t* u)
+{
+	size_t i;
+	if( ! u ) return;
+	for( i = 0; i < u->capacity; i++ ) {
+		free(u->uploads[i].key);
+	}
+	free(u->uploads);
+	free(u);
+}
+
+/**
+ * Start an upload of `key` with a new generation.
+ * @return NULL if all upload slots are busy
+ */
+blob_upload_t* blob_upload_begin(blob_uploads_t* u, const char* key, time_t now)
+{
+	size_t i;
+	for( i = 0; i < u->capacity; i++ ) {
+		blob_upload_t* up = &u->uploads[i];
+		if( up->gen ) continue;
+		memcpy(up->key, key, u->key_size);
+		/* Unique across restarts unless the clock goes back */
+		up->gen = ((uint64_t)now << 24) | (++u->counter & 0xFFFFFF);
+		up->next_seq = 0;
+		up->size = 0;
+		up->active = now;
+		return up;
+	}
+	return NULL;
+}
+
+blob_upload_t* blob_upload_find(blob_uploads_t* u, const char* key, uint64_t gen)
+{
+	size_t i;
+	if( ! gen ) return NULL;
+	for( i = 0; i < u->capacity; i++ ) {
+		blob_upload_t* up = &u->uploads[i];
+		if( up->gen == gen && memcmp(up->key, key, u->key_size) == 0 )
+			return up;
+	}
+	return NULL;
+}
+
+void blob_upload_end(blob_uploads_t* u, blob_upload_t* up)
+{
+	(void)u;
+	up->gen = 0;
+}
+
+/**
+ * An upload which has had no chunk for `timeout` seconds, its chunks
+ * should be deleted before ending it.
+ */
+blob_upload_t* blob_upload_expired(blob_uploads_t* u, time_t now)
+{
+	size_t i;
+	for( i = 0; i < u->capacity; i++ ) {
+		blob_upload_t* up = &u->uploads[i];
+		if( up->gen && now - up->active > u->timeout )
+			return up;
+	}
+	return NULL;
+}
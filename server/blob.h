@@ -0,0 +1,70 @@
+#ifndef _BLOB_H
+#define _BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Values too large for one message, stored as chunks.
+ *
+ * Each chunk is an ordinary value under a key derived from the blob's key,
+ * its generation and the chunk's position:
+ *
+ *   chunk key = sha1(k ++ gen[8] ++ seq[4]), cut or zero-padded to key_size
+ *
+ * Once every chunk is stored a manifest is put under k itself:
+ *
+ *   BLOB_MAGIC[4] ++ gen[8] ++ chunks[4] ++ size[8]
+ *
+ * A new upload uses a new generation, so readers of the old manifest
+ * never see a mix of both, and the old chunks are deleted once the new
+ * manifest is in place.
+ */
+#define BLOB_MAGIC			"DBZB"
+#define BLOB_MANIFEST_SZ	24
+
+/* putblob reply status */
+#define BLOB_STORED		'O'	/* Chunk stored, send the next */
+#define BLOB_COMMITTED	'C'	/* Last chunk stored, manifest written */
+#define BLOB_FAILED		'F'	/* Upload abandoned */
+
+/* getblob reply flag */
+#define BLOB_MORE		'M'
+#define BLOB_LAST		'E'
+
+typedef struct {
+	uint64_t gen;
+	uint32_t chunks;
+	uint64_t size;
+} blob_manifest_t;
+
+typedef struct {
+	char *key;
+	uint64_t gen;
+	uint32_t next_seq;		/* Chunks stored so far */
+	uint64_t size;
+	time_t active;
+} blob_upload_t;
+
+/* Uploads in progress, abandoned after `timeout` seconds without a chunk */
+typedef struct blob_uploads_s {
+	size_t key_size;
+	size_t capacity;
+	time_t timeout;
+	uint64_t counter;
+	blob_upload_t *uploads;
+} blob_uploads_t;
+
+void blob_chunk_key(char* out, size_t key_size, const char* key, uint64_t gen, uint32_t seq);
+size_t blob_manifest_encode(char* out, const blob_manifest_t* m);
+int blob_manifest_decode(const char* data, size_t len, blob_manifest_t* m);
+
+blob_uploads_t* blob_uploads_new(size_t key_size, size_t capacity, time_t timeout);
+void blob_uploads_free(blob_uploads_t* u);
+blob_upload_t* blob_upload_begin(blob_uploads_t* u, const char* key, time_t now);
+blob_upload_t* blob_upload_find(blob_uploads_t* u, const char* key, uint64_t gen);
+void blob_upload_end(blob_uploads_t* u, blob_upload_t* up);
+blob_upload_t* blob_upload_expired(blob_uploads_t* u, time_t now);
+
+#endif
@@ -0,0 +1,864 @@
+/*
+ * Front several db-zmq nodes with one get/put/del interface.
+ *
+ *   db-router <nodes> [op=type@addr ...]
+ *
+ * Each key belongs to a node chosen by consistent hashing (see ring.h),
+ * so clients need not know how many nodes there are, and adding a node
+ * only moves the keys it takes over. With DBZMQ_ROUTER_REPLICAS=N writes
+ * go to the first N distinct nodes for the key and reads go to the
+ * first of them which accepts the request.
+ *
+ * The router talks to each node over one DEALER socket per op, connected
+ * to the node's router@ binds, and tags each request with its own id, so
+ * any number of requests are in flight to a node at once and replies are
+ * matched to their client in whatever order they come. A request waits
+ * in a fixed table of DBZMQ_ROUTER_INFLIGHT slots until enough nodes have
+ * replied (DBZMQ_ROUTER_ACKS for writes, one for reads) or until
+ * DBZMQ_ROUTER_TIMEOUT passes, when the client is answered with
+ * DBZ_STATUS_TIMEOUT. Requests which can't be sent, or find the table
+ * full, are answered with DBZ_STATUS_OVERLOAD. A node can't take a
+ * request once DBZMQ_ROUTER_HWM of them are queued for it, as happens
+ * when it is down or falling behind, and reads then go to the next node
+ * of the key.
+ *
+ * Headers are passed on to the nodes as they are, so a DBZ_HDR_DEADLINE
+ * is enforced by the node. A DBZ_HDR_MIN_SEQ names a mutation of one
+ * node, which is the node of the key as long as the nodes don't change.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include <stdint.h>
+
+#include <zmq.h>
+
+#include "db-zmq.h"
+#include "ring.h"
+
+#define ROUTER_MAX_NODES	64
+#define ROUTER_MAX_REPLICAS	8
+#define ROUTER_MAX_FRONTS	16
+#define ROUTER_MAX_HEADERS	4
+#define ROUTER_BATCH		256	/* Requests read per poll */
+
+enum { OP_GET, OP_PUT, OP_DEL, OP_STATS, NOPS };
+
+static const struct {
+	const char* name;
+	int write;
+	int backend;		/* Forwarded to the nodes */
+} ops[NOPS] = {
+	{"get", 0, 1},
+	{"put", 1, 1},
+	{"del", 1, 1},
+	{"stats", 0, 0},
+};
+
+static const struct {
+	const char* prefix;
+	int type;
+} bind_types[] = {
+	{"pull@", ZMQ_PULL},
+	{"rep@", ZMQ_REP},
+	{"router@", ZMQ_ROUTER},
+	{NULL, 0}
+};
+
+typedef struct {
+	char name[64];
+	uint32_t weight;
+	char* addr[NOPS];
+	void* sock[NOPS];	/* DEALER, connected to addr */
+	struct {
+		uint64_t sent;
+		uint64_t replies;
+		uint64_t timeouts;
+		uint64_t full;	/* Sends refused, nothing connected or at the high-water mark */
+	} stats;
+} node_t;
+
+typedef struct {
+	void* socket;
+	int type;
+	int op;
+	int busy;		/* REP waiting for a node, can't read the next request */
+	uint64_t calls;
+} front_t;
+
+/* A request read from a front */
+typedef struct {
+	front_t* front;
+	zmq_msg_t route[2];	/* identity ++ request id on router fronts */
+	int nroute;
+	zmq_msg_t hdr[ROUTER_MAX_HEADERS];
+	int nhdr;
+	zmq_msg_t msg;		/* Payload */
+} request_t;
+
+/* A request sent to the nodes, in pending[id & pending_mask] */
+typedef struct {
+	uint64_t id;		/* 0 when free */
+	front_t* front;
+	zmq_msg_t route[2];
+	int nroute;
+	uint64_t sent_ms;
+	uint8_t nnodes;
+	uint8_t nodes[ROUTER_MAX_REPLICAS];
+	uint8_t replied;	/* Bit for each of nodes[] */
+	uint8_t waiting;	/* Replies still to come */
+	uint8_t needed;		/* Replies before the client is answered, 0 once it has been */
+	uint8_t key_len;
+} pending_t;
+
+static size_t key_size = 20;
+static size_t replicas = 1;
+static size_t acks = 0;
+static uint64_t timeout_ms = 5000;
+static int node_hwm = 1000;
+
+static ring_t* ring = NULL;
+static node_t nodes[ROUTER_MAX_NODES];
+static size_t nnodes = 0;
+static front_t fronts[ROUTER_MAX_FRONTS];
+static int nfronts = 0;
+
+static pending_t* pending = NULL;
+static char* pending_keys = NULL;
+static uint64_t pending_mask = 0;
+static uint64_t next_id = 1;
+static uint64_t oldest = 1;	/* Ids before this are free */
+
+static struct {
+	uint64_t requests;
+	uint64_t forwarded;
+	uint64_t timeouts;
+	uint64_t overloads;
+	uint64_t stale;		/* Replies for requests which timed out */
+} stats;
+
+static char* stats_buf = NULL;
+static size_t stats_len, stats_cap;
+
+static volatile sig_atomic_t running = 0;
+static struct sigaction old_action;
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static int op_find(const char* name)
+{
+	int i;
+	for( i = 0; i < NOPS; i++ ) {
+		if( strcmp(ops[i].name, name) == 0 ) return i;
+	}
+	return -1;
+}
+
+/**
+ * Read the nodes, one per line:
+ *
+ *   name [weight=N] get=addr put=addr del=addr
+ *
+ * Each address is a router@ bind of that node's db-zmq, without the
+ * "router@". Blank lines and lines starting with '#' are skipped.
+ */
+static void nodes_load(const char* file)
+{
+	char line[4096], *save, *tok;
+	int lineno = 0;
+	size_t i;
+	FILE* fh = fopen(file, "r");
+	if( ! fh ) err(EXIT_FAILURE, "Cannot open nodes file '%s'", file);
+
+	while( fgets(line, sizeof(line), fh) ) {
+		node_t* n;
+		lineno++;
+		tok = strtok_r(line, " \t\r\n", &save);
+		if( ! tok || tok[0] == '#' ) continue;
+		if( nnodes == ROUTER_MAX_NODES ) errx(EXIT_FAILURE, "%s:%d: More than %d nodes", file, lineno, ROUTER_MAX_NODES);
+		if( strlen(tok) >= sizeof(n->name) ) errx(EXIT_FAILURE, "%s:%d: Node name too long", file, lineno);
+		for( i = 0; i < nnodes; i++ ) {
+			if( strcmp(nodes[i].name, tok) == 0 ) errx(EXIT_FAILURE, "%s:%d: Node '%s' listed twice", file, lineno, tok);
+		}
+		n = &nodes[nnodes++];
+		strcpy(n->name, tok);
+		n->weight = 1;
+
+		while( (tok = strtok_r(NULL, " \t\r\n", &save)) ) {
+			char* value = strchr(tok, '=');
+			int op;
+			if( ! value ) errx(EXIT_FAILURE, "%s:%d: Expected name=value, not '%s'", file, lineno, tok);
+			*value++ = 0;
+			if( strcmp(tok, "weight") == 0 ) {
+				n->weight = (uint32_t)atoi(value);
+				if( n->weight < 1 || n->weight > 100 ) errx(EXIT_FAILURE, "%s:%d: Invalid weight", file, lineno);
+			}
+			else if( (op = op_find(tok)) >= 0 && ops[op].backend ) {
+				free(n->addr[op]);
+				n->addr[op] = strdup(value);
+			}
+			else {
+				errx(EXIT_FAILURE, "%s:%d: Unknown setting '%s'", file, lineno, tok);
+			}
+		}
+	}
+	fclose(fh);
+	if( ! nnodes ) errx(EXIT_FAILURE, "No nodes in '%s'", file);
+}
+
+/**
+ * Bound the requests queued for a node, without it ZeroMQ 2.x queues
+ * them all and a send never fails.
+ */
+static void node_set_hwm(node_t* n, int op)
+{
+#ifdef ZMQ_SNDHWM
+	int hwm = node_hwm;
+	if( zmq_setsockopt(n->sock[op], ZMQ_SNDHWM, &hwm, sizeof(hwm)) != 0 )
+#else
+	uint64_t hwm = (uint64_t)node_hwm;
+	if( zmq_setsockopt(n->sock[op], ZMQ_HWM, &hwm, sizeof(hwm)) != 0 )
+#endif
+		errx(EXIT_FAILURE, "Cannot set high-water mark for '%s': %s", n->name, zmq_strerror(zmq_errno()));
+}
+
+/**
+ * Place the nodes on the ring and connect to the ops the fronts use.
+ */
+static void nodes_setup(void* zctx)
+{
+	const char* env;
+	size_t vnodes = 160, i;
+	int f, op;
+
+	env = getenv("DBZMQ_ROUTER_VNODES");
+	if( env ) vnodes = (size_t)atoi(env);
+	if( vnodes < 1 || vnodes > 4096 ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_VNODES");
+
+	ring = ring_new(vnodes);
+	assert(ring != NULL);
+	for( i = 0; i < nnodes; i++ ) {
+		if( ! ring_add(ring, nodes[i].name, nodes[i].weight) ) errx(EXIT_FAILURE, "Out of memory");
+	}
+	ring_build(ring);
+
+	for( f = 0; f < nfronts; f++ ) {
+		op = fronts[f].op;
+		if( ! ops[op].backend || nodes[0].sock[op] ) continue;
+		for( i = 0; i < nnodes; i++ ) {
+			node_t* n = &nodes[i];
+			if( ! n->addr[op] ) errx(EXIT_FAILURE, "Node '%s' has no %s address", n->name, ops[op].name);
+			n->sock[op] = zmq_socket(zctx, ZMQ_DEALER);
+			if( ! n->sock[op] ) errx(EXIT_FAILURE, "Cannot create socket: %s", zmq_strerror(zmq_errno()));
+			node_set_hwm(n, op);
+			if( zmq_connect(n->sock[op], n->addr[op]) != 0 ) {
+				errx(EXIT_FAILURE, "Cannot connect to %s of '%s' at '%s': %s",
+					ops[op].name, n->name, n->addr[op], zmq_strerror(zmq_errno()));
+			}
+		}
+	}
+}
+
+static void front_bind(void* zctx, const char* name, const char* addr)
+{
+	front_t* f;
+	int i, op = op_find(name), type = -1;
+
+	if( op < 0 ) errx(EXIT_FAILURE, "Unknown bind name %s=%s", name, addr);
+	if( nfronts == ROUTER_MAX_FRONTS ) errx(EXIT_FAILURE, "Too many binds, cannot bind %s=%s", name, addr);
+	for( i = 0; bind_types[i].prefix; i++ ) {
+		size_t len = strlen(bind_types[i].prefix);
+		if( strncmp(addr, bind_types[i].prefix, len) == 0 ) {
+			type = bind_types[i].type;
+			addr += len;
+			break;
+		}
+	}
+	if( type == -1 ) errx(EXIT_FAILURE, "Unknown bind type %s=%s", name, addr);
+	if( op == OP_STATS && type != ZMQ_REP ) errx(EXIT_FAILURE, "stats must be bound rep@");
+
+	f = &fronts[nfronts++];
+	f->type = type;
+	f->op = op;
+	f->socket = zmq_socket(zctx, type);
+	if( ! f->socket ) errx(EXIT_FAILURE, "Cannot create socket for '%s': %s", addr, zmq_strerror(zmq_errno()));
+	if( zmq_bind(f->socket, addr) != 0 ) errx(EXIT_FAILURE, "Cannot bind socket '%s': %s", addr, zmq_strerror(zmq_errno()));
+}
+
+/**
+ * Send the routing frames of a reply, if the front has them.
+ */
+static void front_route(front_t* f, zmq_msg_t* route, int nroute)
+{
+	zmq_msg_t msg;
+	int i;
+	for( i = 0; i < nroute; i++ ) {
+		zmq_msg_init(&msg);
+		zmq_msg_copy(&msg, &route[i]);
+		zmq_send(f->socket, &msg, ZMQ_SNDMORE);
+		zmq_msg_close(&msg);
+	}
+}
+
+static void front_frame(front_t* f, const char* data, size_t len, int more)
+{
+	zmq_msg_t msg;
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	zmq_send(f->socket, &msg, more ? ZMQ_SNDMORE : 0);
+	zmq_msg_close(&msg);
+}
+
+/**
+ * Answer a request with a status frame followed by the key, as db-zmq does.
+ */
+static void front_refuse(front_t* f, zmq_msg_t* route, int nroute, const char* status, const char* key, size_t key_len)
+{
+	if( f->type == ZMQ_PULL ) return;
+	front_route(f, route, nroute);
+	front_frame(f, status, strlen(status), 1);
+	front_frame(f, key, key_len, 0);
+	f->busy = 0;
+}
+
+static void request_free(request_t* req)
+{
+	int i;
+	for( i = 0; i < req->nroute; i++ ) zmq_msg_close(&req->route[i]);
+	for( i = 0; i < req->nhdr; i++ ) zmq_msg_close(&req->hdr[i]);
+	zmq_msg_close(&req->msg);
+}
+
+/**
+ * Read one request from a front without waiting, framed as in db-zmq:
+ * identity ++ request id ++ headers ++ payload on router fronts, headers
+ * ++ payload on the others.
+ *
+ * @return 1 for a request, 0 if there was none, -1 if it was discarded
+ */
+static int request_recv(front_t* f, request_t* req)
+{
+	int64_t more;
+	size_t more_sz;
+
+	memset(req, 0, sizeof(request_t));
+	req->front = f;
+	zmq_msg_init(&req->msg);
+	if( zmq_recv(f->socket, &req->msg, ZMQ_NOBLOCK) != 0 ) {
+		zmq_msg_close(&req->msg);
+		return 0;
+	}
+	for( ;; ) {
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(f->socket, ZMQ_RCVMORE, &more, &more_sz);
+		if( ! more ) break;
+		if( f->type == ZMQ_ROUTER && req->nroute < 2 ) {
+			zmq_msg_init(&req->route[req->nroute]);
+			zmq_msg_move(&req->route[req->nroute++], &req->msg);
+		}
+		else if( req->nhdr < ROUTER_MAX_HEADERS ) {
+			zmq_msg_init(&req->hdr[req->nhdr]);
+			zmq_msg_move(&req->hdr[req->nhdr++], &req->msg);
+		}
+		zmq_msg_close(&req->msg);
+		zmq_msg_init(&req->msg);
+		if( zmq_recv(f->socket, &req->msg, 0) != 0 ) break;
+	}
+	f->calls++;
+	if( f->type == ZMQ_ROUTER && req->nroute < 2 ) {
+		request_free(req);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Send a request to a node, tagged with `id`.
+ * @return 0 if the node can't take it now
+ */
+static int node_send(node_t* n, int op, uint64_t id, request_t* req)
+{
+	void* sock = n->sock[op];
+	zmq_msg_t msg;
+	int i;
+
+	zmq_msg_init_size(&msg, 8);
+	dbz_put64((char*)zmq_msg_data(&msg), id);
+	if( zmq_send(sock, &msg, ZMQ_SNDMORE | ZMQ_NOBLOCK) != 0 ) {
+		zmq_msg_close(&msg);
+		n->stats.full++;
+		return 0;
+	}
+	zmq_msg_close(&msg);
+	/* The rest of a message is queued once its first frame is */
+	for( i = 0; i < req->nhdr; i++ ) {
+		zmq_msg_init(&msg);
+		zmq_msg_copy(&msg, &req->hdr[i]);
+		zmq_send(sock, &msg, ZMQ_SNDMORE);
+		zmq_msg_close(&msg);
+	}
+	zmq_msg_init(&msg);
+	zmq_msg_copy(&msg, &req->msg);
+	zmq_send(sock, &msg, 0);
+	zmq_msg_close(&msg);
+	n->stats.sent++;
+	return 1;
+}
+
+static void pending_free(pending_t* p)
+{
+	int i;
+	for( i = 0; i < p->nroute; i++ ) zmq_msg_close(&p->route[i]);
+	p->nroute = 0;
+	p->id = 0;
+	while( oldest < next_id && pending[oldest & pending_mask].id != oldest ) oldest++;
+}
+
+/**
+ * Send a request to the nodes of its key: all replicas for a write, the
+ * first which takes it for a read.
+ */
+static void request_forward(request_t* req)
+{
+	const char* data = (const char*)zmq_msg_data(&req->msg);
+	size_t size = zmq_msg_size(&req->msg);
+	size_t key_len = size < key_size ? size : key_size;
+	int op = req->front->op, write = ops[op].write;
+	uint32_t owners[ROUTER_MAX_REPLICAS];
+	size_t n, i;
+	pending_t* p;
+	uint64_t id;
+
+	stats.requests++;
+	if( next_id - oldest > pending_mask ) {
+		stats.overloads++;
+		front_refuse(req->front, req->route, req->nroute, DBZ_STATUS_OVERLOAD, data, key_len);
+		return;
+	}
+
+	id = next_id;
+	p = &pending[id & pending_mask];
+	assert(p->id == 0);
+	p->nnodes = 0;
+	n = ring_lookup(ring, data, key_len, owners, replicas);
+	for( i = 0; i < n; i++ ) {
+		if( ! node_send(&nodes[owners[i]], op, id, req) ) continue;
+		p->nodes[p->nnodes++] = (uint8_t)owners[i];
+		if( ! write ) break;
+	}
+	if( ! p->nnodes ) {
+		stats.overloads++;
+		front_refuse(req->front, req->route, req->nroute, DBZ_STATUS_OVERLOAD, data, key_len);
+		return;
+	}
+
+	next_id++;
+	stats.forwarded++;
+	p->id = id;
+	p->front = req->front;
+	p->nroute = req->nroute;
+	for( i = 0; i < (size_t)req->nroute; i++ ) {
+		zmq_msg_init(&p->route[i]);
+		zmq_msg_move(&p->route[i], &req->route[i]);
+	}
+	p->sent_ms = now_ms();
+	p->replied = 0;
+	p->waiting = p->nnodes;
+	p->needed = write ? (uint8_t)acks : 1;
+	p->key_len = (uint8_t)key_len;
+	memcpy(pending_keys + (id & pending_mask) * key_size, data, key_len);
+	if( p->front->type == ZMQ_REP ) p->front->busy = 1;
+
+	/* Too few nodes took a write for it to succeed, the others still get it */
+	if( p->nnodes < p->needed ) {
+		stats.overloads++;
+		front_refuse(p->front, p->route, p->nroute, DBZ_STATUS_OVERLOAD, data, key_len);
+		p->needed = 0;
+	}
+}
+
+static void drain(void* sock, zmq_msg_t* msg)
+{
+	int64_t more = 1;
+	size_t more_sz;
+	for( ;; ) {
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		if( ! more ) break;
+		zmq_msg_close(msg);
+		zmq_msg_init(msg);
+		if( zmq_recv(sock, msg, 0) != 0 ) break;
+	}
+	zmq_msg_close(msg);
+}
+
+/**
+ * Read the replies waiting from one node. The reply which completes a
+ * request is passed on to its client, a refusal (a status frame starting
+ * with '!' followed by the key) only once no other node can complete it.
+ */
+static void node_recv(size_t node, int op)
+{
+	node_t* n = &nodes[node];
+	void* sock = n->sock[op];
+	int64_t more;
+	size_t more_sz;
+	zmq_msg_t msg;
+
+	for( ;; ) {
+		pending_t* p;
+		uint64_t id;
+		int j, failed, forward = 0;
+
+		zmq_msg_init(&msg);
+		if( zmq_recv(sock, &msg, ZMQ_NOBLOCK) != 0 ) {
+			zmq_msg_close(&msg);
+			return;
+		}
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		if( zmq_msg_size(&msg) != 8 || ! more ) {
+			drain(sock, &msg);
+			continue;
+		}
+		id = dbz_get64((const char*)zmq_msg_data(&msg));
+		n->stats.replies++;
+
+		p = &pending[id & pending_mask];
+		for( j = 0; p->id == id && j < p->nnodes; j++ ) {
+			if( p->nodes[j] == node && ! (p->replied & (1 << j)) ) break;
+		}
+		if( p->id != id || j == p->nnodes ) {
+			stats.stale++;
+			drain(sock, &msg);
+			continue;
+		}
+		p->replied |= 1 << j;
+		p->waiting--;
+
+		zmq_msg_close(&msg);
+		zmq_msg_init(&msg);
+		if( zmq_recv(sock, &msg, 0) != 0 ) {
+			zmq_msg_close(&msg);
+			if( ! p->waiting ) pending_free(p);
+			continue;
+		}
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+		failed = more && zmq_msg_size(&msg) > 0 && ((const char*)zmq_msg_data(&msg))[0] == '!';
+		if( p->needed ) {
+			if( ! failed ) forward = --p->needed == 0;
+			else forward = p->waiting < p->needed;
+		}
+
+		if( forward && p->front->type != ZMQ_PULL ) {
+			p->needed = 0;
+			p->front->busy = 0;
+			front_route(p->front, p->route, p->nroute);
+			for( ;; ) {
+				zmq_send(p->front->socket, &msg, more ? ZMQ_SNDMORE : 0);
+				zmq_msg_close(&msg);
+				if( ! more ) break;
+				zmq_msg_init(&msg);
+				if( zmq_recv(sock, &msg, 0) != 0 ) {
+					/* Can't happen, a message arrives whole */
+					zmq_msg_init_size(&msg, 0);
+					more = 0;
+					continue;
+				}
+				more_sz = sizeof(more);
+				zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+			}
+		}
+		else {
+			if( forward ) p->needed = 0;
+			drain(sock, &msg);
+		}
+		if( ! p->waiting ) pending_free(p);
+	}
+}
+
+/**
+ * Give up on requests sent more than DBZMQ_ROUTER_TIMEOUT ago. Requests
+ * expire in the order they were sent, so only the oldest are looked at.
+ */
+static void pending_expire(uint64_t now)
+{
+	while( oldest < next_id ) {
+		pending_t* p = &pending[oldest & pending_mask];
+		if( p->id == oldest ) {
+			int j;
+			if( p->sent_ms + timeout_ms > now ) break;
+			for( j = 0; j < p->nnodes; j++ ) {
+				if( ! (p->replied & (1 << j)) ) nodes[p->nodes[j]].stats.timeouts++;
+			}
+			if( p->needed ) {
+				stats.timeouts++;
+				front_refuse(p->front, p->route, p->nroute, DBZ_STATUS_TIMEOUT,
+					pending_keys + (oldest & pending_mask) * key_size, p->key_len);
+			}
+			pending_free(p);
+		}
+		else {
+			oldest++;
+		}
+	}
+}
+
+static void stats_printf(const char* fmt, ...)
+{
+	va_list ap;
+	int len;
+	for( ;; ) {
+		va_start(ap, fmt);
+		len = vsnprintf(stats_buf + stats_len, stats_cap - stats_len, fmt, ap);
+		va_end(ap);
+		if( len < 0 ) return;
+		if( stats_len + len < stats_cap ) break;
+		stats_cap = (stats_len + len + 1) * 2;
+		stats_buf = (char*)realloc(stats_buf, stats_cap);
+		assert(stats_buf != NULL);
+	}
+	stats_len += len;
+}
+
+static void stats_reply(request_t* req)
+{
+	size_t i;
+	stats_len = 0;
+	stats_printf("router nodes=%zu replicas=%zu acks=%zu pending=%llu requests=%llu forwarded=%llu timeouts=%llu overloads=%llu stale=%llu\n",
+		nnodes, replicas, acks,
+		(unsigned long long)(next_id - oldest),
+		(unsigned long long)stats.requests,
+		(unsigned long long)stats.forwarded,
+		(unsigned long long)stats.timeouts,
+		(unsigned long long)stats.overloads,
+		(unsigned long long)stats.stale);
+	for( i = 0; i < nnodes; i++ ) {
+		node_t* n = &nodes[i];
+		stats_printf("node %s weight=%u sent=%llu replies=%llu timeouts=%llu full=%llu\n",
+			n->name, n->weight,
+			(unsigned long long)n->stats.sent,
+			(unsigned long long)n->stats.replies,
+			(unsigned long long)n->stats.timeouts,
+			(unsigned long long)n->stats.full);
+	}
+	front_frame(req->front, stats_buf, stats_len, 0);
+}
+
+/**
+ * Read waiting requests, one from each readable front in turn, and send
+ * them on without waiting for replies.
+ */
+static void fronts_recv(zmq_pollitem_t* items)
+{
+	int i, rc, active = 1, budget = ROUTER_BATCH;
+	request_t req;
+
+	while( active && budget > 0 ) {
+		active = 0;
+		for( i = 0; i < nfronts && budget > 0; i++ ) {
+			front_t* f = &fronts[i];
+			if( ! (items[i].revents & ZMQ_POLLIN) ) continue;
+			rc = request_recv(f, &req);
+			if( rc == 0 || f->type == ZMQ_REP ) items[i].revents = 0;
+			if( rc == 0 ) continue;
+			active = 1;
+			budget--;
+			if( rc < 0 ) continue;
+			if( f->op == OP_STATS ) stats_reply(&req);
+			else request_forward(&req);
+			request_free(&req);
+		}
+	}
+}
+
+static void router_run(void)
+{
+	zmq_pollitem_t items[ROUTER_MAX_FRONTS + ROUTER_MAX_NODES * NOPS];
+	size_t item_node[ROUTER_MAX_NODES * NOPS];
+	int item_op[ROUTER_MAX_NODES * NOPS];
+	int i, op, n = nfronts;
+	size_t j;
+
+	memset(items, 0, sizeof(items));
+	for( i = 0; i < nfronts; i++ ) {
+		items[i].socket = fronts[i].socket;
+		items[i].events = ZMQ_POLLIN;
+	}
+	for( op = 0; op < NOPS; op++ ) {
+		for( j = 0; j < nnodes; j++ ) {
+			if( ! nodes[j].sock[op] ) continue;
+			items[n].socket = nodes[j].sock[op];
+			items[n].events = ZMQ_POLLIN;
+			item_node[n - nfronts] = j;
+			item_op[n - nfronts] = op;
+			n++;
+		}
+	}
+
+	running = 1;
+	while( running == 1 ) {
+		for( i = 0; i < n; i++ ) {
+			items[i].revents = 0;
+			/* REP can't read another request until this one is answered */
+			if( i < nfronts && fronts[i].type == ZMQ_REP ) {
+				items[i].events = fronts[i].busy ? 0 : ZMQ_POLLIN;
+			}
+		}
+		if( zmq_poll(items, n, oldest != next_id ? 1000 : 9001) > 0 ) {
+			/* Replies first, they free slots for the requests */
+			for( i = nfronts; i < n; i++ ) {
+				if( items[i].revents & ZMQ_POLLIN ) node_recv(item_node[i - nfronts], item_op[i - nfronts]);
+			}
+			fronts_recv(items);
+		}
+		if( oldest != next_id ) pending_expire(now_ms());
+	}
+}
+
+static void ctrl_c_handler(int sig_no)
+{
+	if( sig_no == SIGINT ) {
+		running += 1;
+		warnx("CTRL-C caught, shutting down\n");
+		sigaction(sig_no, &old_action, NULL);
+	}
+}
+
+static void print_usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s <nodes> [op=type@addr ...]\n\n", prog);
+	fprintf(stderr,
+		"Ops are get, put and del, bound pull@, rep@ or router@, and stats bound rep@.\n"
+		"The nodes file lists one db-zmq per line, with the addresses of its router@ binds:\n\n"
+		"     # name [weight=N] get=addr put=addr del=addr\n"
+		"     a get=ipc:///tmp/dbz-a.get put=ipc:///tmp/dbz-a.put del=ipc:///tmp/dbz-a.del\n"
+		"     b get=ipc:///tmp/dbz-b.get put=ipc:///tmp/dbz-b.put del=ipc:///tmp/dbz-b.del\n"
+		"     c weight=2 get=ipc:///tmp/dbz-c.get put=ipc:///tmp/dbz-c.put del=ipc:///tmp/dbz-c.del\n"
+	);
+	fprintf(stderr, "\nExample:\n");
+	fprintf(stderr,
+		"# for N in a b c ; do SQLITE3_FILE=$N.dat db-zmq mod-sqlite.so \\\n"
+		"     get=router@ipc:///tmp/dbz-$N.get \\\n"
+		"     put=router@ipc:///tmp/dbz-$N.put \\\n"
+		"     del=router@ipc:///tmp/dbz-$N.del & done\n"
+		"# DBZMQ_ROUTER_REPLICAS=2 %s nodes.conf \\\n"
+		"     get=router@tcp://127.0.0.1:17700 \\\n"
+		"     put=router@tcp://127.0.0.1:17701 \\\n"
+		"     del=pull@tcp://127.0.0.1:17702 \\\n"
+		"     stats=rep@tcp://127.0.0.1:17705 &\n", prog
+	);
+	fprintf(stderr,
+		"\nEnvironment:\n"
+		"     DBZMQ_KEYSIZE           Key size in bytes (default: 20)\n"
+		"     DBZMQ_IO_THREADS        ZeroMQ I/O threads (default: 1)\n"
+		"     DBZMQ_ROUTER_VNODES     Ring points per node and unit of weight (default: 160)\n"
+		"     DBZMQ_ROUTER_REPLICAS   Nodes written for each key (default: 1)\n"
+		"     DBZMQ_ROUTER_ACKS       Node replies before a write is answered (default: replicas)\n"
+		"     DBZMQ_ROUTER_INFLIGHT   Requests waiting for nodes at once (default: 65536)\n"
+		"     DBZMQ_ROUTER_TIMEOUT    ms before a node's reply is given up on (default: 5000)\n"
+		"     DBZMQ_ROUTER_HWM        Requests queued for a node before it counts as full (default: 1000)\n"
+	);
+	printf("\ndbZMQ version v%.1f\n", VERSION);
+}
+
+int main(int argc, char** argv)
+{
+	struct sigaction act;
+	const char* env;
+	size_t inflight = 65536, i;
+	int io_threads = 1, op;
+	void* zctx;
+
+	if( argc < 3 ) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if( (env = getenv("DBZMQ_KEYSIZE")) ) key_size = atoi(env);
+	if( key_size < 1 || key_size > 0xFF ) errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+	if( (env = getenv("DBZMQ_IO_THREADS")) ) io_threads = atoi(env);
+	if( io_threads < 1 ) errx(EXIT_FAILURE, "Invalid DBZMQ_IO_THREADS");
+	if( (env = getenv("DBZMQ_ROUTER_INFLIGHT")) ) inflight = (size_t)atoi(env);
+	if( inflight < 1 ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_INFLIGHT");
+	if( (env = getenv("DBZMQ_ROUTER_TIMEOUT")) ) timeout_ms = (uint64_t)atoi(env);
+	if( timeout_ms < 1 ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_TIMEOUT");
+	if( (env = getenv("DBZMQ_ROUTER_HWM")) ) node_hwm = atoi(env);
+	if( node_hwm < 1 ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_HWM");
+
+	nodes_load(argv[1]);
+
+	if( (env = getenv("DBZMQ_ROUTER_REPLICAS")) ) replicas = (size_t)atoi(env);
+	if( replicas < 1 || replicas > ROUTER_MAX_REPLICAS ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_REPLICAS");
+	if( replicas > nnodes ) errx(EXIT_FAILURE, "%zu replicas need as many nodes, there are %zu", replicas, nnodes);
+	acks = replicas;
+	if( (env = getenv("DBZMQ_ROUTER_ACKS")) ) acks = (size_t)atoi(env);
+	if( acks < 1 || acks > replicas ) errx(EXIT_FAILURE, "Invalid DBZMQ_ROUTER_ACKS");
+
+	/* A power of two, so an id finds its slot with a mask */
+	for( i = 1; i < inflight; i <<= 1 );
+	pending = (pending_t*)calloc(i, sizeof(pending_t));
+	pending_keys = (char*)malloc(i * key_size);
+	if( ! pending || ! pending_keys ) errx(EXIT_FAILURE, "Out of memory");
+	pending_mask = i - 1;
+
+	zctx = zmq_init(io_threads);
+	assert(zctx != NULL);
+	for( i = 2; i < (size_t)argc; i++ ) {
+		char* name = argv[i];
+		char* addr = strchr(name, '=');
+		if( ! addr ) errx(EXIT_FAILURE, "Expected op=type@addr, not '%s'", name);
+		*addr++ = 0;
+		front_bind(zctx, name, addr);
+	}
+	nodes_setup(zctx);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = &ctrl_c_handler;
+	sigaction(SIGINT, &act, &old_action);
+	router_run();
+
+	/* Requests still waiting for nodes are dropped, don't wait to send them */
+	for( i = 0; i <= pending_mask; i++ ) {
+		if( pending[i].id ) pending_free(&pending[i]);
+	}
+	for( i = 0; i < (size_t)nfronts; i++ ) {
+		zmq_close(fronts[i].socket);
+	}
+	for( i = 0; i < nnodes; i++ ) {
+		for( op = 0; op < NOPS; op++ ) {
+			if( nodes[i].sock[op] ) {
+				int linger = 0;
+				zmq_setsockopt(nodes[i].sock[op], ZMQ_LINGER, &linger, sizeof(linger));
+				zmq_close(nodes[i].sock[op]);
+			}
+			free(nodes[i].addr[op]);
+		}
+	}
+	zmq_term(zctx);
+	ring_free(ring);
+	free(pending);
+	free(pending_keys);
+	free(stats_buf);
+	return EXIT_SUCCESS;
+}
@@ -2,173 +2,2127 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <libgen.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/time.h>
 
 #include <err.h>
 #include <assert.h>
 #include <dlfcn.h>
 
-#include <zmq.h>
 #include <stdint.h>
 
-#include "db-zmq.h"
-#include "../i_speak_db.h"
+#include "db-zmq.h"
+#include "../i_speak_db.h"
+
+#ifdef DBZ_MAIN
+#include <zmq.h>
+
+#include "hotset.h"
+#include "binlog.h"
+#include "affinity.h"
+#include "ttl.h"
+#include "topk.h"
+#include "backup.h"
+#include "blob.h"
+#include "trace.h"
+#include "wal.h"
+#include "memory.h"
+#include "merge.h"
+#endif
+
+/**
+ * Initialize with set of operations.
+ */
+dbz* dbz_init(struct dbz_op* ops)
+{
+	dbz* x = (dbz*)malloc(sizeof(dbz));
+	assert(x != NULL);
+	if(!x) return NULL;
+
+	memset(x, 0, sizeof(dbz));
+	x->ops = ops;
+	return x;
+}
+
+/**
+ * Open a .so file which exports "i_speak_db"
+ * @return Database handle
+ */
+dbz* dbz_open(const char *filename)
+{
+	mod_init_fn f = NULL;
+	dbz* x = dbz_init(NULL);
+	x->mod = dlopen(filename, RTLD_LAZY);
+	if( ! x->mod ) {
+		warnx("Cannot dlopen(%p, '%s') = %s", x->mod, filename, dlerror());
+		free(x);
+		return NULL;
+	}
+    f = (mod_init_fn)dlsym(x->mod, "i_speak_db");
+    if( ! f ) {
+    	warnx("Cannot dlsym(%p, 'i_speak_db') = %s", x->mod, dlerror());
+    	dlclose(x->mod);
+    	x->mod = NULL;
+    	free(x);
+    	return NULL;
+    }
+
+    x->ops = (struct dbz_op*)f();
+    return x;
+}
+
+/**
+ * Find an operation with matching name.
+ *
+ * Human readable type informaion can be appended to
+ * the name when defining an operation.
+ *
+ * Providing just "get" or "put" will match these correctly:
+ *   "get (kN) -> k ++ vN || k"
+ *   "put (kNvN) -> k ++ v || k"
+ */
+static struct dbz_op* dbz_op_find(struct dbz_op* f, const char* name)
+{
+	const char *x;
+	while( f->name ) {
+		if( strcmp(f->name, name) == 0 ) {
+			x = f->name + strlen(name);
+			if( *x == 0 || *x == ' ')
+				return f;
+		}
+		f++;
+	}
+	return NULL;
+}
+
+struct dbz_op* dbz_op(dbz* ctx, const char* name)
+{
+	return dbz_op_find(ctx->ops, name);
+}
+
+/**
+ * Close handle, unload module
+ */
+int dbz_close(dbz* ctx)
+{
+	assert(ctx != NULL);
+	if( ctx->mod ) dlclose(ctx->mod);
+	memset(ctx, 0, sizeof(dbz));
+	free(ctx);
+	return 1;
+}
+
+#ifdef DBZ_MAIN
+
+static size_t key_size = 20;
+static struct dbz_op* get_op = NULL;
+static struct dbz_op* put_op = NULL;
+static struct dbz_op* del_op = NULL;
+static struct dbz_op* batch_op = NULL;
+
+static uint64_t mutation_epoch = 0;
+static uint64_t mutation_seq = 0;
+static binlog_t* binlog = NULL;
+static replica_t* replica = NULL;
+static ttl_t* ttl = NULL;
+static size_t ttl_sweep_rate = 1000;
+static topk_t* topk = NULL;
+static time_t topk_window = 10;
+static backup_t* backup = NULL;
+static wal_t* wal = NULL;
+static struct dbz_op* sync_op = NULL;
+static long wal_interval = 0;
+static uint64_t wal_checkpoint = 64 * 1024 * 1024;
+static blob_uploads_t* blobs = NULL;
+static size_t blob_chunk_max = 256 * 1024;
+static memory_t* memory = NULL;
+static merge_t* merges = NULL;
+static size_t merge_batch = 256;
+static struct dbz_op* memory_op = NULL;
+static uint64_t zmq_held = 0;	/* Bytes of requests read and not yet freed */
+static struct {
+	uint64_t chunks_in;
+	uint64_t chunks_out;
+	uint64_t commits;
+	uint64_t aborts;
+} blob_stats;
+static time_t started;
+
+/**
+ * A request being answered, handed to ops as their `token`.
+ */
+typedef struct {
+	struct dbz_arena* arena;	/* First, see i_speak_db.h */
+	dbzmq_socket_t* sock;
+	zmq_msg_t route[2];	/* identity ++ request id on router sockets */
+	int nroute;
+	int partial;		/* Reply frames sent with ZMQ_SNDMORE */
+	uint64_t deadline;	/* ms since the epoch, 0 for none */
+	zmq_msg_t msg;		/* Payload */
+	int traced;		/* Sampled, see trace.h */
+	trace_rec_t trace;
+	uint64_t min_epoch;	/* Mutation to wait for, see DBZ_HDR_MIN_SEQ */
+	uint64_t min_seq;	/* 0 for none */
+	uint64_t wait_until;	/* ms since the epoch, while parked */
+} dbz_request_t;
+
+/* Scratch memory for ops, reset after each request */
+static struct dbz_arena arena;
+
+/* When the last zmq_poll returned, while tracing */
+static uint64_t poll_ns;
+static const char* trace_file = NULL;
+static volatile sig_atomic_t trace_dump_pending = 0;
+
+/* Requests read but not yet run */
+static dbz_request_t* queue = NULL;
+static size_t queue_cap = 256;
+static size_t queue_len = 0;
+
+/* Requests waiting for a mutation to be applied */
+static dbz_request_t* parked = NULL;
+static size_t parked_cap = 0;
+static size_t parked_len = 0;
+static long min_seq_wait = 1000;
+static struct {
+	uint64_t waited;
+	uint64_t timeouts;
+} wait_stats;
+
+/* Acks of applied mutations, published once committed */
+static void* ack_pub = NULL;
+static char* ack_buf = NULL;
+static size_t ack_used, ack_cap;
+
+/* Keys changed, published as soon as the change can be read */
+static void* invalidate_pub = NULL;
+
+/**
+ * Send one frame of the reply to `req`, routed back to the client
+ * when the request came in on a router socket.
+ */
+static void request_send(dbz_request_t* req, const char* data, size_t len, int more)
+{
+	dbzmq_socket_t* sock = req->sock;
+	zmq_msg_t msg;
+	int i;
+
+	if( sock->type != ZMQ_REP && sock->type != ZMQ_ROUTER )
+		return;
+
+	if( ! req->partial ) {
+		for( i = 0; i < req->nroute; i++ ) {
+			zmq_msg_init(&msg);
+			zmq_msg_copy(&msg, &req->route[i]);
+			zmq_send(sock->socket, &msg, ZMQ_SNDMORE);
+			zmq_msg_close(&msg);
+		}
+	}
+
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	if( req->traced && ! req->trace.send ) req->trace.send = trace_now();
+	zmq_send(sock->socket, &msg, more ? ZMQ_SNDMORE : 0);
+	if( req->traced ) req->trace.sent = trace_now();
+	zmq_msg_close(&msg);
+
+	req->partial = more;
+	sock->bytes_out += len;
+}
+
+static void binlog_send(void* ctx, const char* data, size_t len, int more)
+{
+	request_send((dbz_request_t*)ctx, data, len, more);
+}
+
+static
+DB_OP(host_binlog_sync){
+	(void)cb;
+	if( ! binlog ) return 0;
+	binlog_serve(binlog, in_data, in_sz, binlog_send, token);
+	return in_sz;
+}
+
+static void dbz_mutated(char type, const char* data, size_t len);
+
+/**
+ * put with an expiry time, k ++ ttl[4] ++ v with ttl in seconds.
+ * A ttl of 0 stores the value without one, as put does.
+ */
+static
+DB_OP(host_putex){
+	char* value = in_data + key_size;
+	uint32_t seconds;
+	size_t put_sz;
+
+	if( ! ttl || in_sz < key_size + 4 ) {
+		if( cb ) cb(in_data, in_sz < key_size ? in_sz : key_size, NULL, token);
+		return 0;
+	}
+	seconds = dbz_get32(value);
+	memmove(value, value + 4, in_sz - key_size - 4);
+	put_sz = in_sz - 4;
+
+	if( put_op->cb(in_data, put_sz, cb, token) != put_sz )
+		return 0;
+	ttl_set(ttl, in_data, seconds ? (uint32_t)time(NULL) + seconds : 0);
+	dbz_mutated('P', in_data, put_sz);
+	return in_sz;
+}
+
+static void request_move(dbz_request_t* dst, dbz_request_t* src);
+static void request_free(dbz_request_t* req);
+
+/**
+ * A merge request waiting for its key to be written, see merge.h.
+ */
+typedef struct {
+	dbz_request_t req;
+	merge_value_t* value;
+	char small[0x100 + 9];
+	char* reply;		/* Sent once written, the key alone if that failed */
+	size_t reply_len;
+} merge_staged_t;
+
+static merge_staged_t* staged = NULL;
+static size_t staged_len = 0;
+static char* merge_buf = NULL;
+static size_t merge_buf_cap = 0;
+static char* merge_status = NULL;
+static struct {
+	uint64_t incr;
+	uint64_t append;
+	uint64_t cas;
+	uint64_t mismatches;
+	uint64_t writes;
+	uint64_t failed;
+} merge_stats;
+
+typedef struct {
+	struct dbz_arena* arena;	/* First, see i_speak_db.h */
+	merge_value_t* value;
+	size_t len;			/* Statuses of a batch */
+	int ok;
+} merge_read_t;
+
+static size_t merge_read_cb(const char* data, size_t len, dbzop_t unused, merge_read_t* r)
+{
+	(void)unused;
+	if( len > key_size ) r->ok = merge_set(merges, r->value, data + key_size, len - key_size, 0);
+	return len;
+}
+
+static size_t merge_status_cb(const char* status, size_t len, dbzop_t unused, merge_read_t* r)
+{
+	(void)unused;
+	r->len = len < merges->capacity ? len : merges->capacity;
+	memcpy(merge_status, status, r->len);
+	return len;
+}
+
+/**
+ * Write every changed key, with one batch op when the module has one,
+ * then answer the merges waiting for them.
+ */
+static void merge_flush(void)
+{
+	size_t i, used = 0, dirty = 0, mark = arena.used;
+	merge_read_t r;
+
+	for( i = 0; i < merges->count; i++ ) {
+		merge_value_t* v = &merges->values[i];
+		if( ! v->dirty ) continue;
+		if( used + DBZ_REC_HDR + v->len > merge_buf_cap ) {
+			merge_buf_cap = (used + DBZ_REC_HDR + v->len) * 2;
+			merge_buf = (char*)realloc(merge_buf, merge_buf_cap);
+			assert(merge_buf != NULL);
+		}
+		used += dbz_record_header(merge_buf + used, DBZ_REC_PUT, v->len);
+		memcpy(merge_buf + used, v->rec, v->len);
+		used += v->len;
+		dirty++;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.arena = &arena;
+	if( dirty > 1 && batch_op ) {
+		batch_op->cb(merge_buf, used, (void*)merge_status_cb, &r);
+		/* A batch is applied whole or not at all */
+		for( i = 0; i < r.len && merge_status[i] == DBZ_REC_OK; i++ );
+		if( r.len != dirty || i != dirty ) r.len = 0;
+	}
+	for( i = 0; i < merges->count; i++ ) {
+		merge_value_t* v = &merges->values[i];
+		if( ! v->dirty ) continue;
+		/* Find the records which fail, as if put one by one */
+		if( ! r.len ) v->failed = put_op->cb(v->rec, v->len, NULL, &r) != v->len;
+		if( v->failed ) {
+			merge_stats.failed++;
+			continue;
+		}
+		if( ttl ) ttl_set(ttl, v->rec, 0);
+		dbz_mutated('P', v->rec, v->len);
+		merge_stats.writes++;
+	}
+	arena.used = mark;
+
+	for( i = 0; i < staged_len; i++ ) {
+		merge_staged_t* st = &staged[i];
+		if( st->value->failed ) request_send(&st->req, st->reply, key_size, 0);
+		else request_send(&st->req, st->reply, st->reply_len, 0);
+		if( st->reply != st->small ) free(st->reply);
+		request_free(&st->req);
+	}
+	staged_len = 0;
+	merge_clear(merges);
+}
+
+/**
+ * The value of a key as changed by the merges so far, read from the
+ * module the first time.
+ * @return NULL if it cannot be read
+ */
+static merge_value_t* merge_value(const char* key)
+{
+	merge_value_t* v = merge_find(merges, key);
+	merge_read_t r;
+
+	if( v ) return v;
+	if( ! (v = merge_add(merges, key)) ) return NULL;
+	if( ttl && ttl_expired(ttl, key, (uint32_t)time(NULL)) ) return v;
+	memset(&r, 0, sizeof(r));
+	r.arena = &arena;
+	r.value = v;
+	r.ok = 1;
+	get_op->cb((char*)key, key_size, (void*)merge_read_cb, &r);
+	if( ! r.ok ) {
+		merges->count--;
+		return NULL;
+	}
+	v->dirty = 0;
+	return v;
+}
+
+/**
+ * Hold the request until its key has been written.
+ */
+static void merge_stage(dbz_request_t* req, merge_value_t* v, const char* reply, size_t len)
+{
+	merge_staged_t* st = &staged[staged_len++];
+	request_move(&st->req, req);
+	st->value = v;
+	st->reply = len <= sizeof(st->small) ? st->small : (char*)malloc(len);
+	assert(st->reply != NULL);
+	memcpy(st->reply, reply, len);
+	st->reply_len = len;
+}
+
+/**
+ * Room for one more merge, writing out the previous ones if there isn't.
+ */
+static int merge_begin(const char* in_data, size_t in_sz, size_t min_sz, dbzop_t cb, void* token)
+{
+	if( ! merges || in_sz < min_sz ) {
+		if( cb ) cb(in_data, in_sz < key_size ? in_sz : key_size, NULL, token);
+		return 0;
+	}
+	if( staged_len == merge_batch || merges->count == merges->capacity ) merge_flush();
+	return 1;
+}
+
+/**
+ * k ++ delta[8], see merge.h.
+ */
+static
+DB_OP(host_incr){
+	merge_value_t* v;
+	uint64_t value = 0;
+	char reply[0x100 + 8];
+
+	if( ! merge_begin(in_data, in_sz, key_size + 8, cb, token) ) return 0;
+	if( in_sz != key_size + 8 || ! (v = merge_value(in_data))
+	 || (v->exists && v->len != key_size + 8) ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	if( v->exists ) value = dbz_get64(v->rec + key_size);
+	/* Two's complement, so a negative delta decrements */
+	value += dbz_get64(in_data + key_size);
+	memcpy(reply, in_data, key_size);
+	dbz_put64(reply + key_size, value);
+	if( ! merge_set(merges, v, reply + key_size, 8, 0) ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	merge_stats.incr++;
+	merge_stage((dbz_request_t*)token, v, reply, key_size + 8);
+	return in_sz;
+}
+
+/**
+ * k ++ data, see merge.h.
+ */
+static
+DB_OP(host_append){
+	merge_value_t* v;
+	char reply[0x100 + 4];
+
+	if( ! merge_begin(in_data, in_sz, key_size, cb, token) ) return 0;
+	if( ! (v = merge_value(in_data))
+	 || v->len - key_size + (in_sz - key_size) > 0xFFFFFFFF
+	 || ! merge_set(merges, v, in_data + key_size, in_sz - key_size, v->exists) ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	memcpy(reply, in_data, key_size);
+	dbz_put32(reply + key_size, (uint32_t)(v->len - key_size));
+	merge_stats.append++;
+	merge_stage((dbz_request_t*)token, v, reply, key_size + 4);
+	return in_sz;
+}
+
+/**
+ * k ++ len[4] ++ expected ++ v, see merge.h.
+ */
+static
+DB_OP(host_cas){
+	merge_value_t* v;
+	uint32_t expected_len;
+	const char* expected = in_data + key_size + 4;
+	char* reply;
+	size_t reply_len;
+	int match;
+
+	if( ! merge_begin(in_data, in_sz, key_size + 4, cb, token) ) return 0;
+	expected_len = dbz_get32(in_data + key_size);
+	if( (expected_len != 0xFFFFFFFF && expected_len > in_sz - key_size - 4)
+	 || ! (v = merge_value(in_data)) ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	if( expected_len == 0xFFFFFFFF ) {
+		match = ! v->exists;
+		expected_len = 0;
+	}
+	else {
+		match = v->exists && v->len - key_size == expected_len
+			&& memcmp(v->rec + key_size, expected, expected_len) == 0;
+	}
+	merge_stats.cas++;
+	if( ! match ) {
+		/* Answered with the value as it will be written */
+		merge_stats.mismatches++;
+		reply_len = key_size + 1 + (v->exists ? v->len - key_size : 0);
+		reply = (char*)dbz_alloc(token, reply_len);
+		assert(reply != NULL);
+		memcpy(reply, v->rec, key_size);
+		reply[key_size] = v->exists ? 'M' : 'N';
+		if( v->exists ) memcpy(reply + key_size + 1, v->rec + key_size, v->len - key_size);
+		merge_stage((dbz_request_t*)token, v, reply, reply_len);
+		dbz_free(token, reply);
+		return in_sz;
+	}
+	if( ! merge_set(merges, v, expected + expected_len, in_sz - key_size - 4 - expected_len, 0) ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	{
+		char ok[0x100 + 1];
+		memcpy(ok, in_data, key_size);
+		ok[key_size] = 'O';
+		merge_stage((dbz_request_t*)token, v, ok, key_size + 1);
+	}
+	return in_sz;
+}
+
+static int op_is_merge(const struct dbz_op* op)
+{
+	return op->cb == (dbzop_t)host_incr || op->cb == (dbzop_t)host_append || op->cb == (dbzop_t)host_cas;
+}
+
+/**
+ * Stream a snapshot to the receiver at the address in the request, see
+ * backup.h. Replies 'O' once started, 'B' while a backup is running.
+ */
+static
+DB_OP(host_backup){
+	char addr[256];
+	char status = 'F';
+
+	if( backup && in_sz > 0 && in_sz < sizeof(addr) ) {
+		memcpy(addr, in_data, in_sz);
+		addr[in_sz] = 0;
+		if( backup->push ) status = 'B';
+		else if( backup_start(backup, addr) ) status = 'O';
+	}
+	if( cb ) cb(&status, 1, NULL, token);
+	return status == 'O' ? in_sz : 0;
+}
+
+/**
+ * Read state of a blob op, handed to get as its token.
+ */
+typedef struct {
+	struct dbz_arena* arena;	/* First, see i_speak_db.h */
+	dbzop_t cb;
+	void* token;
+	char hdr[0x100 + 13];		/* k ++ gen[8] ++ seq[4] ++ flag[1] */
+	int plain;			/* Reply with a value stored by put */
+	int manifest;
+	blob_manifest_t m;
+	int sent;
+} blob_read_t;
+
+/**
+ * Reply with the header followed by the value `get` found.
+ */
+static size_t blob_reply_cb(const char* data, size_t len, dbzop_t unused, blob_read_t* r)
+{
+	size_t hdr = key_size + 13;
+	char* out;
+	(void)unused;
+	if( len <= key_size ) return len;
+	out = (char*)dbz_alloc(r, hdr + len - key_size);
+	memcpy(out, r->hdr, hdr);
+	memcpy(out + hdr, data + key_size, len - key_size);
+	if( r->cb ) r->cb(out, hdr + len - key_size, NULL, r->token);
+	dbz_free(r, out);
+	r->sent = 1;
+	blob_stats.chunks_out++;
+	return len;
+}
+
+/**
+ * Note the manifest under k, or answer chunk 0 with a value stored by put.
+ */
+static size_t blob_head_cb(const char* data, size_t len, dbzop_t unused, blob_read_t* r)
+{
+	if( len <= key_size ) return len;
+	r->manifest = blob_manifest_decode(data + key_size, len - key_size, &r->m);
+	if( ! r->manifest && r->plain ) {
+		r->hdr[key_size + 12] = BLOB_LAST;
+		blob_reply_cb(data, len, unused, r);
+	}
+	return len;
+}
+
+static int blob_manifest(const char* key, blob_manifest_t* m)
+{
+	blob_read_t r;
+	memset(&r, 0, sizeof(r));
+	r.arena = &arena;
+	get_op->cb(key, key_size, (dbzop_t)blob_head_cb, &r);
+	*m = r.m;
+	return r.manifest;
+}
+
+static void blob_delete_chunks(const char* key, uint64_t gen, uint32_t chunks)
+{
+	char chunk_key[0x100];
+	uint32_t i;
+	for( i = 0; i < chunks; i++ ) {
+		blob_chunk_key(chunk_key, key_size, key, gen, i);
+		if( del_op->cb(chunk_key, key_size, NULL, NULL) > 0 )
+			dbz_mutated('D', chunk_key, key_size);
+	}
+}
+
+static void blob_abort(blob_upload_t* up)
+{
+	blob_delete_chunks(up->key, up->gen, up->next_seq);
+	blob_upload_end(blobs, up);
+	blob_stats.aborts++;
+}
+
+/**
+ * Point k at the uploaded chunks, then delete the ones it replaced.
+ */
+static int blob_commit(blob_upload_t* up)
+{
+	char value[0x100 + BLOB_MANIFEST_SZ];
+	blob_manifest_t old, m;
+	int replaced = blob_manifest(up->key, &old);
+	size_t len;
+
+	m.gen = up->gen;
+	m.chunks = up->next_seq;
+	m.size = up->size;
+	memcpy(value, up->key, key_size);
+	len = key_size + blob_manifest_encode(value + key_size, &m);
+	if( put_op->cb(value, len, NULL, NULL) != len ) {
+		blob_abort(up);
+		return 0;
+	}
+	if( ttl ) ttl_set(ttl, value, 0);
+	dbz_mutated('P', value, len);
+	if( replaced && old.gen != m.gen )
+		blob_delete_chunks(value, old.gen, old.chunks);
+	blob_upload_end(blobs, up);
+	blob_stats.commits++;
+	return 1;
+}
+
+/**
+ * Store one chunk of a large value, see blob.h.
+ *
+ *   putblob(k ++ gen[8] ++ seq[4] ++ flag[1] ++ data) -> k ++ gen[8] ++ seq[4] ++ status[1]
+ *
+ * The first chunk has gen 0 and seq 0, the reply carries the gen to send
+ * the rest with. Chunks come in order, flag being BLOB_MORE or BLOB_LAST
+ * for the one which commits the upload. Each chunk is put as it arrives,
+ * so the server holds at most one chunk of an upload at a time.
+ */
+static
+DB_OP(host_putblob){
+	char reply[0x100 + 13];
+	size_t hdr = key_size + 13, len;
+	blob_upload_t* up = NULL;
+	char status = BLOB_FAILED;
+	time_t now = time(NULL);
+	uint64_t gen;
+	uint32_t seq;
+	char flag, *chunk;
+
+	if( ! blobs || in_sz < hdr ) {
+		if( cb ) cb(in_data, in_sz < key_size ? in_sz : key_size, NULL, token);
+		return 0;
+	}
+	memcpy(reply, in_data, hdr);
+	gen = dbz_get64(in_data + key_size);
+	seq = dbz_get32(in_data + key_size + 8);
+	flag = in_data[key_size + 12];
+	len = in_sz - hdr;
+
+	if( gen == 0 && seq == 0 ) {
+		up = blob_upload_begin(blobs, in_data, now);
+		if( up ) dbz_put64(reply + key_size, up->gen);
+	}
+	else {
+		up = blob_upload_find(blobs, in_data, gen);
+	}
+	if( up && (seq != up->next_seq || len > blob_chunk_max
+	        || (flag != BLOB_MORE && flag != BLOB_LAST) || (len == 0 && flag != BLOB_LAST)) ) {
+		blob_abort(up);
+		up = NULL;
+	}
+
+	if( up && len ) {
+		/* Write the chunk key over the header, in front of the data */
+		chunk = in_data + hdr - key_size;
+		blob_chunk_key(chunk, key_size, up->key, up->gen, seq);
+		if( put_op->cb(chunk, key_size + len, NULL, NULL) == key_size + len ) {
+			dbz_mutated('P', chunk, key_size + len);
+			up->next_seq++;
+			up->size += len;
+			up->active = now;
+			blob_stats.chunks_in++;
+		}
+		else {
+			blob_abort(up);
+			up = NULL;
+		}
+	}
+	if( up ) {
+		status = BLOB_STORED;
+		if( flag == BLOB_LAST ) status = blob_commit(up) ? BLOB_COMMITTED : BLOB_FAILED;
+	}
+
+	reply[hdr - 1] = status;
+	if( cb ) cb(reply, hdr, NULL, token);
+	return status == BLOB_FAILED ? 0 : in_sz;
+}
+
+/**
+ * Read one chunk of a large value.
+ *
+ *   getblob(k ++ gen[8] ++ seq[4]) -> k ++ gen[8] ++ seq[4] ++ flag[1] ++ data || k
+ *
+ * gen 0 reads the current value, the following chunks should ask for the
+ * gen of the first reply. k alone means there is no such chunk, e.g. the
+ * value was replaced since. flag is BLOB_MORE or BLOB_LAST, a value
+ * stored with put comes back whole as chunk 0 of gen 0.
+ */
+static
+DB_OP(host_getblob){
+	blob_read_t r;
+	uint64_t gen;
+	uint32_t seq;
+	char chunk_key[0x100];
+
+	if( ! blobs || in_sz != key_size + 12 ) {
+		if( cb ) cb(in_data, in_sz < key_size ? in_sz : key_size, NULL, token);
+		return 0;
+	}
+	memset(&r, 0, sizeof(r));
+	r.arena = dbz_arena_of(token);
+	r.cb = cb;
+	r.token = token;
+	memcpy(r.hdr, in_data, key_size + 12);
+	gen = dbz_get64(in_data + key_size);
+	seq = dbz_get32(in_data + key_size + 8);
+	r.plain = (gen == 0 && seq == 0);
+
+	get_op->cb(in_data, key_size, (dbzop_t)blob_head_cb, &r);
+	if( r.manifest && (gen == 0 || gen == r.m.gen) && seq < r.m.chunks ) {
+		dbz_put64(r.hdr + key_size, r.m.gen);
+		r.hdr[key_size + 12] = (seq + 1 < r.m.chunks) ? BLOB_MORE : BLOB_LAST;
+		blob_chunk_key(chunk_key, key_size, in_data, r.m.gen, seq);
+		get_op->cb(chunk_key, key_size, (dbzop_t)blob_reply_cb, &r);
+	}
+	else if( r.manifest && r.m.chunks == 0 && seq == 0 ) {
+		dbz_put64(r.hdr + key_size, r.m.gen);
+		r.hdr[key_size + 12] = BLOB_LAST;
+		if( cb ) cb(r.hdr, key_size + 13, NULL, token);
+		r.sent = 1;
+	}
+	if( ! r.sent ) {
+		if( cb ) cb(in_data, key_size, NULL, token);
+		return 0;
+	}
+	return in_sz;
+}
+
+/**
+ * Delete a large value and its chunks, or a value stored by put.
+ *
+ *   delblob(k) -> k
+ */
+static
+DB_OP(host_delblob){
+	blob_manifest_t m;
+	size_t ret;
+
+	if( ! blobs || in_sz != key_size ) {
+		if( cb ) cb(in_data, in_sz < key_size ? in_sz : key_size, NULL, token);
+		return 0;
+	}
+	if( blob_manifest(in_data, &m) )
+		blob_delete_chunks(in_data, m.gen, m.chunks);
+	ret = del_op->cb(in_data, key_size, cb, token);
+	if( ret > 0 ) {
+		if( ttl ) ttl_set(ttl, in_data, 0);
+		dbz_mutated('D', in_data, key_size);
+	}
+	return ret;
+}
+
+/* Bound sockets, in command line order. An op may be bound more than once. */
+#define DBZ_MAX_BINDS 32
+static dbzmq_socket_t* binds[DBZ_MAX_BINDS];
+static int nbinds = 0;
+
+static char* stats_buf = NULL;
+static size_t stats_len, stats_cap;
+
+static void stats_printf(const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+	for(;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(stats_buf + stats_len, stats_cap - stats_len, fmt, ap);
+		va_end(ap);
+		if( n < 0 ) return;
+		if( stats_len + n < stats_cap ) break;
+		stats_cap = (stats_cap + n) * 2;
+		stats_buf = (char*)realloc(stats_buf, stats_cap);
+		assert(stats_buf != NULL);
+	}
+	stats_len += n;
+}
+
+/**
+ * Server counters as key=value text, one line per thing counted.
+ */
+static
+DB_OP(host_stats){
+	int i;
+
+	if( in_sz == 5 && memcmp(in_data, "trace", 5) == 0 ) {
+		size_t len = 0;
+		char* json = trace_json(&len);
+		if( ! json ) return 0;
+		if( cb ) cb(json, len, NULL, token);
+		free(json);
+		return len;
+	}
+
+	stats_len = 0;
+	stats_printf("server uptime=%ld key_size=%zu queue=%zu mutations=%llu arena=%zu arena_misses=%zu\n",
+		(long)(time(NULL) - started), key_size, queue_cap,
+		(unsigned long long)mutation_seq, arena.size, arena.misses);
+	for( i = 0; i < nbinds; i++ ) {
+		dbzmq_socket_t* sock = binds[i];
+		stats_printf("op %s calls=%llu bytes_in=%llu bytes_out=%llu shed=%llu\n",
+			sock->op->name,
+			(unsigned long long)sock->calls,
+			(unsigned long long)sock->bytes_in,
+			(unsigned long long)sock->bytes_out,
+			(unsigned long long)sock->shed);
+	}
+	if( ttl ) {
+		stats_printf("ttl keys=%zu expired=%zu\n", ttl->count, ttl->expired);
+	}
+	if( backup ) {
+		stats_printf("backup running=%d backups=%llu chunks=%llu records=%llu bytes=%llu chunk_us_avg=%llu chunk_us_max=%llu\n",
+			backup->push != NULL,
+			(unsigned long long)backup->backups,
+			(unsigned long long)backup->seq,
+			(unsigned long long)backup->records,
+			(unsigned long long)backup->bytes,
+			(unsigned long long)(backup->seq ? backup->chunk_us / backup->seq : 0),
+			(unsigned long long)backup->max_chunk_us);
+	}
+	if( blobs ) {
+		stats_printf("blob chunk_max=%zu chunks_in=%llu chunks_out=%llu commits=%llu aborts=%llu\n",
+			blob_chunk_max,
+			(unsigned long long)blob_stats.chunks_in,
+			(unsigned long long)blob_stats.chunks_out,
+			(unsigned long long)blob_stats.commits,
+			(unsigned long long)blob_stats.aborts);
+	}
+	if( wal ) {
+		stats_printf("wal bytes=%llu records=%llu commits=%llu commit_us_avg=%llu commit_us_max=%llu truncates=%llu\n",
+			(unsigned long long)wal->size,
+			(unsigned long long)wal->records,
+			(unsigned long long)wal->commits,
+			(unsigned long long)(wal->commits ? wal->commit_us / wal->commits : 0),
+			(unsigned long long)wal->max_commit_us,
+			(unsigned long long)wal->truncates);
+	}
+	if( parked_len || wait_stats.waited ) {
+		stats_printf("wait parked=%zu waited=%llu timeouts=%llu\n", parked_len,
+			(unsigned long long)wait_stats.waited,
+			(unsigned long long)wait_stats.timeouts);
+	}
+	if( trace_sample ) {
+		stats_printf("trace sample=%u records=%zu\n", trace_sample, trace_count());
+	}
+	if( merges ) {
+		stats_printf("merge batch=%zu incr=%llu append=%llu cas=%llu mismatches=%llu writes=%llu failed=%llu\n",
+			merge_batch,
+			(unsigned long long)merge_stats.incr,
+			(unsigned long long)merge_stats.append,
+			(unsigned long long)merge_stats.cas,
+			(unsigned long long)merge_stats.mismatches,
+			(unsigned long long)merge_stats.writes,
+			(unsigned long long)merge_stats.failed);
+	}
+	if( memory ) {
+		static const char* const states[] = {"ok", "trim", "shed"};
+		uint64_t attributed = memory_attributed(memory);
+		stats_printf("memory rss=%llu limit=%llu state=%s",
+			(unsigned long long)memory->rss,
+			(unsigned long long)memory->limit,
+			states[memory->state]);
+		for( i = 0; i < MEMORY_PARTS; i++ ) {
+			stats_printf(" %s=%llu", memory_part_names[i], (unsigned long long)memory->parts[i]);
+		}
+		stats_printf(" other=%llu trims=%llu rejected=%llu\n",
+			(unsigned long long)(memory->rss > attributed ? memory->rss - attributed : 0),
+			(unsigned long long)memory->trims,
+			(unsigned long long)memory->rejected);
+	}
+	if( topk ) {
+		topk_entry_t* top[topk->k];
+		size_t n = topk_sorted(topk, top), j, k;
+		/* A steady rate r settles at a count of 2 * r * window */
+		double scale = 1.0 / (2.0 * topk_window);
+		for( j = 0; j < n; j++ ) {
+			const char* key = topk_key(topk, top[j]);
+			double total = top[j]->reads + top[j]->writes;
+			stats_printf("hot key=");
+			for( k = 0; k < key_size; k++ ) {
+				stats_printf("%02x", (uint8_t)key[k]);
+			}
+			stats_printf(" reads_per_sec=%.1f writes_per_sec=%.1f error_per_sec=%.1f\n",
+				total ? top[j]->count * scale * (top[j]->reads / total) : 0.0,
+				total ? top[j]->count * scale * (top[j]->writes / total) : 0.0,
+				top[j]->error * scale);
+		}
+	}
+	if( cb ) cb(stats_buf, stats_len, NULL, token);
+	return stats_len;
+}
+
+/**
+ * Operations provided by the server itself, bound like module ops.
+ */
+static struct dbz_op host_ops[] = {
+	{"binlog", 0, NULL, NULL},
+	{"binlog-sync", DBZ_OP_REPLY, (dbzop_t)host_binlog_sync, NULL},
+	{"putex", 0, (dbzop_t)host_putex, NULL},
+	{"incr", DBZ_OP_REPLY, (dbzop_t)host_incr, NULL},
+	{"append", DBZ_OP_REPLY, (dbzop_t)host_append, NULL},
+	{"cas", DBZ_OP_REPLY, (dbzop_t)host_cas, NULL},
+	{"stats", DBZ_OP_REPLY, (dbzop_t)host_stats, NULL},
+	{"backup", DBZ_OP_REPLY, (dbzop_t)host_backup, NULL},
+	{"putblob", DBZ_OP_REPLY, (dbzop_t)host_putblob, NULL},
+	{"getblob", DBZ_OP_REPLY, (dbzop_t)host_getblob, NULL},
+	{"delblob", 0, (dbzop_t)host_delblob, NULL},
+	{"acks", 0, NULL, NULL},
+	{"invalidate", 0, NULL, NULL},
+	{NULL, 0, 0, 0}
+};
+
+static const struct {
+	const char* prefix;
+	int type;
+} bind_types[] = {
+	{"pull@", ZMQ_PULL},
+	{"rep@", ZMQ_REP},
+	{"pub@", ZMQ_PUB},
+	{"router@", ZMQ_ROUTER},
+	{NULL, 0}
+};
+
+
+/**
+ * Per-op setting, e.g. DBZMQ_RCVHWM_BINLOG_SYNC, else the DBZMQ_RCVHWM default.
+ */
+static const char* op_env(const char* prefix, const char* name)
+{
+	char env[128];
+	size_t i, len = strlen(prefix);
+	const char* value;
+
+	if( len + strlen(name) + 2 > sizeof(env) ) return getenv(prefix);
+	memcpy(env, prefix, len);
+	env[len++] = '_';
+	for( i = 0; name[i]; i++ ) {
+		env[len++] = isalnum((unsigned char)name[i]) ? toupper((unsigned char)name[i]) : '_';
+	}
+	env[len] = 0;
+	value = getenv(env);
+	return value ? value : getenv(prefix);
+}
+
+/**
+ * Bound the messages ZeroMQ queues for a socket, so a backlog stays in
+ * the sender's queue (or is dropped by PUB) instead of growing here.
+ *
+ *   DBZMQ_RCVHWM[_<OP>]  Incoming messages queued per peer
+ *   DBZMQ_SNDHWM[_<OP>]  Outgoing messages queued per peer
+ */
+static void dbz_set_hwm(void* sock, const char* name)
+{
+	const char* rcv = op_env("DBZMQ_RCVHWM", name);
+	const char* snd = op_env("DBZMQ_SNDHWM", name);
+#ifdef ZMQ_RCVHWM
+	int hwm;
+	if( rcv ) {
+		hwm = atoi(rcv);
+		if( zmq_setsockopt(sock, ZMQ_RCVHWM, &hwm, sizeof(hwm)) != 0 )
+			warnx("Cannot set receive high-water mark of %s: %s", name, zmq_strerror(zmq_errno()));
+	}
+	if( snd ) {
+		hwm = atoi(snd);
+		if( zmq_setsockopt(sock, ZMQ_SNDHWM, &hwm, sizeof(hwm)) != 0 )
+			warnx("Cannot set send high-water mark of %s: %s", name, zmq_strerror(zmq_errno()));
+	}
+#else
+	/* ZeroMQ 2.x has one limit for both directions, use the larger */
+	uint64_t hwm = 0;
+	if( rcv ) hwm = strtoull(rcv, NULL, 10);
+	if( snd && strtoull(snd, NULL, 10) > hwm ) hwm = strtoull(snd, NULL, 10);
+	if( (rcv || snd) && zmq_setsockopt(sock, ZMQ_HWM, &hwm, sizeof(hwm)) != 0 ) {
+		warnx("Cannot set high-water mark of %s: %s", name, zmq_strerror(zmq_errno()));
+	}
+#endif
+}
+
+static struct dbz_op* dbz_bind(void* zctx, dbz* ctx, const char* name, const char *addr)
+{
+	dbzmq_socket_t *token;
+	void *sock;
+	int sock_type = -1;
+	int i;
+	/* Server ops come first, a module can't hide stats or the binlog */
+	struct dbz_op* op = dbz_op_find(host_ops, name);
+	if( op && dbz_op(ctx, name) ) warnx("Module op %s is hidden by the server's", name);
+	if( ! op ) op = dbz_op(ctx, name);
+	if( ! op ) {
+		warnx("Unknown bind name %s=%s", name, addr);
+		return NULL;
+	}
+	if( nbinds == DBZ_MAX_BINDS ) {
+		warnx("Too many binds, cannot bind %s=%s", name, addr);
+		return NULL;
+	}
+
+	for( i = 0; bind_types[i].prefix; i++ ) {
+		size_t len = strlen(bind_types[i].prefix);
+		if( strncmp(addr, bind_types[i].prefix, len) == 0 ) {
+			sock_type = bind_types[i].type;
+			addr += len;
+			break;
+		}
+	}
+	if( sock_type == -1 ) {
+		warnx("Unknown bind type %s=%s", name, addr);
+		return NULL;
+	}
+
+	if( (sock = zmq_socket(zctx, sock_type)) == NULL ) {
+		warnx("Cannot create socket for '%s': %s", addr, zmq_strerror(zmq_errno()));	
+		return NULL;;
+	} 
+	dbz_set_hwm(sock, name);
+	if( zmq_bind(sock, addr) == -1 ) {
+		warnx("Cannot bind socket '%s': %s", addr, zmq_strerror(zmq_errno()));
+		zmq_close(sock);
+		return NULL;
+	}	
+	token = (dbzmq_socket_t*)malloc(sizeof(dbzmq_socket_t));
+	memset(token, 0, sizeof(dbzmq_socket_t));
+	token->socket = sock;
+	token->type = sock_type;
+	token->op = op;
+	if( ! op->token ) op->token = (void*)token;
+	binds[nbinds++] = token;
+	return op;
+}
+
+static size_t reply_cb(const char* data, size_t len, dbzop_t cb, dbz_request_t* req )
+{
+	assert(req->sock->socket);
+	assert(len > 0);
+
+	request_send(req, data, len, 0);
+	if( ! cb )
+		return len;
+
+	return len + cb(data, len, NULL, req);
+}
+
+/**
+ * Reply to a batch, the module calls it once it knows the status of
+ * each record. Records which were applied go to the binlog.
+ */
+static size_t batch_reply_cb(const char* status, size_t len, dbzop_t cb, dbz_request_t* req)
+{
+	const char* batch = (const char*)zmq_msg_data(&req->msg);
+	size_t size = zmq_msg_size(&req->msg);
+	size_t offset = 0, rec_len, i = 0;
+	const char* rec;
+	char type;
+
+	while( i < len && dbz_record_next(batch, size, &offset, &type, &rec, &rec_len) == 1 ) {
+		if( status[i++] != DBZ_REC_OK ) continue;
+		if( ttl ) ttl_set(ttl, rec, 0);
+		dbz_mutated(type, rec, rec_len);
+	}
+	return reply_cb(status, len, cb, req);
+}
+
+static hotset_t* hotset = NULL;
+static hotset_warmer_t hotset_warmer;
+static const char* hotset_file = NULL;
+static time_t hotset_interval = 300;
+static time_t hotset_saved;
+
+/**
+ * Track read keys and pre-read the previous run's hot keys.
+ *
+ *   DBZMQ_HOTSET_FILE      Snapshot file, enables tracking
+ *   DBZMQ_HOTSET_SIZE      Number of keys to keep (default: 65536)
+ *   DBZMQ_HOTSET_SAMPLE    Record 1 in N gets (default: 16)
+ *   DBZMQ_HOTSET_INTERVAL  Seconds between snapshots (default: 300)
+ *   DBZMQ_HOTSET_PREFETCH  'sync' before binding, 'background' when idle
+ *   DBZMQ_HOTSET_THREADS   Parallel readers for 'sync' (default: 4)
+ */
+static void hotset_setup(void)
+{
+	const char* env;
+	size_t capacity = 65536;
+	uint32_t sample = 16;
+	int threads = 4;
+
+	hotset_file = getenv("DBZMQ_HOTSET_FILE");
+	if( ! hotset_file || ! get_op ) return;
+
+	if( (env = getenv("DBZMQ_HOTSET_SIZE")) ) capacity = atoi(env);
+	if( (env = getenv("DBZMQ_HOTSET_SAMPLE")) ) sample = atoi(env);
+	if( (env = getenv("DBZMQ_HOTSET_INTERVAL")) ) hotset_interval = atoi(env);
+	if( (env = getenv("DBZMQ_HOTSET_THREADS")) ) threads = atoi(env);
+	if( capacity < 1 || threads < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_HOTSET_SIZE or DBZMQ_HOTSET_THREADS");
+	}
+
+	hotset = hotset_new(capacity, key_size, sample);
+	if( ! hotset ) {
+		errx(EXIT_FAILURE, "Cannot allocate hot key set of %zu keys", capacity);
+	}
+	hotset_saved = time(NULL);
+
+	if( ! hotset_warmer_load(&hotset_warmer, hotset_file, key_size, get_op->cb) )
+		return;
+
+	env = getenv("DBZMQ_HOTSET_PREFETCH");
+	if( env && strcmp(env, "background") == 0 ) {
+		warnx("Pre-reading %zu hot keys in background", hotset_warmer.count);
+		return;
+	}
+
+	warnx("Pre-reading %zu hot keys", hotset_warmer.count);
+	if( threads > 1 && (get_op->opts & DBZ_OP_THREADSAFE) ) {
+		hotset_warm_parallel(&hotset_warmer, threads);
+	}
+	else {
+		hotset_warm_step(&hotset_warmer, hotset_warmer.count);
+	}
+	hotset_warmer_free(&hotset_warmer);
+}
+
+/**
+ * k ++ epoch[8] ++ seq[8] ++ type[1], key first so subscribers can
+ * filter by key prefix.
+ */
+static void ack_format(char* out, char type, const char* key, uint64_t epoch, uint64_t seq)
+{
+	memcpy(out, key, key_size);
+	dbz_put64(out + key_size, epoch);
+	dbz_put64(out + key_size + 8, seq);
+	out[key_size + 16] = type;
+}
+
+/**
+ * Note the ack of the mutation just applied.
+ */
+static void ack_append(char type, const char* key)
+{
+	size_t need = ack_used + key_size + 17;
+	if( need > ack_cap ) {
+		ack_cap = ack_cap ? ack_cap * 2 : 4096;
+		if( ack_cap < need ) ack_cap = need;
+		ack_buf = (char*)realloc(ack_buf, ack_cap);
+		assert(ack_buf != NULL);
+	}
+	ack_format(ack_buf + ack_used, type, key, mutation_epoch, mutation_seq);
+	ack_used = need;
+}
+
+/**
+ * Tell subscribers a key has changed, in the same format as an ack.
+ * Dropped rather than waited for when a subscriber is slow.
+ */
+static void invalidate_publish(char type, const char* key, uint64_t epoch, uint64_t seq)
+{
+	zmq_msg_t msg;
+	zmq_msg_init_size(&msg, key_size + 17);
+	ack_format((char*)zmq_msg_data(&msg), type, key, epoch, seq);
+	zmq_send(invalidate_pub, &msg, ZMQ_NOBLOCK);
+	zmq_msg_close(&msg);
+}
+
+static void invalidate_replicated(void* ctx, uint64_t epoch, uint64_t seq, char type, const char* data, size_t len)
+{
+	(void)ctx;
+	if( len >= key_size ) invalidate_publish(type, data, epoch, seq);
+}
+
+/**
+ * Publish the acks noted so far, one message each. Called once the
+ * mutations are durable, so with a WAL only after it has committed.
+ */
+static void acks_publish(void)
+{
+	size_t len = key_size + 17, offset;
+	zmq_msg_t msg;
+	for( offset = 0; offset < ack_used; offset += len ) {
+		zmq_msg_init_size(&msg, len);
+		memcpy(zmq_msg_data(&msg), ack_buf + offset, len);
+		zmq_send(ack_pub, &msg, ZMQ_NOBLOCK);
+		zmq_msg_close(&msg);
+	}
+	ack_used = 0;
+}
+
+/**
+ * Called after the module has applied a put ('P') or del ('D').
+ */
+static void dbz_mutated(char type, const char* data, size_t len)
+{
+	mutation_seq++;
+	if( wal && ! wal_append(wal, type, data, len) ) {
+		errx(EXIT_FAILURE, "Cannot buffer WAL record of %zu bytes", len);
+	}
+	if( ack_pub ) {
+		ack_append(type, data);
+	}
+	if( invalidate_pub ) {
+		invalidate_publish(type, data, mutation_epoch, mutation_seq);
+	}
+	if( binlog ) {
+		binlog_publish(binlog, mutation_seq, type, data, len);
+	}
+}
+
+/**
+ * Has the mutation numbered `seq` by the primary running as `epoch` been
+ * applied here. On a primary which has restarted since, the mutation
+ * was either replayed from the WAL or lost, nothing is worth waiting for.
+ */
+static int seq_applied(uint64_t epoch, uint64_t seq)
+{
+	if( replica ) return epoch == replica->epoch && seq <= replica->seq;
+	return epoch != mutation_epoch || seq <= mutation_seq;
+}
+
+/**
+ * Follow another server's binlog instead of accepting writes.
+ *
+ *   DBZMQ_REPLICA_OF     Primary's binlog address, e.g. ipc:///tmp/dbz.binlog
+ *   DBZMQ_REPLICA_SYNC   Primary's binlog-sync address
+ *   DBZMQ_REPLICA_STATE  File recording the last applied mutation
+ *   DBZMQ_REPLICA_EMPTY  1 when the replica and the primary started with no data
+ *
+ * The replica exits when it can't follow the primary, see binlog.h.
+ */
+static void replica_setup(void* zctx)
+{
+	const char* pub_addr = getenv("DBZMQ_REPLICA_OF");
+	const char* sync_addr = getenv("DBZMQ_REPLICA_SYNC");
+	const char* empty = getenv("DBZMQ_REPLICA_EMPTY");
+	if( ! pub_addr ) return;
+	if( ! sync_addr ) {
+		errx(EXIT_FAILURE, "DBZMQ_REPLICA_OF also needs DBZMQ_REPLICA_SYNC");
+	}
+	if( ! put_op || ! del_op ) {
+		errx(EXIT_FAILURE, "Module cannot put and del, cannot be a replica");
+	}
+	replica = replica_new(zctx, pub_addr, sync_addr, getenv("DBZMQ_REPLICA_STATE"),
+		empty && atoi(empty) == 1, put_op->cb, del_op->cb);
+	if( ! replica ) {
+		errx(EXIT_FAILURE, "Cannot follow '%s'", pub_addr);
+	}
+}
+
+/**
+ * Keep a backlog of mutations when the binlog ops are bound.
+ *
+ *   DBZMQ_BINLOG_BACKLOG  Mutations kept for replicas catching up (default: 65536)
+ */
+static void binlog_setup(void)
+{
+	struct dbz_op* pub = dbz_op_find(host_ops, "binlog");
+	struct dbz_op* sync = dbz_op_find(host_ops, "binlog-sync");
+	const char* env = getenv("DBZMQ_BINLOG_BACKLOG");
+	size_t backlog = env ? (size_t)atoi(env) : 65536;
+
+	if( ! pub->token && ! sync->token ) return;
+	if( replica ) {
+		errx(EXIT_FAILURE, "A replica cannot publish a binlog");
+	}
+	if( backlog < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_BINLOG_BACKLOG");
+	}
+	binlog = binlog_new(mutation_epoch, backlog);
+	if( ! binlog ) {
+		errx(EXIT_FAILURE, "Cannot allocate binlog of %zu mutations", backlog);
+	}
+	if( pub->token ) {
+		binlog->pub = ((dbzmq_socket_t*)pub->token)->socket;
+	}
+}
+
+/**
+ * Publish an ack for each mutation when acks is bound, and let requests
+ * wait for a mutation with a DBZ_HDR_MIN_SEQ header.
+ *
+ *   DBZMQ_MIN_SEQ_WAIT  ms a request waits for its mutation (default: 1000)
+ */
+static void ack_setup(void)
+{
+	struct dbz_op* op = dbz_op_find(host_ops, "acks");
+	const char* env = getenv("DBZMQ_MIN_SEQ_WAIT");
+
+	if( env ) min_seq_wait = atol(env);
+	if( min_seq_wait < 0 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_MIN_SEQ_WAIT");
+	}
+	if( ! op->token ) return;
+	if( replica ) {
+		errx(EXIT_FAILURE, "A replica cannot publish acks");
+	}
+	if( ((dbzmq_socket_t*)op->token)->type != ZMQ_PUB ) {
+		errx(EXIT_FAILURE, "acks must be bound as pub@");
+	}
+	ack_pub = ((dbzmq_socket_t*)op->token)->socket;
+}
+
+/**
+ * Publish the key of every put and del when invalidate is bound, for
+ * clients keeping values in a local cache. Unlike acks this is sent
+ * before the WAL commits, as soon as a get would see the change, and a
+ * replica publishes the mutations it applies, so a client reading from
+ * a replica isn't told before it can read the new value. Subscribers
+ * should forget their cache when epoch changes or seq goes back, as
+ * messages published while they were disconnected are lost, and a
+ * change the WAL hadn't committed when the server crashed is undone.
+ */
+static void invalidate_setup(void)
+{
+	struct dbz_op* op = dbz_op_find(host_ops, "invalidate");
+	if( ! op->token ) return;
+	if( ((dbzmq_socket_t*)op->token)->type != ZMQ_PUB ) {
+		errx(EXIT_FAILURE, "invalidate must be bound as pub@");
+	}
+	invalidate_pub = ((dbzmq_socket_t*)op->token)->socket;
+	if( replica ) {
+		replica->on_apply = invalidate_replicated;
+	}
+}
+
+/**
+ * Expire keys written with putex, enabled when putex is bound.
+ *
+ *   DBZMQ_TTL_FILE   Expiry journal (default: dbz.ttl)
+ *   DBZMQ_TTL_SWEEP  Expired keys deleted per second (default: 1000)
+ */
+static void ttl_setup(void)
+{
+	struct dbz_op* putex = dbz_op_find(host_ops, "putex");
+	const char* filename = getenv("DBZMQ_TTL_FILE");
+	const char* env = getenv("DBZMQ_TTL_SWEEP");
+
+	if( ! putex->token ) return;
+	if( replica ) {
+		errx(EXIT_FAILURE, "A replica cannot bind putex");
+	}
+	if( ! put_op || ! del_op ) {
+		errx(EXIT_FAILURE, "Module cannot put and del, cannot expire keys");
+	}
+	if( env ) ttl_sweep_rate = atoi(env);
+	if( ttl_sweep_rate < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_TTL_SWEEP");
+	}
+	ttl = ttl_open(filename ? filename : "dbz.ttl", key_size, (uint32_t)time(NULL));
+	if( ! ttl ) {
+		errx(EXIT_FAILURE, "Cannot open expiry journal");
+	}
+	if( ttl->count ) {
+		warnx("%zu keys have an expiry time", ttl->count);
+	}
+}
+
+/**
+ * Delete up to `n` expired keys.
+ * @return Number of keys deleted
+ */
+static size_t ttl_sweep(size_t n)
+{
+	char key[0x100];
+	const char* expired;
+	size_t done = 0;
+
+	while( done < n && (expired = ttl_peek_expired(ttl)) != NULL ) {
+		memcpy(key, expired, key_size);
+		if( del_op->cb(key, key_size, NULL, NULL) > 0 ) {
+			dbz_mutated('D', key, key_size);
+		}
+		ttl_set(ttl, key, 0);
+		done++;
+	}
+	return done;
+}
+
+/**
+ * incr, append and cas, see merge.h.
+ *
+ *   DBZMQ_MERGE_BATCH  Merges applied before their keys are written (default: 256)
+ */
+static void merge_setup(void)
+{
+	const char* names[] = {"incr", "append", "cas", NULL};
+	const char* env = getenv("DBZMQ_MERGE_BATCH");
+	int i, bound = 0;
+
+	for( i = 0; names[i]; i++ ) {
+		bound |= dbz_op_find(host_ops, names[i])->token != NULL;
+	}
+	if( ! bound ) return;
+	if( replica ) {
+		errx(EXIT_FAILURE, "A replica cannot bind incr, append or cas");
+	}
+	if( ! get_op || ! put_op ) {
+		errx(EXIT_FAILURE, "Module cannot get and put, cannot merge");
+	}
+	if( env ) merge_batch = strtoul(env, NULL, 10);
+	if( merge_batch < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_MERGE_BATCH");
+	}
+	merges = merge_new(key_size, merge_batch);
+	staged = (merge_staged_t*)malloc(merge_batch * sizeof(merge_staged_t));
+	merge_status = (char*)malloc(merge_batch);
+	assert(merges != NULL && staged != NULL && merge_status != NULL);
+}
+
+/**
+ * Track the most requested keys for the stats op.
+ *
+ *   DBZMQ_TOPK         Hot keys to report, 0 to disable (default: 16)
+ *   DBZMQ_TOPK_WINDOW  Seconds between halving counts (default: 10)
+ */
+static void topk_setup(void)
+{
+	const char* env = getenv("DBZMQ_TOPK");
+	int k = env ? atoi(env) : 16;
+	if( (env = getenv("DBZMQ_TOPK_WINDOW")) ) topk_window = atoi(env);
+	if( k < 0 || topk_window < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_TOPK or DBZMQ_TOPK_WINDOW");
+	}
+	if( ! k ) return;
+	topk = topk_new(k, key_size);
+	if( ! topk ) {
+		errx(EXIT_FAILURE, "Cannot allocate hot key counters");
+	}
+}
+
+/**
+ * Stream backups from the module's snapshot op, enabled when backup is bound.
+ *
+ *   DBZMQ_BACKUP_CHUNK  Bytes read per chunk (default: 65536)
+ *   DBZMQ_BACKUP_RATE   Bytes sent per second, 0 for no limit (default: 16777216)
+ */
+static void backup_setup(void* zctx, dbz* ctx)
+{
+	struct dbz_op* op = dbz_op_find(host_ops, "backup");
+	struct dbz_op* snapshot = dbz_op(ctx, "snapshot");
+	const char* env = getenv("DBZMQ_BACKUP_CHUNK");
+	long chunk = env ? atol(env) : 65536;
+	unsigned long long rate = 16 * 1024 * 1024;
+
+	if( ! op->token ) return;
+	if( ! snapshot ) {
+		errx(EXIT_FAILURE, "Module has no snapshot op, cannot back up");
+	}
+	if( (env = getenv("DBZMQ_BACKUP_RATE")) ) rate = strtoull(env, NULL, 10);
+	if( chunk < 1 || chunk > 0x7FFFFFFF ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_BACKUP_CHUNK");
+	}
+	backup = backup_new(zctx, snapshot->cb, key_size, (size_t)chunk, rate);
+	if( ! backup ) {
+		errx(EXIT_FAILURE, "Cannot allocate backup");
+	}
+}
+
+/**
+ * Large values in chunks, enabled when putblob, getblob or delblob is bound.
+ *
+ *   DBZMQ_BLOB_CHUNK    Largest chunk accepted in bytes (default: 262144)
+ *   DBZMQ_BLOB_UPLOADS  Uploads in progress at once (default: 64)
+ *   DBZMQ_BLOB_TIMEOUT  Seconds before an idle upload is abandoned (default: 60)
+ */
+static void blob_setup(void)
+{
+	struct dbz_op* putblob = dbz_op_find(host_ops, "putblob");
+	struct dbz_op* getblob = dbz_op_find(host_ops, "getblob");
+	struct dbz_op* delblob = dbz_op_find(host_ops, "delblob");
+	const char* env = getenv("DBZMQ_BLOB_CHUNK");
+	long uploads = 64, timeout = 60;
+
+	if( ! putblob->token && ! getblob->token && ! delblob->token ) return;
+	if( replica && (putblob->token || delblob->token) ) {
+		errx(EXIT_FAILURE, "A replica cannot bind putblob or delblob");
+	}
+	if( ! get_op || ! put_op || ! del_op ) {
+		errx(EXIT_FAILURE, "Module cannot get, put and del, cannot store blobs");
+	}
+	if( env ) blob_chunk_max = strtoul(env, NULL, 10);
+	if( (env = getenv("DBZMQ_BLOB_UPLOADS")) ) uploads = atol(env);
+	if( (env = getenv("DBZMQ_BLOB_TIMEOUT")) ) timeout = atol(env);
+	if( blob_chunk_max < 1 || uploads < 1 || timeout < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_BLOB_CHUNK, DBZMQ_BLOB_UPLOADS or DBZMQ_BLOB_TIMEOUT");
+	}
+	blobs = blob_uploads_new(key_size, uploads, timeout);
+	if( ! blobs ) {
+		errx(EXIT_FAILURE, "Cannot allocate blob uploads");
+	}
+#ifdef ZMQ_MAXMSGSIZE
+	{
+		/* Refuse oversized chunks before they are read into memory */
+		int64_t max = key_size + 13 + blob_chunk_max;
+		int i;
+		for( i = 0; i < nbinds; i++ ) {
+			if( binds[i]->op == putblob )
+				zmq_setsockopt(binds[i]->socket, ZMQ_MAXMSGSIZE, &max, sizeof(max));
+		}
+	}
+#endif
+}
+
+/**
+ * Commit buffered mutations to the WAL, then empty it once it has grown
+ * past the checkpoint size and the module has synced.
+ */
+static void wal_flush(void)
+{
+	if( ! wal_commit(wal) ) {
+		errx(EXIT_FAILURE, "Cannot commit WAL, stopping before more writes are lost");
+	}
+	if( ack_pub ) acks_publish();
+	if( binlog ) binlog_release(binlog);
+	if( wal->size >= wal_checkpoint && sync_op->cb(NULL, 0, NULL, NULL) ) {
+		wal_truncate(wal);
+	}
+}
 
 /**
- * Initialize with set of operations.
+ * Log mutations to a WAL before they count as durable, and replay it
+ * into the module on start.
+ *
+ *   DBZMQ_WAL_FILE        Log file, enables the WAL
+ *   DBZMQ_WAL_INTERVAL    ms between commits, 0 to commit after every poll (default: 0)
+ *   DBZMQ_WAL_CHECKPOINT  Bytes before the module is synced and the log emptied (default: 67108864)
  */
-dbz* dbz_init(struct dbz_op* ops)
+static void wal_setup(dbz* ctx)
 {
-	dbz* x = (dbz*)malloc(sizeof(dbz));
-	assert(x != NULL);
-	if(!x) return NULL;
+	const char* filename = getenv("DBZMQ_WAL_FILE");
+	const char* env = getenv("DBZMQ_WAL_INTERVAL");
+	long replayed;
 
-	memset(x, 0, sizeof(dbz));
-	x->ops = ops;
-	return x;
+	if( ! filename ) return;
+	if( replica ) {
+		errx(EXIT_FAILURE, "A replica cannot keep a WAL");
+	}
+	if( ! put_op || ! del_op ) {
+		errx(EXIT_FAILURE, "Module cannot put and del, cannot keep a WAL");
+	}
+	sync_op = dbz_op(ctx, "sync");
+	if( ! sync_op ) {
+		errx(EXIT_FAILURE, "Module has no sync op, cannot keep a WAL");
+	}
+	if( env ) wal_interval = atol(env);
+	if( (env = getenv("DBZMQ_WAL_CHECKPOINT")) ) wal_checkpoint = strtoull(env, NULL, 10);
+	if( wal_interval < 0 || wal_checkpoint < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_WAL_INTERVAL or DBZMQ_WAL_CHECKPOINT");
+	}
+
+	wal = wal_open(filename);
+	if( ! wal ) {
+		errx(EXIT_FAILURE, "Cannot open WAL");
+	}
+	replayed = wal_replay(wal, put_op->cb, del_op->cb);
+	if( replayed < 0 ) {
+		errx(EXIT_FAILURE, "Cannot replay WAL '%s'", filename);
+	}
+	if( replayed ) {
+		warnx("Replayed %ld mutations from '%s'", replayed, filename);
+	}
+	if( wal->size && sync_op->cb(NULL, 0, NULL, NULL) ) {
+		wal_truncate(wal);
+	}
+	/* Replicas only hear of what the WAL has committed */
+	if( binlog ) binlog->hold = 1;
 }
 
 /**
- * Open a .so file which exports "i_speak_db"
- * @return Database handle
+ * Sample requests for tracing, see trace.h. The records are written to
+ * DBZMQ_TRACE_FILE on SIGUSR1, or returned by the stats op when asked
+ * for "trace".
+ *
+ *   DBZMQ_TRACE_SAMPLE  Trace 1 in N requests, 0 to disable (default: 0)
+ *   DBZMQ_TRACE_RING    Records kept (default: 4096)
+ *   DBZMQ_TRACE_FILE    File written on SIGUSR1 (default: dbz.trace.json)
  */
-dbz* dbz_open(const char *filename)
+static void trace_setup(void)
 {
-	mod_init_fn f = NULL;
-	dbz* x = dbz_init(NULL);
-	x->mod = dlopen(filename, RTLD_LAZY);
-	if( ! x->mod ) {
-		warnx("Cannot dlopen(%p, '%s') = %s", x->mod, filename, dlerror());
-		free(x);
-		return NULL;
+	const char* env = getenv("DBZMQ_TRACE_SAMPLE");
+	long sample = env ? atol(env) : 0;
+	long ring = 4096;
+
+	if( (env = getenv("DBZMQ_TRACE_RING")) ) ring = atol(env);
+	if( sample < 0 || ring < 1 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_TRACE_SAMPLE or DBZMQ_TRACE_RING");
 	}
-    f = (mod_init_fn)dlsym(x->mod, "i_speak_db");
-    if( ! f ) {
-    	warnx("Cannot dlsym(%p, 'i_speak_db') = %s", x->mod, dlerror());
-    	dlclose(x->mod);
-    	x->mod = NULL;
-    	free(x);
-    	return NULL;
-    }
+	trace_file = getenv("DBZMQ_TRACE_FILE");
+	if( ! trace_file ) trace_file = "dbz.trace.json";
+	trace_init((uint32_t)sample, (size_t)ring);
+}
 
-    x->ops = (struct dbz_op*)f();
-    return x;
+static void trace_dump(void)
+{
+	size_t len = 0;
+	char* json = trace_json(&len);
+	FILE* f;
+
+	if( ! json ) {
+		warnx("Cannot render trace");
+		return;
+	}
+	f = fopen(trace_file, "w");
+	if( ! f || fwrite(json, 1, len, f) != len ) {
+		warnx("Cannot write trace to '%s'", trace_file);
+	}
+	else {
+		warnx("Wrote %zu traced requests to '%s'", trace_count(), trace_file);
+	}
+	if( f ) fclose(f);
+	free(json);
+}
+
+static void memory_setup(dbz* ctx)
+{
+	const char* env = getenv("DBZMQ_MEMORY_LIMIT");
+	uint64_t limit = env ? strtoull(env, NULL, 10) : 0;
+	int trim = 90;
+
+	env = getenv("DBZMQ_MEMORY_TRIM");
+	if( env ) trim = atoi(env);
+	if( trim < 1 || trim > 100 ) {
+		errx(EXIT_FAILURE, "Invalid DBZMQ_MEMORY_TRIM");
+	}
+	memory = memory_new(limit, (unsigned)trim);
+	assert(memory != NULL);
+	memory_op = dbz_op(ctx, "memory");
+	if( limit && ! memory_rss() ) {
+		warnx("Cannot read the resident size, DBZMQ_MEMORY_LIMIT applies to memory the server can attribute");
+	}
 }
 
 /**
- * Find an operation with matching name.
+ * Add up what each part of the server holds, from the sizes of its
+ * tables. ZeroMQ's own queues are not counted, the high-water marks
+ * bound them.
+ */
+static void memory_measure(void)
+{
+	uint64_t* parts = memory->parts;
+
+	parts[MEMORY_ZMQ] = zmq_held;
+	parts[MEMORY_MODULE] = memory_op ? memory_op->cb(NULL, 0, NULL, NULL) : 0;
+	parts[MEMORY_BINLOG] = binlog ? binlog->capacity * sizeof(binlog_entry_t) + binlog->bytes : 0;
+	parts[MEMORY_HOTSET] = 0;
+	if( hotset ) {
+		parts[MEMORY_HOTSET] += hotset->capacity * (hotset->key_size + sizeof(uint8_t) + sizeof(uint32_t))
+			+ (hotset->bucket_mask + 1) * sizeof(uint32_t);
+	}
+	if( hotset_warmer.keys ) {
+		parts[MEMORY_HOTSET] += hotset_warmer.count * hotset_warmer.key_size;
+	}
+	parts[MEMORY_TOPK] = topk ? sizeof(topk_t) + topk->k * (sizeof(topk_entry_t) + topk->key_size) : 0;
+	parts[MEMORY_TTL] = ttl ? ttl->capacity * (sizeof(ttl_entry_t) + ttl->key_size)
+		+ (ttl->bucket_mask + 1) * sizeof(uint32_t) : 0;
+	parts[MEMORY_TRACE] = trace_memory();
+	parts[MEMORY_BLOBS] = blobs ? blobs->capacity * (sizeof(blob_upload_t) + blobs->key_size) : 0;
+	parts[MEMORY_BUFFERS] = arena.size
+		+ (queue_cap + parked_cap) * sizeof(dbz_request_t)
+		+ stats_cap + ack_cap + (wal ? wal->cap : 0)
+		+ (merges ? merge_batch * (sizeof(merge_staged_t) + sizeof(merge_value_t) + 1) + merge_buf_cap : 0);
+}
+
+/**
+ * Measure, then trim or start shedding writes as DBZMQ_MEMORY_LIMIT
+ * is approached, see memory.h.
+ */
+static void memory_check(void)
+{
+	int was = memory->state;
+
+	memory_measure();
+	if( memory_update(memory) == MEMORY_OK ) {
+		if( was != MEMORY_OK ) warnx("Memory back under %llu bytes", (unsigned long long)memory->trim_at);
+		return;
+	}
+	if( memory->state != was ) {
+		warnx("Memory at %llu of %llu bytes, %s", (unsigned long long)memory->rss, (unsigned long long)memory->limit,
+			memory->state == MEMORY_SHED ? "refusing writes" : "trimming caches");
+	}
+	memory->trims++;
+	if( memory_op ) memory_op->cb("trim", 4, NULL, NULL);
+	if( memory->state == MEMORY_SHED && binlog ) binlog_trim(binlog, binlog->count / 2);
+	memory_release();
+}
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/**
+ * Periodic work, called between polls.
+ * @param idle Nothing was received on the last poll
+ */
+static void dbz_tick(int idle)
+{
+	static time_t last_second;
+	static size_t ttl_budget;
+	static time_t topk_decayed;
+	time_t now = time(NULL);
+
+	if( trace_dump_pending ) {
+		trace_dump_pending = 0;
+		trace_dump();
+	}
+
+	if( hotset_warmer.keys && idle ) {
+		if( ! hotset_warm_step(&hotset_warmer, 64) ) {
+			warnx("Pre-read %zu hot keys", hotset_warmer.done);
+			hotset_warmer_free(&hotset_warmer);
+		}
+	}
+
+	if( hotset && now - hotset_saved >= hotset_interval ) {
+		hotset_save(hotset, hotset_file);
+		hotset_saved = now;
+	}
+
+	if( now != last_second ) {
+		last_second = now;
+		if( replica ) replica_save(replica);
+		if( ttl ) {
+			ttl_flush(ttl);
+			ttl_advance(ttl, (uint32_t)now);
+			ttl_budget = ttl_sweep_rate;
+		}
+		affinity_scan();
+		if( blobs ) {
+			blob_upload_t* up;
+			while( (up = blob_upload_expired(blobs, now)) != NULL ) {
+				warnx("Abandoned upload after %u chunks", up->next_seq);
+				blob_abort(up);
+			}
+		}
+		if( topk && now - topk_decayed >= topk_window ) {
+			topk_decay(topk);
+			topk_decayed = now;
+		}
+		memory_check();
+	}
+
+	if( backup ) backup_step(backup);
+
+	if( wal && wal->pending ) {
+		static uint64_t committed;
+		uint64_t ms = now_ms();
+		if( ms - committed >= (uint64_t)wal_interval ) {
+			wal_flush();
+			committed = ms;
+		}
+	}
+
+	/* Spread deletes over the second, in bigger batches when idle */
+	if( ttl && ttl_budget && ttl->expired ) {
+		size_t batch = idle ? 256 : 16;
+		if( batch > ttl_budget ) batch = ttl_budget;
+		ttl_budget -= ttl_sweep(batch);
+	}
+}
+
+
+static void request_header(dbz_request_t* req, const char* data, size_t size)
+{
+	if( size == 9 && data[0] == DBZ_HDR_DEADLINE ) {
+		req->deadline = dbz_get64(data + 1);
+	}
+	else if( size == 17 && data[0] == DBZ_HDR_MIN_SEQ ) {
+		req->min_epoch = dbz_get64(data + 1);
+		req->min_seq = dbz_get64(data + 9);
+	}
+}
+
+/**
+ * Bytes of the messages making up a request, counted in MEMORY_ZMQ.
+ */
+static size_t request_bytes(dbz_request_t* req)
+{
+	size_t bytes = zmq_msg_size(&req->msg);
+	int i;
+	for( i = 0; i < req->nroute; i++ ) {
+		bytes += zmq_msg_size(&req->route[i]);
+	}
+	return bytes;
+}
+
+static void request_free(dbz_request_t* req)
+{
+	int i;
+	zmq_held -= request_bytes(req);
+	for( i = 0; i < req->nroute; i++ ) {
+		zmq_msg_close(&req->route[i]);
+	}
+	zmq_msg_close(&req->msg);
+}
+
+/**
+ * Read one request from `sock` without waiting.
  *
- * Human readable type informaion can be appended to
- * the name when defining an operation.
+ * Requests on router sockets are framed as identity ++ request id ++
+ * headers ++ payload, the identity is added by ZeroMQ and the request id
+ * is chosen by the client (usually a DEALER socket). The reply carries
+ * the same identity and request id, so a client can have many requests
+ * in flight on one connection and match replies in any order. Other
+ * sockets take headers ++ payload.
  *
- * Providing just "get" or "put" will match these correctly:
- *   "get (kN) -> k ++ vN || k"
- *   "put (kNvN) -> k ++ v || k"
+ * @return 1 for a request, 0 if there was none, -1 if it was discarded
  */
-struct dbz_op* dbz_op(dbz* ctx, const char* name)
+static int request_recv(dbzmq_socket_t* sock, dbz_request_t* req)
 {
-	struct dbz_op* f = ctx->ops;
-	const char *x;
-	while( f->name ) {
-		if( strcmp(f->name, name) == 0 ) {
-			x = f->name + strlen(name);
-			if( *x == 0 || *x == ' ')
-				return f;
+	int64_t more;
+	size_t more_sz;
+
+	assert(sock->socket);
+	memset(req, 0, sizeof(dbz_request_t));
+	req->arena = &arena;
+	req->sock = sock;
+	zmq_msg_init(&req->msg);
+
+	if( zmq_recv(sock->socket, &req->msg, ZMQ_NOBLOCK) != 0 ) {
+		zmq_msg_close(&req->msg);
+		return 0;
+	}
+
+	/* The payload is the last frame */
+	for(;;) {
+		more = 0;
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock->socket, ZMQ_RCVMORE, &more, &more_sz);
+		if( ! more ) break;
+		if( sock->type == ZMQ_ROUTER && req->nroute < 2 ) {
+			zmq_msg_init(&req->route[req->nroute]);
+			zmq_msg_move(&req->route[req->nroute++], &req->msg);
 		}
-		f++;
+		else {
+			request_header(req, (const char*)zmq_msg_data(&req->msg), zmq_msg_size(&req->msg));
+		}
+		zmq_msg_close(&req->msg);
+		zmq_msg_init(&req->msg);
+		if( zmq_recv(sock->socket, &req->msg, 0) != 0 ) break;
 	}
-	return NULL;
+
+	zmq_held += request_bytes(req);
+	sock->calls += 1;
+	if( sock->type == ZMQ_ROUTER && req->nroute < 2 ) {
+		/* No request id, nothing to answer with */
+		request_free(req);
+		return -1;
+	}
+	sock->bytes_in += zmq_msg_size(&req->msg);
+	if( trace_sample && trace_sampled() ) {
+		req->traced = 1;
+		req->trace.poll = poll_ns;
+		req->trace.recv = trace_now();
+	}
+	return 1;
 }
 
 /**
- * Close handle, unload module
+ * Answer a request without running it, with a status frame followed by
+ * the key.
  */
-int dbz_close(dbz* ctx)
+static void request_refuse(dbz_request_t* req, const char* status)
 {
-	assert(ctx != NULL);
-	if( ctx->mod ) dlclose(ctx->mod);
-	memset(ctx, 0, sizeof(dbz));
-	free(ctx);
-	return 1;
+	size_t size = zmq_msg_size(&req->msg);
+	request_send(req, status, strlen(status), 1);
+	request_send(req, (const char*)zmq_msg_data(&req->msg), size < key_size ? size : key_size, 0);
 }
 
-static struct dbz_op* dbz_bind(void* zctx, dbz* ctx, const char* name, const char *addr)
+/**
+ * Answer a request which is past its deadline with an overload status.
+ */
+static void request_shed(dbz_request_t* req)
 {
-	dbzmq_socket_t *token;
-	void *sock;
-	int sock_type;
-	struct dbz_op* op = dbz_op(ctx, name);
-	if( ! op->name ) {
-		warnx("Unknown bind name %s=%s", name, addr);
-		return NULL;
+	req->sock->shed += 1;
+	request_refuse(req, DBZ_STATUS_OVERLOAD);
+}
+
+/**
+ * Pass a request to its op.
+ */
+static void request_run(dbz_request_t* req)
+{
+	struct dbz_op* op = req->sock->op;
+	const char* data = (const char*)zmq_msg_data(&req->msg);
+	size_t size = zmq_msg_size(&req->msg);
+	size_t ret;
+
+	assert(op->cb);
+	if( req->deadline && req->deadline < now_ms() ) {
+		request_shed(req);
+		return;
+	}
+	if( memory->state == MEMORY_SHED && (op == put_op || op == batch_op
+	 || op->cb == (dbzop_t)host_putex || op->cb == (dbzop_t)host_putblob || op_is_merge(op)) ) {
+		memory->rejected++;
+		request_shed(req);
+		return;
 	}
 
-	if( strncmp(addr, "pull@", 5) == 0 ) {
-		sock_type = ZMQ_PULL;
-		addr += 5;
+	if( hotset && op == get_op ) {
+		hotset_touch(hotset, data, size);
+	}
+	if( topk && size >= key_size ) {
+		if( op == get_op ) topk_touch(topk, data, 0);
+		else if( op == put_op || op == del_op || op->cb == (dbzop_t)host_putex || op_is_merge(op) ) topk_touch(topk, data, 1);
 	}
-	else if( strncmp(addr, "rep@", 4) == 0 ) {
-		sock_type = ZMQ_REP;
-		addr += 4;
+	if( ttl && op == get_op && size >= key_size && ttl_expired(ttl, data, (uint32_t)time(NULL)) ) {
+		/* Not deleted yet, but gone as far as clients are concerned */
+		request_send(req, data, key_size, 0);
+		ret = 0;
 	}
 	else {
-		warnx("Unknown bind type %s=%s", name, addr);
-		return NULL;
+		ret = op->cb(data, size, op == batch_op ? (void*)batch_reply_cb : (void*)reply_cb, req);
+	}
+	if( op == put_op && ret == size ) {
+		if( ttl ) ttl_set(ttl, data, 0);
+		dbz_mutated('P', data, size);
+	}
+	else if( op == del_op && ret > 0 ) {
+		if( ttl ) ttl_set(ttl, data, 0);
+		dbz_mutated('D', data, size);
 	}
+}
 
-	if( (sock = zmq_socket(zctx, sock_type)) == NULL ) {
-		warnx("Cannot create socket for '%s': %s", addr, zmq_strerror(zmq_errno()));	
-		return NULL;;
-	} 
-	if( zmq_bind(sock, addr) == -1 ) {
-		warnx("Cannot bind socket '%s': %s", addr, zmq_strerror(zmq_errno()));
-		zmq_close(sock);
-		return NULL;
-	}	
-	token = (dbzmq_socket_t*)malloc(sizeof(dbzmq_socket_t));
-	memset(token, 0, sizeof(dbzmq_socket_t));
-	token->socket = sock;
-	op->token = (void*)token;
-	return op;
+/**
+ * Read waiting requests into the queue, one from each readable socket
+ * in turn so a backlog of one op doesn't hold up the others. Requests
+ * beyond the queue are left with ZeroMQ, bounded by its high-water marks.
+ */
+static void queue_fill(zmq_pollitem_t* items, dbzmq_socket_t** socks, int n)
+{
+	int i, rc, active = 1;
+	uint64_t now = 0;
+
+	while( active && queue_len < queue_cap ) {
+		active = 0;
+		for( i = 0; i < n && queue_len < queue_cap; i++ ) {
+			dbz_request_t* req = &queue[queue_len];
+			if( ! socks[i] || ! (items[i].revents & ZMQ_POLLIN) ) continue;
+			rc = request_recv(socks[i], req);
+			/* REP must answer before it can read the next request */
+			if( rc == 0 || socks[i]->type == ZMQ_REP ) {
+				items[i].revents = 0;
+			}
+			if( rc == 0 ) continue;
+			active = 1;
+			if( rc < 0 ) continue;
+			if( req->deadline ) {
+				if( ! now ) now = now_ms();
+				if( req->deadline < now ) {
+					request_shed(req);
+					request_free(req);
+					continue;
+				}
+			}
+			queue_len++;
+		}
+	}
 }
 
-static size_t reply_cb(const char* data, size_t len, dbzop_t cb, dbzmq_socket_t* token )
+/**
+ * Finish the trace record of a sampled request.
+ */
+static void request_traced(dbz_request_t* req)
 {
-	zmq_msg_t msg;	
-	assert(token->socket);
-	assert(len > 0);
+	size_t size = zmq_msg_size(&req->msg);
+	req->trace.done = trace_now();
+	req->trace.op = req->sock->op->name;
+	req->trace.key_hash = trace_hash((const char*)zmq_msg_data(&req->msg), size < key_size ? size : key_size);
+	trace_commit(&req->trace);
+}
 
-	zmq_msg_init_size(&msg, len);
-	memcpy(zmq_msg_data(&msg), data, len);
-	zmq_send(token->socket, &msg, 0);
-	zmq_msg_close(&msg);
+/**
+ * Run a request and release it.
+ */
+static void request_dispatch(dbz_request_t* req)
+{
+	/* Merges so far are written before anything else sees their keys */
+	if( merges && merges->count && ! op_is_merge(req->sock->op) ) merge_flush();
+	if( req->traced ) req->trace.run = trace_now();
+	request_run(req);
+	if( req->traced ) request_traced(req);
+	request_free(req);
+	arena.used = 0;
+}
 
-	token->bytes_out += len;
-	if( ! cb )
-		return len;
+/**
+ * Move a request, ZeroMQ messages can't be copied as plain structs.
+ */
+static void request_move(dbz_request_t* dst, dbz_request_t* src)
+{
+	int i;
+	*dst = *src;
+	for( i = 0; i < src->nroute; i++ ) {
+		zmq_msg_init(&dst->route[i]);
+		zmq_msg_move(&dst->route[i], &src->route[i]);
+	}
+	zmq_msg_init(&dst->msg);
+	zmq_msg_move(&dst->msg, &src->msg);
+}
 
-	return len + cb(data, len, NULL, token);
+/**
+ * Hold a request until the mutation it waits for has been applied, or
+ * until DBZMQ_MIN_SEQ_WAIT or its deadline passes.
+ */
+static void request_park(dbz_request_t* req)
+{
+	dbz_request_t* p;
+	if( parked_len == parked_cap ) {
+		parked_cap = parked_cap ? parked_cap * 2 : 16;
+		parked = (dbz_request_t*)realloc(parked, parked_cap * sizeof(dbz_request_t));
+		assert(parked != NULL);
+	}
+	p = &parked[parked_len++];
+	request_move(p, req);
+	p->wait_until = now_ms() + min_seq_wait;
+	if( p->deadline && p->deadline < p->wait_until ) p->wait_until = p->deadline;
+	p->sock->parked++;
+	wait_stats.waited++;
 }
 
-static void handle_POLLIN(dbzop_t cb, dbzmq_socket_t* token)
+/**
+ * Run parked requests whose mutation has been applied, and refuse those
+ * which waited too long with a timeout status.
+ */
+static void parked_run(void)
 {
-	zmq_msg_t msg;
-	int rc = zmq_msg_init(&msg);
+	size_t i, kept = 0;
+	uint64_t now = now_ms();
 
-	assert(rc==0);
-	if(rc!=0) return;
+	for( i = 0; i < parked_len; i++ ) {
+		dbz_request_t* req = &parked[i];
+		if( seq_applied(req->min_epoch, req->min_seq) ) {
+			req->sock->parked--;
+			request_dispatch(req);
+		}
+		else if( req->wait_until <= now ) {
+			req->sock->parked--;
+			wait_stats.timeouts++;
+			request_refuse(req, DBZ_STATUS_TIMEOUT);
+			request_free(req);
+		}
+		else {
+			if( kept != i ) request_move(&parked[kept], req);
+			kept++;
+		}
+	}
+	parked_len = kept;
+	if( merges && merges->count ) merge_flush();
+}
 
-	assert(token);
-	assert(token->socket);
-	assert(cb);
-	if( ! zmq_recv(token->socket, &msg, ZMQ_NOBLOCK) ) {
-		token->calls += 1;
-		token->bytes_in += zmq_msg_size(&msg);
-		cb((const char*)zmq_msg_data(&msg), zmq_msg_size(&msg), (void*)reply_cb, token);
+static void queue_run(void)
+{
+	size_t i;
+	for( i = 0; i < queue_len; i++ ) {
+		dbz_request_t* req = &queue[i];
+		if( req->min_seq && ! seq_applied(req->min_epoch, req->min_seq) ) {
+			request_park(req);
+			request_free(req);
+			continue;
+		}
+		request_dispatch(req);
 	}
-	zmq_msg_close(&msg);
+	queue_len = 0;
+	if( merges && merges->count ) merge_flush();
 }
 
 static int dbz_run(dbz* ctx)
@@ -177,29 +2131,50 @@ static int dbz_run(dbz* ctx)
 	ctx->running = 1;
 	int fc = 0;
 	int i;
-	struct dbz_op* f = ctx->ops;
-	while( (f++)->name ) {
-		fc++;
+	zmq_pollitem_t items[DBZ_MAX_BINDS + 1];
+	dbzmq_socket_t* item_socks[DBZ_MAX_BINDS + 1];
+
+	memset(&items[0], 0, sizeof(items));
+	for( i = 0; i < nbinds; i++ ) {
+		if( binds[i]->type == ZMQ_PUB ) continue;
+		items[fc].socket = binds[i]->socket;
+		items[fc].events = ZMQ_POLLIN;
+		item_socks[fc++] = binds[i];
+	}
+	if( replica ) {
+		items[fc].socket = replica->sub;
+		items[fc].events = ZMQ_POLLIN;
+		item_socks[fc++] = NULL;
 	}
-	zmq_pollitem_t items[fc];
 
 	while( ctx->running == 1 ) {
-		memset(&items[0], 0, sizeof(zmq_pollitem_t) * fc);
+		/* Don't wait while there is background work */
+		long timeout = hotset_warmer.keys ? 0
+			: ((backup && backup->push) || (wal && wal->pending) || parked_len) ? 1000 : 9001;
 		for( i = 0; i < fc; i++ ) {
-			items[i].socket = ((dbzmq_socket_t*)(ctx->ops[i].token))->socket;
-			items[i].fd = 0;
-			items[i].events = ZMQ_POLLIN;
 			items[i].revents = 0;
+			/* REP can't read another request until the parked one is answered */
+			if( item_socks[i] && item_socks[i]->type == ZMQ_REP ) {
+				items[i].events = item_socks[i]->parked ? 0 : ZMQ_POLLIN;
+			}
 		}
 	
-		int rc = zmq_poll(items, fc, /*over*/9001);
+		int rc = zmq_poll(items, fc, /*over*/timeout);
+		if( trace_sample ) poll_ns = trace_now();
 		if( rc > 0 ) {
 			for( i = 0; i < fc; i++ ) {
-				if( items[i].revents & ZMQ_POLLIN ){	
-					handle_POLLIN(ctx->ops[i].cb, (dbzmq_socket_t*)ctx->ops[i].token);
+				if( ! item_socks[i] && (items[i].revents & ZMQ_POLLIN) && replica_pull(replica) < 0 ) {
+					errx(EXIT_FAILURE, "Replica no longer matches the primary, start it again from a copy of its data");
 				}
-			}	
+			}
+			queue_fill(items, item_socks, fc);
+			queue_run();
+			/* Group commit of everything this poll applied */
+			if( wal && ! wal_interval && wal->pending ) wal_flush();
 		}		
+		dbz_tick(rc <= 0);
+		if( parked_len ) parked_run();
+		if( ack_pub && ! wal ) acks_publish();
 	}
 	return ctx->running;
 }
@@ -207,6 +2182,12 @@ static int dbz_run(dbz* ctx)
 static dbz* d = NULL;
 static struct sigaction old_action;
 
+static void trace_handler(int sig_no)
+{
+	(void)sig_no;
+	trace_dump_pending = 1;
+}
+
 static void ctrl_c_handler(int sig_no)
 {
 	if( sig_no == SIGINT ){		
@@ -222,11 +2203,16 @@ static void setup_handlers()
 	memset(&act, 0, sizeof(act));
 	act.sa_handler = &ctrl_c_handler;
 	sigaction(SIGINT, &act, &old_action);
+	if( trace_sample ) {
+		act.sa_handler = &trace_handler;
+		sigaction(SIGUSR1, &act, NULL);
+	}
 }
 
 int main(int argc, char **argv)
 {
-	int i, ok;
+	int i, ok = 0;
+	int io_threads;
 	void *zctx;
 
 	if( argc < 2 ) {	
@@ -235,7 +2221,72 @@ int main(int argc, char **argv)
 		fprintf(stderr,
 			"     get=rep@tcp://127.0.0.1:17700 \\\n"
 			"     put=pull@tcp://127.0.0.1:17701 \\\n"
-			"     del=pull@tcp://127.0.0.1:17702 &\n"
+			"     del=pull@tcp://127.0.0.1:17702 \\\n"
+			"     get=router@tcp://127.0.0.1:17703 \\\n"
+			"     putex=pull@tcp://127.0.0.1:17704 \\\n"
+			"     incr=router@tcp://127.0.0.1:17714 \\\n"
+			"     append=router@tcp://127.0.0.1:17717 \\\n"
+			"     cas=router@tcp://127.0.0.1:17718 \\\n"
+			"     batch=rep@tcp://127.0.0.1:17706 \\\n"
+			"     backup=rep@tcp://127.0.0.1:17707 \\\n"
+			"     putblob=router@tcp://127.0.0.1:17709 \\\n"
+			"     getblob=router@tcp://127.0.0.1:17711 \\\n"
+			"     delblob=pull@tcp://127.0.0.1:17712 \\\n"
+			"     acks=pub@tcp://127.0.0.1:17713 \\\n"
+			"     invalidate=pub@tcp://127.0.0.1:17715 \\\n"
+			"     stats=rep@tcp://127.0.0.1:17705 &\n"
+		);
+		fprintf(stderr, "\nReplication:\n# %s mod-leveldb.so ... \\\n", argv[0]);
+		fprintf(stderr,
+			"     binlog=pub@ipc:///tmp/dbz.binlog \\\n"
+			"     binlog-sync=rep@ipc:///tmp/dbz.sync &\n"
+			"# DBZMQ_REPLICA_OF=ipc:///tmp/dbz.binlog DBZMQ_REPLICA_SYNC=ipc:///tmp/dbz.sync DBZMQ_REPLICA_EMPTY=1 \\\n"
+			"  %s mod-leveldb.so get=rep@tcp://127.0.0.1:17710 \\\n"
+			"     invalidate=pub@tcp://127.0.0.1:17716 &\n", argv[0]
+		);
+
+		fprintf(stderr,
+			"\nEnvironment:\n"
+			"     DBZMQ_KEYSIZE          Key size in bytes (default: 20)\n"
+			"     DBZMQ_IO_THREADS       ZeroMQ I/O threads (default: 1)\n"
+			"     DBZMQ_NUMA_NODE        Run on, and allocate from, this NUMA node\n"
+			"     DBZMQ_CPUS_WORKER      CPU list for the request thread, e.g. 2\n"
+			"     DBZMQ_CPUS_IO          CPU list for ZeroMQ I/O threads, e.g. 0-1\n"
+			"     DBZMQ_CPUS_BACKEND     CPU list for module threads, e.g. 3,5-7\n"
+			"     DBZMQ_HOTSET_FILE      Save hot keys here, pre-read them on start\n"
+			"     DBZMQ_HOTSET_SIZE      Hot keys to track (default: 65536)\n"
+			"     DBZMQ_HOTSET_SAMPLE    Track 1 in N gets (default: 16)\n"
+			"     DBZMQ_HOTSET_INTERVAL  Seconds between saves (default: 300)\n"
+			"     DBZMQ_HOTSET_PREFETCH  sync|background (default: sync)\n"
+			"     DBZMQ_HOTSET_THREADS   Pre-read threads (default: 4)\n"
+			"     DBZMQ_BINLOG_BACKLOG   Mutations kept for replicas (default: 65536)\n"
+			"     DBZMQ_REPLICA_OF       Follow this binlog, don't accept writes\n"
+			"     DBZMQ_REPLICA_SYNC     Primary's binlog-sync address\n"
+			"     DBZMQ_REPLICA_STATE    File recording replica progress\n"
+			"     DBZMQ_REPLICA_EMPTY    1 when replica and primary start with no data\n"
+			"     DBZMQ_TTL_FILE         Expiry journal for putex (default: dbz.ttl)\n"
+			"     DBZMQ_TTL_SWEEP        Expired keys deleted per second (default: 1000)\n"
+			"     DBZMQ_QUEUE            Requests read per poll (default: 256)\n"
+			"     DBZMQ_ARENA            Scratch bytes for each request (default: 1048576)\n"
+			"     DBZMQ_TOPK             Hot keys shown by stats (default: 16)\n"
+			"     DBZMQ_TOPK_WINDOW      Seconds between halving key counts (default: 10)\n"
+			"     DBZMQ_BACKUP_CHUNK     Bytes per backup chunk (default: 65536)\n"
+			"     DBZMQ_BACKUP_RATE      Backup bytes per second, 0 for no limit (default: 16777216)\n"
+			"     DBZMQ_BLOB_CHUNK       Largest putblob chunk in bytes (default: 262144)\n"
+			"     DBZMQ_BLOB_UPLOADS     putblob uploads in progress at once (default: 64)\n"
+			"     DBZMQ_BLOB_TIMEOUT     Seconds before an idle upload is abandoned (default: 60)\n"
+			"     DBZMQ_WAL_FILE         Log mutations here, replayed on start\n"
+			"     DBZMQ_WAL_INTERVAL     ms between WAL commits, 0 for every poll (default: 0)\n"
+			"     DBZMQ_WAL_CHECKPOINT   WAL bytes before the module is synced (default: 67108864)\n"
+			"     DBZMQ_MIN_SEQ_WAIT     ms a request waits for the mutation it names (default: 1000)\n"
+			"     DBZMQ_TRACE_SAMPLE     Trace 1 in N requests, 0 to disable (default: 0)\n"
+			"     DBZMQ_TRACE_RING       Traced requests kept (default: 4096)\n"
+			"     DBZMQ_TRACE_FILE       Trace written on SIGUSR1 (default: dbz.trace.json)\n"
+			"     DBZMQ_MERGE_BATCH      incr/append/cas applied before their keys are written (default: 256)\n"
+			"     DBZMQ_MEMORY_LIMIT     Resident bytes before writes are refused, 0 for none (default: 0)\n"
+			"     DBZMQ_MEMORY_TRIM      Percent of the limit at which caches are trimmed (default: 90)\n"
+			"     DBZMQ_RCVHWM[_<OP>]    Incoming messages queued per peer\n"
+			"     DBZMQ_SNDHWM[_<OP>]    Outgoing messages queued per peer\n"
 		);
 
 		printf("\ndbZMQ version v%.1f\n", VERSION);
@@ -245,8 +2296,30 @@ int main(int argc, char **argv)
 	d = dbz_open(argv[1]);
 	if( ! d ) return( EXIT_FAILURE );
 
-	zctx = zmq_init(1);
+	{const char* prot_keysize = getenv("DBZMQ_KEYSIZE");
+		if( prot_keysize ) key_size = atoi(prot_keysize);
+		if( key_size < 1 || key_size > 0xFF ) {
+			errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+		}
+	}
+
+	get_op = dbz_op(d, "get");
+	put_op = dbz_op(d, "put");
+	del_op = dbz_op(d, "del");
+	batch_op = dbz_op(d, "batch");
+
+	io_threads = affinity_setup();
+	affinity_enter_io();
+	zctx = zmq_init(io_threads);
 	assert(zctx != NULL);
+	affinity_enter_worker();
+
+	started = time(NULL);
+	mutation_epoch = ((uint64_t)started << 24) | ((uint64_t)getpid() & 0xFFFFFF);
+	replica_setup(zctx);
+	hotset_setup();
+	topk_setup();
+	trace_setup();
 
 	for( i = 2 ; i < argc; i++ ) {
 		char *op = argv[i];
@@ -259,6 +2332,33 @@ int main(int argc, char **argv)
 		ok += f!=0;
 	}
 
+	if( replica && ((put_op && put_op->token) || (del_op && del_op->token) || (batch_op && batch_op->token)) ) {
+		errx(EXIT_FAILURE, "A replica cannot bind put, del or batch");
+	}
+	binlog_setup();
+	ttl_setup();
+	backup_setup(zctx, d);
+	blob_setup();
+	wal_setup(d);
+	ack_setup();
+	invalidate_setup();
+	memory_setup(d);
+	merge_setup();
+
+	{const char* env = getenv("DBZMQ_QUEUE");
+		if( env ) queue_cap = atoi(env);
+		if( queue_cap < 1 ) {
+			errx(EXIT_FAILURE, "Invalid DBZMQ_QUEUE");
+		}
+		queue = (dbz_request_t*)malloc(queue_cap * sizeof(dbz_request_t));
+		assert(queue != NULL);
+
+		env = getenv("DBZMQ_ARENA");
+		arena.size = env ? (size_t)atoi(env) : (1024 * 1024);
+		arena.base = (char*)malloc(arena.size + 1);
+		assert(arena.base != NULL);
+	}
+
 	if( ! ok ) {
 		struct dbz_op* f = d->ops;
 		fprintf(stderr, "Operations:\n");
@@ -272,16 +2372,71 @@ int main(int argc, char **argv)
 	setup_handlers();
 	dbz_run(d);	
 
-	struct dbz_op* f = d->ops;
-	while( f && f->name ) {
-		if( f->token ) {
-			dbzmq_socket_t* token = (dbzmq_socket_t*)f->token;
-			zmq_close(token->socket);
-		}
-		f++;
+	if( hotset ) {
+		hotset_save(hotset, hotset_file);
+		hotset_free(hotset);
+		hotset = NULL;
+	}
+	if( hotset_warmer.keys ) {
+		hotset_warmer_free(&hotset_warmer);
+	}
+
+	ack_pub = NULL;
+	invalidate_pub = NULL;
+	if( replica ) replica->on_apply = NULL;
+	for( i = 0; i < (int)parked_len; i++ ) {
+		request_free(&parked[i]);
+	}
+	free(parked);
+	parked = NULL;
+	parked_len = 0;
+	for( i = 0; i < nbinds; i++ ) {
+		binds[i]->op->token = NULL;
+		zmq_close(binds[i]->socket);
+		free(binds[i]);
+	}
+	nbinds = 0;
+	replica_free(replica);
+	replica = NULL;
+	binlog_free(binlog);
+	binlog = NULL;
+	if( wal ) {
+		/* A clean shutdown leaves nothing to replay */
+		wal_flush();
+		if( wal->size && sync_op->cb(NULL, 0, NULL, NULL) ) wal_truncate(wal);
+		wal_close(wal);
+		wal = NULL;
 	}
+	ttl_close(ttl);
+	ttl = NULL;
+	free(queue);
+	queue = NULL;
+	free(arena.base);
+	memset(&arena, 0, sizeof(arena));
+	topk_free(topk);
+	topk = NULL;
+	backup_free(backup);
+	backup = NULL;
+	blob_uploads_free(blobs);
+	blobs = NULL;
+	trace_free();
+	memory_free(memory);
+	memory = NULL;
+	merge_free(merges);
+	merges = NULL;
+	free(staged);
+	staged = NULL;
+	free(merge_buf);
+	merge_buf = NULL;
+	free(merge_status);
+	merge_status = NULL;
+	free(stats_buf);
+	stats_buf = NULL;
+	free(ack_buf);
+	ack_buf = NULL;
 	if( zctx ) zmq_term(zctx);
 	dbz_close(d);
 	return( EXIT_SUCCESS );
 }
 
+#endif
@@ -1,13 +1,32 @@
 #ifndef _DB_ZMQ_H
 #define _DB_ZMQ_H
 
+#include <stdint.h>
+
+#include "../i_speak_db.h"
+
 typedef struct {
 	void *socket;
+	int type;
+	struct dbz_op *op;
 	uint64_t bytes_in;
 	uint64_t bytes_out;
 	uint64_t calls;
+	uint64_t shed;
+	int parked;		/* Requests waiting for a mutation, see DBZ_HDR_MIN_SEQ */
 } dbzmq_socket_t;
 
+/*
+ * Frames between the routing frames and the payload are headers,
+ * tag[1] ++ value, unknown tags are ignored.
+ */
+#define DBZ_HDR_DEADLINE	'D'	/* deadline[8], ms since the epoch */
+#define DBZ_HDR_MIN_SEQ		'S'	/* epoch[8] ++ seq[8] from an ack, run once applied */
+
+/* Status frame before the echoed key when a request was not run */
+#define DBZ_STATUS_OVERLOAD	"!overload"
+#define DBZ_STATUS_TIMEOUT	"!timeout"	/* DBZ_HDR_MIN_SEQ mutation not applied in time */
+
 struct dbz_s {
 	int running;
 	void* mod;
@@ -21,4 +40,38 @@ dbz* dbz_open(const char *filename);
 struct dbz_op* dbz_op(dbz* ctx, const char* name);
 int dbz_close(dbz* ctx);
 
+/* Integers on the wire are big-endian */
+static inline void dbz_put64(char* p, uint64_t v)
+{
+	int i;
+	for( i = 7; i >= 0; i-- ) {
+		p[i] = (char)(v & 0xFF);
+		v >>= 8;
+	}
+}
+
+static inline void dbz_put32(char* p, uint32_t v)
+{
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+static inline uint32_t dbz_get32(const char* p)
+{
+	const uint8_t* u = (const uint8_t*)p;
+	return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static inline uint64_t dbz_get64(const char* p)
+{
+	uint64_t v = 0;
+	int i;
+	for( i = 0; i < 8; i++ ) {
+		v = (v << 8) | (uint8_t)p[i];
+	}
+	return v;
+}
+
 #endif
@@ -0,0 +1,302 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include "hotset.h"
+
+static const char hotset_magic[8] = "DBZHOT1";
+
+#define NIL ((uint32_t)-1)
+
+static uint32_t
+hotset_hash(const char* key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	while( len-- ) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Allocate a set holding at most `capacity` keys, recording 1 in `sample` touches.
+ */
+hotset_t* hotset_new(size_t capacity, size_t key_size, uint32_t sample)
+{
+	size_t nbuckets = 1;
+	hotset_t* hs;
+	size_t i;
+
+	assert(capacity > 0 && capacity < NIL);
+	assert(key_size > 0);
+	hs = (hotset_t*)malloc(sizeof(hotset_t));
+	if( ! hs ) return NULL;
+	memset(hs, 0, sizeof(hotset_t));
+
+	while( nbuckets < capacity ) nbuckets <<= 1;
+	hs->capacity = capacity;
+	hs->key_size = key_size;
+	hs->sample = sample ? sample : 1;
+	hs->rstate = 0x9E3779B9u;
+	hs->bucket_mask = (uint32_t)(nbuckets - 1);
+	hs->keys = (char*)malloc(capacity * key_size);
+	hs->ref = (uint8_t*)calloc(capacity, 1);
+	hs->next = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+	hs->buckets = (uint32_t*)malloc(nbuckets * sizeof(uint32_t));
+	if( ! hs->keys || ! hs->ref || ! hs->next || ! hs->buckets ) {
+		hotset_free(hs);
+		return NULL;
+	}
+	for( i = 0; i < nbuckets; i++ ) {
+		hs->buckets[i] = NIL;
+	}
+	return hs;
+}
+
+void hotset_free(hotset_t* hs)
+{
+	if( ! hs ) return;
+	free(hs->keys);
+	free(hs->ref);
+	free(hs->next);
+	free(hs->buckets);
+	free(hs);
+}
+
+static void
+hotset_unlink(hotset_t* hs, uint32_t slot)
+{
+	const char* key = hs->keys + (slot * hs->key_size);
+	uint32_t *p = &hs->buckets[hotset_hash(key, hs->key_size) & hs->bucket_mask];
+	while( *p != NIL ) {
+		if( *p == slot ) {
+			*p = hs->next[slot];
+			return;
+		}
+		p = &hs->next[*p];
+	}
+}
+
+/**
+ * Record a read of `key`, cheap enough to call on every get.
+ */
+void hotset_touch(hotset_t* hs, const char* key, size_t len)
+{
+	uint32_t h, slot;
+
+	if( len != hs->key_size ) return;
+
+	/* xorshift32, sample 1 in N */
+	hs->rstate ^= hs->rstate << 13;
+	hs->rstate ^= hs->rstate >> 17;
+	hs->rstate ^= hs->rstate << 5;
+	if( hs->rstate % hs->sample ) return;
+
+	h = hotset_hash(key, len) & hs->bucket_mask;
+	for( slot = hs->buckets[h]; slot != NIL; slot = hs->next[slot] ) {
+		if( memcmp(hs->keys + (slot * len), key, len) == 0 ) {
+			hs->ref[slot] = 1;
+			return;
+		}
+	}
+
+	if( hs->used < hs->capacity ) {
+		slot = (uint32_t)hs->used++;
+	}
+	else {
+		/* Second chance: clear reference bits until an unreferenced slot comes round */
+		while( hs->ref[hs->hand] ) {
+			hs->ref[hs->hand] = 0;
+			hs->hand = (hs->hand + 1) % hs->capacity;
+		}
+		slot = (uint32_t)hs->hand;
+		hs->hand = (hs->hand + 1) % hs->capacity;
+		hotset_unlink(hs, slot);
+	}
+
+	memcpy(hs->keys + (slot * len), key, len);
+	hs->ref[slot] = 1;
+	hs->next[slot] = hs->buckets[h];
+	hs->buckets[h] = slot;
+}
+
+static size_t sort_key_size;
+
+static int
+hotset_key_cmp(const void* a, const void* b)
+{
+	return memcmp(a, b, sort_key_size);
+}
+
+/**
+ * Write the current set, sorted by key, to `filename`.
+ *
+ * File format (integers in network order):
+ *   magic[8] ++ key_size[4] ++ count[4] ++ keys[count * key_size]
+ *
+ * @return 1 on success
+ */
+int hotset_save(hotset_t* hs, const char* filename)
+{
+	char tmp_filename[4096];
+	uint32_t hdr[2];
+	char* sorted;
+	FILE* fh;
+	int ok;
+
+	assert(hs != NULL);
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+	sorted = (char*)malloc((hs->used * hs->key_size) + 1);
+	if( ! sorted ) return 0;
+	memcpy(sorted, hs->keys, hs->used * hs->key_size);
+	sort_key_size = hs->key_size;
+	qsort(sorted, hs->used, hs->key_size, hotset_key_cmp);
+
+	fh = fopen(tmp_filename, "wb");
+	if( ! fh ) {
+		warn("Cannot open hot key file '%s'", tmp_filename);
+		free(sorted);
+		return 0;
+	}
+	hdr[0] = htonl((uint32_t)hs->key_size);
+	hdr[1] = htonl((uint32_t)hs->used);
+	ok = fwrite(hotset_magic, sizeof(hotset_magic), 1, fh) == 1
+	  && fwrite(hdr, sizeof(hdr), 1, fh) == 1
+	  && (hs->used == 0 || fwrite(sorted, hs->key_size, hs->used, fh) == hs->used)
+	  && fflush(fh) == 0
+	  && fdatasync(fileno(fh)) == 0;
+	ok = (fclose(fh) == 0) && ok;
+	free(sorted);
+
+	if( ! ok || rename(tmp_filename, filename) != 0 ) {
+		warn("Cannot write hot key file '%s'", filename);
+		unlink(tmp_filename);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Read a file written by hotset_save() ready for pre-reading.
+ * @return 1 if there are keys to warm
+ */
+int hotset_warmer_load(hotset_warmer_t* w, const char* filename, size_t key_size, dbzop_t get)
+{
+	char magic[sizeof(hotset_magic)];
+	uint32_t hdr[2];
+	FILE* fh;
+
+	assert(w != NULL);
+	memset(w, 0, sizeof(hotset_warmer_t));
+	w->key_size = key_size;
+	w->get = get;
+
+	fh = fopen(filename, "rb");
+	if( ! fh ) return 0;
+
+	if( fread(magic, sizeof(magic), 1, fh) != 1
+	 || fread(hdr, sizeof(hdr), 1, fh) != 1
+	 || memcmp(magic, hotset_magic, sizeof(magic)) != 0
+	 || ntohl(hdr[0]) != key_size ) {
+		warnx("Ignoring hot key file '%s', bad header", filename);
+		fclose(fh);
+		return 0;
+	}
+
+	w->count = ntohl(hdr[1]);
+	w->keys = (char*)malloc((w->count * key_size) + 1);
+	if( ! w->keys || fread(w->keys, key_size, w->count, fh) != w->count ) {
+		warnx("Ignoring hot key file '%s', truncated", filename);
+		hotset_warmer_free(w);
+		fclose(fh);
+		return 0;
+	}
+	fclose(fh);
+	return w->count > 0;
+}
+
+/**
+ * Pre-read up to `n` keys in file (key-sorted) order.
+ * @return Number of keys remaining
+ */
+size_t hotset_warm_step(hotset_warmer_t* w, size_t n)
+{
+	assert(w != NULL);
+	while( n-- && w->done < w->count ) {
+		w->get(w->keys + (w->done * w->key_size), w->key_size, NULL, NULL);
+		w->done++;
+	}
+	return w->count - w->done;
+}
+
+struct warm_range {
+	hotset_warmer_t* w;
+	size_t begin;
+	size_t end;
+};
+
+static void*
+hotset_warm_thread(void* arg)
+{
+	struct warm_range* r = (struct warm_range*)arg;
+	size_t i;
+	for( i = r->begin; i < r->end; i++ ) {
+		r->w->get(r->w->keys + (i * r->w->key_size), r->w->key_size, NULL, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Pre-read every remaining key using `threads` threads, each taking a
+ * contiguous key-sorted range. The get op must be safe to call concurrently.
+ */
+void hotset_warm_parallel(hotset_warmer_t* w, int threads)
+{
+	pthread_t tids[threads];
+	struct warm_range ranges[threads];
+	size_t per_thread;
+	int i;
+
+	assert(w != NULL);
+	assert(threads > 0);
+
+	/* The first read opens the database, so don't race it */
+	hotset_warm_step(w, 1);
+	per_thread = ((w->count - w->done) / threads) + 1;
+
+	for( i = 0; i < threads; i++ ) {
+		ranges[i].w = w;
+		ranges[i].begin = w->done + (per_thread * i);
+		ranges[i].end = ranges[i].begin + per_thread;
+		if( ranges[i].begin > w->count ) ranges[i].begin = w->count;
+		if( ranges[i].end > w->count ) ranges[i].end = w->count;
+		if( pthread_create(&tids[i], NULL, hotset_warm_thread, &ranges[i]) != 0 ) {
+			warnx("Cannot start warm-up thread, reading range inline");
+			hotset_warm_thread(&ranges[i]);
+			tids[i] = pthread_self();
+		}
+	}
+	for( i = 0; i < threads; i++ ) {
+		if( ! pthread_equal(tids[i], pthread_self()) )
+			pthread_join(tids[i], NULL);
+	}
+	w->done = w->count;
+}
+
+void hotset_warmer_free(hotset_warmer_t* w)
+{
+	assert(w != NULL);
+	free(w->keys);
+	w->keys = NULL;
+	w->count = w->done = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef _HOTSET_H
+#define _HOTSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../i_speak_db.h"
+
+/**
+ * Sampled CLOCK over recently read keys.
+ *
+ * Every Nth get is recorded, a key which is sampled again before the
+ * clock hand comes round keeps its slot. The resulting set is written
+ * to a small file so a restarted server can pre-read it.
+ */
+typedef struct hotset_s {
+	size_t capacity;
+	size_t key_size;
+	size_t used;
+	size_t hand;
+	uint32_t sample;
+	uint32_t rstate;
+	uint32_t bucket_mask;
+	char *keys;
+	uint8_t *ref;
+	uint32_t *next;
+	uint32_t *buckets;
+} hotset_t;
+
+/**
+ * Cursor used to pre-read a loaded snapshot through a get op.
+ */
+typedef struct hotset_warmer_s {
+	char *keys;
+	size_t key_size;
+	size_t count;
+	size_t done;
+	dbzop_t get;
+} hotset_warmer_t;
+
+hotset_t* hotset_new(size_t capacity, size_t key_size, uint32_t sample);
+void hotset_free(hotset_t* hs);
+void hotset_touch(hotset_t* hs, const char* key, size_t len);
+int hotset_save(hotset_t* hs, const char* filename);
+
+int hotset_warmer_load(hotset_warmer_t* w, const char* filename, size_t key_size, dbzop_t get);
+size_t hotset_warm_step(hotset_warmer_t* w, size_t n);
+void hotset_warm_parallel(hotset_warmer_t* w, int threads);
+void hotset_warmer_free(hotset_warmer_t* w);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <assert.h>
+
+#include "memory.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+const char* const memory_part_names[MEMORY_PARTS] = {
+	"zmq",
+	"module",
+	"binlog",
+	"hotset",
+	"topk",
+	"ttl",
+	"trace",
+	"blobs",
+	"buffers",
+};
+
+memory_t* memory_new(uint64_t limit, unsigned trim_percent)
+{
+	memory_t* m;
+	assert(trim_percent > 0 && trim_percent <= 100);
+	m = (memory_t*)calloc(1, sizeof(memory_t));
+	if( ! m ) return NULL;
+	m->limit = limit;
+	m->trim_at = limit / 100 * trim_percent;
+	return m;
+}
+
+void memory_free(memory_t* m)
+{
+	free(m);
+}
+
+/**
+ * Resident size of the process, what the kernel's OOM killer goes by.
+ * @return 0 where it can't be read
+ */
+uint64_t memory_rss(void)
+{
+#ifdef __linux__
+	unsigned long long size, resident;
+	FILE* fh = fopen("/proc/self/statm", "r");
+	int ok;
+	if( ! fh ) return 0;
+	ok = fscanf(fh, "%llu %llu", &size, &resident) == 2;
+	fclose(fh);
+	return ok ? resident * (uint64_t)sysconf(_SC_PAGESIZE) : 0;
+#else
+	return 0;
+#endif
+}
+
+uint64_t memory_attributed(const memory_t* m)
+{
+	uint64_t total = 0;
+	int i;
+	for( i = 0; i < MEMORY_PARTS; i++ ) total += m->parts[i];
+	return total;
+}
+
+/**
+ * Read the resident size, once the parts are filled in, and move between
+ * states. Shedding goes on until the size is back under the trim level,
+ * so writes don't flap on and off at the limit.
+ * @return MEMORY_OK, MEMORY_TRIM or MEMORY_SHED
+ */
+int memory_update(memory_t* m)
+{
+	m->rss = memory_rss();
+	if( ! m->rss ) m->rss = memory_attributed(m);
+	if( ! m->limit ) m->state = MEMORY_OK;
+	else if( m->rss >= m->limit ) m->state = MEMORY_SHED;
+	else if( m->rss >= m->trim_at ) m->state = m->state == MEMORY_SHED ? MEMORY_SHED : MEMORY_TRIM;
+	else m->state = MEMORY_OK;
+	return m->state;
+}
+
+/**
+ * Give freed heap back to the kernel, malloc keeps it otherwise.
+ */
+void memory_release(void)
+{
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef _MEMORY_H
+#define _MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Memory held by the server, by the part holding it, and a limit on the
+ * resident size of the process.
+ *
+ *   DBZMQ_MEMORY_LIMIT  Resident bytes before writes are refused, 0 for none
+ *   DBZMQ_MEMORY_TRIM   Percent of the limit at which caches are trimmed (default: 90)
+ *
+ * Above the trim level the module is asked to release what it can (see
+ * the memory op in i_speak_db.h) and freed heap is given back to the
+ * kernel. Above the limit writes which add data are refused with
+ * DBZ_STATUS_OVERLOAD and the binlog backlog is cut, until the process
+ * is back under the trim level. Deletes and reads are still served.
+ */
+enum {
+	MEMORY_ZMQ,		/* Messages read and not yet answered */
+	MEMORY_MODULE,		/* As reported by the module's memory op */
+	MEMORY_BINLOG,
+	MEMORY_HOTSET,
+	MEMORY_TOPK,
+	MEMORY_TTL,
+	MEMORY_TRACE,
+	MEMORY_BLOBS,
+	MEMORY_BUFFERS,		/* Arena, request queue, WAL and reply buffers */
+	MEMORY_PARTS
+};
+
+#define MEMORY_OK	0
+#define MEMORY_TRIM	1
+#define MEMORY_SHED	2
+
+typedef struct memory_s {
+	uint64_t limit;
+	uint64_t trim_at;
+	uint64_t rss;		/* Resident bytes, or the sum of parts where it can't be read */
+	uint64_t parts[MEMORY_PARTS];
+	int state;
+	/* Counters */
+	uint64_t trims;
+	uint64_t rejected;
+} memory_t;
+
+extern const char* const memory_part_names[MEMORY_PARTS];
+
+memory_t* memory_new(uint64_t limit, unsigned trim_percent);
+void memory_free(memory_t* m);
+uint64_t memory_rss(void);
+uint64_t memory_attributed(const memory_t* m);
+int memory_update(memory_t* m);
+void memory_release(void);
+
+#endif
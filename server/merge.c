@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "merge.h"
+
+merge_t* merge_new(size_t key_size, size_t capacity)
+{
+	merge_t* m;
+	assert(key_size > 0 && capacity > 0);
+	m = (merge_t*)calloc(1, sizeof(merge_t));
+	if( ! m ) return NULL;
+	m->key_size = key_size;
+	m->capacity = capacity;
+	m->values = (merge_value_t*)calloc(capacity, sizeof(merge_value_t));
+	if( ! m->values ) {
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+void merge_free(merge_t* m)
+{
+	size_t i;
+	if( ! m ) return;
+	for( i = 0; i < m->capacity; i++ ) {
+		free(m->values[i].rec);
+	}
+	free(m->values);
+	free(m);
+}
+
+/**
+ * Few keys are held between writes, a scan is as quick as hashing.
+ */
+merge_value_t* merge_find(merge_t* m, const char* key)
+{
+	size_t i;
+	for( i = 0; i < m->count; i++ ) {
+		if( memcmp(m->values[i].rec, key, m->key_size) == 0 ) return &m->values[i];
+	}
+	return NULL;
+}
+
+/**
+ * Hold a key, as missing until merge_set().
+ * @return NULL when the table is full or out of memory
+ */
+merge_value_t* merge_add(merge_t* m, const char* key)
+{
+	merge_value_t* v;
+	if( m->count == m->capacity ) return NULL;
+	v = &m->values[m->count];
+	if( v->cap < m->key_size ) {
+		char* rec = (char*)realloc(v->rec, m->key_size);
+		if( ! rec ) return NULL;
+		v->rec = rec;
+		v->cap = m->key_size;
+	}
+	memcpy(v->rec, key, m->key_size);
+	v->len = m->key_size;
+	v->exists = 0;
+	v->dirty = 0;
+	v->failed = 0;
+	m->count++;
+	return v;
+}
+
+/**
+ * Replace the value of `v`, or add to its end.
+ * @return 0 when out of memory
+ */
+int merge_set(merge_t* m, merge_value_t* v, const char* value, size_t len, int append)
+{
+	size_t need = (append ? v->len : m->key_size) + len;
+	if( need > v->cap ) {
+		size_t cap = v->cap * 2 > need ? v->cap * 2 : need;
+		char* rec = (char*)realloc(v->rec, cap);
+		if( ! rec ) return 0;
+		v->rec = rec;
+		v->cap = cap;
+	}
+	memcpy(v->rec + need - len, value, len);
+	v->len = need;
+	v->exists = 1;
+	v->dirty = 1;
+	return 1;
+}
+
+/**
+ * Forget every key, keeping their buffers for the next ones.
+ */
+void merge_clear(merge_t* m)
+{
+	size_t i;
+	for( i = 0; i < m->count; i++ ) {
+		/* Let a one-off large value go */
+		if( m->values[i].cap > 65536 ) {
+			free(m->values[i].rec);
+			m->values[i].rec = NULL;
+			m->values[i].cap = 0;
+		}
+	}
+	m->count = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _MERGE_H
+#define _MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Values changed by incr, append and cas and not yet written.
+ *
+ *   incr    k ++ delta[8]       Add a signed delta to an 8 byte counter,
+ *                               0 when missing, wrapping on overflow.
+ *                               Replies k ++ value[8].
+ *   append  k ++ data           Add data to the end of the value, empty
+ *                               when missing. Replies k ++ size[4].
+ *   cas     k ++ len[4] ++ expected ++ v
+ *                               Store v if the value is `expected`, or
+ *                               is missing when len is 0xFFFFFFFF.
+ *                               Replies k ++ 'O' when stored, otherwise
+ *                               k ++ 'M' ++ value, or k ++ 'N' when the
+ *                               value is missing.
+ *
+ * Numbers are big-endian, a failed request is answered with k alone.
+ *
+ * The server runs requests one at a time, so a read-modify-write is
+ * never interleaved with another request for the same key. Merges read
+ * in one poll are applied to this table, each key read from the module
+ * once, and the table is written with one batch op when a request other
+ * than a merge comes up or the poll's requests are done. Many updates
+ * of a hot counter cost one get and one put.
+ */
+typedef struct {
+	char *rec;		/* k ++ v */
+	size_t len;		/* Of rec, the key size while missing */
+	size_t cap;
+	int exists;
+	int dirty;
+	int failed;		/* Write refused by the module */
+} merge_value_t;
+
+typedef struct merge_s {
+	size_t key_size;
+	size_t capacity;
+	size_t count;
+	merge_value_t *values;
+} merge_t;
+
+merge_t* merge_new(size_t key_size, size_t capacity);
+void merge_free(merge_t* m);
+merge_value_t* merge_find(merge_t* m, const char* key);
+merge_value_t* merge_add(merge_t* m, const char* key);
+int merge_set(merge_t* m, merge_value_t* v, const char* value, size_t len, int append);
+void merge_clear(merge_t* m);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "ring.h"
+
+ring_t* ring_new(size_t vnodes)
+{
+	ring_t* r;
+	assert(vnodes > 0);
+	r = (ring_t*)calloc(1, sizeof(ring_t));
+	if( ! r ) return NULL;
+	r->vnodes = vnodes;
+	return r;
+}
+
+void ring_free(ring_t* r)
+{
+	if( ! r ) return;
+	free(r->points);
+	free(r);
+}
+
+/**
+ * FNV-1a, then MurmurHash3's finalizer so that similar names and keys
+ * spread over the whole ring.
+ */
+uint64_t ring_hash(const char* data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while( len-- ) {
+		h ^= (uint8_t)*data++;
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * Add the next node, numbered from 0 in the order they are added. Nodes
+ * are placed by name, so a node keeps its keys when others are listed
+ * in a different order.
+ * @return 0 when out of memory
+ */
+int ring_add(ring_t* r, const char* name, uint32_t weight)
+{
+	size_t i, n = r->vnodes * weight;
+	char point[256];
+	ring_point_t* p;
+
+	assert(weight > 0);
+	p = (ring_point_t*)realloc(r->points, (r->npoints + n) * sizeof(ring_point_t));
+	if( ! p ) return 0;
+	r->points = p;
+	for( i = 0; i < n; i++ ) {
+		int len = snprintf(point, sizeof(point), "%s#%zu", name, i);
+		p[r->npoints].point = ring_hash(point, (size_t)len < sizeof(point) ? (size_t)len : sizeof(point) - 1);
+		p[r->npoints].node = (uint32_t)r->nodes;
+		r->npoints++;
+	}
+	r->nodes++;
+	return 1;
+}
+
+static int point_cmp(const void* a, const void* b)
+{
+	const ring_point_t *x = (const ring_point_t*)a, *y = (const ring_point_t*)b;
+	if( x->point != y->point ) return x->point < y->point ? -1 : 1;
+	return x->node < y->node ? -1 : x->node > y->node;
+}
+
+/**
+ * Sort the points once every node has been added.
+ */
+void ring_build(ring_t* r)
+{
+	qsort(r->points, r->npoints, sizeof(ring_point_t), point_cmp);
+}
+
+/**
+ * The first `n` distinct nodes for `key`, its owner first.
+ * @return Nodes written to `nodes`, fewer than `n` if there aren't as many
+ */
+size_t ring_lookup(const ring_t* r, const char* key, size_t len, uint32_t* nodes, size_t n)
+{
+	uint64_t h = ring_hash(key, len);
+	size_t lo = 0, hi = r->npoints, i, j, found = 0;
+
+	if( n > r->nodes ) n = r->nodes;
+	if( ! n ) return 0;
+
+	/* First point at or after h, wrapping around to the start */
+	while( lo < hi ) {
+		size_t mid = lo + (hi - lo) / 2;
+		if( r->points[mid].point < h ) lo = mid + 1;
+		else hi = mid;
+	}
+	for( i = 0; i < r->npoints && found < n; i++ ) {
+		uint32_t node = r->points[(lo + i) % r->npoints].node;
+		for( j = 0; j < found && nodes[j] != node; j++ );
+		if( j == found ) nodes[found++] = node;
+	}
+	return found;
+}
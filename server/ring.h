@@ -0,0 +1,36 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Consistent hashing of keys onto nodes.
+ *
+ * Each node is placed on a 64-bit ring at `vnodes` points per unit of
+ * weight, hashed from its name, and a key belongs to the first node
+ * found clockwise from the hash of the key. Adding or removing a node
+ * only moves the keys between it and its neighbours, about 1/n of them,
+ * and the many points even out the share of each node. A key's replicas
+ * are the next distinct nodes after the first.
+ */
+typedef struct {
+	uint64_t point;
+	uint32_t node;
+} ring_point_t;
+
+typedef struct ring_s {
+	ring_point_t *points;
+	size_t npoints;
+	size_t nodes;
+	size_t vnodes;
+} ring_t;
+
+ring_t* ring_new(size_t vnodes);
+void ring_free(ring_t* r);
+int ring_add(ring_t* r, const char* name, uint32_t weight);
+void ring_build(ring_t* r);
+uint64_t ring_hash(const char* data, size_t len);
+size_t ring_lookup(const ring_t* r, const char* key, size_t len, uint32_t* nodes, size_t n);
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef _SHA1_H
 #define _SHA1_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define HASH_LENGTH 20
 #define BLOCK_LENGTH 64
 
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "topk.h"
+
+static uint64_t
+topk_hash(const char* key, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while( len-- ) {
+		h ^= (uint8_t)*key++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+topk_t* topk_new(size_t k, size_t key_size)
+{
+	topk_t* tk;
+	assert(k > 0);
+	assert(key_size > 0);
+	tk = (topk_t*)calloc(1, sizeof(topk_t));
+	if( ! tk ) return NULL;
+	tk->k = k;
+	tk->key_size = key_size;
+	tk->entries = (topk_entry_t*)calloc(k, sizeof(topk_entry_t));
+	tk->keys = (char*)malloc(k * key_size);
+	if( ! tk->entries || ! tk->keys ) {
+		topk_free(tk);
+		return NULL;
+	}
+	return tk;
+}
+
+void topk_free(topk_t* tk)
+{
+	if( ! tk ) return;
+	free(tk->entries);
+	free(tk->keys);
+	free(tk);
+}
+
+static void
+topk_find_min(topk_t* tk)
+{
+	size_t i;
+	tk->min = 0;
+	for( i = 1; i < tk->used; i++ ) {
+		if( tk->entries[i].count < tk->entries[tk->min].count ) tk->min = i;
+	}
+}
+
+/**
+ * Count one request for `key`, cheap enough to call on every request.
+ */
+void topk_touch(topk_t* tk, const char* key, int write)
+{
+	uint64_t h = topk_hash(key, tk->key_size);
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	uint32_t estimate = (uint32_t)-1;
+	topk_entry_t* e;
+	size_t i;
+
+	for( i = 0; i < TOPK_DEPTH; i++ ) {
+		uint32_t* c = &tk->sketch[i][((uint32_t)h + (i * h2)) & (TOPK_WIDTH - 1)];
+		if( *c != (uint32_t)-1 ) (*c)++;
+		if( *c < estimate ) estimate = *c;
+	}
+
+	for( i = 0; i < tk->used; i++ ) {
+		e = &tk->entries[i];
+		if( e->hash == h && memcmp(tk->keys + (i * tk->key_size), key, tk->key_size) == 0 ) {
+			e->count++;
+			if( write ) e->writes++;
+			else e->reads++;
+			if( i == tk->min ) topk_find_min(tk);
+			return;
+		}
+	}
+
+	if( tk->used < tk->k ) {
+		i = tk->used++;
+	}
+	else if( estimate > tk->entries[tk->min].count ) {
+		i = tk->min;
+	}
+	else {
+		return;
+	}
+
+	e = &tk->entries[i];
+	e->hash = h;
+	e->count = estimate;
+	e->error = estimate - 1;
+	e->reads = ! write;
+	e->writes = !! write;
+	memcpy(tk->keys + (i * tk->key_size), key, tk->key_size);
+	topk_find_min(tk);
+}
+
+/**
+ * Halve every count, older requests fade out.
+ */
+void topk_decay(topk_t* tk)
+{
+	size_t i, j;
+	for( i = 0; i < TOPK_DEPTH; i++ ) {
+		for( j = 0; j < TOPK_WIDTH; j++ ) {
+			tk->sketch[i][j] >>= 1;
+		}
+	}
+	for( i = 0; i < tk->used; i++ ) {
+		tk->entries[i].count >>= 1;
+		tk->entries[i].error >>= 1;
+		tk->entries[i].reads >>= 1;
+		tk->entries[i].writes >>= 1;
+	}
+}
+
+static int
+topk_cmp(const void* a, const void* b)
+{
+	uint32_t x = (*(topk_entry_t* const*)a)->count;
+	uint32_t y = (*(topk_entry_t* const*)b)->count;
+	return (x < y) - (x > y);
+}
+
+/**
+ * Fill `entries`, which has room for k pointers, with the tracked keys
+ * from most to least requested.
+ * @return Number of keys
+ */
+size_t topk_sorted(topk_t* tk, topk_entry_t** entries)
+{
+	size_t i;
+	for( i = 0; i < tk->used; i++ ) {
+		entries[i] = &tk->entries[i];
+	}
+	qsort(entries, tk->used, sizeof(topk_entry_t*), topk_cmp);
+	return tk->used;
+}
+
+const char* topk_key(topk_t* tk, const topk_entry_t* e)
+{
+	return tk->keys + ((size_t)(e - tk->entries) * tk->key_size);
+}
@@ -0,0 +1,46 @@
+#ifndef _TOPK_H
+#define _TOPK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Most requested keys, in fixed memory.
+ *
+ * Every key is counted in a count-min sketch, and the keys whose estimate
+ * beats the smallest count in a space-saving table of `k` keys replace
+ * it. topk_decay() halves every counter, so counts follow the recent
+ * request rate: with a decay every `window` seconds a key requested r
+ * times a second settles at about 2 * r * window.
+ *
+ * Only the server thread updates it, so no locks are needed.
+ */
+#define TOPK_DEPTH		4
+#define TOPK_WIDTH		4096	/* Power of two */
+
+typedef struct {
+	uint64_t hash;
+	uint32_t count;
+	uint32_t error;		/* Count the key had before it was tracked */
+	uint32_t reads;
+	uint32_t writes;
+} topk_entry_t;
+
+typedef struct topk_s {
+	size_t k;
+	size_t key_size;
+	size_t used;
+	size_t min;			/* Entry with the smallest count */
+	uint32_t sketch[TOPK_DEPTH][TOPK_WIDTH];
+	topk_entry_t *entries;
+	char *keys;
+} topk_t;
+
+topk_t* topk_new(size_t k, size_t key_size);
+void topk_free(topk_t* tk);
+void topk_touch(topk_t* tk, const char* key, int write);
+void topk_decay(topk_t* tk);
+size_t topk_sorted(topk_t* tk, topk_entry_t** entries);
+const char* topk_key(topk_t* tk, const topk_entry_t* e);
+
+#endif
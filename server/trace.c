@@ -0,0 +1,258 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <assert.h>
+
+#include "trace.h"
+
+/* Threads which can have a ring, later threads are not traced */
+#define TRACE_MAX_THREADS	64
+
+/*
+ * A slot is stamped 0 while it is written and with the record number + 1
+ * once written, a reader keeps the copy only if the stamp was the one it
+ * expected both before and after copying.
+ */
+typedef struct {
+	uint64_t stamp;
+	trace_rec_t rec;
+} trace_slot_t;
+
+typedef struct {
+	uint64_t head;		/* Records written */
+	int tid;
+	trace_slot_t *slots;
+} trace_ring_t;
+
+uint32_t trace_sample = 0;
+
+static size_t ring_mask;
+static trace_ring_t* rings[TRACE_MAX_THREADS];
+static uint32_t nrings;
+static __thread trace_ring_t* own_ring;
+static __thread uint32_t countdown;
+
+/**
+ * Trace 1 in `sample` requests, 0 for none, keeping the last `ring_size`
+ * records of each thread (rounded up to a power of 2).
+ */
+void trace_init(uint32_t sample, size_t ring_size)
+{
+	size_t size = 1;
+	assert(ring_size > 0);
+	while( size < ring_size ) size <<= 1;
+	ring_mask = size - 1;
+	trace_sample = sample;
+}
+
+void trace_free(void)
+{
+	uint32_t i;
+	trace_sample = 0;
+	for( i = 0; i < nrings && i < TRACE_MAX_THREADS; i++ ) {
+		if( ! rings[i] ) continue;
+		free(rings[i]->slots);
+		free(rings[i]);
+		rings[i] = NULL;
+	}
+	nrings = 0;
+	own_ring = NULL;
+}
+
+/**
+ * Should the calling thread trace its next request.
+ */
+int trace_sampled(void)
+{
+	if( ++countdown < trace_sample ) return 0;
+	countdown = 0;
+	return 1;
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+uint64_t trace_hash(const char* data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	while( len-- ) {
+		h ^= (uint8_t)*data++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static trace_ring_t* ring_new(void)
+{
+	trace_ring_t* r;
+	uint32_t i = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+	if( i >= TRACE_MAX_THREADS ) return NULL;
+	r = (trace_ring_t*)calloc(1, sizeof(trace_ring_t));
+	if( ! r ) return NULL;
+	r->tid = (int)i + 1;
+	r->slots = (trace_slot_t*)calloc(ring_mask + 1, sizeof(trace_slot_t));
+	if( ! r->slots ) {
+		free(r);
+		return NULL;
+	}
+	__atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+	return r;
+}
+
+/**
+ * Append a finished record to the calling thread's ring, overwriting
+ * its oldest record once the ring is full.
+ */
+void trace_commit(const trace_rec_t* rec)
+{
+	trace_ring_t* r = own_ring;
+	trace_slot_t* slot;
+	uint64_t n;
+
+	if( ! r ) {
+		r = own_ring = ring_new();
+		if( ! r ) return;
+	}
+	n = r->head;
+	slot = &r->slots[n & ring_mask];
+	__atomic_store_n(&slot->stamp, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec = *rec;
+	__atomic_store_n(&slot->stamp, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy record `n` of `r`.
+ * @return 0 if it was overwritten or is being written
+ */
+static int ring_read(trace_ring_t* r, uint64_t n, trace_rec_t* rec)
+{
+	trace_slot_t* slot = &r->slots[n & ring_mask];
+	if( __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE) != n + 1 ) return 0;
+	*rec = slot->rec;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->stamp, __ATOMIC_RELAXED) == n + 1;
+}
+
+static trace_ring_t* ring_at(uint32_t i)
+{
+	return __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+}
+
+static uint32_t ring_count(void)
+{
+	uint32_t n = __atomic_load_n(&nrings, __ATOMIC_RELAXED);
+	return n < TRACE_MAX_THREADS ? n : TRACE_MAX_THREADS;
+}
+
+/**
+ * Records currently held by all rings.
+ */
+size_t trace_count(void)
+{
+	size_t count = 0;
+	uint32_t i, n = ring_count();
+	for( i = 0; i < n; i++ ) {
+		trace_ring_t* r = ring_at(i);
+		uint64_t head;
+		if( ! r ) continue;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		count += head > ring_mask ? ring_mask + 1 : head;
+	}
+	return count;
+}
+
+/**
+ * Bytes held by the rings of the threads traced so far.
+ */
+size_t trace_memory(void)
+{
+	size_t bytes = 0;
+	uint32_t i, n = ring_count();
+	for( i = 0; i < n; i++ ) {
+		if( ring_at(i) ) bytes += sizeof(trace_ring_t) + (ring_mask + 1) * sizeof(trace_slot_t);
+	}
+	return bytes;
+}
+
+static void json_event(FILE* f, int* first, const char* name, int namelen,
+                       char ph, uint64_t ts, int tid, uint64_t id)
+{
+	fprintf(f, "%s\n{\"name\":\"%.*s\",\"cat\":\"request\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%d,\"id\":\"0x%llx\"}",
+		*first ? "" : ",", namelen, name, ph, ts / 1000.0, (long)getpid(), tid, (unsigned long long)id);
+	*first = 0;
+}
+
+#define STAGE(name, ph, ts)	json_event(f, first, name, (int)strlen(name), ph, ts, tid, id)
+
+/**
+ * One request as nested async spans, so requests read by the same poll
+ * can overlap: the op, then poll (until read), queue (until run),
+ * module (until the op returned) and send within module.
+ */
+static void json_record(FILE* f, int* first, const trace_rec_t* rec, int tid, uint64_t id)
+{
+	int oplen = (int)strcspn(rec->op, " ");
+
+	fprintf(f, "%s\n{\"name\":\"%.*s\",\"cat\":\"request\",\"ph\":\"b\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%d,\"id\":\"0x%llx\","
+		"\"args\":{\"key_hash\":\"%016llx\"}}",
+		*first ? "" : ",", oplen, rec->op, rec->poll / 1000.0, (long)getpid(), tid, (unsigned long long)id,
+		(unsigned long long)rec->key_hash);
+	*first = 0;
+	STAGE("poll", 'b', rec->poll);
+	STAGE("poll", 'e', rec->recv);
+	STAGE("queue", 'b', rec->recv);
+	STAGE("queue", 'e', rec->run);
+	STAGE("module", 'b', rec->run);
+	if( rec->send ) {
+		STAGE("send", 'b', rec->send);
+		STAGE("send", 'e', rec->sent);
+	}
+	STAGE("module", 'e', rec->done);
+	json_event(f, first, rec->op, oplen, 'e', rec->done, tid, id);
+}
+
+#undef STAGE
+
+/**
+ * The records held by all rings as Chrome trace event JSON, oldest
+ * first within each thread.
+ * @return malloc'd text, NULL on failure
+ */
+char* trace_json(size_t* len)
+{
+	char* buf = NULL;
+	int first = 1;
+	uint32_t i, n = ring_count();
+	trace_rec_t rec;
+	FILE* f = open_memstream(&buf, len);
+	if( ! f ) return NULL;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for( i = 0; i < n; i++ ) {
+		trace_ring_t* r = ring_at(i);
+		uint64_t head, seq;
+		if( ! r ) continue;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for( seq = head > ring_mask ? head - ring_mask - 1 : 0; seq < head; seq++ ) {
+			if( ! ring_read(r, seq, &rec) ) continue;
+			json_record(f, &first, &rec, r->tid, ((uint64_t)r->tid << 48) | seq);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if( fclose(f) != 0 ) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
@@ -0,0 +1,42 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Sampled request tracing.
+ *
+ * One in `trace_sample` requests notes when zmq_poll returned, when the
+ * request was read, when its op was called, when the first reply frame
+ * was sent and when the op returned, all in ns of CLOCK_MONOTONIC. Each
+ * thread keeps its most recent records in its own ring, written without
+ * locks, and trace_json() renders every ring in Chrome's trace event
+ * format for chrome://tracing or Perfetto.
+ *
+ * With `trace_sample` 0 the server only tests it once per request.
+ */
+typedef struct {
+	const char *op;
+	uint64_t key_hash;
+	uint64_t poll;		/* zmq_poll returned */
+	uint64_t recv;		/* Request read */
+	uint64_t run;		/* Op called */
+	uint64_t send;		/* First reply frame, 0 for none */
+	uint64_t sent;		/* Last reply frame sent */
+	uint64_t done;		/* Op returned */
+} trace_rec_t;
+
+extern uint32_t trace_sample;
+
+void trace_init(uint32_t sample, size_t ring_size);
+void trace_free(void);
+int trace_sampled(void);
+uint64_t trace_now(void);
+uint64_t trace_hash(const char* data, size_t len);
+void trace_commit(const trace_rec_t* rec);
+size_t trace_count(void);
+size_t trace_memory(void);
+char* trace_json(size_t* len);
+
+#endif
@@ -0,0 +1,426 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include "ttl.h"
+
+static const char ttl_magic[8] = "DBZTTL1";
+
+#define NIL ((uint32_t)-1)
+
+/* Rewrite the journal once it holds this many more records than keys */
+#define TTL_COMPACT_SLACK 65536
+
+static uint32_t
+ttl_hash(const char* key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	while( len-- ) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static inline char*
+ttl_key(ttl_t* t, uint32_t idx)
+{
+	return t->keys + ((size_t)idx * t->key_size);
+}
+
+static uint32_t
+ttl_find(ttl_t* t, const char* key)
+{
+	uint32_t idx = t->buckets[ttl_hash(key, t->key_size) & t->bucket_mask];
+	while( idx != NIL && memcmp(ttl_key(t, idx), key, t->key_size) != 0 ) {
+		idx = t->entries[idx].hnext;
+	}
+	return idx;
+}
+
+static void
+list_push(ttl_t* t, uint32_t list, uint32_t idx)
+{
+	ttl_entry_t* e = &t->entries[idx];
+	e->list = list;
+	e->next = NIL;
+	e->prev = t->tail[list];
+	if( e->prev != NIL ) t->entries[e->prev].next = idx;
+	else t->head[list] = idx;
+	t->tail[list] = idx;
+	if( list == TTL_EXPIRED ) t->expired++;
+}
+
+static void
+list_remove(ttl_t* t, uint32_t idx)
+{
+	ttl_entry_t* e = &t->entries[idx];
+	if( e->prev != NIL ) t->entries[e->prev].next = e->next;
+	else t->head[e->list] = e->next;
+	if( e->next != NIL ) t->entries[e->next].prev = e->prev;
+	else t->tail[e->list] = e->prev;
+	if( e->list == TTL_EXPIRED ) t->expired--;
+	e->list = NIL;
+}
+
+/**
+ * Put an entry in the slot of the coarsest wheel which resolves its
+ * expiry, or in the expired queue when it is already due.
+ */
+static void
+wheel_insert(ttl_t* t, uint32_t idx)
+{
+	uint32_t expires = t->entries[idx].expires;
+	uint32_t delta;
+	int level = 0;
+
+	if( expires <= t->now ) {
+		list_push(t, TTL_EXPIRED, idx);
+		return;
+	}
+	delta = expires - t->now;
+	while( level < TTL_LEVELS - 1 && delta >= (1u << (TTL_SLOT_BITS * (level + 1))) ) {
+		level++;
+	}
+	list_push(t, (level * TTL_SLOTS) + ((expires >> (TTL_SLOT_BITS * level)) & (TTL_SLOTS - 1)), idx);
+}
+
+static int
+ttl_grow(ttl_t* t)
+{
+	size_t capacity = t->capacity * 2;
+	size_t nbuckets = t->bucket_mask + 1;
+	ttl_entry_t* entries;
+	char* keys;
+	uint32_t* buckets;
+	size_t i;
+
+	if( capacity >= NIL ) return 0;
+	entries = (ttl_entry_t*)realloc(t->entries, capacity * sizeof(ttl_entry_t));
+	if( ! entries ) return 0;
+	t->entries = entries;
+	keys = (char*)realloc(t->keys, capacity * t->key_size);
+	if( ! keys ) return 0;
+	t->keys = keys;
+
+	for( i = t->capacity; i < capacity; i++ ) {
+		t->entries[i].list = NIL;
+		t->entries[i].next = (i + 1 < capacity) ? (uint32_t)(i + 1) : t->free_list;
+	}
+	t->free_list = (uint32_t)t->capacity;
+	t->capacity = capacity;
+
+	/* Keep chains short, rehash when there are more keys than buckets */
+	if( capacity <= nbuckets ) return 1;
+	buckets = (uint32_t*)malloc(capacity * sizeof(uint32_t));
+	if( ! buckets ) return 1;
+	free(t->buckets);
+	t->buckets = buckets;
+	t->bucket_mask = (uint32_t)(capacity - 1);
+	for( i = 0; i < capacity; i++ ) {
+		t->buckets[i] = NIL;
+	}
+	for( i = 0; i < t->capacity; i++ ) {
+		uint32_t h;
+		if( t->entries[i].list == NIL ) continue;
+		h = ttl_hash(ttl_key(t, i), t->key_size) & t->bucket_mask;
+		t->entries[i].hnext = t->buckets[h];
+		t->buckets[h] = (uint32_t)i;
+	}
+	return 1;
+}
+
+static void
+ttl_unlink(ttl_t* t, uint32_t idx)
+{
+	uint32_t *p = &t->buckets[ttl_hash(ttl_key(t, idx), t->key_size) & t->bucket_mask];
+	while( *p != NIL ) {
+		if( *p == idx ) {
+			*p = t->entries[idx].hnext;
+			break;
+		}
+		p = &t->entries[*p].hnext;
+	}
+	list_remove(t, idx);
+	t->entries[idx].next = t->free_list;
+	t->free_list = idx;
+	t->count--;
+}
+
+/**
+ * Set or clear (expires = 0) the expiry of `key` without journalling.
+ * @return 1 if anything changed
+ */
+static int
+ttl_apply(ttl_t* t, const char* key, uint32_t expires)
+{
+	uint32_t idx = ttl_find(t, key);
+	uint32_t h;
+
+	if( ! expires ) {
+		if( idx == NIL ) return 0;
+		ttl_unlink(t, idx);
+		return 1;
+	}
+
+	if( idx != NIL ) {
+		list_remove(t, idx);
+	}
+	else {
+		if( t->free_list == NIL && ! ttl_grow(t) ) {
+			warnx("Cannot allocate expiry for more than %zu keys", t->count);
+			return 0;
+		}
+		idx = t->free_list;
+		t->free_list = t->entries[idx].next;
+		memcpy(ttl_key(t, idx), key, t->key_size);
+		h = ttl_hash(key, t->key_size) & t->bucket_mask;
+		t->entries[idx].hnext = t->buckets[h];
+		t->buckets[h] = idx;
+		t->count++;
+	}
+	t->entries[idx].expires = expires;
+	wheel_insert(t, idx);
+	return 1;
+}
+
+static int
+journal_write(ttl_t* t, FILE* fh, const char* key, uint32_t expires)
+{
+	uint32_t be = htonl(expires);
+	return fwrite(&be, sizeof(be), 1, fh) == 1
+	    && fwrite(key, t->key_size, 1, fh) == 1;
+}
+
+/**
+ * Rewrite the journal with one record per key which still expires.
+ * @return 1 on success
+ */
+static int
+ttl_compact(ttl_t* t)
+{
+	char tmp_filename[4096];
+	uint32_t hdr = htonl((uint32_t)t->key_size);
+	FILE* fh;
+	size_t i;
+	int ok;
+
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", t->filename);
+	fh = fopen(tmp_filename, "wb");
+	if( ! fh ) {
+		warn("Cannot open expiry journal '%s'", tmp_filename);
+		return 0;
+	}
+	ok = fwrite(ttl_magic, sizeof(ttl_magic), 1, fh) == 1
+	  && fwrite(&hdr, sizeof(hdr), 1, fh) == 1;
+	for( i = 0; ok && i < t->capacity; i++ ) {
+		if( t->entries[i].list == NIL ) continue;
+		ok = journal_write(t, fh, ttl_key(t, i), t->entries[i].expires);
+	}
+	ok = ok && fflush(fh) == 0 && fdatasync(fileno(fh)) == 0;
+	ok = (fclose(fh) == 0) && ok;
+	if( ! ok || rename(tmp_filename, t->filename) != 0 ) {
+		warn("Cannot write expiry journal '%s'", t->filename);
+		unlink(tmp_filename);
+		return 0;
+	}
+
+	if( t->journal ) fclose(t->journal);
+	t->journal = fopen(t->filename, "ab");
+	if( ! t->journal ) {
+		warn("Cannot append to expiry journal '%s'", t->filename);
+		return 0;
+	}
+	t->journal_records = t->count;
+	t->dirty = 0;
+	return 1;
+}
+
+/**
+ * Load the expiry journal in `filename`, creating it if needed.
+ * Keys which expired while the server was down are due immediately.
+ */
+ttl_t* ttl_open(const char* filename, size_t key_size, uint32_t now)
+{
+	char magic[sizeof(ttl_magic)];
+	uint32_t hdr, be;
+	char* key;
+	ttl_t* t;
+	FILE* fh;
+	int i;
+
+	assert(filename != NULL);
+	assert(key_size > 0);
+	t = (ttl_t*)malloc(sizeof(ttl_t));
+	if( ! t ) return NULL;
+	memset(t, 0, sizeof(ttl_t));
+	t->key_size = key_size;
+	t->filename = filename;
+	t->now = now;
+	t->free_list = NIL;
+	t->capacity = 512;
+	t->bucket_mask = 1023;
+	t->entries = (ttl_entry_t*)malloc(t->capacity * sizeof(ttl_entry_t));
+	t->keys = (char*)malloc(t->capacity * key_size);
+	t->buckets = (uint32_t*)malloc((t->bucket_mask + 1) * sizeof(uint32_t));
+	key = (char*)malloc(key_size);
+	if( ! t->entries || ! t->keys || ! t->buckets || ! key ) {
+		free(key);
+		ttl_close(t);
+		return NULL;
+	}
+	for( i = 0; i <= TTL_EXPIRED; i++ ) {
+		t->head[i] = t->tail[i] = NIL;
+	}
+	for( i = 0; i <= (int)t->bucket_mask; i++ ) {
+		t->buckets[i] = NIL;
+	}
+	for( i = 0; i < (int)t->capacity; i++ ) {
+		t->entries[i].list = NIL;
+		t->entries[i].next = (i + 1 < (int)t->capacity) ? (uint32_t)(i + 1) : NIL;
+	}
+	t->free_list = 0;
+
+	fh = fopen(filename, "rb");
+	if( fh ) {
+		if( fread(magic, sizeof(magic), 1, fh) != 1
+		 || fread(&hdr, sizeof(hdr), 1, fh) != 1
+		 || memcmp(magic, ttl_magic, sizeof(magic)) != 0
+		 || ntohl(hdr) != key_size ) {
+			errx(EXIT_FAILURE, "Expiry journal '%s' has a bad header", filename);
+		}
+		/* A torn last record is ignored */
+		while( fread(&be, sizeof(be), 1, fh) == 1 && fread(key, key_size, 1, fh) == 1 ) {
+			ttl_apply(t, key, ntohl(be));
+		}
+		fclose(fh);
+	}
+	free(key);
+
+	if( ! ttl_compact(t) ) {
+		ttl_close(t);
+		return NULL;
+	}
+	return t;
+}
+
+void ttl_close(ttl_t* t)
+{
+	if( ! t ) return;
+	if( t->journal ) {
+		ttl_flush(t);
+		fclose(t->journal);
+	}
+	free(t->entries);
+	free(t->keys);
+	free(t->buckets);
+	free(t);
+}
+
+/**
+ * Set the absolute expiry time of `key`, 0 if it no longer expires.
+ * @return 1 if anything changed
+ */
+int ttl_set(ttl_t* t, const char* key, uint32_t expires)
+{
+	assert(t != NULL);
+	if( ! ttl_apply(t, key, expires) ) return 0;
+	if( ! t->journal || ! journal_write(t, t->journal, key, expires) ) {
+		warn("Cannot append to expiry journal '%s'", t->filename);
+	}
+	t->journal_records++;
+	t->dirty = 1;
+	return 1;
+}
+
+/**
+ * Is `key` past its expiry time, but not yet deleted?
+ */
+int ttl_expired(ttl_t* t, const char* key, uint32_t now)
+{
+	uint32_t idx;
+	if( ! t->count ) return 0;
+	idx = ttl_find(t, key);
+	return idx != NIL && t->entries[idx].expires <= now;
+}
+
+static void
+wheel_cascade(ttl_t* t, uint32_t list)
+{
+	uint32_t idx;
+	while( (idx = t->head[list]) != NIL ) {
+		list_remove(t, idx);
+		wheel_insert(t, idx);
+	}
+}
+
+/**
+ * Turn the wheels to `now`, moving due entries to the expired queue.
+ */
+void ttl_advance(ttl_t* t, uint32_t now)
+{
+	uint32_t s;
+	size_t i;
+	int level;
+
+	assert(t != NULL);
+	if( now <= t->now ) return;
+
+	if( now - t->now >= (1u << (TTL_SLOT_BITS * 2)) ) {
+		/* Stopped for a long time, cheaper to place every entry again */
+		t->now = now;
+		for( i = 0; i < t->capacity; i++ ) {
+			if( t->entries[i].list == NIL || t->entries[i].list == TTL_EXPIRED ) continue;
+			list_remove(t, (uint32_t)i);
+			wheel_insert(t, (uint32_t)i);
+		}
+		return;
+	}
+
+	for( s = t->now + 1; s <= now && s != 0; s++ ) {
+		t->now = s;
+		for( level = TTL_LEVELS - 1; level > 0; level-- ) {
+			uint32_t shift = TTL_SLOT_BITS * level;
+			if( (s & ((1u << shift) - 1)) == 0 ) {
+				wheel_cascade(t, (level * TTL_SLOTS) + ((s >> shift) & (TTL_SLOTS - 1)));
+			}
+		}
+		wheel_cascade(t, s & (TTL_SLOTS - 1));
+	}
+}
+
+/**
+ * @return The oldest expired key, NULL if none are due
+ */
+const char* ttl_peek_expired(ttl_t* t)
+{
+	uint32_t idx = t->head[TTL_EXPIRED];
+	return idx == NIL ? NULL : ttl_key(t, idx);
+}
+
+/**
+ * Make journalled changes durable, rewriting the journal if it has grown
+ * well beyond the number of keys.
+ * @return 1 on success
+ */
+int ttl_flush(ttl_t* t)
+{
+	assert(t != NULL);
+	if( ! t->dirty ) return 1;
+	if( ! t->journal || t->journal_records > (t->count * 2) + TTL_COMPACT_SLACK ) {
+		return ttl_compact(t);
+	}
+	if( fflush(t->journal) != 0 || fdatasync(fileno(t->journal)) != 0 ) {
+		warn("Cannot sync expiry journal '%s'", t->filename);
+		return 0;
+	}
+	t->dirty = 0;
+	return 1;
+}
@@ -0,0 +1,60 @@
+#ifndef _TTL_H
+#define _TTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Key expiry times, kept in a hierarchical timing wheel.
+ *
+ * Four wheels of 256 one second slots each cover 2^32 seconds, an entry
+ * sits in the slot of the coarsest wheel that still resolves its expiry
+ * and moves down a wheel each time that slot comes round. Due entries
+ * wait in the expired queue until they are deleted from the module.
+ *
+ * Changes are appended to a journal of expires[4] ++ key records,
+ * expires being 0 for a key which no longer expires, which is replayed
+ * on open and rewritten once it mostly holds overwritten records.
+ */
+#define TTL_LEVELS		4
+#define TTL_SLOT_BITS	8
+#define TTL_SLOTS		(1 << TTL_SLOT_BITS)
+#define TTL_EXPIRED		(TTL_LEVELS * TTL_SLOTS)	/* List index of the expired queue */
+
+typedef struct {
+	uint32_t expires;
+	uint32_t list;
+	uint32_t prev;
+	uint32_t next;
+	uint32_t hnext;
+} ttl_entry_t;
+
+typedef struct ttl_s {
+	size_t key_size;
+	uint32_t now;
+	size_t count;
+	size_t capacity;
+	uint32_t free_list;
+	ttl_entry_t *entries;
+	char *keys;
+	uint32_t bucket_mask;
+	uint32_t *buckets;
+	uint32_t head[TTL_EXPIRED + 1];
+	uint32_t tail[TTL_EXPIRED + 1];
+	size_t expired;
+	const char *filename;
+	FILE *journal;
+	size_t journal_records;
+	int dirty;
+} ttl_t;
+
+ttl_t* ttl_open(const char* filename, size_t key_size, uint32_t now);
+void ttl_close(ttl_t* t);
+int ttl_set(ttl_t* t, const char* key, uint32_t expires);
+int ttl_expired(ttl_t* t, const char* key, uint32_t now);
+void ttl_advance(ttl_t* t, uint32_t now);
+const char* ttl_peek_expired(ttl_t* t);
+int ttl_flush(ttl_t* t);
+
+#endif
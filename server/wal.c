@@ -0,0 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include <err.h>
+#include <assert.h>
+
+#include "db-zmq.h"
+#include "wal.h"
+
+#define WAL_CRC		4
+
+static uint32_t crc_table[256];
+
+static void
+crc_init(void)
+{
+	uint32_t i, j, c;
+	if( crc_table[1] ) return;
+	for( i = 0; i < 256; i++ ) {
+		c = i;
+		for( j = 0; j < 8; j++ ) {
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t
+crc32(const char* data, size_t len)
+{
+	uint32_t c = 0xFFFFFFFF;
+	while( len-- ) {
+		c = crc_table[(c ^ (uint8_t)*data++) & 0xFF] ^ (c >> 8);
+	}
+	return c ^ 0xFFFFFFFF;
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/**
+ * Read exactly `len` bytes.
+ * @return 0 at the end of the file or on error
+ */
+static int
+read_full(int fd, char* buf, size_t len)
+{
+	ssize_t n;
+	while( len ) {
+		n = read(fd, buf, len);
+		if( n < 0 && errno == EINTR ) continue;
+		if( n <= 0 ) return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+write_full(int fd, const char* buf, size_t len)
+{
+	ssize_t n;
+	while( len ) {
+		n = write(fd, buf, len);
+		if( n < 0 && errno == EINTR ) continue;
+		if( n <= 0 ) return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/**
+ * Sync the directory holding `filename`, so a new log outlives a crash.
+ */
+static void
+sync_dir(const char* filename)
+{
+	char* copy = strdup(filename);
+	int fd;
+	if( ! copy ) return;
+	fd = open(dirname(copy), O_RDONLY);
+	if( fd >= 0 ) {
+		fsync(fd);
+		close(fd);
+	}
+	free(copy);
+}
+
+wal_t* wal_open(const char* filename)
+{
+	wal_t* w;
+	assert(filename != NULL);
+	crc_init();
+	w = (wal_t*)calloc(1, sizeof(wal_t));
+	if( ! w ) return NULL;
+	w->filename = filename;
+	w->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if( w->fd < 0 ) {
+		warn("Cannot open WAL '%s'", filename);
+		free(w);
+		return NULL;
+	}
+	sync_dir(filename);
+	return w;
+}
+
+void wal_close(wal_t* w)
+{
+	if( ! w ) return;
+	if( w->pending ) {
+		wal_commit(w);
+	}
+	close(w->fd);
+	free(w->buf);
+	free(w);
+}
+
+/**
+ * Apply every intact record in the log with `put` and `del`, then cut
+ * off anything after the last one.
+ * @return Records applied, -1 on error
+ */
+long wal_replay(wal_t* w, dbzop_t put, dbzop_t del)
+{
+	char head[WAL_CRC + DBZ_REC_HDR];
+	char* data = NULL;
+	size_t cap = 0, len;
+	uint64_t good = 0;
+	off_t end;
+	long n = 0;
+
+	if( lseek(w->fd, 0, SEEK_SET) != 0 ) return -1;
+	while( read_full(w->fd, head, sizeof(head)) ) {
+		char type = head[WAL_CRC];
+		len = dbz_get32(head + WAL_CRC + 1);
+		if( type != DBZ_REC_PUT && type != DBZ_REC_DEL ) break;
+		if( len + DBZ_REC_HDR > cap ) {
+			char* p = (char*)realloc(data, len + DBZ_REC_HDR);
+			if( ! p ) break;
+			data = p;
+			cap = len + DBZ_REC_HDR;
+		}
+		memcpy(data, head + WAL_CRC, DBZ_REC_HDR);
+		if( ! read_full(w->fd, data + DBZ_REC_HDR, len) ) break;
+		if( crc32(data, DBZ_REC_HDR + len) != dbz_get32(head) ) break;
+
+		if( type == DBZ_REC_PUT ) put(data + DBZ_REC_HDR, len, NULL, NULL);
+		else del(data + DBZ_REC_HDR, len, NULL, NULL);
+		good += sizeof(head) + len;
+		n++;
+	}
+	free(data);
+
+	end = lseek(w->fd, 0, SEEK_END);
+	if( end < 0 ) return -1;
+	if( (uint64_t)end > good ) {
+		warnx("Cutting %llu bytes of torn WAL from '%s'", (unsigned long long)(end - good), w->filename);
+		if( ftruncate(w->fd, good) != 0 || fdatasync(w->fd) != 0 ) {
+			warn("Cannot truncate WAL '%s'", w->filename);
+			return -1;
+		}
+		lseek(w->fd, good, SEEK_SET);
+	}
+	w->size = good;
+	return n;
+}
+
+/**
+ * Buffer a mutation until the next wal_commit().
+ * @return 0 when out of memory
+ */
+int wal_append(wal_t* w, char type, const char* data, size_t len)
+{
+	size_t need = w->used + WAL_CRC + DBZ_REC_HDR + len;
+	char* rec;
+
+	assert(type == DBZ_REC_PUT || type == DBZ_REC_DEL);
+	if( need > w->cap ) {
+		size_t n = w->cap ? w->cap : 65536;
+		char* p;
+		while( n < need ) n *= 2;
+		p = (char*)realloc(w->buf, n);
+		if( ! p ) return 0;
+		w->buf = p;
+		w->cap = n;
+	}
+	rec = w->buf + w->used + WAL_CRC;
+	dbz_record_header(rec, type, len);
+	memcpy(rec + DBZ_REC_HDR, data, len);
+	dbz_put32(w->buf + w->used, crc32(rec, DBZ_REC_HDR + len));
+	w->used = need;
+	w->pending++;
+	return 1;
+}
+
+/**
+ * Write the buffered mutations and sync them, once for the lot.
+ * @return 0 on error, the log is then in an unknown state
+ */
+int wal_commit(wal_t* w)
+{
+	uint64_t started, took;
+
+	if( ! w->used ) return 1;
+	started = now_us();
+	if( ! write_full(w->fd, w->buf, w->used) || fdatasync(w->fd) != 0 ) {
+		warn("Cannot write WAL '%s'", w->filename);
+		return 0;
+	}
+	took = now_us() - started;
+	w->size += w->used;
+	w->records += w->pending;
+	w->used = 0;
+	w->pending = 0;
+	w->commits++;
+	w->commit_us += took;
+	if( took > w->max_commit_us ) w->max_commit_us = took;
+	return 1;
+}
+
+/**
+ * Empty the log, once the module has synced everything in it.
+ */
+int wal_truncate(wal_t* w)
+{
+	if( ftruncate(w->fd, 0) != 0 || lseek(w->fd, 0, SEEK_SET) != 0 || fdatasync(w->fd) != 0 ) {
+		warn("Cannot truncate WAL '%s'", w->filename);
+		return 0;
+	}
+	w->size = 0;
+	w->truncates++;
+	return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef _WAL_H
+#define _WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../i_speak_db.h"
+
+/**
+ * Write-ahead log of the mutations the server applied, so writes which
+ * the module hasn't synced survive a crash.
+ *
+ * Each mutation is appended as crc[4] ++ record, the record being a
+ * DBZ_REC_PUT or DBZ_REC_DEL record (see i_speak_db.h) and crc the
+ * big-endian CRC-32 of it. Appends are buffered and written by
+ * wal_commit() with a single fdatasync(), so a group of mutations costs
+ * one sync. On start the log is replayed into the module and a torn or
+ * corrupt tail, left by a crash mid-write, is cut off. Once the module
+ * has synced everything the log is emptied with wal_truncate().
+ */
+typedef struct wal_s {
+	int fd;
+	const char *filename;
+	char *buf;
+	size_t used;
+	size_t cap;
+	uint64_t size;		/* Bytes in the file */
+	uint64_t pending;	/* Records appended but not committed */
+	/* Counters */
+	uint64_t records;
+	uint64_t commits;
+	uint64_t commit_us;
+	uint64_t max_commit_us;
+	uint64_t truncates;
+} wal_t;
+
+wal_t* wal_open(const char* filename);
+void wal_close(wal_t* w);
+long wal_replay(wal_t* w, dbzop_t put, dbzop_t del);
+int wal_append(wal_t* w, char type, const char* data, size_t len);
+int wal_commit(wal_t* w);
+int wal_truncate(wal_t* w);
+
+#endif
@@ -4,12 +4,15 @@ class DBZMQ{
 	private $ops = array();
 	/** @var ZMQContext */
 	private $ctx;
+	private $next_id = 0;
+	private $headers = array();
 	public function __construct(){
 		$this->ctx = new ZMQContext();
 	}
 	public function bind($name, $type, $addr) {
 		assert($name != 'bind');		
 		$sock = $this->ctx->getSocket($type, __FILE__."-".$name);
+		if( $type == ZMQ::SOCKET_SUB ) $sock->setSockOpt(ZMQ::SOCKOPT_SUBSCRIBE, '');
 		$sock->connect($addr);
 		$this->ops[$name] = array(
 			'type' => $type,
@@ -23,19 +26,87 @@ class DBZMQ{
 		$op = $this->ops[$name];
 		$data = implode('', $args);
 		$sock = $op['sock'];
-		$sock->send($data);
+		$headers = $this->headers;
+		$this->headers = array();
 
 		switch($op['type']){
+		case ZMQ::SOCKET_XREQ:
+			$x = $this->pipeline($name, array($data), $headers);
+			return $x[0];
+
 		case ZMQ::SOCKET_PAIR:
 		case ZMQ::SOCKET_REQ:
-		case ZMQ::SOCKET_XREQ:
+			$sock->sendmulti(array_merge($headers, array($data)));
 			$x = $sock->recv();
 			return $x;
 		
 		default:
+			$sock->send($data);
 			return NULL;
 		}
 	}
+
+	/**
+	 * Read-your-writes: the next request waits, on the server, until the
+	 * mutation acknowledged with $ack has been applied.
+	 */
+	public function after($ack){
+		$this->headers[] = 'S' . $ack;
+		return $this;
+	}
+
+	/**
+	 * Wait for the ack of a mutation of $key, for ops bound with
+	 * ZMQ::SOCKET_SUB to acks=pub@...
+	 *
+	 * Each ack is k ++ epoch[8] ++ seq[8] ++ type[1].
+	 *
+	 * @return string epoch[8] ++ seq[8], for after(), or FALSE if there
+	 *         was none waiting and $block is FALSE
+	 */
+	public function ack($name, $key, $block = TRUE){
+		assert($this->ops[$name]['type'] == ZMQ::SOCKET_SUB);
+		$sock = $this->ops[$name]['sock'];
+		do {
+			$msg = $sock->recv($block ? 0 : ZMQ::MODE_NOBLOCK);
+			if( $msg === FALSE ) return FALSE;
+		} while( substr($msg, 0, strlen($key)) != $key );
+		return substr($msg, strlen($key), 16);
+	}
+
+	/**
+	 * Send every request before waiting for any reply, for ops bound
+	 * with ZMQ::SOCKET_XREQ to a router@ socket.
+	 *
+	 * Each request goes out as request-id ++ payload and each reply comes
+	 * back as request-id ++ reply, in any order.
+	 *
+	 * @return array Replies in the same order as $requests
+	 */
+	public function pipeline($name, array $requests, array $headers = array()){
+		assert(isset($this->ops[$name]));
+		$op = $this->ops[$name];
+		assert($op['type'] == ZMQ::SOCKET_XREQ);
+		$sock = $op['sock'];
+
+		$pending = array();
+		foreach( array_values($requests) as $i => $data ){
+			$id = pack('N', $this->next_id++ & 0xFFFFFFFF);
+			$pending[$id] = $i;
+			$sock->sendmulti(array_merge(array($id), $headers, array($data)));
+		}
+
+		$replies = array();
+		while( count($pending) ){
+			$parts = $sock->recvmulti();
+			$id = $parts[0];
+			if( ! isset($pending[$id]) ) continue;
+			$replies[$pending[$id]] = end($parts);
+			unset($pending[$id]);
+		}
+		ksort($replies);
+		return $replies;
+	}
 }
 
 
@@ -43,6 +114,17 @@ $dbz = new DBZMQ();
 $dbz->bind("get",ZMQ::SOCKET_REQ,"tcp://127.0.0.1:17700");
 $dbz->bind("put",ZMQ::SOCKET_PUSH,"tcp://127.0.0.1:17701");
 $dbz->bind("del",ZMQ::SOCKET_PUSH,"tcp://127.0.0.1:17702");
+$dbz->bind("pget",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17703");   // get=router@...
+$dbz->bind("putex",ZMQ::SOCKET_PUSH,"tcp://127.0.0.1:17704");
+$dbz->bind("batch",ZMQ::SOCKET_REQ,"tcp://127.0.0.1:17706");
+$dbz->bind("backup",ZMQ::SOCKET_REQ,"tcp://127.0.0.1:17707");
+$dbz->bind("putblob",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17709"); // putblob=router@...
+$dbz->bind("getblob",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17711"); // getblob=router@...
+$dbz->bind("delblob",ZMQ::SOCKET_PUSH,"tcp://127.0.0.1:17712");
+$dbz->bind("acks",ZMQ::SOCKET_SUB,"tcp://127.0.0.1:17713");
+$dbz->bind("incr",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17714");    // incr=router@...
+$dbz->bind("append",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17717");  // append=router@...
+$dbz->bind("cas",ZMQ::SOCKET_XREQ,"tcp://127.0.0.1:17718");     // cas=router@...
 
 // Contrived test sequence to validate the 'protocol'.
 /*
@@ -51,6 +133,21 @@ Definition:
   get(k20) -> k ++ vN || k
   put(k20++vN) -> k ++ v || k
   del(k20) -> k ++ "OK" || k
+  putex(k20++ttl4++vN) -> k ++ v || k
+  batch(('P' ++ len4 ++ k20++vN || 'D' ++ len4 ++ k20)*) -> status[1]*
+  backup(address) -> 'O' || 'B', then to a PULL socket at address:
+    seq8 ++ 'C', ('P' ++ len4 ++ k20++vN)*  ...  seq8 ++ 'E', ''
+  putblob(k20++gen8++seq4++('M' || 'E')++vN) -> k ++ gen8 ++ seq4 ++ ('O' || 'C' || 'F')
+  getblob(k20++gen8++seq4) -> k ++ gen8 ++ seq4 ++ ('M' || 'E') ++ vN || k
+  delblob(k20) -> k
+  acks: k20 ++ epoch8 ++ seq8 ++ ('P' || 'D') for every applied mutation
+  incr(k20++delta8) -> k ++ value8 || k
+  append(k20++vN) -> k ++ size4 || k
+  cas(k20++len4++expected++vN) -> k ++ ('O' || 'M' ++ vN || 'N') || k
+
+Any request may carry an 'S' ++ epoch8 ++ seq8 frame before its payload,
+it then waits until that mutation is applied or answers with the frames
+"!timeout", k.
 
 With the key length being fixed at 20 bytes (160 bits) 
 it allows for a protocol which can be easily expressed.
@@ -66,20 +163,132 @@ $valB = md5("VALUE_B");
 assert(strlen($varA) == 20);               // sha1(a) = A
 assert(strlen($varB) == 20);               // sha1(a) = B
 
-// Verify Del() works
+// A subscriber misses what is published before it has connected
+$probe = sha1("PROBE", TRUE);
+do {
+	$dbz->del($probe);
+	usleep(10000);
+} while( $dbz->ack('acks', $probe, FALSE) === FALSE );
+
+// Verify Del() works, mutations are applied in order so the ack of
+// del(B) covers del(A)
 assert($dbz->del($varA) == NULL);          // del(A)
 assert($dbz->del($varB) == NULL);          // del(B)
-sleep(1);
-assert($dbz->get($varA) == $varA);         // get(A) = A
+$ack = $dbz->ack('acks', $varB);
+assert($dbz->after($ack)->get($varA) == $varA);         // get(A) = A
 assert($dbz->get($varB) == $varB);         // get(B) = B
 
 // Verify Put() and Get() work
 assert($dbz->put($varA, $valA) == NULL);    // put(A ++ a)
 assert($dbz->put($varB, $valB) == NULL);    // put(B ++ b)
+$ack = $dbz->ack('acks', $varB);
+assert($dbz->after($ack)->get($varA) == $varA . $valA);
+assert($dbz->get($varB) == $varB . $valB);
+
+// Verify a get waits for the mutation it names
+$later = substr($ack, 0, 8) . pack('NN', 0x7FFFFFFF, 0);
+$x = $dbz->after($later)->pget($varA);
+assert($x == $varA);			// "!timeout", A
+
+// Verify pipelined Get() over router socket
+assert($dbz->pget($varA) == $varA . $valA);
+$x = $dbz->pipeline('pget', array($varA, $varB, $varA));
+assert($x[0] == $varA . $valA);
+assert($x[1] == $varB . $valB);
+assert($x[2] == $varA . $valA);
+
+// Verify PutEx() values expire
+assert($dbz->putex($varA, pack('N', 1), $valA) == NULL);   // putex(A ++ 1s ++ a)
 sleep(1);
 assert($dbz->get($varA) == $varA . $valA);
-assert($dbz->get($varB) == $varB . $valB);
+sleep(2);
+assert($dbz->get($varA) == $varA);
+
+// Verify Batch() applies puts and deletes together
+$rec = function($type, $data){ return $type . pack('N', strlen($data)) . $data; };
+assert($dbz->batch($rec('D', $varA), $rec('P', $varB . $valA)) == 'OO');
+assert($dbz->get($varA) == $varA);
+assert($dbz->get($varB) == $varB . $valA);
+assert($dbz->batch('P') == 'F');
+
+// Verify Incr() adds a signed delta, wrapping past the largest value
+$varC = sha1("VARIABLE_C", TRUE);
+$varD = sha1("VARIABLE_D", TRUE);
+$varE = sha1("VARIABLE_E", TRUE);
+assert($dbz->del($varC) == NULL);
+assert($dbz->del($varD) == NULL);
+assert($dbz->del($varE) == NULL);
+$ack = $dbz->ack('acks', $varE);
+assert($dbz->after($ack)->incr($varC, pack('J', 5)) == $varC . pack('J', 5));
+assert($dbz->incr($varC, pack('J', -2)) == $varC . pack('J', 3));
+assert($dbz->incr($varC, pack('J', PHP_INT_MAX)) == $varC . pack('J', PHP_INT_MIN + 2));
+assert($dbz->get($varC) == $varC . pack('J', PHP_INT_MIN + 2));
+
+// Verify Append() grows a value, which then isn't a counter
+assert($dbz->append($varD, "abc") == $varD . pack('N', 3));
+assert($dbz->append($varD, "de") == $varD . pack('N', 5));
+assert($dbz->incr($varD, pack('J', 1)) == $varD);
+assert($dbz->get($varD) == $varD . "abcde");
+
+// Verify Cas() stores only over the expected value
+assert($dbz->cas($varD, pack('N', 5), "abcde", "xyz") == $varD . 'O');
+assert($dbz->cas($varD, pack('N', 5), "abcde", "q") == $varD . 'Mxyz');
+assert($dbz->get($varD) == $varD . "xyz");
+assert($dbz->cas($varE, pack('N', 3), "xyz", "q") == $varE . 'N');
+assert($dbz->cas($varE, pack('N', 0xFFFFFFFF), "new") == $varE . 'O');
+assert($dbz->cas($varE, pack('N', 0xFFFFFFFF), "again") == $varE . 'Mnew');
+
+// Verify PutBlob() and GetBlob() move a value in chunks
+$blob = str_repeat(md5("BLOB", TRUE), 4096);
+$chunks = str_split($blob, 16384);
+$gen = str_repeat("\0", 8);
+foreach( $chunks as $seq => $chunk ){
+	$last = ($seq == count($chunks) - 1);
+	$x = $dbz->putblob($varA, $gen, pack('N', $seq), $last ? 'E' : 'M', $chunk);
+	assert($x[32] == ($last ? 'C' : 'O'));
+	$gen = substr($x, 20, 8);
+}
+$read = '';
+$seq = 0;
+do {
+	$x = $dbz->getblob($varA, $gen, pack('N', $seq++));
+	assert(strlen($x) > 33);
+	$read .= substr($x, 33);
+} while( $x[32] == 'M' );
+assert($read == $blob);
+
+// Verify a new generation replaces the blob, its old chunks are deleted
+// by the server with no one to answer
+$blob = str_repeat(md5("BLOB2", TRUE), 1024);
+$x = $dbz->putblob($varA, str_repeat("\0", 8), pack('N', 0), 'E', $blob);
+assert($x[32] == 'C');
+assert(substr($x, 20, 8) != $gen);
+$gen = substr($x, 20, 8);
+$x = $dbz->getblob($varA, $gen, pack('N', 0));
+assert($x[32] == 'E');
+assert(substr($x, 33) == $blob);
+assert($dbz->get($varB) == $varB . $valA);
+
+// Verify Backup() streams every key to the receiver
+$ctx = new ZMQContext();
+$receiver = $ctx->getSocket(ZMQ::SOCKET_PULL);
+$receiver->bind("tcp://127.0.0.1:17708");
+assert($dbz->backup("tcp://127.0.0.1:17708") == 'O');
+$backup = array();
+do {
+	list($hdr, $records) = $receiver->recvmulti();
+	for( $i = 0; $i < strlen($records); $i += 5 + $len ){
+		list(, $len) = unpack('N', substr($records, $i + 1, 4));
+		$backup[substr($records, $i + 5, 20)] = substr($records, $i + 25, $len - 20);
+	}
+} while( $hdr[8] == 'C' );
+assert($hdr[8] == 'E');
+assert($backup[$varB] == $valA);
+assert(strlen($backup[$varA]) == 24);	// Blob manifest
 
 // Clean up
-assert($dbz->del($varA) == NULL);         
-assert($dbz->del($varB) == NULL);         
+assert($dbz->delblob($varA) == NULL);
+assert($dbz->del($varB) == NULL);
+assert($dbz->del($varC) == NULL);
+assert($dbz->del($varD) == NULL);
+assert($dbz->del($varE) == NULL);         
@@ -0,0 +1,229 @@
+/*
+ * The client library, see client/dbz-client.h: replies are matched to
+ * their requests in whatever order they come, batched puts and dels are
+ * answered record by record and sent before later requests, and gets
+ * refused as overloaded are sent again.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+#include "../client/dbz-client.h"
+
+#define MAX_CALLS	16
+
+/* Callbacks made, in the order they were made */
+static struct {
+	int n;
+	int arg[MAX_CALLS];
+	int status[MAX_CALLS];
+	char value[MAX_CALLS][16];
+	size_t len[MAX_CALLS];
+} calls;
+
+static void on_reply(void* arg, int status, const char* data, size_t len)
+{
+	int i = calls.n++;
+	CHECK(i < MAX_CALLS && len < sizeof(calls.value[i]));
+	calls.arg[i] = (int)(size_t)arg;
+	calls.status[i] = status;
+	calls.len[i] = len;
+	if( len ) memcpy(calls.value[i], data, len);
+}
+
+static const char* client_key(int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "client-%d", i);
+	return test_key(name);
+}
+
+static void put(void* dealer, const char* key, const char* value)
+{
+	test_reply_t r;
+	char rec[40];
+	memcpy(rec, key, 20);
+	memcpy(rec + 20, value, strlen(value));
+	test_call(dealer, rec, 20 + strlen(value), &r);
+	CHECK(r.nframes == 1 && r.len[0] == 20 + strlen(value));
+	test_reply_free(&r);
+}
+
+static void start(const char* name)
+{
+	const char* args[] = {
+		test_bind(name, "get", "router"),
+		test_bind(name, "put", "router"),
+		test_bind(name, "batch", "router"),
+		NULL
+	};
+	void* dealer;
+	char value[8];
+	int i;
+
+	test_node(name, NULL, args);
+	dealer = test_socket(ZMQ_DEALER, test_op(name, "put"));
+	for( i = 0; i < 6; i++ ) {
+		snprintf(value, sizeof(value), "v%d", i);
+		put(dealer, client_key(i), value);
+	}
+	put(dealer, test_key("client-node"), name);
+	zmq_close(dealer);
+}
+
+/* Answer a request read by `router`, as db-zmq would */
+static void reply(void* router, test_reply_t* req, const char* status, const char* data, size_t len)
+{
+	test_frame(router, req->data[0], req->len[0], 1);
+	test_frame(router, req->data[1], req->len[1], 1);
+	if( status ) test_frame(router, status, strlen(status), 1);
+	test_frame(router, data, len, 0);
+}
+
+int main(int argc, char** argv)
+{
+	dbzc_t *c, *fake_c;
+	void* fake;
+	test_reply_t r, retry;
+	char value[32];
+	int i, seen_a = 0, seen_b = 0, overtaken = 0;
+
+	test_init(argc, argv);
+	start("a");
+	start("b");
+
+	/* A request never timing out would keep every later one waiting */
+	c = dbzc_new(test_zctx);
+	CHECK(c != NULL);
+	CHECK(dbzc_set(c, DBZC_OPT_TIMEOUT, 0) == DBZC_INVALID);
+	CHECK(dbzc_set(c, DBZC_OPT_POOL, 1) == DBZC_OK);
+	CHECK(dbzc_connect(c, "get", test_op("a", "get")) == DBZC_OK);
+	CHECK(dbzc_connect(c, "get", test_op("b", "get")) == DBZC_OK);
+	CHECK(dbzc_connect(c, "batch", test_op("a", "batch")) == DBZC_OK);
+
+	/* Gets are spread between both nodes once connected to each */
+	for( i = 0; i < 100 && ! (seen_a && seen_b); i++ ) {
+		calls.n = 0;
+		CHECK(dbzc_get(c, test_key("client-node"), on_reply, NULL) == DBZC_OK);
+		CHECK(dbzc_wait(c, 5000) == 0);
+		CHECK(calls.n == 1 && calls.status[0] == DBZC_OK && calls.len[0] == 1);
+		seen_a |= calls.value[0][0] == 'a';
+		seen_b |= calls.value[0][0] == 'b';
+	}
+	CHECK(seen_a && seen_b);
+
+	/* While b is stopped, a answers the later requests first */
+	calls.n = 0;
+	test_pause("b", 1);
+	for( i = 0; i < 6; i++ ) CHECK(dbzc_get(c, client_key(i), on_reply, (void*)(size_t)i) == DBZC_OK);
+	CHECK(dbzc_wait(c, 300) == 3);
+	test_pause("b", 0);
+	CHECK(dbzc_wait(c, 5000) == 0);
+	CHECK(calls.n == 6);
+	for( i = 0; i < 6; i++ ) {
+		snprintf(value, sizeof(value), "v%d", calls.arg[i]);
+		CHECK(calls.status[i] == DBZC_OK);
+		CHECK(calls.len[i] == strlen(value) && memcmp(calls.value[i], value, calls.len[i]) == 0);
+		if( i && calls.arg[i] < calls.arg[i - 1] ) overtaken = 1;
+	}
+	CHECK(overtaken);
+
+	/* Puts and dels gathered into one batch, each answered */
+	calls.n = 0;
+	CHECK(dbzc_put(c, test_key("client-batch-0"), "x0", 2, on_reply, (void*)0) == DBZC_OK);
+	CHECK(dbzc_put(c, test_key("client-batch-1"), "x1", 2, on_reply, (void*)1) == DBZC_OK);
+	CHECK(dbzc_del(c, test_key("client-node"), on_reply, (void*)2) == DBZC_OK);
+	CHECK(dbzc_pending(c) == 3);
+	CHECK(dbzc_wait(c, 5000) == 0);
+	CHECK(calls.n == 3);
+	for( i = 0; i < 3; i++ ) CHECK(calls.arg[i] == i && calls.status[i] == DBZC_OK);
+	{
+		void* get = test_socket(ZMQ_DEALER, test_op("a", "get"));
+		CHECK(test_wait_value(get, test_key("client-batch-1"), 20, "x1", 2, 5000));
+		CHECK(test_wait_value(get, test_key("client-node"), 20, NULL, 0, 5000));
+		zmq_close(get);
+	}
+	dbzc_free(c);
+
+	/*
+	 * db-zmq only refuses a get past its deadline, which the client
+	 * doesn't send, no module answers a batch with some records applied
+	 * and others not, and requests on different sockets may be read in
+	 * either order, so those come from a stand-in for the server.
+	 */
+	fake = zmq_socket(test_zctx, ZMQ_ROUTER);
+	CHECK(fake != NULL);
+	CHECK(zmq_bind(fake, test_op("fake", "ops")) == 0);
+	fake_c = dbzc_new(test_zctx);
+	CHECK(fake_c != NULL);
+	CHECK(dbzc_set(fake_c, DBZC_OPT_TIMEOUT, 5000) == DBZC_OK);
+	CHECK(dbzc_connect(fake_c, "get", test_op("fake", "ops")) == DBZC_OK);
+	CHECK(dbzc_connect(fake_c, "batch", test_op("fake", "ops")) == DBZC_OK);
+
+	/* A get refused as overloaded is sent again under a new id */
+	calls.n = 0;
+	CHECK(dbzc_get(fake_c, client_key(0), on_reply, NULL) == DBZC_OK);
+	CHECK(test_recv(fake, &r, 5000) && r.nframes == 3 && r.len[2] == 20);
+	reply(fake, &r, DBZ_STATUS_OVERLOAD, r.data[2], 20);
+	CHECK(dbzc_poll(fake_c, 5000) == 0);
+	CHECK(test_recv(fake, &retry, 5000) && retry.nframes == 3);
+	CHECK(memcmp(retry.data[1], r.data[1], 8) != 0);
+	CHECK(retry.len[2] == 20 && memcmp(retry.data[2], client_key(0), 20) == 0);
+	memcpy(value, client_key(0), 20);
+	memcpy(value + 20, "fresh", 5);
+	reply(fake, &retry, NULL, value, 25);
+	CHECK(dbzc_wait(fake_c, 5000) == 0);
+	CHECK(calls.n == 1 && calls.status[0] == DBZC_OK);
+	CHECK(calls.len[0] == 5 && memcmp(calls.value[0], "fresh", 5) == 0);
+	test_reply_free(&r);
+	test_reply_free(&retry);
+
+	/* A status per record, those missing from a short reply failed */
+	calls.n = 0;
+	CHECK(dbzc_put(fake_c, client_key(0), "x", 1, on_reply, (void*)0) == DBZC_OK);
+	CHECK(dbzc_put(fake_c, client_key(1), "x", 1, on_reply, (void*)1) == DBZC_OK);
+	CHECK(dbzc_del(fake_c, client_key(2), on_reply, (void*)2) == DBZC_OK);
+	CHECK(dbzc_del(fake_c, client_key(3), on_reply, (void*)3) == DBZC_OK);
+	CHECK(dbzc_poll(fake_c, 0) == 0);
+	CHECK(test_recv(fake, &r, 5000) && r.nframes == 3);
+	CHECK(dbz_batch_count(r.data[2], r.len[2], 20) == 4);
+	{
+		const char status[] = {DBZ_REC_OK, DBZ_REC_FAILED, DBZ_REC_OK};
+		reply(fake, &r, NULL, status, sizeof(status));
+	}
+	test_reply_free(&r);
+	CHECK(dbzc_wait(fake_c, 5000) == 0);
+	CHECK(calls.n == 4);
+	for( i = 0; i < 4; i++ ) CHECK(calls.arg[i] == i);
+	CHECK(calls.status[0] == DBZC_OK && calls.status[1] == DBZC_FAILED);
+	CHECK(calls.status[2] == DBZC_OK && calls.status[3] == DBZC_FAILED);
+
+	/* A gathered put is sent before a later get, without a poll between */
+	calls.n = 0;
+	CHECK(dbzc_put(fake_c, client_key(0), "x", 1, on_reply, (void*)0) == DBZC_OK);
+	CHECK(dbzc_get(fake_c, client_key(0), on_reply, (void*)1) == DBZC_OK);
+	CHECK(test_recv(fake, &r, 5000) && r.nframes == 3);
+	CHECK(test_recv(fake, &retry, 5000) && retry.nframes == 3);
+	if( r.len[2] == 20 ) {
+		test_reply_t get = r;
+		r = retry;
+		retry = get;
+	}
+	CHECK(dbz_batch_count(r.data[2], r.len[2], 20) == 1 && retry.len[2] == 20);
+	CHECK(dbz_get64(r.data[1]) < dbz_get64(retry.data[1]));
+	reply(fake, &r, NULL, "O", 1);
+	memcpy(value, client_key(0), 20);
+	memcpy(value + 20, "x", 1);
+	reply(fake, &retry, NULL, value, 21);
+	test_reply_free(&r);
+	test_reply_free(&retry);
+	CHECK(dbzc_wait(fake_c, 5000) == 0);
+	CHECK(calls.n == 2 && calls.status[0] == DBZC_OK && calls.status[1] == DBZC_OK);
+	dbzc_free(fake_c);
+	zmq_close(fake);
+
+	CHECK(test_alive("a") && test_alive("b"));
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
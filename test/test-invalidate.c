@@ -0,0 +1,140 @@
+/*
+ * Subscribers to invalidate hear of every put and del, those of the TTL
+ * sweeper included, and a replica publishes what it applies.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+/**
+ * Read messages until one for `key` of `type`, noting its epoch and seq.
+ * @return 0 if none came within `timeout_ms`
+ */
+static int wait_message(void* sub, const char* key, char type, uint64_t* epoch, uint64_t* seq, long timeout_ms)
+{
+	uint64_t until = test_now_ms() + timeout_ms;
+	test_reply_t r;
+	int found = 0;
+
+	while( ! found && test_now_ms() <= until ) {
+		if( ! test_recv(sub, &r, 100) ) continue;
+		CHECK(r.nframes == 1 && r.len[0] == 20 + 17);
+		found = memcmp(r.data[0], key, 20) == 0 && r.data[0][36] == type;
+		if( found ) {
+			*epoch = dbz_get64(r.data[0] + 20);
+			*seq = dbz_get64(r.data[0] + 28);
+		}
+		test_reply_free(&r);
+	}
+	return found;
+}
+
+/* Delete `key` until `sub` hears of it, it misses what is published before it has connected */
+static void probe(void* del, void* sub, const char* key)
+{
+	test_reply_t r;
+	uint64_t epoch, seq;
+	int i;
+
+	for( i = 0; ; i++ ) {
+		CHECK(i < 50);
+		test_call(del, key, 20, &r);
+		test_reply_free(&r);
+		if( wait_message(sub, key, 'D', &epoch, &seq, 100) ) break;
+	}
+}
+
+static void* subscribe(const char* node, const char* prefix)
+{
+	void* sub = test_socket(ZMQ_SUB, test_op(node, "invalidate"));
+	zmq_setsockopt(sub, ZMQ_SUBSCRIBE, prefix, strlen(prefix));
+	return sub;
+}
+
+int main(int argc, char** argv)
+{
+	void *put, *putex, *del, *sub, *replica_sub;
+	uint64_t epoch, put_seq, del_seq, e, s;
+	test_reply_t r;
+	char rec[31];
+
+	test_init(argc, argv);
+	{
+		const char* args[] = {
+			test_bind("primary", "put", "router"),
+			test_bind("primary", "putex", "router"),
+			test_bind("primary", "del", "router"),
+			test_bind("primary", "invalidate", "pub"),
+			test_bind("primary", "binlog", "pub"),
+			test_bind("primary", "binlog-sync", "rep"),
+			NULL
+		};
+		test_node("primary", NULL, args);
+	}
+	{
+		const char* env[] = {
+			test_env("DBZMQ_REPLICA_OF", test_op("primary", "binlog")),
+			test_env("DBZMQ_REPLICA_SYNC", test_op("primary", "binlog-sync")),
+			test_env("DBZMQ_REPLICA_EMPTY", "1"),
+			NULL
+		};
+		const char* args[] = {test_bind("replica", "invalidate", "pub"), NULL};
+		test_node("replica", env, args);
+	}
+	put = test_socket(ZMQ_DEALER, test_op("primary", "put"));
+	putex = test_socket(ZMQ_DEALER, test_op("primary", "putex"));
+	del = test_socket(ZMQ_DEALER, test_op("primary", "del"));
+	sub = subscribe("primary", "inval-");
+	replica_sub = subscribe("replica", "inval-");
+	probe(del, sub, test_key("inval-probe"));
+	probe(del, replica_sub, test_key("inval-probe"));
+	while( test_recv(sub, &r, 200) ) test_reply_free(&r);
+
+	/* Only keys starting with the prefix, each put and del with a later seq */
+	memcpy(rec, test_key("other"), 20);
+	memcpy(rec + 20, "value", 5);
+	test_call(put, rec, 25, &r);
+	test_reply_free(&r);
+	memcpy(rec, test_key("inval-a"), 20);
+	test_call(put, rec, 25, &r);
+	test_reply_free(&r);
+	CHECK(test_recv(sub, &r, 5000));
+	CHECK(r.nframes == 1 && r.len[0] == 20 + 17);
+	CHECK(memcmp(r.data[0], test_key("inval-a"), 20) == 0 && r.data[0][36] == 'P');
+	epoch = dbz_get64(r.data[0] + 20);
+	put_seq = dbz_get64(r.data[0] + 28);
+	test_reply_free(&r);
+
+	test_call(del, test_key("inval-a"), 20, &r);
+	test_reply_free(&r);
+	CHECK(wait_message(sub, test_key("inval-a"), 'D', &e, &del_seq, 5000));
+	CHECK(e == epoch && del_seq > put_seq);
+
+	/* The replica publishes the primary's epoch and seq once applied */
+	CHECK(wait_message(replica_sub, test_key("inval-a"), 'D', &e, &s, 5000));
+	CHECK(e == epoch && s == del_seq);
+
+	/* Deletes by the TTL sweeper are published too, by both */
+	memcpy(rec, test_key("inval-ttl"), 20);
+	dbz_put32(rec + 20, 1);
+	memcpy(rec + 24, "expires", 7);
+	test_call(putex, rec, sizeof(rec), &r);
+	test_reply_free(&r);
+	CHECK(wait_message(sub, test_key("inval-ttl"), 'P', &e, &put_seq, 5000));
+	CHECK(e == epoch && put_seq > del_seq);
+	CHECK(wait_message(sub, test_key("inval-ttl"), 'D', &e, &del_seq, 5000));
+	CHECK(e == epoch && del_seq > put_seq);
+	CHECK(wait_message(replica_sub, test_key("inval-ttl"), 'D', &e, &s, 5000));
+	CHECK(e == epoch && s == del_seq);
+	CHECK(test_alive("primary") && test_alive("replica"));
+
+	zmq_close(put);
+	zmq_close(putex);
+	zmq_close(del);
+	zmq_close(sub);
+	zmq_close(replica_sub);
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
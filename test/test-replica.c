@@ -0,0 +1,90 @@
+/*
+ * A replica applies the puts and dels of its primary, see binlog.h, and
+ * stops once it can't follow the primary any more.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+static void start_primary(void)
+{
+	const char* args[] = {
+		test_bind("primary", "put", "router"),
+		test_bind("primary", "del", "router"),
+		test_bind("primary", "binlog", "pub"),
+		test_bind("primary", "binlog-sync", "rep"),
+		NULL
+	};
+	test_node("primary", NULL, args);
+}
+
+/* A replica which exits before binding its ipc:// sockets binds inproc:// */
+static void start_replica(const char* name, const char* empty, const char* get)
+{
+	const char* env[] = {
+		test_env("DBZMQ_REPLICA_OF", test_op("primary", "binlog")),
+		test_env("DBZMQ_REPLICA_SYNC", test_op("primary", "binlog-sync")),
+		test_env("DBZMQ_REPLICA_EMPTY", empty),
+		NULL
+	};
+	const char* args[] = {get, NULL};
+	test_node(name, env, args);
+}
+
+int main(int argc, char** argv)
+{
+	void *put, *del, *get;
+	test_reply_t r;
+	int i;
+
+	test_init(argc, argv);
+	start_primary();
+	start_replica("replica", "1", test_bind("replica", "get", "router"));
+	put = test_socket(ZMQ_DEALER, test_op("primary", "put"));
+	del = test_socket(ZMQ_DEALER, test_op("primary", "del"));
+	get = test_socket(ZMQ_DEALER, test_op("replica", "get"));
+
+	/* Puts reach the replica */
+	for( i = 0; i < 10; i++ ) {
+		char rec[27];
+		memcpy(rec, test_key(i % 2 ? "replica-odd" : "replica-even"), 20);
+		memcpy(rec + 20, "value-", 6);
+		rec[26] = '0' + i;
+		test_call(put, rec, sizeof(rec), &r);
+		CHECK(r.nframes == 1 && r.len[0] == sizeof(rec));
+		test_reply_free(&r);
+	}
+	CHECK(test_wait_value(get, test_key("replica-odd"), 20, "value-9", 7, 5000));
+	CHECK(test_wait_value(get, test_key("replica-even"), 20, "value-8", 7, 5000));
+
+	/* So do deletes, which the replica applies without a reply */
+	test_call(del, test_key("replica-odd"), 20, &r);
+	test_reply_free(&r);
+	CHECK(test_wait_value(get, test_key("replica-odd"), 20, NULL, 0, 5000));
+	CHECK(test_wait_value(get, test_key("replica-even"), 20, "value-8", 7, 5000));
+	CHECK(test_alive("replica"));
+
+	/* Without a state file the primary's existing data can't be fetched */
+	start_replica("late", "0", "get=router@inproc://late.get");
+	CHECK(test_exited("late", 5000));
+	CHECK(test_log_contains("late", "Replica has no state"));
+
+	/* Nor can what a restarted primary's earlier run published */
+	test_stop("primary");
+	start_primary();
+	for( i = 0; ! test_exited("replica", 100); i++ ) {
+		/* Until the replica has reconnected and hears of one */
+		CHECK(i < 50);
+		test_call(del, test_key("replica-even"), 20, &r);
+		test_reply_free(&r);
+	}
+	CHECK(test_log_contains("replica", "Primary restarted"));
+
+	zmq_close(put);
+	zmq_close(del);
+	zmq_close(get);
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
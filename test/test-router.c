@@ -0,0 +1,101 @@
+/*
+ * db-router spreads keys over two nodes and, once a node is down and its
+ * queue is at DBZMQ_ROUTER_HWM, reads the other replica, see db-router.c.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+#define KEYS	20
+#define GETS	200
+
+static const char* key(int i)
+{
+	char s[16];
+	snprintf(s, sizeof(s), "router-%d", i);
+	return test_key(s);
+}
+
+int main(int argc, char** argv)
+{
+	void *put, *get, *node_get[2];
+	const char* names[2] = {"a", "b"};
+	char rec[20 + 8], id[8];
+	test_reply_t r;
+	int i, j, found = 0;
+	FILE* fh;
+
+	test_init(argc, argv);
+	fh = fopen(test_path("nodes"), "w");
+	CHECK(fh != NULL);
+	for( i = 0; i < 2; i++ ) {
+		const char* args[] = {
+			test_bind(names[i], "get", "router"),
+			test_bind(names[i], "put", "router"),
+			test_bind(names[i], "del", "router"),
+			NULL
+		};
+		test_node(names[i], NULL, args);
+		fprintf(fh, "%s get=%s put=%s del=%s\n", names[i],
+			test_op(names[i], "get"), test_op(names[i], "put"), test_op(names[i], "del"));
+		node_get[i] = test_socket(ZMQ_DEALER, test_op(names[i], "get"));
+	}
+	CHECK(fclose(fh) == 0);
+	{
+		const char* env[] = {
+			"DBZMQ_ROUTER_REPLICAS=2",
+			"DBZMQ_ROUTER_HWM=4",
+			"DBZMQ_ROUTER_TIMEOUT=60000",
+			NULL
+		};
+		const char* args[] = {
+			test_path("nodes"),
+			test_bind("router", "get", "router"),
+			test_bind("router", "put", "router"),
+			NULL
+		};
+		test_start("router", "db-router", env, args);
+	}
+	put = test_socket(ZMQ_DEALER, test_op("router", "put"));
+	get = test_socket(ZMQ_DEALER, test_op("router", "get"));
+
+	/* Writes reach both replicas */
+	for( i = 0; i < KEYS; i++ ) {
+		memcpy(rec, key(i), 20);
+		snprintf(rec + 20, 8, "value%02d", i);
+		test_call(put, rec, sizeof(rec) - 1, &r);
+		CHECK(r.nframes == 1 && r.len[0] == sizeof(rec) - 1);
+		test_reply_free(&r);
+		for( j = 0; j < 2; j++ ) {
+			test_call(node_get[j], key(i), 20, &r);
+			CHECK(r.nframes == 1 && r.len[0] == sizeof(rec) - 1);
+			test_reply_free(&r);
+		}
+		CHECK(test_wait_value(get, key(i), 20, rec + 20, 7, 1000));
+	}
+
+	/* Requests for b queue up to the high-water mark, then go to a */
+	test_kill("b");
+	for( i = 0; i < GETS; i++ ) {
+		dbz_put64(id, i);
+		test_frame(get, id, 8, 1);
+		test_frame(get, key(i % KEYS), 20, 0);
+		while( test_recv(get, &r, 200) ) {
+			j = r.len[0] == 8 && dbz_get64(r.data[0]) == (uint64_t)i;
+			if( j ) found += r.nframes == 2 && r.len[1] == sizeof(rec) - 1 && memcmp(r.data[1], key(i % KEYS), 20) == 0;
+			test_reply_free(&r);
+			if( j ) break;
+		}
+	}
+	printf("%s: %d of %d gets answered with b down\n", argv[0], found, GETS);
+	CHECK(found >= GETS - 4);
+	CHECK(test_alive("router"));
+
+	zmq_close(put);
+	zmq_close(get);
+	for( i = 0; i < 2; i++ ) zmq_close(node_get[i]);
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * A sqlite batch is applied whole or not at all: a record failing
+ * partway leaves the records before it unapplied, see do_batch. The page
+ * cache is kept small so the batch reaches the file before it's rolled
+ * back. The write-behind module keeps a write sqlite refused, to try it
+ * again, until the key is written again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "test.h"
+
+#define KEYS	2000
+
+/* Refuse to store "fail", so the batch fails at that record */
+static const char schema[] =
+	"PRAGMA default_cache_size = 10;"
+	"CREATE TABLE kv(k BLOB PRIMARY KEY, v BLOB);"
+	"CREATE TRIGGER refuse BEFORE INSERT ON kv WHEN NEW.v = CAST('fail' AS BLOB)"
+	" BEGIN SELECT RAISE(ABORT, 'refused'); END;";
+
+static const char* sqlite_key(int i)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "sqlite-%d", i);
+	return test_key(name);
+}
+
+static size_t record(char* out, const char* key, const char* value)
+{
+	size_t len = strlen(value);
+	dbz_record_header(out, DBZ_REC_PUT, 20 + len);
+	memcpy(out + DBZ_REC_HDR, key, 20);
+	memcpy(out + DBZ_REC_HDR + 20, value, len);
+	return DBZ_REC_HDR + 20 + len;
+}
+
+/* Create the table `node` starts with, refusing "fail" */
+static void create(const char* node)
+{
+	char file[64];
+	sqlite3* db;
+
+	snprintf(file, sizeof(file), "%s.sqlite", node);
+	CHECK(sqlite3_open(test_path(file), &db) == SQLITE_OK);
+	CHECK(sqlite3_exec(db, schema, NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+}
+
+/* Store "old" under every key, in one transaction */
+static void fill(sqlite3* db)
+{
+	sqlite3_stmt* stmt;
+	int i;
+
+	CHECK(sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK);
+	CHECK(sqlite3_prepare_v2(db, "INSERT INTO kv VALUES(?, ?)", -1, &stmt, NULL) == SQLITE_OK);
+	for( i = 0; i < KEYS; i++ ) {
+		sqlite3_bind_blob(stmt, 1, sqlite_key(i), 20, SQLITE_TRANSIENT);
+		sqlite3_bind_blob(stmt, 2, "old", 3, SQLITE_STATIC);
+		CHECK(sqlite3_step(stmt) == SQLITE_DONE);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	CHECK(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+}
+
+int main(int argc, char** argv)
+{
+	void *batch, *put, *get;
+	test_reply_t r;
+	sqlite3_stmt* stmt;
+	char rec[24], *buf;
+	size_t len = 0;
+	sqlite3* db;
+	int i;
+
+	test_init(argc, argv);
+	if( ! strstr(test_module, "sqlite") ) {
+		printf("%s: skipped for %s\n", argv[0], test_module);
+		return 0;
+	}
+	create("node");
+	CHECK(sqlite3_open(test_path("node.sqlite"), &db) == SQLITE_OK);
+	fill(db);
+	sqlite3_close(db);
+	{
+		const char* args[] = {
+			test_bind("node", "batch", "router"),
+			test_bind("node", "get", "router"),
+			NULL
+		};
+		test_node("node", NULL, args);
+	}
+	batch = test_socket(ZMQ_DEALER, test_op("node", "batch"));
+	get = test_socket(ZMQ_DEALER, test_op("node", "get"));
+	buf = (char*)malloc((KEYS + 2) * (DBZ_REC_HDR + 24));
+	CHECK(buf != NULL);
+
+	/* The record after every key fails, all the others are aborted */
+	for( i = 0; i < KEYS; i++ ) len += record(buf + len, sqlite_key(i), "new");
+	len += record(buf + len, test_key("sqlite-fail"), "fail");
+	len += record(buf + len, test_key("sqlite-after"), "new");
+	test_call(batch, buf, len, &r);
+	CHECK(r.nframes == 1 && r.len[0] == KEYS + 2);
+	for( i = 0; i < KEYS + 2; i++ ) CHECK(r.data[0][i] == (i == KEYS ? DBZ_REC_FAILED : DBZ_REC_ABORTED));
+	test_reply_free(&r);
+	for( i = 0; i < KEYS; i += 97 ) CHECK(test_wait_value(get, sqlite_key(i), 20, "old", 3, 0));
+	CHECK(test_wait_value(get, sqlite_key(KEYS - 1), 20, "old", 3, 0));
+	CHECK(test_wait_value(get, test_key("sqlite-after"), 20, NULL, 0, 0));
+
+	/* Without it the batch goes through */
+	len = record(buf, sqlite_key(0), "new");
+	len += record(buf + len, test_key("sqlite-after"), "new");
+	test_call(batch, buf, len, &r);
+	CHECK(r.nframes == 1 && r.len[0] == 2 && r.data[0][0] == DBZ_REC_OK && r.data[0][1] == DBZ_REC_OK);
+	test_reply_free(&r);
+	CHECK(test_wait_value(get, sqlite_key(0), 20, "new", 3, 0));
+	CHECK(test_wait_value(get, test_key("sqlite-after"), 20, "new", 3, 0));
+	free(buf);
+	CHECK(test_alive("node"));
+	zmq_close(batch);
+	zmq_close(get);
+
+	create("wb");
+	{
+		char module[512];
+		const char* env[] = {
+			test_env("WRITEBEHIND_MODULE", test_module),
+			test_env("WRITEBEHIND_AGE", "50"),
+			NULL
+		};
+		const char* args[] = {
+			module,
+			test_bind("wb", "put", "router"),
+			test_bind("wb", "get", "router"),
+			NULL
+		};
+		snprintf(module, sizeof(module), "%s/mod-writebehind.so", test_build);
+		test_start("wb", "db-zmq", env, args);
+	}
+	put = test_socket(ZMQ_DEALER, test_op("wb", "put"));
+	get = test_socket(ZMQ_DEALER, test_op("wb", "get"));
+
+	/* Acknowledged, refused when flushed, and still there for a get */
+	memcpy(rec, test_key("wb-a"), 20);
+	memcpy(rec + 20, "fail", 4);
+	test_call(put, rec, 24, &r);
+	CHECK(r.nframes == 1 && r.len[0] == 24);
+	test_reply_free(&r);
+	for( i = 0; ! test_log_contains("wb", "Cannot write 1 of 1 buffered writes"); i++ ) {
+		CHECK(i < 500);
+		usleep(10000);
+	}
+	CHECK(test_wait_value(get, rec, 20, "fail", 4, 0));
+
+	/* Written again, the new value reaches sqlite */
+	memcpy(rec + 20, "new", 3);
+	test_call(put, rec, 23, &r);
+	test_reply_free(&r);
+	zmq_close(put);
+	zmq_close(get);
+	test_stop("wb");
+	CHECK(! test_log_contains("wb", "Lost "));
+	CHECK(sqlite3_open(test_path("wb.sqlite"), &db) == SQLITE_OK);
+	CHECK(sqlite3_prepare_v2(db, "SELECT v FROM kv WHERE k = ?", -1, &stmt, NULL) == SQLITE_OK);
+	sqlite3_bind_blob(stmt, 1, rec, 20, SQLITE_STATIC);
+	CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+	CHECK(sqlite3_column_bytes(stmt, 0) == 3 && memcmp(sqlite3_column_blob(stmt, 0), "new", 3) == 0);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
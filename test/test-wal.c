@@ -0,0 +1,137 @@
+/*
+ * Mutations logged to the WAL are replayed into the module after a
+ * crash, deletes included, see wal.h, and only reach replicas once
+ * committed.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static void start(void)
+{
+	const char* env[] = {test_env("DBZMQ_WAL_FILE", test_path("node.wal")), NULL};
+	const char* args[] = {
+		test_bind("node", "put", "router"),
+		test_bind("node", "del", "router"),
+		test_bind("node", "get", "router"),
+		test_bind("node", "acks", "pub"),
+		NULL
+	};
+	test_node("node", env, args);
+}
+
+/* A primary committing every 2s, and its replica */
+static void start_held(void)
+{
+	const char* env[] = {
+		test_env("DBZMQ_WAL_FILE", test_path("held.wal")),
+		test_env("DBZMQ_WAL_INTERVAL", "2000"),
+		NULL
+	};
+	const char* args[] = {
+		test_bind("held", "put", "router"),
+		test_bind("held", "get", "router"),
+		test_bind("held", "binlog", "pub"),
+		test_bind("held", "binlog-sync", "rep"),
+		NULL
+	};
+	const char* replica_env[] = {
+		test_env("DBZMQ_REPLICA_OF", test_op("held", "binlog")),
+		test_env("DBZMQ_REPLICA_SYNC", test_op("held", "binlog-sync")),
+		test_env("DBZMQ_REPLICA_EMPTY", "1"),
+		NULL
+	};
+	const char* replica_args[] = {test_bind("held-replica", "get", "router"), NULL};
+	test_node("held", env, args);
+	test_node("held-replica", replica_env, replica_args);
+}
+
+/* Delete `key` and wait for its ack, published once the WAL has committed */
+static int del_acked(void* del, void* acks, const char* key, long timeout_ms)
+{
+	test_reply_t r;
+	int acked = 0;
+
+	test_call(del, key, 20, &r);
+	test_reply_free(&r);
+	while( ! acked && test_recv(acks, &r, timeout_ms) ) {
+		acked = r.len[0] == 20 + 17 && memcmp(r.data[0], key, 20) == 0 && r.data[0][36] == 'D';
+		test_reply_free(&r);
+	}
+	return acked;
+}
+
+int main(int argc, char** argv)
+{
+	void *put, *del, *get, *acks, *replica_get;
+	test_reply_t r;
+	char rec[27];
+	int i;
+
+	test_init(argc, argv);
+	start();
+	put = test_socket(ZMQ_DEALER, test_op("node", "put"));
+	del = test_socket(ZMQ_DEALER, test_op("node", "del"));
+	get = test_socket(ZMQ_DEALER, test_op("node", "get"));
+	acks = test_socket(ZMQ_SUB, test_op("node", "acks"));
+	zmq_setsockopt(acks, ZMQ_SUBSCRIBE, "", 0);
+
+	/* A subscriber misses what is published before it has connected */
+	for( i = 0; ! del_acked(del, acks, test_key("wal-probe"), 100); i++ ) CHECK(i < 50);
+
+	for( i = 0; i < 10; i++ ) {
+		memcpy(rec, test_key(i % 2 ? "wal-odd" : "wal-even"), 20);
+		memcpy(rec + 20, "value-", 6);
+		rec[26] = '0' + i;
+		test_call(put, rec, sizeof(rec), &r);
+		CHECK(r.nframes == 1 && r.len[0] == sizeof(rec));
+		test_reply_free(&r);
+	}
+	CHECK(del_acked(del, acks, test_key("wal-odd"), 5000));
+
+	/* Replayed on restart, the module was never synced */
+	test_kill("node");
+	start();
+	CHECK(test_wait_value(get, test_key("wal-even"), 20, "value-8", 7, 5000));
+	CHECK(test_wait_value(get, test_key("wal-odd"), 20, NULL, 0, 5000));
+	CHECK(test_log_contains("node", "Replayed "));
+	CHECK(test_alive("node"));
+	zmq_close(put);
+	zmq_close(get);
+
+	/* Until the replica has connected and heard of one, just after a commit */
+	start_held();
+	put = test_socket(ZMQ_DEALER, test_op("held", "put"));
+	get = test_socket(ZMQ_DEALER, test_op("held", "get"));
+	replica_get = test_socket(ZMQ_DEALER, test_op("held-replica", "get"));
+	memcpy(rec, test_key("wal-held"), 20);
+	memcpy(rec + 20, "value-0", 7);
+	for( i = 0; ; i++ ) {
+		CHECK(i < 10);
+		rec[26] = '0' + i;
+		test_call(put, rec, sizeof(rec), &r);
+		test_reply_free(&r);
+		if( test_wait_value(replica_get, rec, 20, rec + 20, 7, 3000) ) break;
+	}
+
+	/* Readable on the primary at once, on the replica with the next commit */
+	rec[26] = 'x';
+	test_call(put, rec, sizeof(rec), &r);
+	test_reply_free(&r);
+	CHECK(test_wait_value(get, rec, 20, "value-x", 7, 0));
+	usleep(500 * 1000);
+	CHECK(! test_wait_value(replica_get, rec, 20, "value-x", 7, 0));
+	CHECK(test_wait_value(replica_get, rec, 20, "value-x", 7, 5000));
+	CHECK(test_alive("held") && test_alive("held-replica"));
+
+	zmq_close(put);
+	zmq_close(del);
+	zmq_close(get);
+	zmq_close(replica_get);
+	zmq_close(acks);
+	test_stop(NULL);
+	printf("%s: ok\n", argv[0]);
+	return 0;
+}
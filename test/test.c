@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+
+#include "test.h"
+
+#define TEST_MAX_NODES	8
+
+typedef struct {
+	char name[32];
+	pid_t pid;
+} test_node_t;
+
+const char* test_build;
+const char* test_module;
+char test_dir[256];
+void* test_zctx;
+static test_node_t test_nodes[TEST_MAX_NODES];
+static int test_nnodes;
+static uint64_t test_next_id = 1;
+
+uint64_t test_now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+void test_stop(const char* name)
+{
+	int i, status;
+	uint64_t until;
+
+	for( i = 0; i < test_nnodes; i++ ) {
+		test_node_t* n = &test_nodes[i];
+		if( ! n->pid || (name && strcmp(n->name, name) != 0) ) continue;
+		kill(n->pid, SIGINT);
+		until = test_now_ms() + 5000;
+		while( waitpid(n->pid, &status, WNOHANG) == 0 ) {
+			if( test_now_ms() > until ) {
+				kill(n->pid, SIGKILL);
+				waitpid(n->pid, &status, 0);
+				break;
+			}
+			usleep(10000);
+		}
+		n->pid = 0;
+	}
+}
+
+/**
+ * Stop a node as a crash would, without letting it shut down.
+ */
+void test_kill(const char* name)
+{
+	int i;
+	for( i = 0; i < test_nnodes; i++ ) {
+		test_node_t* n = &test_nodes[i];
+		if( ! n->pid || strcmp(n->name, name) != 0 ) continue;
+		kill(n->pid, SIGKILL);
+		waitpid(n->pid, NULL, 0);
+		n->pid = 0;
+	}
+}
+
+/**
+ * Stop a node with SIGSTOP, or resume it, its sockets stay connected and
+ * requests queue up until it runs again.
+ */
+void test_pause(const char* name, int paused)
+{
+	int i;
+	for( i = 0; i < test_nnodes; i++ ) {
+		test_node_t* n = &test_nodes[i];
+		if( n->pid && strcmp(n->name, name) == 0 ) kill(n->pid, paused ? SIGSTOP : SIGCONT);
+	}
+}
+
+/**
+ * Is the node still running, it exits on errors and dies on crashes.
+ */
+int test_alive(const char* name)
+{
+	int i;
+	for( i = 0; i < test_nnodes; i++ ) {
+		test_node_t* n = &test_nodes[i];
+		if( n->pid && strcmp(n->name, name) == 0 ) return waitpid(n->pid, NULL, WNOHANG) == 0;
+	}
+	return 0;
+}
+
+/**
+ * Wait for a node to exit on its own.
+ * @return 0 if it still runs after `timeout_ms`
+ */
+int test_exited(const char* name, long timeout_ms)
+{
+	uint64_t until = test_now_ms() + timeout_ms;
+	while( test_alive(name) ) {
+		if( test_now_ms() > until ) return 0;
+		usleep(10000);
+	}
+	return 1;
+}
+
+static void test_cleanup(void)
+{
+	char cmd[300];
+	test_stop(NULL);
+	if( test_dir[0] && ! getenv("TEST_KEEP") ) {
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", test_dir);
+		if( system(cmd) != 0 ) warnx("Cannot remove '%s'", test_dir);
+	}
+}
+
+void test_init(int argc, char** argv)
+{
+	if( argc < 3 ) errx(EXIT_FAILURE, "Usage: %s <build dir> <module.so>", argv[0]);
+	test_build = argv[1];
+	test_module = argv[2];
+	strcpy(test_dir, "/tmp/dbz-test-XXXXXX");
+	if( ! mkdtemp(test_dir) ) err(EXIT_FAILURE, "Cannot create scratch directory");
+	atexit(test_cleanup);
+	signal(SIGPIPE, SIG_IGN);
+	test_zctx = zmq_init(1);
+	CHECK(test_zctx != NULL);
+}
+
+/* Strings for arguments, valid for the next 64 calls */
+static char* test_string(void)
+{
+	static char strings[64][300];
+	static int next;
+	return strings[next++ % 64];
+}
+
+/**
+ * Argument binding op `name` as `type`, e.g. "get=router@ipc://.../node.get".
+ */
+const char* test_bind(const char* node, const char* name, const char* type)
+{
+	char* a = test_string();
+	snprintf(a, 300, "%s=%s@ipc://%s/%s.%s", name, type, test_dir, node, name);
+	return a;
+}
+
+/**
+ * Address of the op bound by test_bind().
+ */
+const char* test_op(const char* node, const char* name)
+{
+	char* a = test_string();
+	snprintf(a, 300, "ipc://%s/%s.%s", test_dir, node, name);
+	return a;
+}
+
+/**
+ * Path of file `name` in the scratch directory.
+ */
+const char* test_path(const char* name)
+{
+	char* a = test_string();
+	snprintf(a, 300, "%s/%s", test_dir, name);
+	return a;
+}
+
+const char* test_env(const char* name, const char* value)
+{
+	char* a = test_string();
+	snprintf(a, 300, "%s=%s", name, value);
+	return a;
+}
+
+/**
+ * Start `prog` (db-zmq or db-router) from the build directory as node
+ * `name`, with "NAME=value" settings in `env` and `args` after the
+ * program name, both NULL terminated. Returns once every ipc:// socket
+ * in `args` is bound. Output goes to <name>.log in the scratch directory.
+ */
+void test_start(const char* name, const char* prog, const char* const* env, const char* const* args)
+{
+	char path[512], log[512], file[512];
+	const char* argv[32];
+	test_node_t* n;
+	uint64_t until;
+	int i, argc = 0, fd;
+	pid_t pid;
+
+	CHECK(test_nnodes < TEST_MAX_NODES);
+	snprintf(path, sizeof(path), "%s/%s", test_build, prog);
+	snprintf(log, sizeof(log), "%s/%s.log", test_dir, name);
+	argv[argc++] = path;
+	for( i = 0; args[i] && argc < 31; i++ ) argv[argc++] = args[i];
+	argv[argc] = NULL;
+
+	/* A killed node leaves its sockets behind */
+	for( i = 1; i < argc; i++ ) {
+		const char* ipc = strstr(argv[i], "@ipc://");
+		if( ipc ) unlink(ipc + 7);
+	}
+
+	pid = fork();
+	CHECK(pid >= 0);
+	if( pid == 0 ) {
+		static const char* const files[] = {
+			"SQLITE3_FILE", "sqlite", "TCBDB_FILE", "tcb", "LEVELDB_FILE", "ldb",
+			"DBZMQ_TTL_FILE", "ttl", "DBZMQ_HOTSET_FILE", "hot", NULL
+		};
+		for( i = 0; files[i]; i += 2 ) {
+			snprintf(file, sizeof(file), "%s/%s.%s", test_dir, name, files[i + 1]);
+			setenv(files[i], file, 1);
+		}
+		for( i = 0; env && env[i]; i++ ) putenv((char*)env[i]);
+		fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if( fd >= 0 ) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(path, (char* const*)argv);
+		_exit(127);
+	}
+	n = &test_nodes[test_nnodes++];
+	snprintf(n->name, sizeof(n->name), "%s", name);
+	n->pid = pid;
+
+	until = test_now_ms() + 10000;
+	for( i = 1; i < argc; i++ ) {
+		const char* ipc = strstr(argv[i], "@ipc://");
+		struct stat st;
+		if( ! ipc ) continue;
+		while( stat(ipc + 7, &st) != 0 ) {
+			if( ! test_alive(name) || test_now_ms() > until ) {
+				errx(EXIT_FAILURE, "Node '%s' did not start, see %s", name, log);
+			}
+			usleep(10000);
+		}
+	}
+}
+
+/**
+ * Start db-zmq with the module under test.
+ */
+void test_node(const char* name, const char* const* env, const char* const* args)
+{
+	const char* argv[32];
+	int i;
+	argv[0] = test_module;
+	for( i = 0; args[i] && i < 30; i++ ) argv[i + 1] = args[i];
+	argv[i + 1] = NULL;
+	test_start(name, "db-zmq", env, argv);
+}
+
+/**
+ * Has node `name` written `text` to its log.
+ */
+int test_log_contains(const char* name, const char* text)
+{
+	char log[512], line[1024];
+	int found = 0;
+	FILE* fh;
+
+	snprintf(log, sizeof(log), "%s/%s.log", test_dir, name);
+	if( ! (fh = fopen(log, "r")) ) return 0;
+	while( ! found && fgets(line, sizeof(line), fh) ) found = strstr(line, text) != NULL;
+	fclose(fh);
+	return found;
+}
+
+void* test_socket(int type, const char* addr)
+{
+	int linger = 0;
+	void* sock = zmq_socket(test_zctx, type);
+	CHECK(sock != NULL);
+	zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(linger));
+	CHECK(zmq_connect(sock, addr) == 0);
+	return sock;
+}
+
+void test_frame(void* sock, const char* data, size_t len, int more)
+{
+	zmq_msg_t msg;
+	zmq_msg_init_size(&msg, len);
+	memcpy(zmq_msg_data(&msg), data, len);
+	CHECK(zmq_send(sock, &msg, more ? ZMQ_SNDMORE : 0) == 0);
+	zmq_msg_close(&msg);
+}
+
+void test_reply_free(test_reply_t* r)
+{
+	int i;
+	for( i = 0; i < r->nframes; i++ ) free(r->data[i]);
+	r->nframes = 0;
+}
+
+/**
+ * Read one message, waiting up to `timeout_ms`.
+ * @return 0 if none came
+ */
+int test_recv(void* sock, test_reply_t* r, long timeout_ms)
+{
+	zmq_pollitem_t item;
+	int64_t more = 1;
+	size_t more_sz;
+	zmq_msg_t msg;
+
+	memset(r, 0, sizeof(test_reply_t));
+	memset(&item, 0, sizeof(item));
+	item.socket = sock;
+	item.events = ZMQ_POLLIN;
+	if( zmq_poll(&item, 1, TEST_POLL_MSEC(timeout_ms)) <= 0 ) return 0;
+	while( more ) {
+		zmq_msg_init(&msg);
+		CHECK(zmq_recv(sock, &msg, 0) == 0);
+		CHECK(r->nframes < TEST_MAX_FRAMES);
+		r->len[r->nframes] = zmq_msg_size(&msg);
+		r->data[r->nframes] = (char*)malloc(r->len[r->nframes] + 1);
+		memcpy(r->data[r->nframes], zmq_msg_data(&msg), r->len[r->nframes]);
+		r->nframes++;
+		zmq_msg_close(&msg);
+		more_sz = sizeof(more);
+		zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_sz);
+	}
+	return 1;
+}
+
+/**
+ * Send a request over a DEALER connected to a router@ bind and wait for
+ * its reply, frames after the request id in `r`.
+ */
+void test_call(void* dealer, const char* data, size_t len, test_reply_t* r)
+{
+	char id[8];
+	int i;
+	dbz_put64(id, test_next_id++);
+	test_frame(dealer, id, 8, 1);
+	test_frame(dealer, data, len, 0);
+	CHECK(test_recv(dealer, r, 5000));
+	CHECK(r->nframes >= 2 && r->len[0] == 8 && memcmp(r->data[0], id, 8) == 0);
+	free(r->data[0]);
+	for( i = 1; i < r->nframes; i++ ) {
+		r->data[i - 1] = r->data[i];
+		r->len[i - 1] = r->len[i];
+	}
+	r->nframes--;
+}
+
+/**
+ * Get `key` until its value is `value` (NULL for missing), for changes
+ * which arrive asynchronously, e.g. through replication.
+ * @return 0 if it didn't within `timeout_ms`
+ */
+int test_wait_value(void* dealer, const char* key, size_t key_len, const char* value, size_t len, long timeout_ms)
+{
+	uint64_t until = test_now_ms() + timeout_ms;
+	test_reply_t r;
+	int ok;
+
+	for( ;; ) {
+		test_call(dealer, key, key_len, &r);
+		ok = r.nframes == 1 && (value
+			? r.len[0] == key_len + len && memcmp(r.data[0] + key_len, value, len) == 0
+			: r.len[0] == key_len);
+		test_reply_free(&r);
+		if( ok ) return 1;
+		if( test_now_ms() > until ) return 0;
+		usleep(10000);
+	}
+}
+
+/**
+ * A key_size byte key from a string, padded with '.'.
+ */
+const char* test_key(const char* s)
+{
+	static char keys[8][20];
+	static int next;
+	char* k = keys[next++ % 8];
+	size_t len = strlen(s);
+	memset(k, '.', 20);
+	memcpy(k, s, len < 20 ? len : 20);
+	return k;
+}
@@ -0,0 +1,72 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include <zmq.h>
+
+#include "../server/db-zmq.h"
+
+/**
+ * Helpers for the programs in test/, each run by `make TEST` as
+ *
+ *   test-<name> <build dir> <module.so>
+ *
+ * A test starts db-zmq nodes bound to ipc:// sockets in a scratch
+ * directory, talks to them over ZeroMQ and exits non-zero at the first
+ * failed CHECK. Nodes are stopped and the directory removed on exit.
+ * Every module's file setting points into the directory, so the same
+ * test runs against any module.
+ */
+#if ZMQ_VERSION_MAJOR < 3
+#define TEST_POLL_MSEC(ms)	((ms) * 1000L)
+#else
+#define TEST_POLL_MSEC(ms)	(ms)
+#endif
+
+#define TEST_MAX_FRAMES	4
+
+#define CHECK(x) do { \
+	if( ! (x) ) errx(EXIT_FAILURE, "%s:%d: CHECK(%s) failed", __FILE__, __LINE__, #x); \
+} while( 0 )
+
+/* A reply, without the request id */
+typedef struct {
+	int nframes;
+	size_t len[TEST_MAX_FRAMES];
+	char* data[TEST_MAX_FRAMES];
+} test_reply_t;
+
+extern const char* test_build;
+extern const char* test_module;
+extern char test_dir[256];
+extern void* test_zctx;
+
+void test_init(int argc, char** argv);
+uint64_t test_now_ms(void);
+const char* test_bind(const char* node, const char* name, const char* type);
+const char* test_op(const char* node, const char* name);
+const char* test_path(const char* name);
+const char* test_env(const char* name, const char* value);
+const char* test_key(const char* s);
+
+void test_start(const char* name, const char* prog, const char* const* env, const char* const* args);
+void test_node(const char* name, const char* const* env, const char* const* args);
+void test_stop(const char* name);
+void test_kill(const char* name);
+void test_pause(const char* name, int paused);
+int test_alive(const char* name);
+int test_exited(const char* name, long timeout_ms);
+int test_log_contains(const char* name, const char* text);
+
+void* test_socket(int type, const char* addr);
+void test_frame(void* sock, const char* data, size_t len, int more);
+int test_recv(void* sock, test_reply_t* r, long timeout_ms);
+void test_reply_free(test_reply_t* r);
+void test_call(void* dealer, const char* data, size_t len, test_reply_t* r);
+int test_wait_value(void* dealer, const char* key, size_t key_len, const char* value, size_t len, long timeout_ms);
+
+#endif
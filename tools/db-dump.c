@@ -0,0 +1,240 @@
+/*
+ * Write every record of a module, without a server.
+ *
+ *   db-dump [options] <module.so> [output]
+ *
+ * The module is read through its snapshot op (see i_speak_db.h), so the
+ * dump is a consistent view even if something else writes to the
+ * database meanwhile. Records are written to the output, stdout when
+ * none is given, as DBZ_REC_PUT records or, with -t, as the TSV lines
+ * read by db-load -t.
+ *
+ * With -a the dump starts after the given hex key, e.g. the last key of
+ * an interrupted dump, as module snapshots are ordered by key. The first
+ * chunk of a new view is read and skipped up to the key, then the view
+ * carries on after it.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../server/db-zmq.h"
+#include "../i_speak_db.h"
+
+static size_t key_size = 20;
+static bool tsv = false;
+static FILE *out = NULL;
+
+/* Last chunk of the snapshot */
+static char *chunk = NULL;
+static size_t chunk_len = 0;
+static size_t chunk_cap = 0;
+static bool called = false;
+
+/* -a, records up to this key are skipped */
+static char skip[0x100];
+static bool skipping = false;
+
+static struct {
+	uint64_t records;
+	uint64_t bytes;
+} stats;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+chunk_cb(const char* data, size_t len, void* a, void* token)
+{
+	(void)a; (void)token;
+	if( len > chunk_cap ) {
+		chunk_cap = len;
+		chunk = (char*)realloc(chunk, chunk_cap);
+		if( ! chunk ) errx(EXIT_FAILURE, "Out of memory");
+	}
+	memcpy(chunk, data, len);
+	chunk_len = len;
+	called = true;
+	return len;
+}
+
+static void
+write_tsv(const char* data, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	for( i = 0; i < key_size; i++ ) {
+		putc(hex[(uint8_t)data[i] >> 4], out);
+		putc(hex[(uint8_t)data[i] & 0xF], out);
+	}
+	putc('\t', out);
+	for( i = key_size; i < len; i++ ) {
+		uint8_t c = (uint8_t)data[i];
+		switch( c ) {
+		case '\\': fputs("\\\\", out); break;
+		case '\t': fputs("\\t", out); break;
+		case '\n': fputs("\\n", out); break;
+		case '\r': fputs("\\r", out); break;
+		default:
+			if( c < 0x20 || c == 0x7F ) fprintf(out, "\\x%02x", c);
+			else putc(c, out);
+		}
+	}
+	putc('\n', out);
+}
+
+/**
+ * Write the records of a chunk and keep its last key.
+ * @return 0 if the chunk is malformed
+ */
+static int
+write_chunk(char* after)
+{
+	size_t offset = 0, start = 0, len;
+	const char* data;
+	char type;
+	int rc;
+
+	while( (rc = dbz_record_next(chunk, chunk_len, &offset, &type, &data, &len)) == 1 ) {
+		if( type != DBZ_REC_PUT || len <= key_size ) return 0;
+		if( skipping && memcmp(data, skip, key_size) <= 0 ) {
+			start = offset;
+			continue;
+		}
+		if( tsv ) write_tsv(data, len);
+		memcpy(after, data, key_size);
+		stats.records++;
+	}
+	if( rc < 0 ) return 0;
+	if( skipping ) {
+		if( start == chunk_len ) memcpy(after, skip, key_size);
+		skipping = false;
+	}
+	if( ! tsv && start < chunk_len && fwrite(chunk + start, chunk_len - start, 1, out) != 1 ) {
+		err(EXIT_FAILURE, "Cannot write dump");
+	}
+	stats.bytes += chunk_len - start;
+	return 1;
+}
+
+static int
+hex_digit(char c)
+{
+	if( c >= '0' && c <= '9' ) return c - '0';
+	if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
+
+static void
+print_usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <module.so> [output]\n"
+		"\t-t       Write TSV: hex(key) TAB escaped value\n"
+		"\t-k <num> Key size in bytes (default: $DBZMQ_KEYSIZE or 20)\n"
+		"\t-c <kb>  Bytes read per snapshot call in kilobytes (default: 1024)\n"
+		"\t-a <hex> Start after this key\n"
+		"\t-p <sec> Seconds between progress reports (default: 1)\n",
+		prog);
+}
+
+int
+main(int argc, char** argv)
+{
+	char request[4 + 0x100];
+	const char *after_hex = NULL, *output = NULL;
+	size_t limit = 1024 * 1024, request_len = 4, i;
+	double report_every = 1, started, last_report;
+	uint64_t last_records = 0, last_bytes = 0;
+	struct dbz_op* snapshot;
+	dbz* mod;
+	int c;
+
+	if( getenv("DBZMQ_KEYSIZE") ) key_size = atoi(getenv("DBZMQ_KEYSIZE"));
+	while( (c = getopt(argc, argv, "tk:c:a:p:")) != -1 ) {
+		switch( c ) {
+		case 't': tsv = true; break;
+		case 'k': key_size = atoi(optarg); break;
+		case 'c': limit = (size_t)atoi(optarg) * 1024; break;
+		case 'a': after_hex = optarg; break;
+		case 'p': report_every = atof(optarg); break;
+		default:
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if( optind >= argc ) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if( key_size < 1 || key_size > 0xFF ) errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+	if( limit < 1 || limit > 0xFFFFFFFF ) errx(EXIT_FAILURE, "Invalid snapshot call size");
+
+	dbz_put32(request, limit);
+	if( after_hex ) {
+		if( strlen(after_hex) != key_size * 2 ) errx(EXIT_FAILURE, "-a needs a %zu byte key in hex", key_size);
+		for( i = 0; i < key_size; i++ ) {
+			int hi = hex_digit(after_hex[i * 2]), lo = hex_digit(after_hex[i * 2 + 1]);
+			if( hi < 0 || lo < 0 ) errx(EXIT_FAILURE, "-a needs a %zu byte key in hex", key_size);
+			skip[i] = (char)(hi << 4 | lo);
+		}
+		skipping = true;
+	}
+
+	mod = dbz_open(argv[optind]);
+	if( ! mod ) return EXIT_FAILURE;
+	snapshot = dbz_op(mod, "snapshot");
+	if( ! snapshot ) errx(EXIT_FAILURE, "Module '%s' has no snapshot op", argv[optind]);
+
+	output = optind + 1 < argc ? argv[optind + 1] : NULL;
+	out = output ? fopen(output, "w") : stdout;
+	if( ! out ) err(EXIT_FAILURE, "Cannot open '%s'", output);
+
+	started = last_report = now();
+	for( ;; ) {
+		chunk_len = 0;
+		called = false;
+		if( snapshot->cb(request, request_len, (void*)chunk_cb, NULL) == 0 ) {
+			if( ! called ) errx(EXIT_FAILURE, "Module cannot take or read a snapshot");
+			break;
+		}
+		if( ! write_chunk(request + 4) ) errx(EXIT_FAILURE, "Module returned a malformed snapshot chunk");
+		request_len = 4 + key_size;
+
+		if( now() - last_report >= report_every ) {
+			double t = now();
+			fprintf(stderr, "%llu records, %.0f records/s, %.1f MB/s\n",
+				(unsigned long long)stats.records,
+				(stats.records - last_records) / (t - last_report),
+				(stats.bytes - last_bytes) / (t - last_report) / 1048576.0);
+			last_report = t;
+			last_records = stats.records;
+			last_bytes = stats.bytes;
+		}
+	}
+
+	if( fflush(out) != 0 || (out != stdout && fclose(out) != 0) ) {
+		err(EXIT_FAILURE, "Cannot write '%s'", output ? output : "stdout");
+	}
+	dbz_close(mod);
+	free(chunk);
+
+	fprintf(stderr, "Dumped %llu records in %.1fs, %.0f records/s\n",
+		(unsigned long long)stats.records, now() - started, stats.records / (now() - started));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,709 @@
+/*
+ * Load records straight into a module, without a server.
+ *
+ *   db-load [options] <module.so> [input ...]
+ *
+ * Inputs, stdin when none are given, hold DBZ_REC_PUT and DBZ_REC_DEL
+ * records (see i_speak_db.h) or, with -t, lines of
+ *
+ *   hex(key) TAB value     a put
+ *   hex(key)               a del
+ *
+ * with `\\`, `\t`, `\n`, `\r` and `\xHH` escapes in the value. db-dump
+ * writes both formats, so `db-dump a.so | db-load b.so` copies a module.
+ *
+ * One thread reads the input in chunks, -j threads check and decode
+ * them and, with -s, sort each chunk by key for ordered backends, and
+ * the main thread applies the chunks in input order with the module's
+ * batch op, or put and del when it has none. Within a sorted chunk only
+ * the last record of a key is kept, so the result is the same as
+ * applying every record in order.
+ *
+ * With -r the position after the last applied chunk is saved to a file
+ * every few seconds, after the module's sync op, and a load given the
+ * same file and inputs again carries on from there. Records are
+ * idempotent, so those applied after the last save are simply applied
+ * again. -r needs a module with a sync op, as a position saved without
+ * one could be ahead of what reached disk. The file is removed once the
+ * load finishes.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../server/db-zmq.h"
+#include "../i_speak_db.h"
+
+enum {
+	CHUNK_FREE,
+	CHUNK_READ,		/* Waiting for a parse thread */
+	CHUNK_PARSING,
+	CHUNK_PARSED	/* Waiting to be applied */
+};
+
+struct chunk {
+	int state;
+	uint64_t seq;		/* Chunks are applied in this order */
+	/* Input as read */
+	char *raw;
+	size_t raw_used;
+	size_t raw_cap;
+	size_t file;		/* Index of the input and offset after the chunk */
+	uint64_t end;
+	/* Records to apply */
+	char *recs;
+	size_t recs_used;
+	size_t recs_cap;
+	size_t n;
+	const char *error;
+	uint64_t error_line;
+};
+
+struct sorted {
+	const char *rec;
+	size_t pos;
+};
+
+static size_t key_size = 20;
+static bool tsv = false;
+static bool sort_keys = false;
+static size_t chunk_size;
+static size_t batch_records = 1024;
+
+static struct chunk *chunks;
+static size_t nchunks;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static bool reading = true;
+
+static char **inputs;
+static size_t ninputs;
+static size_t resume_file = 0;
+static uint64_t resume_offset = 0;
+
+static struct {
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t batches;
+	uint64_t replaced;	/* Dropped by -s for a later record of the key */
+} stats;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+reserve(char** buf, size_t* cap, size_t need)
+{
+	if( need <= *cap ) return;
+	if( ! *cap ) *cap = 65536;
+	while( *cap < need ) *cap *= 2;
+	*buf = (char*)realloc(*buf, *cap);
+	if( ! *buf ) errx(EXIT_FAILURE, "Out of memory");
+}
+
+/**
+ * Wait for chunk `seq` to be in `state`, with `lock` held.
+ */
+static struct chunk*
+chunk_wait(uint64_t seq, int state)
+{
+	struct chunk* c = &chunks[seq % nchunks];
+	while( c->state != state || (state != CHUNK_FREE && c->seq != seq) ) {
+		pthread_cond_wait(&changed, &lock);
+	}
+	return c;
+}
+
+static void
+chunk_set(struct chunk* c, int state)
+{
+	pthread_mutex_lock(&lock);
+	c->state = state;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Reading
+ */
+
+static uint64_t read_seq = 0;
+
+static struct chunk*
+chunk_next(void)
+{
+	struct chunk* c;
+	pthread_mutex_lock(&lock);
+	c = chunk_wait(read_seq, CHUNK_FREE);
+	c->seq = read_seq++;
+	pthread_mutex_unlock(&lock);
+	c->raw_used = 0;
+	return c;
+}
+
+static void
+chunk_send(struct chunk* c, size_t file, uint64_t end)
+{
+	c->file = file;
+	c->end = end;
+	chunk_set(c, CHUNK_READ);
+}
+
+/**
+ * Split one input into chunks, only finding where records end.
+ */
+static void
+read_input(FILE* in, size_t file)
+{
+	struct chunk* c = chunk_next();
+	uint64_t offset = file == resume_file ? resume_offset : 0;
+	char head[DBZ_REC_HDR], *line = NULL;
+	size_t line_cap = 0, len;
+	ssize_t got;
+
+	for( ;; ) {
+		if( tsv ) {
+			got = getline(&line, &line_cap, in);
+			if( got < 0 ) break;
+			len = got;
+		}
+		else {
+			got = fread(head, 1, DBZ_REC_HDR, in);
+			if( got < DBZ_REC_HDR ) {
+				if( got ) errx(EXIT_FAILURE, "Truncated record at byte %llu of '%s'", (unsigned long long)offset, inputs[file]);
+				break;
+			}
+			len = DBZ_REC_HDR + dbz_get32(head + 1);
+		}
+		if( len > chunk_size ) {
+			errx(EXIT_FAILURE, "Record at byte %llu of '%s' is larger than a chunk, raise -m", (unsigned long long)offset, inputs[file]);
+		}
+		if( c->raw_used + len > chunk_size ) {
+			chunk_send(c, file, offset);
+			c = chunk_next();
+		}
+		reserve(&c->raw, &c->raw_cap, c->raw_used + len);
+		if( tsv ) {
+			memcpy(c->raw + c->raw_used, line, len);
+		}
+		else {
+			memcpy(c->raw + c->raw_used, head, DBZ_REC_HDR);
+			if( fread(c->raw + c->raw_used + DBZ_REC_HDR, 1, len - DBZ_REC_HDR, in) != len - DBZ_REC_HDR ) {
+				errx(EXIT_FAILURE, "Truncated record at byte %llu of '%s'", (unsigned long long)offset, inputs[file]);
+			}
+		}
+		c->raw_used += len;
+		offset += len;
+	}
+	if( ferror(in) ) err(EXIT_FAILURE, "Cannot read '%s'", inputs[file]);
+	free(line);
+	chunk_send(c, file, offset);
+}
+
+static void*
+reader_thread(void* arg)
+{
+	size_t i;
+	(void)arg;
+	for( i = resume_file; i < ninputs; i++ ) {
+		FILE* in = strcmp(inputs[i], "-") == 0 ? stdin : fopen(inputs[i], "r");
+		if( ! in ) err(EXIT_FAILURE, "Cannot open '%s'", inputs[i]);
+		if( i == resume_file && resume_offset ) {
+			if( in != stdin ) {
+				if( fseeko(in, resume_offset, SEEK_SET) != 0 ) err(EXIT_FAILURE, "Cannot seek in '%s'", inputs[i]);
+			}
+			else {
+				char skip[65536];
+				uint64_t left = resume_offset;
+				while( left ) {
+					size_t n = fread(skip, 1, left < sizeof(skip) ? left : sizeof(skip), in);
+					if( ! n ) errx(EXIT_FAILURE, "'%s' is shorter than the resume point", inputs[i]);
+					left -= n;
+				}
+			}
+		}
+		read_input(in, i);
+		if( in != stdin ) fclose(in);
+	}
+	pthread_mutex_lock(&lock);
+	reading = false;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Parsing
+ */
+
+static int
+hex_digit(char c)
+{
+	if( c >= '0' && c <= '9' ) return c - '0';
+	if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+	if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Decode one TSV line into a record at the end of the chunk's records.
+ * @return 0 if it is malformed
+ */
+static int
+parse_line(struct chunk* c, const char* line, size_t len)
+{
+	char *out, *p;
+	size_t i;
+	int hi, lo;
+
+	if( len && line[len - 1] == '\n' ) len--;
+	if( len < key_size * 2 || (len > key_size * 2 && line[key_size * 2] != '\t') ) return 0;
+
+	/* A value can only shrink when unescaped */
+	reserve(&c->recs, &c->recs_cap, c->recs_used + DBZ_REC_HDR + len);
+	out = p = c->recs + c->recs_used + DBZ_REC_HDR;
+	for( i = 0; i < key_size; i++ ) {
+		hi = hex_digit(line[i * 2]);
+		lo = hex_digit(line[i * 2 + 1]);
+		if( hi < 0 || lo < 0 ) return 0;
+		*p++ = (char)(hi << 4 | lo);
+	}
+	for( i = key_size * 2 + 1; i < len; i++ ) {
+		if( line[i] != '\\' ) {
+			*p++ = line[i];
+			continue;
+		}
+		if( ++i == len ) return 0;
+		switch( line[i] ) {
+		case '\\': *p++ = '\\'; break;
+		case 't': *p++ = '\t'; break;
+		case 'n': *p++ = '\n'; break;
+		case 'r': *p++ = '\r'; break;
+		case 'x':
+			if( i + 2 >= len || (hi = hex_digit(line[i + 1])) < 0 || (lo = hex_digit(line[i + 2])) < 0 ) return 0;
+			*p++ = (char)(hi << 4 | lo);
+			i += 2;
+			break;
+		default:
+			return 0;
+		}
+	}
+	if( len > key_size * 2 && (size_t)(p - out) == key_size ) return 0;
+	dbz_record_header(out - DBZ_REC_HDR, len > key_size * 2 ? DBZ_REC_PUT : DBZ_REC_DEL, p - out);
+	c->recs_used = p - c->recs;
+	return 1;
+}
+
+static int
+sorted_cmp(const void* a, const void* b)
+{
+	const struct sorted *x = (const struct sorted*)a, *y = (const struct sorted*)b;
+	int c = memcmp(x->rec + DBZ_REC_HDR, y->rec + DBZ_REC_HDR, key_size);
+	if( c ) return c;
+	return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/**
+ * Put the chunk's records in key order, keeping the last of each key.
+ */
+static void
+sort_chunk(struct chunk* c)
+{
+	struct sorted* order = (struct sorted*)malloc((c->n ? c->n : 1) * sizeof(struct sorted));
+	size_t offset = 0, len, i, n = 0, kept = 0, used = 0;
+	const char* data;
+	char type, *out;
+
+	if( ! order ) errx(EXIT_FAILURE, "Out of memory");
+	while( dbz_record_next(c->recs, c->recs_used, &offset, &type, &data, &len) == 1 ) {
+		order[n].rec = data - DBZ_REC_HDR;
+		order[n].pos = n;
+		n++;
+	}
+	qsort(order, n, sizeof(struct sorted), sorted_cmp);
+
+	out = (char*)malloc(c->recs_used ? c->recs_used : 1);
+	if( ! out ) errx(EXIT_FAILURE, "Out of memory");
+	for( i = 0; i < n; i++ ) {
+		if( i + 1 < n && memcmp(order[i].rec + DBZ_REC_HDR, order[i + 1].rec + DBZ_REC_HDR, key_size) == 0 )
+			continue;
+		len = DBZ_REC_HDR + dbz_get32(order[i].rec + 1);
+		memcpy(out + used, order[i].rec, len);
+		used += len;
+		kept++;
+	}
+	__atomic_fetch_add(&stats.replaced, n - kept, __ATOMIC_RELAXED);
+	free(c->recs);
+	free(order);
+	c->recs = out;
+	c->recs_cap = c->recs_used ? c->recs_used : 1;
+	c->recs_used = used;
+	c->n = kept;
+}
+
+static void
+parse_chunk(struct chunk* c)
+{
+	const char *p = c->raw, *end = c->raw + c->raw_used, *nl;
+	uint64_t line = 0;
+	long n;
+
+	c->recs_used = 0;
+	c->n = 0;
+	c->error = NULL;
+	if( tsv ) {
+		while( p < end ) {
+			nl = memchr(p, '\n', end - p);
+			nl = nl ? nl + 1 : end;
+			line++;
+			if( ! parse_line(c, p, nl - p) ) {
+				c->error = "Malformed line";
+				c->error_line = line;
+				return;
+			}
+			c->n++;
+			p = nl;
+		}
+	}
+	else {
+		n = dbz_batch_count(c->raw, c->raw_used, key_size);
+		if( n < 0 ) {
+			c->error = "Malformed record";
+			return;
+		}
+		reserve(&c->recs, &c->recs_cap, c->raw_used);
+		memcpy(c->recs, c->raw, c->raw_used);
+		c->recs_used = c->raw_used;
+		c->n = n;
+	}
+	if( sort_keys ) sort_chunk(c);
+}
+
+static void*
+parse_thread(void* arg)
+{
+	struct chunk* c;
+	size_t i;
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	for( ;; ) {
+		for( c = NULL, i = 0; i < nchunks && ! c; i++ ) {
+			if( chunks[i].state == CHUNK_READ ) c = &chunks[i];
+		}
+		if( c ) {
+			c->state = CHUNK_PARSING;
+			pthread_mutex_unlock(&lock);
+			parse_chunk(c);
+			pthread_mutex_lock(&lock);
+			c->state = CHUNK_PARSED;
+			pthread_cond_broadcast(&changed);
+		}
+		else if( ! reading ) {
+			break;
+		}
+		else {
+			pthread_cond_wait(&changed, &lock);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+/*
+ * Applying
+ */
+
+static size_t reply_len;
+static char *status = NULL;
+static size_t status_cap = 0;
+
+static size_t
+reply_cb(const char* data, size_t len, void* a, void* token)
+{
+	(void)a; (void)token;
+	if( len > status_cap ) {
+		status_cap = len;
+		status = (char*)realloc(status, len);
+		if( ! status ) errx(EXIT_FAILURE, "Out of memory");
+	}
+	memcpy(status, data, len);
+	reply_len = len;
+	return len;
+}
+
+/**
+ * Apply `n` records at `recs` with the batch op.
+ * @return 0 if the module failed any of them
+ */
+static int
+apply_batch(struct dbz_op* batch, const char* recs, size_t len, size_t n)
+{
+	size_t i;
+	reply_len = 0;
+	batch->cb(recs, len, (void*)reply_cb, NULL);
+	if( reply_len != n ) return 0;
+	for( i = 0; i < n; i++ ) {
+		if( status[i] != DBZ_REC_OK ) return 0;
+	}
+	return 1;
+}
+
+static int
+apply_each(struct dbz_op* put, struct dbz_op* del, const char* recs, size_t len)
+{
+	size_t offset = 0, data_len;
+	const char* data;
+	char type;
+	while( dbz_record_next(recs, len, &offset, &type, &data, &data_len) == 1 ) {
+		if( type == DBZ_REC_PUT ) {
+			if( put->cb(data, data_len, (void*)reply_cb, NULL) != data_len ) return 0;
+		}
+		else {
+			del->cb(data, data_len, (void*)reply_cb, NULL);
+		}
+	}
+	return 1;
+}
+
+static void
+apply_chunk(struct chunk* c, struct dbz_op* batch, struct dbz_op* put, struct dbz_op* del)
+{
+	size_t offset = 0, start = 0, len, n = 0;
+	const char* data;
+	char type;
+	int more;
+
+	do {
+		more = dbz_record_next(c->recs, c->recs_used, &offset, &type, &data, &len) == 1;
+		if( more ) n++;
+		if( n && (n == batch_records || ! more) ) {
+			int ok = batch
+				? apply_batch(batch, c->recs + start, offset - start, n)
+				: apply_each(put, del, c->recs + start, offset - start);
+			if( ! ok ) {
+				errx(EXIT_FAILURE, "Module failed a write in the chunk of '%s' ending at byte %llu",
+					inputs[c->file], (unsigned long long)c->end);
+			}
+			stats.records += n;
+			stats.bytes += offset - start;
+			stats.batches++;
+			start = offset;
+			n = 0;
+		}
+	} while( more );
+}
+
+/*
+ * Resuming
+ */
+
+static void
+resume_load(const char* path)
+{
+	char name[4096];
+	unsigned long long file, offset;
+	FILE* f = fopen(path, "r");
+	if( ! f ) return;
+	if( fscanf(f, "%llu %llu %4095[^\n]", &file, &offset, name) != 3 ) {
+		errx(EXIT_FAILURE, "Cannot read resume file '%s'", path);
+	}
+	fclose(f);
+	if( file >= ninputs || strcmp(inputs[file], name) != 0 ) {
+		errx(EXIT_FAILURE, "Resume file '%s' is for input '%s', not these inputs", path, name);
+	}
+	resume_file = file;
+	resume_offset = offset;
+	warnx("Resuming at byte %llu of '%s'", offset, name);
+}
+
+/**
+ * Save the position after chunk `c`, once the module has synced.
+ */
+static void
+resume_save(const char* path, struct dbz_op* sync, const struct chunk* c)
+{
+	char tmp[4096];
+	FILE* f;
+	if( ! sync->cb(NULL, 0, NULL, NULL) ) {
+		warnx("Module cannot sync, not saving the resume point");
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if( ! f
+	 || fprintf(f, "%zu %llu %s\n", c->file, (unsigned long long)c->end, inputs[c->file]) < 0
+	 || fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0
+	 || rename(tmp, path) != 0 ) {
+		err(EXIT_FAILURE, "Cannot write resume file '%s'", path);
+	}
+}
+
+static void
+print_progress(double* last, uint64_t* last_records, uint64_t* last_bytes)
+{
+	double t = now();
+	fprintf(stderr, "%llu records, %.0f records/s, %.1f MB/s\n",
+		(unsigned long long)stats.records,
+		(stats.records - *last_records) / (t - *last),
+		(stats.bytes - *last_bytes) / (t - *last) / 1048576.0);
+	*last = t;
+	*last_records = stats.records;
+	*last_bytes = stats.bytes;
+}
+
+static void
+print_usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <module.so> [input ...]\n"
+		"\t-t       Inputs are TSV: hex(key) TAB escaped value, or just hex(key) for a del\n"
+		"\t-s       Sort each chunk by key before applying it\n"
+		"\t-k <num> Key size in bytes (default: $DBZMQ_KEYSIZE or 20)\n"
+		"\t-b <num> Records per batch (default: 1024)\n"
+		"\t-m <mb>  Chunk size in megabytes (default: 16)\n"
+		"\t-j <num> Parse threads (default: number of CPUs)\n"
+		"\t-r <file> Save the position to this file and resume from it, needs a sync op\n"
+		"\t-c <sec> Seconds between saves of the position (default: 10)\n"
+		"\t-p <sec> Seconds between progress reports (default: 1)\n"
+		"\n"
+		"Inputs hold put and del records, see i_speak_db.h, and default to stdin.\n",
+		prog);
+}
+
+int
+main(int argc, char** argv)
+{
+	static char *std_input[] = { "-" };
+	const char *resume_path = NULL;
+	size_t threads = 0, megabytes = 16, i;
+	double save_every = 10, report_every = 1, started, last_save, last_report;
+	uint64_t last_records = 0, last_bytes = 0, seq;
+	struct dbz_op *batch, *put, *del, *sync;
+	pthread_t reader, *parsers;
+	dbz* mod;
+	int c;
+
+	if( getenv("DBZMQ_KEYSIZE") ) key_size = atoi(getenv("DBZMQ_KEYSIZE"));
+	while( (c = getopt(argc, argv, "tsk:b:m:j:r:c:p:")) != -1 ) {
+		switch( c ) {
+		case 't': tsv = true; break;
+		case 's': sort_keys = true; break;
+		case 'k': key_size = atoi(optarg); break;
+		case 'b': batch_records = atoi(optarg); break;
+		case 'm': megabytes = atoi(optarg); break;
+		case 'j': threads = atoi(optarg); break;
+		case 'r': resume_path = optarg; break;
+		case 'c': save_every = atof(optarg); break;
+		case 'p': report_every = atof(optarg); break;
+		default:
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if( optind >= argc ) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if( key_size < 1 || key_size > 0xFF ) errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+	if( batch_records < 1 || megabytes < 1 ) errx(EXIT_FAILURE, "Invalid batch or chunk size");
+	if( ! threads ) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	chunk_size = megabytes * 1024 * 1024;
+
+	mod = dbz_open(argv[optind]);
+	if( ! mod ) return EXIT_FAILURE;
+	batch = dbz_op(mod, "batch");
+	put = dbz_op(mod, "put");
+	del = dbz_op(mod, "del");
+	sync = dbz_op(mod, "sync");
+	if( ! batch && (! put || ! del) ) {
+		errx(EXIT_FAILURE, "Module '%s' needs batch, or put and del", argv[optind]);
+	}
+	if( resume_path && ! sync ) {
+		/* Without a sync a saved position may be ahead of what is on disk */
+		errx(EXIT_FAILURE, "Module '%s' has no sync op, cannot resume", argv[optind]);
+	}
+
+	inputs = optind + 1 < argc ? argv + optind + 1 : std_input;
+	ninputs = optind + 1 < argc ? (size_t)(argc - optind - 1) : 1;
+	if( resume_path ) resume_load(resume_path);
+
+	/* Enough chunks for every parser to be busy while one is read and one applied */
+	nchunks = threads + 2;
+	chunks = (struct chunk*)calloc(nchunks, sizeof(struct chunk));
+	parsers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+	if( ! chunks || ! parsers ) errx(EXIT_FAILURE, "Out of memory");
+	if( pthread_create(&reader, NULL, reader_thread, NULL) != 0 ) {
+		errx(EXIT_FAILURE, "Cannot start the reader thread");
+	}
+	for( i = 0; i < threads; i++ ) {
+		if( pthread_create(&parsers[i], NULL, parse_thread, NULL) != 0 ) {
+			errx(EXIT_FAILURE, "Cannot start a parse thread");
+		}
+	}
+
+	started = last_save = last_report = now();
+	for( seq = 0; ; seq++ ) {
+		struct chunk* ch = &chunks[seq % nchunks];
+		pthread_mutex_lock(&lock);
+		while( ! (ch->state == CHUNK_PARSED && ch->seq == seq) && (reading || read_seq > seq) ) {
+			pthread_cond_wait(&changed, &lock);
+		}
+		if( ! (ch->state == CHUNK_PARSED && ch->seq == seq) ) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if( ch->error ) {
+			if( ch->error_line )
+				errx(EXIT_FAILURE, "%s %llu of the chunk of '%s' ending at byte %llu", ch->error,
+					(unsigned long long)ch->error_line, inputs[ch->file], (unsigned long long)ch->end);
+			errx(EXIT_FAILURE, "%s in the chunk of '%s' ending at byte %llu", ch->error,
+				inputs[ch->file], (unsigned long long)ch->end);
+		}
+		apply_chunk(ch, batch, put, del);
+		if( resume_path && now() - last_save >= save_every ) {
+			resume_save(resume_path, sync, ch);
+			last_save = now();
+		}
+		if( now() - last_report >= report_every ) {
+			print_progress(&last_report, &last_records, &last_bytes);
+		}
+		chunk_set(ch, CHUNK_FREE);
+	}
+
+	pthread_join(reader, NULL);
+	for( i = 0; i < threads; i++ ) pthread_join(parsers[i], NULL);
+	if( sync && ! sync->cb(NULL, 0, NULL, NULL) ) {
+		warnx("Module cannot sync");
+	}
+	dbz_close(mod);
+	if( resume_path ) unlink(resume_path);
+
+	fprintf(stderr, "Loaded %llu records in %llu batches (%llu replaced in a chunk) in %.1fs, %.0f records/s\n",
+		(unsigned long long)stats.records,
+		(unsigned long long)stats.batches,
+		(unsigned long long)stats.replaced,
+		now() - started,
+		stats.records / (now() - started));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,501 @@
+/*
+ * Build a table for mod/sstable.c from unsorted records.
+ *
+ *   db-sstable [options] <table> [input ...]
+ *
+ * Inputs are DBZ_REC_PUT and DBZ_REC_DEL records (see i_speak_db.h), read
+ * from stdin when none are given. When a key appears more than once the
+ * last record for it wins and a DBZ_REC_DEL drops it, as if the records
+ * had been applied in order.
+ *
+ * The records are sorted externally: the input is read in chunks of
+ * about the memory limit divided by the number of threads, each chunk is
+ * sorted by its own thread while the next is read and written to an
+ * unlinked temporary file as a run, then the runs are merged. Values go
+ * straight to the table as the merge emits them, the entries through one
+ * more temporary file. The table is written to <table>.tmp, synced and
+ * renamed over <table>, so a server restarted at any time sees either
+ * the old table or the new one.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../i_speak_db.h"
+#include "../mod/sstable.h"
+
+#define RUN_SEQ		8	/* Runs hold seq[8] ++ record */
+
+struct sorted {
+	const char *rec;
+	uint64_t seq;
+};
+
+/* One chunk of input, sorted into one run */
+struct chunk {
+	char *buf;
+	size_t used;
+	struct sorted *recs;
+	size_t n;
+	size_t cap;
+	pthread_t thread;
+	bool busy;
+	FILE *run;
+};
+
+/* A run being merged */
+struct reader {
+	FILE *f;
+	char *rec;
+	size_t cap;
+	size_t len;		/* Of the record's data */
+	uint64_t seq;
+};
+
+static size_t key_size = 20;
+static size_t block = SST_BLOCK;
+static size_t chunk_size;
+static const char *tmpdir = NULL;
+
+static FILE **runs = NULL;
+static size_t nruns = 0;
+
+static struct {
+	uint64_t in;
+	uint64_t written;
+	uint64_t value_bytes;
+} stats;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Open an unlinked temporary file, gone once it is closed.
+ */
+static FILE*
+temp_file(void)
+{
+	char path[4096];
+	FILE* f;
+	int fd;
+	snprintf(path, sizeof(path), "%s/db-sstable.XXXXXX", tmpdir);
+	fd = mkstemp(path);
+	if( fd < 0 ) err(EXIT_FAILURE, "Cannot create a temporary file in '%s'", tmpdir);
+	unlink(path);
+	f = fdopen(fd, "w+");
+	if( ! f ) err(EXIT_FAILURE, "Cannot fdopen('%s')", path);
+	return f;
+}
+
+static void
+write_or_die(FILE* f, const void* data, size_t len, const char* what)
+{
+	if( len && fwrite(data, len, 1, f) != 1 ) err(EXIT_FAILURE, "Cannot write %s", what);
+}
+
+/**
+ * Length of the data of the record at `rec`.
+ */
+static size_t
+record_len(const char* rec)
+{
+	return dbz_get32(rec + 1);
+}
+
+static int
+sorted_cmp(const void* a, const void* b)
+{
+	const struct sorted *x = (const struct sorted*)a, *y = (const struct sorted*)b;
+	int c = memcmp(x->rec + DBZ_REC_HDR, y->rec + DBZ_REC_HDR, key_size);
+	if( c ) return c;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Sort a chunk and write it as a run, keeping only the last record of
+ * each key.
+ */
+static void*
+chunk_sort(void* arg)
+{
+	struct chunk* c = (struct chunk*)arg;
+	char seq[RUN_SEQ];
+	size_t i;
+
+	qsort(c->recs, c->n, sizeof(struct sorted), sorted_cmp);
+	c->run = temp_file();
+	for( i = 0; i < c->n; i++ ) {
+		const char* rec = c->recs[i].rec;
+		if( i + 1 < c->n && memcmp(rec + DBZ_REC_HDR, c->recs[i + 1].rec + DBZ_REC_HDR, key_size) == 0 )
+			continue;
+		dbz_put64(seq, c->recs[i].seq);
+		write_or_die(c->run, seq, RUN_SEQ, "run");
+		write_or_die(c->run, rec, DBZ_REC_HDR + record_len(rec), "run");
+	}
+	if( fflush(c->run) != 0 ) err(EXIT_FAILURE, "Cannot write run");
+	return NULL;
+}
+
+/**
+ * Wait for the chunk's sort, if any, and keep its run.
+ */
+static void
+chunk_join(struct chunk* c)
+{
+	if( ! c->busy ) return;
+	pthread_join(c->thread, NULL);
+	c->busy = false;
+	runs = (FILE**)realloc(runs, (nruns + 1) * sizeof(FILE*));
+	if( ! runs ) errx(EXIT_FAILURE, "Out of memory");
+	runs[nruns++] = c->run;
+	c->run = NULL;
+	c->used = 0;
+	c->n = 0;
+}
+
+static void
+chunk_start(struct chunk* c)
+{
+	if( ! c->n ) return;
+	if( pthread_create(&c->thread, NULL, chunk_sort, c) != 0 ) {
+		errx(EXIT_FAILURE, "Cannot start a sort thread");
+	}
+	c->busy = true;
+}
+
+/**
+ * Read every record of `in` into the chunks, starting a sort whenever
+ * the current chunk is full.
+ */
+static void
+read_input(FILE* in, const char* name, struct chunk* chunks, size_t nchunks, size_t* current)
+{
+	char head[DBZ_REC_HDR];
+	uint64_t offset = 0;
+	size_t len, got;
+
+	while( (got = fread(head, 1, DBZ_REC_HDR, in)) == DBZ_REC_HDR ) {
+		struct chunk* c = &chunks[*current];
+		len = record_len(head);
+		if( (head[0] == DBZ_REC_PUT && len <= key_size)
+		 || (head[0] == DBZ_REC_DEL && len != key_size)
+		 || (head[0] != DBZ_REC_PUT && head[0] != DBZ_REC_DEL) ) {
+			errx(EXIT_FAILURE, "Malformed record at byte %llu of '%s'", (unsigned long long)offset, name);
+		}
+		if( DBZ_REC_HDR + len > chunk_size ) {
+			errx(EXIT_FAILURE, "Record at byte %llu of '%s' is larger than a chunk, raise -m", (unsigned long long)offset, name);
+		}
+		if( c->used + DBZ_REC_HDR + len > chunk_size ) {
+			chunk_start(c);
+			*current = (*current + 1) % nchunks;
+			c = &chunks[*current];
+			chunk_join(c);
+		}
+		if( c->n == c->cap ) {
+			c->cap = c->cap ? c->cap * 2 : 65536;
+			c->recs = (struct sorted*)realloc(c->recs, c->cap * sizeof(struct sorted));
+			if( ! c->recs ) errx(EXIT_FAILURE, "Out of memory");
+		}
+		memcpy(c->buf + c->used, head, DBZ_REC_HDR);
+		if( fread(c->buf + c->used + DBZ_REC_HDR, 1, len, in) != len ) {
+			errx(EXIT_FAILURE, "Truncated record at byte %llu of '%s'", (unsigned long long)offset, name);
+		}
+		c->recs[c->n].rec = c->buf + c->used;
+		c->recs[c->n].seq = stats.in++;
+		c->n++;
+		c->used += DBZ_REC_HDR + len;
+		offset += DBZ_REC_HDR + len;
+	}
+	if( ferror(in) ) err(EXIT_FAILURE, "Cannot read '%s'", name);
+	if( got ) errx(EXIT_FAILURE, "Truncated record at byte %llu of '%s'", (unsigned long long)offset, name);
+}
+
+/**
+ * Read the next record of a run.
+ * @return 0 at its end
+ */
+static int
+reader_next(struct reader* r)
+{
+	char head[RUN_SEQ + DBZ_REC_HDR];
+	if( fread(head, sizeof(head), 1, r->f) != 1 ) {
+		if( ferror(r->f) ) err(EXIT_FAILURE, "Cannot read run");
+		return 0;
+	}
+	r->seq = dbz_get64(head);
+	r->len = record_len(head + RUN_SEQ);
+	if( DBZ_REC_HDR + r->len > r->cap ) {
+		r->cap = DBZ_REC_HDR + r->len;
+		r->rec = (char*)realloc(r->rec, r->cap);
+		if( ! r->rec ) errx(EXIT_FAILURE, "Out of memory");
+	}
+	memcpy(r->rec, head + RUN_SEQ, DBZ_REC_HDR);
+	if( fread(r->rec + DBZ_REC_HDR, 1, r->len, r->f) != r->len ) {
+		errx(EXIT_FAILURE, "Truncated run");
+	}
+	return 1;
+}
+
+static int
+reader_less(const struct reader* a, const struct reader* b)
+{
+	int c = memcmp(a->rec + DBZ_REC_HDR, b->rec + DBZ_REC_HDR, key_size);
+	return c < 0 || (c == 0 && a->seq < b->seq);
+}
+
+static void
+heap_down(struct reader** heap, size_t n, size_t i)
+{
+	for( ;; ) {
+		size_t l = 2 * i + 1, m = i;
+		struct reader* t;
+		if( l < n && reader_less(heap[l], heap[m]) ) m = l;
+		if( l + 1 < n && reader_less(heap[l + 1], heap[m]) ) m = l + 1;
+		if( m == i ) return;
+		t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+/**
+ * Merge the runs in key order, writing the last record of each key which
+ * is a put: its value to `values`, its entry to `entries` and every
+ * `block`th key to the index.
+ */
+static void
+merge_runs(FILE* values, FILE* entries, char** index, size_t* index_used)
+{
+	struct reader *readers, **heap, *top;
+	char *last = NULL, entry[0x100 + 8];
+	size_t n = 0, i, last_cap = 0, last_len = 0, index_cap = 0;
+	uint64_t offset = 0;
+	bool have = false;
+
+	readers = (struct reader*)calloc(nruns, sizeof(struct reader));
+	heap = (struct reader**)calloc(nruns, sizeof(struct reader*));
+	if( nruns && (! readers || ! heap) ) errx(EXIT_FAILURE, "Out of memory");
+	for( i = 0; i < nruns; i++ ) {
+		readers[i].f = runs[i];
+		rewind(runs[i]);
+		if( reader_next(&readers[i]) ) heap[n++] = &readers[i];
+	}
+	for( i = n / 2; i-- > 0; ) heap_down(heap, n, i);
+
+	for( ;; ) {
+		top = n ? heap[0] : NULL;
+		/* A new key, or the end: emit the last record of the previous one */
+		if( have && (! top || memcmp(top->rec + DBZ_REC_HDR, last + DBZ_REC_HDR, key_size) != 0) ) {
+			if( last[0] == DBZ_REC_PUT ) {
+				size_t v_sz = last_len - key_size;
+				if( stats.written % block == 0 ) {
+					if( *index_used + key_size > index_cap ) {
+						index_cap = index_cap ? index_cap * 2 : 65536;
+						*index = (char*)realloc(*index, index_cap);
+						if( ! *index ) errx(EXIT_FAILURE, "Out of memory");
+					}
+					memcpy(*index + *index_used, last + DBZ_REC_HDR, key_size);
+					*index_used += key_size;
+				}
+				memcpy(entry, last + DBZ_REC_HDR, key_size);
+				dbz_put64(entry + key_size, offset);
+				write_or_die(entries, entry, sst_entry_size(key_size), "entries");
+				write_or_die(values, last + DBZ_REC_HDR + key_size, v_sz, "table");
+				offset += v_sz;
+				stats.written++;
+			}
+			have = false;
+		}
+		if( ! top ) break;
+
+		/* Records of a key come out oldest first, keep the latest */
+		if( DBZ_REC_HDR + top->len > last_cap ) {
+			last_cap = DBZ_REC_HDR + top->len;
+			last = (char*)realloc(last, last_cap);
+			if( ! last ) errx(EXIT_FAILURE, "Out of memory");
+		}
+		memcpy(last, top->rec, DBZ_REC_HDR + top->len);
+		last_len = top->len;
+		have = true;
+
+		if( ! reader_next(top) ) heap[0] = heap[--n];
+		heap_down(heap, n, 0);
+	}
+	stats.value_bytes = offset;
+
+	for( i = 0; i < nruns; i++ ) {
+		free(readers[i].rec);
+		fclose(runs[i]);
+	}
+	free(readers);
+	free(heap);
+	free(last);
+}
+
+static void
+copy_file(FILE* from, FILE* to)
+{
+	char buf[65536];
+	size_t n;
+	rewind(from);
+	while( (n = fread(buf, 1, sizeof(buf), from)) > 0 ) {
+		write_or_die(to, buf, n, "table");
+	}
+	if( ferror(from) ) err(EXIT_FAILURE, "Cannot read entries");
+}
+
+static void
+print_usage(const char* prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <table> [input ...]\n"
+		"\t-k <num> Key size in bytes (default: $DBZMQ_KEYSIZE or 20)\n"
+		"\t-b <num> Entries per index key (default: %d)\n"
+		"\t-m <mb>  Memory for sorting in megabytes (default: 256)\n"
+		"\t-j <num> Sort threads (default: number of CPUs)\n"
+		"\t-T <dir> Directory for temporary files (default: $TMPDIR or /tmp)\n"
+		"\n"
+		"Inputs hold put and del records, see i_speak_db.h, and default to stdin.\n",
+		prog, SST_BLOCK);
+}
+
+int
+main(int argc, char** argv)
+{
+	struct sst_header h;
+	struct chunk* chunks;
+	char header[SST_HEADER], tmp_path[4096], *index = NULL;
+	const char* table;
+	size_t memory = 256, threads = 0, current = 0, index_used = 0, i;
+	FILE *out, *entries;
+	double started = now();
+	int c;
+
+	if( getenv("DBZMQ_KEYSIZE") ) key_size = atoi(getenv("DBZMQ_KEYSIZE"));
+	tmpdir = getenv("TMPDIR");
+	if( ! tmpdir ) tmpdir = "/tmp";
+
+	while( (c = getopt(argc, argv, "k:b:m:j:T:")) != -1 ) {
+		switch( c ) {
+		case 'k':
+			key_size = atoi(optarg);
+			break;
+
+		case 'b':
+			block = atoi(optarg);
+			break;
+
+		case 'm':
+			memory = atoi(optarg);
+			break;
+
+		case 'j':
+			threads = atoi(optarg);
+			break;
+
+		case 'T':
+			tmpdir = optarg;
+			break;
+
+		default:
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if( optind >= argc ) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if( key_size < 1 || key_size > 0xFF ) errx(EXIT_FAILURE, "Invalid key size %zu", key_size);
+	if( block < 1 || block > 0x7FFFFFFF ) errx(EXIT_FAILURE, "Invalid block size %zu", block);
+	if( ! threads ) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if( memory < 1 ) errx(EXIT_FAILURE, "Invalid memory limit");
+	chunk_size = memory * 1024 * 1024 / threads;
+
+	table = argv[optind];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", table);
+
+	/* Sort the input into runs */
+	chunks = (struct chunk*)calloc(threads, sizeof(struct chunk));
+	if( ! chunks ) errx(EXIT_FAILURE, "Out of memory");
+	for( i = 0; i < threads; i++ ) {
+		chunks[i].buf = (char*)malloc(chunk_size);
+		if( ! chunks[i].buf ) errx(EXIT_FAILURE, "Out of memory");
+	}
+	if( optind + 1 == argc ) {
+		read_input(stdin, "stdin", chunks, threads, &current);
+	}
+	for( i = optind + 1; i < (size_t)argc; i++ ) {
+		FILE* in = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+		if( ! in ) err(EXIT_FAILURE, "Cannot open '%s'", argv[i]);
+		read_input(in, argv[i], chunks, threads, &current);
+		if( in != stdin ) fclose(in);
+	}
+	chunk_start(&chunks[current]);
+	for( i = 1; i <= threads; i++ ) {
+		chunk_join(&chunks[(current + i) % threads]);
+	}
+	for( i = 0; i < threads; i++ ) {
+		free(chunks[i].buf);
+		free(chunks[i].recs);
+	}
+	free(chunks);
+	fprintf(stderr, "Sorted %llu records into %zu runs in %.1fs\n",
+		(unsigned long long)stats.in, nruns, now() - started);
+
+	/* Merge them into the table */
+	out = fopen(tmp_path, "w");
+	if( ! out ) err(EXIT_FAILURE, "Cannot open '%s'", tmp_path);
+	memset(header, 0, sizeof(header));
+	write_or_die(out, header, sizeof(header), "table");
+	entries = temp_file();
+	merge_runs(out, entries, &index, &index_used);
+	copy_file(entries, out);
+	fclose(entries);
+	write_or_die(out, index, index_used, "table");
+	free(index);
+	free(runs);
+
+	h.key_size = key_size;
+	h.block = block;
+	h.count = stats.written;
+	h.values = SST_HEADER;
+	h.entries = SST_HEADER + stats.value_bytes;
+	h.index = h.entries + h.count * sst_entry_size(key_size);
+	assert(index_used == sst_blocks(h.count, block) * key_size);
+	sst_header_write(header, &h);
+	if( fseeko(out, 0, SEEK_SET) != 0 ) err(EXIT_FAILURE, "Cannot seek in '%s'", tmp_path);
+	write_or_die(out, header, sizeof(header), "table");
+	if( fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0 ) {
+		err(EXIT_FAILURE, "Cannot write '%s'", tmp_path);
+	}
+	if( rename(tmp_path, table) != 0 ) {
+		err(EXIT_FAILURE, "Cannot rename '%s' to '%s'", tmp_path, table);
+	}
+
+	fprintf(stderr, "Wrote %llu entries (%llu dropped or replaced) to '%s' in %.1fs\n",
+		(unsigned long long)stats.written,
+		(unsigned long long)(stats.in - stats.written),
+		table, now() - started);
+	return EXIT_SUCCESS;
+}